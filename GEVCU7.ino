@@ -79,7 +79,7 @@ The currently existing scheme is basically cooperative multi-tasking as there's
 dispatched in order and so devices get callbacks at interval and CAN data can more or less be immediately
 sent to the CAN handler for a given device. There also is already existing a message passing system. Nothing
 in the whole system has any sort of sychronization but since most everything is cooperatively tasked
-that may be OK. Even the CAN messages are really only dispatched by the events calls in the main loop. So, really
+that may be OK. Even the CAN messages are only queued by interrupts and really dispatched from canEvents() in the main loop. So, really
 nothing that a device driver would do should ever step on other code. It's a bit "icky" that everything is
 cooperatively tasked but we're talking about a 600MHz processor running pretty basic code. Your device driver should
 not be taking that many cycles. The only thing to really watch out for is to never use wait loops like the "delay"
@@ -137,6 +137,8 @@ create config entries)
 #include "src/FlasherX.h"
 #include "src/devices/misc/SystemDevice.h"
 #include "src/CrashHandler.h"
+#include "src/CanRecorder.h"
+#include "src/DeviceStartup.h"
 #include "localconfig.h"
 
 // Use Teensy SDIO - SDIO is four bit and direct in hardware - it should be plenty fast
@@ -180,11 +182,9 @@ void initializeDevices() {
     //fault handler is always enabled too - its also statically allocated so no using -> here
     faultHandler.setup();
 
-    //send message is not asynchronous so it will block for as long as it takes for all devices to complete.
-    //this makes initialization easier but means a device could freeze the system. Might want to do
-    //asynchronous or threaded messages at some point but that opens up many other cans of worms.
-    deviceManager.sendMessage(DEVICE_ANY, INVALID, MSG_STARTUP, NULL); //allows each device to register its preference handler
-    deviceManager.sendMessage(DEVICE_ANY, INVALID, MSG_SETUP, NULL); //then use the preference handler to initialize only enabled devices
+    //every device registers its preference handler here. Enabled devices are then set up in dependency
+    //order from the main loop so one slow device can't hold up the rest (or the boot)
+    deviceStartup.begin();
 }
 
 //called when the watchdog triggers because it was not reset properly. Probably means a hangup has occurred.
@@ -342,6 +342,9 @@ void setup() {
     }
 #endif
 
+    //if the last run crashed, get what the flight recorder saw onto the card before anything else can go wrong
+    crashHandler.saveFlightRecord();
+
     if (sdCardPresent)
     {
         //here, directly after trying to find the SDCard is the best place to check the sdcard for firmware files
@@ -379,6 +382,8 @@ void setup() {
 	memCache = new MemCache();
 	Logger::info("add MemCache (id: %X, %X)", MEMCACHE, memCache);
 	memCache->setup();
+    //pull the device table, device settings and fault log in with a few long reads instead of page by page
+    uint32_t prefetchTime = PrefHandler::bootPrefetch();
 
     //force the system device to be set enabled. ALWAYS. It would not be good if it weren't enabled!
     Device *sysDev = deviceManager.getDeviceByID(SYSTEM);
@@ -415,7 +420,9 @@ void setup() {
 	//btDevice = static_cast<ADAFRUITBLE *>(deviceManager.getDeviceByID(ADABLUE));
     //deviceManager.sendMessage(DEVICE_WIFI, ADABLUE, MSG_CONFIG_CHANGE, NULL); //Load config into BLE interface
 
-	Logger::info("System Ready");
+	Logger::info("System Ready. Took %ums from power on (%ums prefetching EEPROM)", millis(), prefetchTime);
+    //from here on log messages are queued and printed from Logger::loop() so they don't hold up the caller
+    Logger::setDeferred(true);
     crashHandler.addBreadcrumb(ENCODE_BREAD("BOOTD"));
 
     //just for testing obviously. Don't leave these uncommented.
@@ -440,16 +447,23 @@ void loop() {
 
     //no direct calls here anymore. The serial connections are handled via interrupt callbacks.
 	//serialConsole->loop();
-    //canHandlerBus0.loop(); //the one loop actually handles incoming traffic for all three
-    //canHandlerBus1.loop(); //so no need to call these other two. It's redundant.
-    //canHandlerBus2.loop(); //technically you can call them but don't unless some actual need arises?!
     
     //This needs to be called to handle sdCard writing though.
     Logger::loop();
+
+    //writes out buffered CAN recording sectors whenever the sdCard is idle
+    canRecorder.loop();
+
+    //writes aged out EEPROM cache pages in the background
+    memCache->loop();
+
+    //starts devices whose dependencies have come up. Does nothing once they're all running
+    deviceStartup.loop();
     
     //ESP32 would be our BT device now. Does it need a loop function?
     //if (btDevice) btDevice->loop();
 
+    //CAN interrupts only queue frames. This dispatches them to observers for all three buses
     canEvents();
     
     wdt.feed(); //must feed the watchdog every so often or it'll get angry
@@ -475,5 +489,5 @@ void serialEvent() {
 
 void serialEventUSB1()
 {
-    canHandlerBus0.loop();
+    canHandlerBus0.processGVRET(); //handles GVRET traffic for all three buses
 }
@@ -28,6 +28,9 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "CanHandler.h"
+#include <TeensyTimerTool.h>
+#include "CanRecorder.h"
+#include "CrashHandler.h"
 #include "sys_io.h"
 #include "devices/misc/SystemDevice.h"
 #include "sys_io.h"
@@ -37,9 +40,11 @@ CAN1 is regular can but with some chip changes could be put into SWCAN mode.
 CAN2 is isolated
 CAN3 is CAN-FD capable. GEVCU7A boards failed to get an FD transceiver though.
 
-Not using hardware filtering right now. CAN buses aren't really that fast and this is a
-very fast chip. But, still it might not be a bad idea to eventually try it.
-FIFOs are not available for CAN-FD mode but CAN-FD mode is not being attempted right now
+Hardware filtering is programmed from the attached observers (see updateHardwareFilters) so
+traffic no device cares about never makes it to the CPU. CAN0 and CAN1 use the RX FIFO filters.
+FIFOs are not available for CAN-FD mode so CAN2 filters with individual receive mailboxes.
+The software dispatch in process() still checks every frame so the hardware filters only need
+to let through a superset of what the observers want.
 
 Should allow for the GEVCU7 board to be used with SavvyCAN for easy debugging. Maybe don't even
 support anything other than sending frames back and forth - no bus config? Set GEVCU to present
@@ -58,26 +63,128 @@ FlexCAN_T4<CAN1, RX_SIZE_256, TX_SIZE_16> Can0; //Reg CAN or SWCAN depending on
 FlexCAN_T4<CAN2, RX_SIZE_256, TX_SIZE_16> Can1; //Isolated CAN
 FlexCAN_T4FD<CAN3, RX_SIZE_256, TX_SIZE_16> Can2; //Only CAN-FD capable output
 
+#if CFG_CAN_DISPATCH_HASH_SIZE < (2 * CFG_CAN_NUM_OBSERVERS) || (CFG_CAN_DISPATCH_HASH_SIZE & (CFG_CAN_DISPATCH_HASH_SIZE - 1))
+#error "CFG_CAN_DISPATCH_HASH_SIZE must be a power of two and at least twice CFG_CAN_NUM_OBSERVERS"
+#endif
+
+#if (CFG_CAN_RX_RING_SIZE & (CFG_CAN_RX_RING_SIZE - 1)) || (CFG_CANFD_RX_RING_SIZE & (CFG_CANFD_RX_RING_SIZE - 1))
+#error "CFG_CAN_RX_RING_SIZE and CFG_CANFD_RX_RING_SIZE must be powers of two"
+#endif
+
+#if CFG_CAN_TX_QUEUE_SIZE < 1 || CFG_CAN_TX_QUEUE_SIZE > 255
+#error "CFG_CAN_TX_QUEUE_SIZE must be between 1 and 255"
+#endif
+
+#define DISPATCH_EMPTY  0xFF
+#define PERIODIC_IDLE   0xFFFFFFFFul
+
+bool CanHandler::binOutput = false;
+
+//GVRET binary output for all three buses is gathered here and handed to USB in big chunks instead of
+//one write per frame. Only ever touched from the main loop.
+static uint8_t gvretBuffer[CFG_GVRET_TX_BUFFER_SIZE];
+static uint32_t gvretBufferLen = 0;
+static uint32_t gvretOldest = 0;      // micros() when the oldest unsent byte was added
+static uint32_t gvretDropped = 0;     // frames that didn't fit because USB wasn't keeping up
+
+//hand as much of the buffer to USB as it will take without blocking
+static void flushGVRET()
+{
+    if (gvretBufferLen == 0) return;
+    int room = SerialUSB1.availableForWrite();
+    if (room <= 0) return;
+    uint32_t len = ((uint32_t)room < gvretBufferLen) ? (uint32_t)room : gvretBufferLen;
+    SerialUSB1.write(gvretBuffer, len);
+    gvretBufferLen -= len;
+    if (gvretBufferLen > 0) memmove(gvretBuffer, gvretBuffer + len, gvretBufferLen);
+}
+
+//get space for a frame of the given size in the output buffer, or NULL if it has to be dropped
+static uint8_t *reserveGVRET(uint32_t len)
+{
+    if (gvretBufferLen + len > CFG_GVRET_TX_BUFFER_SIZE) flushGVRET();
+    if (gvretBufferLen + len > CFG_GVRET_TX_BUFFER_SIZE)
+    {
+        gvretDropped++;
+        return NULL;
+    }
+    if (gvretBufferLen == 0) gvretOldest = micros();
+    uint8_t *ptr = gvretBuffer + gvretBufferLen;
+    gvretBufferLen += len;
+    return ptr;
+}
+
+//command replies go through the same buffer so they can't land in the middle of a partly sent frame
+static void replyGVRET(const uint8_t *data, uint32_t len)
+{
+    uint8_t *buff = reserveGVRET(len);
+    if (!buff) return;
+    memcpy(buff, data, len);
+    flushGVRET();
+}
+
+//periodic frames on all three buses share one hardware timer. It is set to go off when the next one is due
+static TeensyTimerTool::OneShotTimer periodicTimer(TeensyTimerTool::GPT2);
+static bool periodicTimerStarted = false;
+
+static void periodicTrampoline()
+{
+    CanHandler::handlePeriodicInterrupt();
+}
+
+//classic frame for CAN2. It can only be sent as a CANFD frame without the FD bits set
+static inline void bridgeToFD(const CAN_message_t &msg, CANFD_message_t &fdMsg)
+{
+    fdMsg.id = msg.id;
+    fdMsg.brs = 0; //no rate switching
+    fdMsg.edl = 0; //no extended data length either
+    fdMsg.len = msg.len;
+    fdMsg.flags.extended = msg.flags.extended;
+    memcpy(fdMsg.buf, msg.buf, msg.len);
+}
+
+//multiplicative hash. Standard IDs tend to be clustered so spread them out before masking
+static inline uint32_t dispatchHash(uint32_t id)
+{
+    return ((id * 2654435761ul) >> 16) & (CFG_CAN_DISPATCH_HASH_SIZE - 1);
+}
+
+//an observer goes into the exact id hash if its mask covers every bit of the id it asked for
+static inline bool isExactMask(uint32_t mask, bool extended)
+{
+    if (extended) return (mask & 0x1FFFFFFFul) == 0x1FFFFFFFul;
+    return (mask & 0x7FFul) == 0x7FFul;
+}
+
+static inline uint32_t exactKey(uint32_t id, bool extended)
+{
+    return id & (extended ? 0x1FFFFFFFul : 0x7FFul);
+}
+
+//These are called by FlexCAN_T4 straight from the CAN interrupt since events() is no longer used.
+//So, don't do anything here but stash the frame. CanHandler::loop() takes it from there.
 void canRX0(const CAN_message_t &msg) 
 {
-    canHandlerBus0.process(msg);
+    canHandlerBus0.queueFrame(msg);
 }
 
 void canRX1(const CAN_message_t &msg) 
 {
-    canHandlerBus1.process(msg); 
+    canHandlerBus1.queueFrame(msg); 
 }
 
 void canRX2(const CANFD_message_t &msg) 
 {
-    canHandlerBus2.process(msg);
+    canHandlerBus2.queueFrame(msg);
 }
 
+//called from the main loop. Dispatches whatever the interrupts have queued up since last time
 void canEvents()
 {
-    Can0.events();
-    Can1.events();
-    Can2.events();
+    canHandlerBus0.loop();
+    canHandlerBus1.loop();
+    canHandlerBus2.loop();
+    CanHandler::serviceGVRET();
 }
 
 /*
@@ -90,10 +197,47 @@ CanHandler::CanHandler(CanBusNode canBusNode)
     for (int i = 0; i < CFG_CAN_NUM_OBSERVERS; i++) {
         observerData[i].observer = NULL;
     }
+    for (int i = 0; i < CFG_ISOTP_SESSIONS; i++) {
+        isoTPSessions[i].observer = NULL;
+    }
+    numISOTPSessions = 0;
+    for (int i = 0; i < CFG_CAN_PERIODIC_SLOTS; i++) {
+        periodicSlots[i].observer = NULL;
+    }
+    numPeriodicSlots = 0;
+    txFrames = NULL;
+    txFramesFD = NULL;
+    for (int i = 0; i < CFG_CAN_TX_QUEUE_SIZE; i++) {
+        txFreeSlots[i] = i;
+    }
+    txNumFree = CFG_CAN_TX_QUEUE_SIZE;
+    txDepth = 0;
+    txSeq = 0;
+    txHighWater = 0;
+    txQueued = 0;
+    txFailed = 0;
+    txStale = 0;
+    txSuperseded = 0;
+    txLatencyMax = 0;
+    txLatencySum = 0;
+    txLatencyCount = 0;
+    rebuildDispatchIndex();
+    frameCount = 0;
+    fpsWindowCount = 0;
+    fpsWindowStart = 0;
+    framesPerSecond = 0;
+    rxRing = NULL;
+    rxRingFD = NULL;
+    rxHead = rxTail = 0;
+    rxHeadFD = rxTailFD = 0;
+    rxHighWater = 0;
+    rxOverflows = 0;
+    hwReady = false;
+    numHwFilters = -1;
     masterID = 0x05;
     busSpeed = 0;
     swmode = SW_SLEEP;
-    binOutput = false;
+    frameLogging = false;
     gvretState = IDLE;
     gvretStep = 0;
 }
@@ -110,6 +254,15 @@ void CanHandler::setup()
     CANFD_timings_t fdTimings;
     int busNum = 0;
 
+    //has to exist before the receive interrupt is hooked up below
+    if (!rxRing) rxRing = new CAN_message_t[CFG_CAN_RX_RING_SIZE];
+    if (canBusNode == CAN_BUS_2 && !rxRingFD) rxRingFD = new CANFD_message_t[CFG_CANFD_RX_RING_SIZE];
+    if (canBusNode == CAN_BUS_2)
+    {
+        if (!txFramesFD) txFramesFD = new CANFD_message_t[CFG_CAN_TX_QUEUE_SIZE];
+    }
+    else if (!txFrames) txFrames = new CAN_message_t[CFG_CAN_TX_QUEUE_SIZE];
+
     //these pins control whether differential CAN or SingleWire CAN is found on CAN0
     pinMode(33, OUTPUT);
     pinMode(MODE0_PIN, OUTPUT);
@@ -181,6 +334,12 @@ void CanHandler::setup()
             //Can2.setMaxMB(16);
             //Can2.enableFIFO();
             //Can2.enableFIFOInterrupt();
+            //64 byte regions give 14 mailboxes. Fixed split between receive and transmit.
+            for (int mb = 0; mb < 14; mb++)
+            {
+                if (mb < CFG_CANFD_NUM_RX_MAILBOXES) Can2.setMB((FLEXCAN_MAILBOX)mb, RX, (mb & 1) ? EXT : STD);
+                else Can2.setMB((FLEXCAN_MAILBOX)mb, TX);
+            }
             Can2.setMBFilter(ACCEPT_ALL);
             Can2.enableMBInterrupts();
             Can2.onReceive(canRX2);
@@ -190,6 +349,9 @@ void CanHandler::setup()
         //else Can2.reset();
         break;
     }
+
+    hwReady = true;
+    updateHardwareFilters();
 }
 
 void CanHandler::setSWMode(SWMode newMode)
@@ -280,6 +442,7 @@ void CanHandler::setBusSpeed(uint32_t newSpeed)
             Can1.enableFIFO();
             Can1.enableFIFOInterrupt();
             Can1.onReceive(canRX1);
+            updateHardwareFilters(); //begin() wiped them
         }
     }
 
@@ -311,59 +474,176 @@ uint8_t CanHandler::checksumCalc(uint8_t *buffer, int length)
     return valu;
 }
 
+//GVRET frame: F1 00, timestamp, id, bus << 4 | length, data, checksum placeholder. All little endian like us.
 void CanHandler::sendFrameToUSB(const CAN_message_t &msg, int busNum)
 {
     if (!binOutput) return;
-    uint8_t buff[20];
+    uint8_t *buff = reserveGVRET(12 + msg.len);
+    if (!buff) return;
     uint32_t now = micros();
     buff[0] = 0xF1;
     buff[1] = 0;
-    buff[2] = now & 0xFF;
-    buff[3] = (now >> 8) & 0xFF;
-    buff[4] = (now >> 16) & 0xFF;
-    buff[5] = (now >> 24) & 0xFF;
-    buff[6] = msg.id & 0xFF;
-    buff[7] = (msg.id >> 8) & 0xFF;
-    buff[8] = (msg.id >> 16) & 0xFF;
-    buff[9] = (msg.id >> 24) & 0xFF;
+    memcpy(&buff[2], &now, 4);
+    memcpy(&buff[6], &msg.id, 4);
     if (busNum == -1)
         buff[10] = (msg.bus << 4) + msg.len;
     else
         buff[10] = (busNum << 4) + msg.len;
-    for (int i = 0; i < msg.len; i++)
-    {
-        buff[11 + i] = msg.buf[i];
-    }
+    memcpy(&buff[11], msg.buf, msg.len);
     buff[11 + msg.len] = 0;
-    SerialUSB1.write(buff, 12 + msg.len);
 }
 
+//FD version has bus and length in separate bytes
 void CanHandler::sendFrameToUSB(const CANFD_message_t &msg, int busNum)
 {
     if (!binOutput) return;
-    uint8_t buff[70];
+    uint8_t *buff = reserveGVRET(13 + msg.len);
+    if (!buff) return;
     uint32_t now = micros();
     buff[0] = 0xF1;
     buff[1] = 0;
-    buff[2] = now & 0xFF;
-    buff[3] = (now >> 8) & 0xFF;
-    buff[4] = (now >> 16) & 0xFF;
-    buff[5] = (now >> 24) & 0xFF;
-    buff[6] = msg.id & 0xFF;
-    buff[7] = (msg.id >> 8) & 0xFF;
-    buff[8] = (msg.id >> 16) & 0xFF;
-    buff[9] = (msg.id >> 24) & 0xFF;
+    memcpy(&buff[2], &now, 4);
+    memcpy(&buff[6], &msg.id, 4);
     buff[10] = 2;
     buff[11] = msg.len;
-    for (int i = 0; i < msg.len; i++)
+    memcpy(&buff[12], msg.buf, msg.len);
+    buff[12 + msg.len] = 0;
+}
+
+/*
+ * Send buffered GVRET output once there's a USB packet worth of it or the oldest frame
+ * has waited CFG_GVRET_FLUSH_US. Called from canEvents() every main loop.
+ */
+void CanHandler::serviceGVRET()
+{
+    if (gvretBufferLen == 0) return;
+    if (gvretBufferLen >= CFG_GVRET_TX_THRESHOLD || (micros() - gvretOldest) >= CFG_GVRET_FLUSH_US)
     {
-        buff[12 + i] = msg.buf[i];
+        flushGVRET();
+        gvretOldest = micros(); //anything USB wouldn't take yet gets another full wait
     }
-    buff[12 + msg.len] = 0;
-    SerialUSB1.write(buff, 13 + msg.len);
 }
 
+uint32_t CanHandler::getGVRETDropCount()
+{
+    return gvretDropped;
+}
+
+/*
+ * Called from the CAN interrupt. Copy the frame into the receive ring and get out.
+ * If the main loop has fallen so far behind that the ring is full the frame is dropped and counted.
+ */
+void CanHandler::queueFrame(const CAN_message_t &msg)
+{
+    uint32_t head = rxHead;
+    uint32_t depth = head - rxTail;
+
+    if (!rxRing || depth >= CFG_CAN_RX_RING_SIZE)
+    {
+        rxOverflows++;
+        return;
+    }
+    rxRing[head & (CFG_CAN_RX_RING_SIZE - 1)] = msg;
+    portMEMORY_BARRIER(); //frame must be in place before loop() can see the new head
+    rxHead = head + 1;
+    if (depth + 1 > rxHighWater) rxHighWater = depth + 1;
+}
+
+void CanHandler::queueFrame(const CANFD_message_t &msgfd)
+{
+    //frames that fit the classic format go through the classic ring like they would on the other buses
+    if ( (msgfd.brs == 0) && (msgfd.edl == 0) && (msgfd.len < 9) )
+    {
+        CAN_message_t msg;
+        msg.id = msgfd.id;
+        msg.bus = msgfd.bus;
+        msg.len = msgfd.len;
+        msg.timestamp = msgfd.timestamp;
+        msg.flags.extended = msgfd.flags.extended;
+        memcpy(msg.buf, msgfd.buf, msg.len);
+        queueFrame(msg);
+        return;
+    }
+
+    uint32_t head = rxHeadFD;
+    uint32_t depth = head - rxTailFD;
+
+    if (!rxRingFD || depth >= CFG_CANFD_RX_RING_SIZE)
+    {
+        rxOverflows++;
+        return;
+    }
+    rxRingFD[head & (CFG_CANFD_RX_RING_SIZE - 1)] = msgfd;
+    portMEMORY_BARRIER();
+    rxHeadFD = head + 1;
+    if (depth + 1 > rxHighWater) rxHighWater = depth + 1;
+}
+
+/*
+ * Dispatch frames queued by the receive interrupt. Takes a snapshot of the ring head and works
+ * through that batch, then looks again. Gives up after CFG_CAN_RX_BUDGET_US so a storm on one bus
+ * can't starve the tick handler; whatever is left stays in the ring for the next pass.
+ * Frames are handed to observers straight out of the ring slot. The slot isn't released until
+ * process() returns so the interrupt can't overwrite it in the meantime.
+ * Classic and FD frames on CAN2 have separate rings so their relative order isn't preserved.
+ */
 void CanHandler::loop()
+{
+    uint32_t start = micros();
+    uint32_t head;
+    bool workDone = true;
+
+    frameLogging = Logger::isDebug();
+
+    //frames that were waiting for a transmit mailbox
+    serviceTxQueue();
+    if (numPeriodicSlots) servicePeriodic();
+
+    //consecutive frames of ISO-TP messages go out a few at a time, as fast as the receivers allow
+    if (numISOTPSessions) serviceISOTP();
+
+    while (workDone)
+    {
+        workDone = false;
+
+        head = rxHead;
+        portMEMORY_BARRIER(); //don't read ring contents from before we saw the head move
+        while (rxTail != head)
+        {
+            process(rxRing[rxTail & (CFG_CAN_RX_RING_SIZE - 1)]);
+            rxTail = rxTail + 1;
+            workDone = true;
+            if ((micros() - start) >= CFG_CAN_RX_BUDGET_US) return;
+        }
+
+        if (!rxRingFD) continue;
+        head = rxHeadFD;
+        portMEMORY_BARRIER();
+        while (rxTailFD != head)
+        {
+            process(rxRingFD[rxTailFD & (CFG_CANFD_RX_RING_SIZE - 1)]);
+            rxTailFD = rxTailFD + 1;
+            workDone = true;
+            if ((micros() - start) >= CFG_CAN_RX_BUDGET_US) return;
+        }
+    }
+}
+
+uint32_t CanHandler::getRxQueueHighWater()
+{
+    return rxHighWater;
+}
+
+uint32_t CanHandler::getRxOverflowCount()
+{
+    return rxOverflows;
+}
+
+/*
+ * GVRET (SavvyCAN) protocol handling for the second USB serial port. Only called for CAN0
+ * but it handles traffic for all three buses.
+ */
+void CanHandler::processGVRET()
 {
     uint8_t buff[80];
     uint8_t temp8;
@@ -371,6 +651,7 @@ void CanHandler::loop()
     int c;
     uint32_t now;
     static int out_bus = 0;
+
     while (SerialUSB1.available()) {
         c = SerialUSB1.read();
         switch (gvretState)
@@ -380,6 +661,10 @@ void CanHandler::loop()
             {
             case 0xE7: //puts interface into binary mode. Otherwise it'll be outputting in ascii
                 binOutput = true;
+                //SavvyCAN wants to see all traffic, not just what the observers want
+                canHandlerBus0.updateHardwareFilters();
+                canHandlerBus1.updateHardwareFilters();
+                canHandlerBus2.updateHardwareFilters();
                 break;
             case 0xF1:
                 gvretState = GET_COMMAND;
@@ -403,7 +688,7 @@ void CanHandler::loop()
                 buff[3] = (now >> 8) & 0xFF;
                 buff[4] = (now >> 16) & 0xFF;
                 buff[5] = (now >> 24) & 0xFF;
-                SerialUSB1.write(buff, 6);
+                replyGVRET(buff, 6);
                 break;                
             case PROTO_DIG_INPUTS:
                 //immediately return the data for digital inputs
@@ -416,7 +701,7 @@ void CanHandler::loop()
                 buff[1] = 2;
                 buff[2] = temp8;
                 buff[3] = checksumCalc(buff, 3);
-                SerialUSB1.write(buff, 4);
+                replyGVRET(buff, 4);
                 gvretState = IDLE; //ignore
                 break;
             case PROTO_ANA_INPUTS:
@@ -446,7 +731,7 @@ void CanHandler::loop()
                 buff[15] = (temp16 >> 8) && 0xFF;
                 temp8 = checksumCalc(buff, 16);
                 buff[16] = temp8;
-                SerialUSB1.write(buff, 17);
+                replyGVRET(buff, 17);
                 gvretState = IDLE; //ignore
                 break;
             case PROTO_SET_DIG_OUT:
@@ -469,7 +754,7 @@ void CanHandler::loop()
                 buff[9] = (sysConfig->canSpeed[1] >> 8) & 0xFF;
                 buff[10] = (sysConfig->canSpeed[1] >> 16) & 0xFF;
                 buff[11] = (sysConfig->canSpeed[1] >> 24) & 0xFF;
-                SerialUSB1.write(buff, 12);
+                replyGVRET(buff, 12);
                 gvretState = IDLE; //ignore
                 break;
             case PROTO_GET_DEV_INFO:
@@ -482,7 +767,7 @@ void CanHandler::loop()
                 buff[5] = 0;
                 buff[6] = 0;
                 buff[7] = 0; //singlewire mode. Maybe use some day
-                SerialUSB1.write(buff, 8);
+                replyGVRET(buff, 8);
                 gvretState = IDLE; //ignore
                 break;
             case PROTO_SET_SW_MODE:
@@ -493,7 +778,7 @@ void CanHandler::loop()
                 buff[1] = 0x09;
                 buff[2] = 0xDE;
                 buff[3] = 0xAD;
-                SerialUSB1.write(buff, 4);
+                replyGVRET(buff, 4);
                 gvretState = IDLE;            
                 break;
             case PROTO_SET_SYSTYPE:
@@ -506,14 +791,14 @@ void CanHandler::loop()
                 buff[0] = 0xF1;
                 buff[1] = 12;
                 buff[2] = 3;
-                SerialUSB1.write(buff, 3);
+                replyGVRET(buff, 3);
                 gvretState = IDLE;
                 break;
             case PROTO_GET_EXT_BUSES:
                 buff[0] = 0xF1;
                 buff[1] = 13;
                 for (int u = 2; u < 17; u++) buff[u] = 0;
-                SerialUSB1.write(buff, 18);
+                replyGVRET(buff, 18);
                 gvretStep = 0;
                 gvretState = IDLE;            
                 break;
@@ -625,7 +910,7 @@ void CanHandler::loop()
                     //build_out_frame.flags.rtr = 0;
                     //the CANFD_message_t structure defaults to using fast data bytes and extended length
                     //so it might be needed to be able to set this explicitly to be able to turn them off.
-                    canHandlerBus2.sendFrame(build_out_frame);
+                    canHandlerBus2.sendFrameFD(build_out_fd);
                 }
                 break;
             }
@@ -652,7 +937,7 @@ void CanHandler::loop()
 /*
  * Attach a CanObserver. Can frames which match the id/mask will be forwarded to the observer
  * via the method handleCanFrame(RX_CAN_FRAME).
- * Sets up a can bus mailbox if necessary.
+ * Reprograms the hardware acceptance filters to let the new id/mask through.
  *
  *  \param observer - the observer object to register (must implement CanObserver class)
  *  \param id - the id of the can frame to listen to
@@ -668,22 +953,12 @@ void CanHandler::attach(CanObserver* observer, uint32_t id, uint32_t mask, bool
         return;
     }
 
-    //int mailbox = bus->findFreeRXMailbox();
-
-    //if (mailbox == -1) {
-    //    Logger::error("no free CAN mailbox on bus %d", canBusNode);
-    //    return;
-    //}
-
     observerData[pos].id = id;
     observerData[pos].mask = mask;
     observerData[pos].extended = extended;
-    observerData[pos].mailbox = 0;//mailbox;
     observerData[pos].observer = observer;
+    rebuildDispatchIndex();
 
-    //bus->setMBUserFilter(mailbox, id, mask);
-
-    //Logger::debug("attached CanObserver (%X) for id=%X, mask=%X, mailbox=%d", observer, id, mask, mailbox);
     Logger::debug("attached CanObserver (%X) for id=%X, mask=%X", observer, id, mask);
 }
 
@@ -701,10 +976,9 @@ void CanHandler::detach(CanObserver* observer, uint32_t id, uint32_t mask)
                 observerData[i].id == id &&
                 observerData[i].mask == mask) {
             observerData[i].observer = NULL;
-
-            //TODO: if no more observers on same mailbox, disable its interrupt, reset mailbox
         }
     }
+    rebuildDispatchIndex();
 }
 
 /* Detaches all CAN observers for a given object
@@ -716,205 +990,491 @@ void CanHandler::detachAll(CanObserver *observer)
         if (observerData[i].observer == observer)
         {
             observerData[i].observer = NULL;
-            //TODO: if no more observers on same mailbox, disable its interrupt, reset mailbox
         }
     }
+    for (int i = 0; i < CFG_ISOTP_SESSIONS; i++) {
+        if (isoTPSessions[i].observer == observer)
+        {
+            isoTPSessions[i].observer = NULL;
+            numISOTPSessions--;
+        }
+    }
+    for (int i = 0; i < CFG_CAN_PERIODIC_SLOTS; i++) {
+        if (periodicSlots[i].observer == observer) removePeriodic(i);
+    }
+    rebuildDispatchIndex();
 }
 
 /*
- * Logs the content of a received can frame
- *
- * \param frame - the received can frame to log
+ * Rebuild the lookup structures process() uses to find observers for an incoming frame.
+ * Observers with a full mask go into a hash keyed by id, everything else into a short list
+ * of id ranges sorted by the lowest id they can match. Attaching and detaching is rare and
+ * there are only CFG_CAN_NUM_OBSERVERS entries so just redo the whole thing each time.
+ * Also must be called if an already attached observer switches canopen mode.
  */
-void CanHandler::logFrame(const CAN_message_t &msg)
+void CanHandler::rebuildDispatchIndex()
 {
-    
-    if (Logger::isDebug()) {
-        Logger::debug("CAN: bus=%i id=%X dlc=%u ide=%X data=%X,%X,%X,%X,%X,%X,%X,%X",
-                      (int)canBusNode, msg.id, msg.len, msg.flags.extended,
-                      msg.buf[0], msg.buf[1], msg.buf[2], msg.buf[3],
-                      msg.buf[4], msg.buf[5], msg.buf[6], msg.buf[7]);
+    for (int i = 0; i < CFG_CAN_DISPATCH_HASH_SIZE; i++) exactIndex[i] = DISPATCH_EMPTY;
+    numMaskEntries = 0;
+    numCanOpenEntries = 0;
+
+    for (int i = 0; i < CFG_CAN_NUM_OBSERVERS; i++)
+    {
+        CanObserverData &data = observerData[i];
+        if (data.observer == NULL) continue;
+
+        if (data.observer->isCANOpen())
+        {
+            canOpenIndex[numCanOpenEntries++] = i;
+        }
+        else if (isExactMask(data.mask, data.extended))
+        {
+            uint32_t h = dispatchHash(exactKey(data.id, data.extended));
+            while (exactIndex[h] != DISPATCH_EMPTY) h = (h + 1) & (CFG_CAN_DISPATCH_HASH_SIZE - 1);
+            exactIndex[h] = i;
+        }
+        else
+        {
+            MaskRange range;
+            range.mask = data.mask;
+            range.low = data.id & data.mask;
+            range.high = range.low | ~data.mask;
+            range.slot = i;
+            //insertion sort, the list is tiny
+            int pos = numMaskEntries++;
+            while (pos > 0 && maskIndex[pos - 1].low > range.low)
+            {
+                maskIndex[pos] = maskIndex[pos - 1];
+                pos--;
+            }
+            maskIndex[pos] = range;
+        }
     }
+
+    updateHardwareFilters();
 }
 
-void CanHandler::logFrame(const CANFD_message_t &msg_fd)
+//number of ids a filter lets through, as a power of two. Lower is tighter.
+static inline int filterWidth(uint32_t mask, bool extended)
 {
-    if (Logger::isDebug()) {
-        String dataBytes;
-        for (int i = 0; i < msg_fd.len; i++) dataBytes += String(msg_fd.buf[i], HEX) + ",";
-        Logger::debug("CANFD: bus=%i id=%X dlc=%u ide=%X data=%s",
-                      (int)canBusNode, msg_fd.id, msg_fd.len, msg_fd.flags.extended,
-                      dataBytes.c_str());
-    }
+    uint32_t idBits = extended ? 0x1FFFFFFFul : 0x7FFul;
+    return __builtin_popcount(idBits & ~mask);
 }
 
-/*
- * Find a observerData entry which is not in use.
- *
- * \retval array index of the next unused entry in observerData[]
- */
-int8_t CanHandler::findFreeObserverData()
+//true if everything filter a accepts is also accepted by filter b
+static inline bool filterCovers(uint32_t aId, uint32_t aMask, uint32_t bId, uint32_t bMask)
 {
-    for (int i = 0; i < CFG_CAN_NUM_OBSERVERS; i++) {
-        if (observerData[i].observer == NULL) {
-            return i;
-        }
-    }
-
-    return -1;
+    return ((aMask & bMask) == bMask) && ((aId & bMask) == bId);
 }
 
 /*
- * Find a unused can mailbox according to entries in observerData[].
+ * Work out the acceptance filters needed for the attached observers. Filters that are
+ * already covered by another one are dropped. If there are still more than the hardware has, the
+ * pair that merges into the narrowest filter gets merged until they fit. Merging two filters
+ * keeps only the mask bits both care about and on which their ids agree.
  *
- * \retval the mailbox index of the next unused mailbox
+ * \param filters - filled in with up to maxFilters filters
+ * \retval number of filters, or -1 if the bus should just accept everything
  */
-int8_t CanHandler::findFreeMailbox()
+int CanHandler::buildHardwareFilters(HardwareFilter *filters, int maxFilters)
 {
-/*    uint8_t numRxMailboxes = 6; //there are 8 total and two are used for TX
+    HardwareFilter wanted[CFG_CAN_NUM_OBSERVERS + CFG_ISOTP_SESSIONS + 1];
+    int count = 0;
+
+    //SavvyCAN sniffing the bus or a CAN recording gets the whole bus
+    if (binOutput || canRecorder.isRecording()) return -1;
+
+    //CANIO is handled by the CanHandler itself so it always needs to get through
+    wanted[count++] = {CAN_SWITCH, 0x7FF, false};
+
+    for (int i = 0; i < CFG_CAN_NUM_OBSERVERS; i++)
+    {
+        CanObserverData &data = observerData[i];
+        if (data.observer == NULL) continue;
+        if (data.observer->isCANOpen())
+        {
+            //PDOs, SDOs and all that. Just take every standard frame
+            wanted[count++] = {0, 0, false};
+            continue;
+        }
+        uint32_t idBits = data.extended ? 0x1FFFFFFFul : 0x7FFul;
+        wanted[count].mask = data.mask & idBits;
+        wanted[count].id = data.id & wanted[count].mask;
+        wanted[count].extended = data.extended;
+        count++;
+    }
 
-    for (uint8_t i = 0; i < numRxMailboxes; i++) {
-        bool used = false;
+    //ISO-TP sessions don't need an observer attached for their frames
+    for (int i = 0; i < CFG_ISOTP_SESSIONS; i++)
+    {
+        if (isoTPSessions[i].observer == NULL) continue;
+        wanted[count].mask = isoTPSessions[i].extended ? 0x1FFFFFFFul : 0x7FFul;
+        wanted[count].id = isoTPSessions[i].rxId & wanted[count].mask;
+        wanted[count].extended = isoTPSessions[i].extended;
+        count++;
+    }
 
-        for (uint8_t j = 0; j < CFG_CAN_NUM_OBSERVERS; j++) {
-            if (observerData[j].observer != NULL && observerData[j].mailbox == i) {
-                used = true;
+    //drop anything another filter already lets through
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < count; j++)
+        {
+            if (i == j || wanted[i].extended != wanted[j].extended) continue;
+            if (filterCovers(wanted[i].id, wanted[i].mask, wanted[j].id, wanted[j].mask))
+            {
+                wanted[i] = wanted[--count];
+                i--;
+                break;
             }
         }
+    }
 
-        if (!used) {
-            return i;
+    while (count > maxFilters)
+    {
+        int bestA = -1, bestB = -1, bestWidth = 64;
+        for (int a = 0; a < count; a++)
+        {
+            for (int b = a + 1; b < count; b++)
+            {
+                if (wanted[a].extended != wanted[b].extended) continue;
+                uint32_t mask = wanted[a].mask & wanted[b].mask & ~(wanted[a].id ^ wanted[b].id);
+                int width = filterWidth(mask, wanted[a].extended);
+                if (width < bestWidth)
+                {
+                    bestWidth = width;
+                    bestA = a;
+                    bestB = b;
+                }
+            }
         }
+        if (bestA == -1) return -1; //can't happen with two or more filters to play with
+        wanted[bestA].mask = wanted[bestA].mask & wanted[bestB].mask & ~(wanted[bestA].id ^ wanted[bestB].id);
+        wanted[bestA].id &= wanted[bestA].mask;
+        wanted[bestB] = wanted[--count];
+    }
+
+    for (int i = 0; i < count; i++) filters[i] = wanted[i];
+    return count;
+}
+
+template <class T> static void programFIFOFilters(T &bus, const CanHandler::HardwareFilter *filters, int count)
+{
+    if (count < 0)
+    {
+        bus.setFIFOFilter(ACCEPT_ALL);
+        return;
+    }
+    bus.setFIFOFilter(REJECT_ALL);
+    for (int i = 0; i < count; i++)
+    {
+        bus.setFIFOUserFilter(i, filters[i].id, filters[i].mask, filters[i].extended ? EXT : STD);
     }
-*/
-    return -1;
 }
 
 /*
- * If a message is available, read it and forward it to registered observers.
+ * Program the FlexCAN acceptance filters so only frames some observer (or GVRET) wants reach the CPU.
+ * Without CFG_CAN_HW_FILTERING, or if something goes wrong, the hardware accepts everything and
+ * process() sorts it out in software like it always did.
  */
-void CanHandler::process(const CAN_message_t &msg)
+void CanHandler::updateHardwareFilters()
 {
-    static SDO_FRAME sFrame;
+    HardwareFilter filters[CFG_CAN_NUM_OBSERVERS + 1];
+    int count = -1;
 
-    CanObserver *observer;
+    if (!hwReady) return;
 
-    sendFrameToUSB(msg);
-    logFrame(msg);
+#ifdef CFG_CAN_HW_FILTERING
+    count = buildHardwareFilters(filters, (canBusNode == CAN_BUS_2) ? CFG_CANFD_NUM_RX_MAILBOXES : CFG_CAN_NUM_HW_FILTERS);
+#endif
 
-    if(msg.id == CAN_SWITCH) CANIO(msg);
-    for (int i = 0; i < CFG_CAN_NUM_OBSERVERS; i++) 
+    switch (canBusNode)
     {
-        observer = observerData[i].observer;
-        if (observer != NULL) {
-            // Apply mask to frame.id and observer.id. If they match, forward the frame to the observer
-            if (observer->isCANOpen())
+    case CAN_BUS_0:
+        programFIFOFilters(Can0, filters, count);
+        break;
+    case CAN_BUS_1:
+        programFIFOFilters(Can1, filters, count);
+        break;
+    case CAN_BUS_2:
+        //each receive mailbox has its own filter and only takes one frame format
+        for (int mb = 0; mb < CFG_CANFD_NUM_RX_MAILBOXES; mb++)
+        {
+            if (count < 0)
             {
-                if (msg.id > 0x17F && msg.id < 0x580)
-                {
-                    observer->handlePDOFrame(msg);
-                }
-                if (msg.id == 0x600 + observer->getNodeID()) //SDO request targetted to our ID
-                {
-                    sFrame.nodeID = observer->getNodeID();
-                    sFrame.index = msg.buf[1] + (msg.buf[2] * 256);
-                    sFrame.subIndex = msg.buf[3];
-                    sFrame.cmd = (SDO_COMMAND)(msg.buf[0] & 0xF0);
-            
-                    if ((msg.buf[0] != 0x40) && (msg.buf[0] != 0x60))
-                    {
-                        sFrame.dataLength = (3 - ((msg.buf[0] & 0xC) >> 2)) + 1;            
-                    }
-                    else sFrame.dataLength = 0;
-
-                    for (int x = 0; x < sFrame.dataLength; x++) sFrame.data[x] = msg.buf[4 + x];
-                    observer->handleSDORequest(sFrame);
-                }
-
-                if (msg.id == 0x580 + observer->getNodeID()) //SDO reply to our ID
-                {
-                    sFrame.nodeID = observer->getNodeID();
-                    sFrame.index = msg.buf[1] + (msg.buf[2] * 256);
-                    sFrame.subIndex = msg.buf[3];
-                    sFrame.cmd = (SDO_COMMAND)(msg.buf[0] & 0xF0);
-            
-                    if ((msg.buf[0] != 0x40) && (msg.buf[0] != 0x60))
-                    {
-                        sFrame.dataLength = (3 - ((msg.buf[0] & 0xC) >> 2)) + 1;            
-                    }
-                    else sFrame.dataLength = 0;
-
-                    for (int x = 0; x < sFrame.dataLength; x++) sFrame.data[x] = msg.buf[4 + x];
-
-                    observer->handleSDOResponse(sFrame);                       
-                }
+                Can2.setMB((FLEXCAN_MAILBOX)mb, RX, (mb & 1) ? EXT : STD);
+                Can2.setMBFilter((FLEXCAN_MAILBOX)mb, ACCEPT_ALL);
             }
-            else //raw canbus
+            else if (mb < count)
             {
-                if ((msg.id & observerData[i].mask) == (observerData[i].id & observerData[i].mask)) {
-                    observer->handleCanFrame(msg);
-                }
+                Can2.setMB((FLEXCAN_MAILBOX)mb, RX, filters[mb].extended ? EXT : STD);
+                Can2.setMBUserFilter((FLEXCAN_MAILBOX)mb, filters[mb].id, filters[mb].mask);
+            }
+            else
+            {
+                Can2.setMBFilter((FLEXCAN_MAILBOX)mb, REJECT_ALL);
             }
         }
+        break;
+    }
+
+    numHwFilters = count;
+    if (count < 0) Logger::debug("CAN%d hardware filters: accept all", (int)canBusNode);
+    for (int i = 0; i < count; i++)
+    {
+        Logger::debug("CAN%d hardware filter %d: id=%X mask=%X ext=%d", (int)canBusNode, i, filters[i].id, filters[i].mask, filters[i].extended);
     }
 }
 
-void CanHandler::process(const CANFD_message_t &msgfd)
+int CanHandler::getNumHardwareFilters()
 {
-    //static SDO_FRAME sFrame;
+    return numHwFilters;
+}
 
-    CanObserver *observer;
+/*
+ * Find all non-canopen observers that want a frame with the given id.
+ *
+ * \param slots - filled with indexes into observerData. Must hold CFG_CAN_NUM_OBSERVERS entries
+ * \retval number of matching observers
+ */
+int CanHandler::findMatchingObservers(uint32_t id, uint8_t *slots)
+{
+    int found = 0;
 
-    //see if we can turn this into a standard CAN frame and process it via that interface. Otherwise
-    //continue with CAN-FD interpretation
-    if ( (msgfd.brs == 0) && (msgfd.edl == 0) && (msgfd.len < 9) )
+    //exact matches. Probe until an empty slot, there may be more than one observer per id
+    uint32_t h = dispatchHash(id);
+    while (exactIndex[h] != DISPATCH_EMPTY)
     {
-        CAN_message_t msg;
-        msg.id = msgfd.id;
-        msg.bus = msgfd.bus;
-        msg.len = msgfd.len;
-        msg.timestamp = msgfd.timestamp;
-        msg.flags.extended = msgfd.flags.extended;
-        for (int i = 0; i < msg.len; i++) msg.buf[i] = msgfd.buf[i];
-        process(msg);
-        return;
-    }    
-
-    sendFrameToUSB(msgfd);
-    logFrame(msgfd);
+        uint8_t slot = exactIndex[h];
+        if (exactKey(observerData[slot].id, observerData[slot].extended) == id) slots[found++] = slot;
+        h = (h + 1) & (CFG_CAN_DISPATCH_HASH_SIZE - 1);
+    }
 
-    for (int i = 0; i < CFG_CAN_NUM_OBSERVERS; i++) 
+    //ranges are sorted by low end so once one starts above the id none of the rest can match
+    for (int i = 0; i < numMaskEntries; i++)
     {
-        observer = observerData[i].observer;
-        if (observer != NULL) {
-            if ((msgfd.id & observerData[i].mask) == (observerData[i].id & observerData[i].mask)) {
-                observer->handleCanFDFrame(msgfd);
-            }
-        }
+        const MaskRange &range = maskIndex[i];
+        if (range.low > id) break;
+        if (id > range.high) continue;
+        if ((id & range.mask) == range.low) slots[found++] = range.slot;
     }
+
+    return found;
 }
 
 /*
- * Prepare the CAN transmit frame.
- * Re-sets all parameters in the re-used frame.
+ * Update the frame counters. The rate is worked out over roughly one second windows.
  */
-void CanHandler::prepareOutputFrame(CAN_message_t &msg, uint32_t id)
+void CanHandler::countFrame()
 {
-    msg.len = 8;
-    msg.id = id;
-    msg.flags.extended = 0;
+    uint32_t now = millis();
+    uint32_t elapsed = now - fpsWindowStart;
 
-    msg.buf[0] = 0;
-    msg.buf[1] = 0;
-    msg.buf[2] = 0;
-    msg.buf[3] = 0;
-    msg.buf[4] = 0;
-    msg.buf[5] = 0;
-    msg.buf[6] = 0;
-    msg.buf[7] = 0;
+    frameCount++;
+    fpsWindowCount++;
+    if (elapsed >= 1000)
+    {
+        framesPerSecond = (fpsWindowCount * 1000ul) / elapsed;
+        fpsWindowCount = 0;
+        fpsWindowStart = now;
+    }
 }
 
-void CanHandler::CANIO(const CAN_message_t &msg) {
+uint32_t CanHandler::getFramesPerSecond()
+{
+    uint32_t elapsed = millis() - fpsWindowStart;
+    //if the bus went quiet nothing rolls the window over so report what has trickled in since
+    if (elapsed >= 2000) return (fpsWindowCount * 1000ul) / elapsed;
+    return framesPerSecond;
+}
+
+uint32_t CanHandler::getFrameCount()
+{
+    return frameCount;
+}
+
+/*
+ * Logs the content of a received can frame. Callers check frameLogging first
+ * so none of this costs anything unless debug logging is on.
+ *
+ * \param frame - the received can frame to log
+ */
+void CanHandler::logFrame(const CAN_message_t &msg)
+{
+    Logger::debug("CAN: bus=%i id=%X dlc=%u ide=%X data=%X,%X,%X,%X,%X,%X,%X,%X",
+                  (int)canBusNode, msg.id, msg.len, msg.flags.extended,
+                  msg.buf[0], msg.buf[1], msg.buf[2], msg.buf[3],
+                  msg.buf[4], msg.buf[5], msg.buf[6], msg.buf[7]);
+}
+
+void CanHandler::logFrame(const CANFD_message_t &msg_fd)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+    char dataBytes[64 * 3 + 1];
+    int pos = 0;
+
+    for (int i = 0; i < msg_fd.len && i < 64; i++)
+    {
+        dataBytes[pos++] = hexDigits[msg_fd.buf[i] >> 4];
+        dataBytes[pos++] = hexDigits[msg_fd.buf[i] & 0xF];
+        dataBytes[pos++] = ',';
+    }
+    dataBytes[pos] = 0;
+    Logger::debug("CANFD: bus=%i id=%X dlc=%u ide=%X data=%s",
+                  (int)canBusNode, msg_fd.id, msg_fd.len, msg_fd.flags.extended,
+                  dataBytes);
+}
+
+/*
+ * Find a observerData entry which is not in use.
+ *
+ * \retval array index of the next unused entry in observerData[]
+ */
+int8_t CanHandler::findFreeObserverData()
+{
+    for (int i = 0; i < CFG_CAN_NUM_OBSERVERS; i++) {
+        if (observerData[i].observer == NULL) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * If a message is available, read it and forward it to registered observers.
+ */
+void CanHandler::process(const CAN_message_t &msg)
+{
+    static SDO_FRAME sFrame;
+
+    CanObserver *observer;
+    uint8_t slots[CFG_CAN_NUM_OBSERVERS];
+    int numSlots;
+
+    countFrame();
+    sendFrameToUSB(msg);
+    if (frameLogging) logFrame(msg);
+    if (canRecorder.isRecording()) canRecorder.record(msg, canBusNode, false);
+    crashHandler.recordFrame(msg, canBusNode, false);
+
+    if(msg.id == CAN_SWITCH) CANIO(msg);
+
+    if (numISOTPSessions) processISOTP(msg.id, msg.flags.extended, msg.buf, msg.len);
+
+    // raw canbus observers whose id/mask matches this frame
+    numSlots = findMatchingObservers(msg.id, slots);
+    for (int i = 0; i < numSlots; i++)
+    {
+        observer = observerData[slots[i]].observer;
+        if (observer != NULL) observer->handleCanFrame(msg);
+    }
+
+    // canopen observers don't use id/mask, they get PDOs and SDOs for their node id
+    for (int i = 0; i < numCanOpenEntries; i++) 
+    {
+        observer = observerData[canOpenIndex[i]].observer;
+        if (observer == NULL) continue;
+        if (msg.id > 0x17F && msg.id < 0x580)
+        {
+            observer->handlePDOFrame(msg);
+        }
+        if (msg.id == 0x600 + observer->getNodeID()) //SDO request targetted to our ID
+        {
+            sFrame.nodeID = observer->getNodeID();
+            sFrame.index = msg.buf[1] + (msg.buf[2] * 256);
+            sFrame.subIndex = msg.buf[3];
+            sFrame.cmd = (SDO_COMMAND)(msg.buf[0] & 0xF0);
+    
+            if ((msg.buf[0] != 0x40) && (msg.buf[0] != 0x60))
+            {
+                sFrame.dataLength = (3 - ((msg.buf[0] & 0xC) >> 2)) + 1;            
+            }
+            else sFrame.dataLength = 0;
+
+            for (int x = 0; x < sFrame.dataLength; x++) sFrame.data[x] = msg.buf[4 + x];
+            observer->handleSDORequest(sFrame);
+        }
+
+        if (msg.id == 0x580 + observer->getNodeID()) //SDO reply to our ID
+        {
+            sFrame.nodeID = observer->getNodeID();
+            sFrame.index = msg.buf[1] + (msg.buf[2] * 256);
+            sFrame.subIndex = msg.buf[3];
+            sFrame.cmd = (SDO_COMMAND)(msg.buf[0] & 0xF0);
+    
+            if ((msg.buf[0] != 0x40) && (msg.buf[0] != 0x60))
+            {
+                sFrame.dataLength = (3 - ((msg.buf[0] & 0xC) >> 2)) + 1;            
+            }
+            else sFrame.dataLength = 0;
+
+            for (int x = 0; x < sFrame.dataLength; x++) sFrame.data[x] = msg.buf[4 + x];
+
+            observer->handleSDOResponse(sFrame);                       
+        }
+    }
+}
+
+void CanHandler::process(const CANFD_message_t &msgfd)
+{
+    //static SDO_FRAME sFrame;
+
+    CanObserver *observer;
+    uint8_t slots[CFG_CAN_NUM_OBSERVERS];
+    int numSlots;
+
+    //see if we can turn this into a standard CAN frame and process it via that interface. Otherwise
+    //continue with CAN-FD interpretation
+    if ( (msgfd.brs == 0) && (msgfd.edl == 0) && (msgfd.len < 9) )
+    {
+        CAN_message_t msg;
+        msg.id = msgfd.id;
+        msg.bus = msgfd.bus;
+        msg.len = msgfd.len;
+        msg.timestamp = msgfd.timestamp;
+        msg.flags.extended = msgfd.flags.extended;
+        for (int i = 0; i < msg.len; i++) msg.buf[i] = msgfd.buf[i];
+        process(msg);
+        return;
+    }    
+
+    countFrame();
+    sendFrameToUSB(msgfd);
+    if (frameLogging) logFrame(msgfd);
+    if (canRecorder.isRecording()) canRecorder.record(msgfd, canBusNode, false);
+    crashHandler.recordFrame(msgfd, canBusNode, false);
+
+    if (numISOTPSessions) processISOTP(msgfd.id, msgfd.flags.extended, msgfd.buf, msgfd.len);
+
+    numSlots = findMatchingObservers(msgfd.id, slots);
+    for (int i = 0; i < numSlots; i++)
+    {
+        observer = observerData[slots[i]].observer;
+        if (observer != NULL) observer->handleCanFDFrame(msgfd);
+    }
+}
+
+/*
+ * Prepare the CAN transmit frame.
+ * Re-sets all parameters in the re-used frame.
+ */
+void CanHandler::prepareOutputFrame(CAN_message_t &msg, uint32_t id)
+{
+    msg.len = 8;
+    msg.id = id;
+    msg.flags.extended = 0;
+
+    msg.buf[0] = 0;
+    msg.buf[1] = 0;
+    msg.buf[2] = 0;
+    msg.buf[3] = 0;
+    msg.buf[4] = 0;
+    msg.buf[5] = 0;
+    msg.buf[6] = 0;
+    msg.buf[7] = 0;
+}
+
+void CanHandler::CANIO(const CAN_message_t &msg) {
     static CAN_message_t CANioFrame;
     int i;
 
@@ -965,85 +1525,837 @@ void CanHandler::CANIO(const CAN_message_t &msg) {
 
 //Allow the canbus driver to figure out the proper mailbox to use
 //(whatever happens to be open) or queue it to send (if nothing is open)
-void CanHandler::sendFrame(const CAN_message_t &msg)
+/*
+ * Send a frame. It goes straight to a transmit mailbox if one is free. Otherwise it waits in the
+ * transmit queue, ordered by priority class and then arbitration id, and loop() sends it as soon as
+ * a mailbox frees up. Frames sent every tick should give a maxAge (in microseconds, about one tick
+ * interval is right). Such a frame is dropped instead of being sent once it has waited longer than
+ * that and a newer copy of it replaces one still waiting in the queue. So a busy bus gets the latest
+ * value late rather than a backlog of old values.
+ * Returns false if the frame had to be thrown away because the queue is full.
+ */
+bool CanHandler::sendFrame(const CAN_message_t &msg, CAN_TX_PRIORITY priority, uint32_t maxAge)
 {
-    int busNum = -1;
-    switch (canBusNode)
+    if (canBusNode == CAN_BUS_2)
     {
-    case CAN_BUS_0:
-        Can0.write(msg);
-        busNum = 0;
-        break;
-    case CAN_BUS_1:    
-        Can1.write(msg);
-        busNum = 1;
-        break;
-    case CAN_BUS_2:
         //can't do this directly. Have to package it into a CANFD frame to send
         CANFD_message_t fdMsg;
-        fdMsg.id = msg.id;
-        fdMsg.brs = 0; //no rate switching
-        fdMsg.edl = 0; //no extended data length either
-        fdMsg.len = msg.len;
-        fdMsg.flags.extended = msg.flags.extended;
-        for (int i = 0; i < msg.len; i++) fdMsg.buf[i] = msg.buf[i];
-        Can2.write(fdMsg);
-        busNum = 2;
-        break;            
+        bridgeToFD(msg, fdMsg);
+        if (!txFramesFD) return writeFrame(fdMsg, true);
+        serviceTxQueue(); //anything already waiting goes first
+        if (txDepth == 0 && writeFrame(fdMsg, true)) return true;
+        int slot = reserveTxSlot(msg.id, msg.flags.extended, priority, maxAge);
+        if (slot < 0) return false;
+        txFramesFD[slot] = fdMsg;
+        txEntries[slot].classic = true;
+        return true;
     }
 
-    sendFrameToUSB(msg, busNum);
+    if (!txFrames) return writeFrame(msg); //setup() hasn't run yet
+    serviceTxQueue();
+    if (txDepth == 0 && writeFrame(msg)) return true;
+    int slot = reserveTxSlot(msg.id, msg.flags.extended, priority, maxAge);
+    if (slot < 0) return false;
+    txFrames[slot] = msg;
+    return true;
 }
 
-void CanHandler::sendFrameFD(const CANFD_message_t& framefd)
+bool CanHandler::sendFrameFD(const CANFD_message_t& framefd, CAN_TX_PRIORITY priority, uint32_t maxAge)
 {
-    if (canBusNode != CAN_BUS_2) return;
-    Can2.write(framefd);
-    sendFrameToUSB(framefd, 2);
+    if (canBusNode != CAN_BUS_2) return false;
+    if (!txFramesFD) return writeFrame(framefd, false);
+    serviceTxQueue();
+    if (txDepth == 0 && writeFrame(framefd, false)) return true;
+    int slot = reserveTxSlot(framefd.id, framefd.flags.extended, priority, maxAge);
+    if (slot < 0) return false;
+    txFramesFD[slot] = framefd;
+    txEntries[slot].classic = false;
+    return true;
 }
 
-void CanHandler::sendISOTP(int id, int length, uint8_t *data)
+//hand a frame to a transmit mailbox. False if they're all busy. The periodic timer interrupt writes to the
+//mailboxes too so this is done with interrupts off. FlexCAN_T4's write() is only a few register accesses.
+bool CanHandler::writeFrame(const CAN_message_t &msg)
 {
-    CAN_message_t frame;
+    uint32_t primask = disableInterrupts();
+    int accepted = (canBusNode == CAN_BUS_0) ? Can0.write(msg) : Can1.write(msg);
+    restoreInterrupts(primask);
+    if (accepted) logSentFrame(msg);
+    return accepted;
+}
 
-    frame.flags.extended = false;
-    frame.id = id;
+bool CanHandler::writeFrame(const CANFD_message_t &msg, bool classic)
+{
+    uint32_t primask = disableInterrupts();
+    int accepted = Can2.write(msg);
+    restoreInterrupts(primask);
+    if (!accepted) return false;
+    if (classic) //log it the way it went out on the wire
+    {
+        CAN_message_t classicMsg;
+        classicMsg.id = msg.id;
+        classicMsg.flags.extended = msg.flags.extended;
+        classicMsg.len = msg.len;
+        memcpy(classicMsg.buf, msg.buf, msg.len);
+        logSentFrame(classicMsg);
+    }
+    else logSentFrame(msg);
+    return true;
+}
+
+void CanHandler::logSentFrame(const CAN_message_t &msg)
+{
+    sendFrameToUSB(msg, canBusNode);
+    if (canRecorder.isRecording()) canRecorder.record(msg, canBusNode, true);
+    crashHandler.recordFrame(msg, canBusNode, true);
+}
+
+void CanHandler::logSentFrame(const CANFD_message_t &msg)
+{
+    sendFrameToUSB(msg, canBusNode);
+    if (canRecorder.isRecording()) canRecorder.record(msg, canBusNode, true);
+    crashHandler.recordFrame(msg, canBusNode, true);
+}
+
+/*
+ * The queue order. Standard ids line up with the top 11 bits of extended ones and beat an extended id
+ * with the same top bits, same as in bus arbitration. The priority class goes above all that.
+ */
+static inline uint32_t txKey(uint32_t id, bool extended, CAN_TX_PRIORITY priority)
+{
+    uint32_t arbitration = extended ? (((id & 0x1FFFFFFFul) << 1) | 1) : ((id & 0x7FFul) << 19);
+    return ((uint32_t)priority << 30) | arbitration;
+}
 
-    if (length < 8) //single frame
+/*
+ * Find a place in the transmit queue for a frame. A periodic frame (maxAge set) takes over the slot of
+ * an older copy of itself that is still waiting. It keeps that copy's place in line.
+ * Returns the slot the caller must copy the frame into or -1 if the queue is full.
+ */
+int CanHandler::reserveTxSlot(uint32_t id, bool extended, CAN_TX_PRIORITY priority, uint32_t maxAge)
+{
+    uint32_t key = txKey(id, extended, priority);
+    uint8_t slot;
+
+    if (maxAge)
     {
-        frame.len = length + 1;
-        frame.buf[0] = SINGLE + (length << 4);
-        for (int i = 0; i < length; i++) frame.buf[i + 1] = data[i];
-        sendFrame(frame);
+        for (int i = 0; i < txDepth; i++)
+        {
+            slot = txHeap[i];
+            if (txEntries[slot].key == key && txEntries[slot].maxAge)
+            {
+                txEntries[slot].queuedAt = micros();
+                txEntries[slot].maxAge = maxAge;
+                txSuperseded++;
+                return slot;
+            }
+        }
+    }
+
+    if (txNumFree == 0)
+    {
+        txFailed++;
+        return -1;
+    }
+    slot = txFreeSlots[--txNumFree];
+    txEntries[slot].key = key;
+    txEntries[slot].seq = txSeq++;
+    txEntries[slot].queuedAt = micros();
+    txEntries[slot].maxAge = maxAge;
+    txHeap[txDepth] = slot;
+    txHeapUp(txDepth);
+    txDepth++;
+    txQueued++;
+    if (txDepth > txHighWater) txHighWater = txDepth;
+    return slot;
+}
+
+//does the frame in slot a go before the one in slot b?
+bool CanHandler::txBefore(uint8_t a, uint8_t b)
+{
+    if (txEntries[a].key != txEntries[b].key) return txEntries[a].key < txEntries[b].key;
+    return (int32_t)(txEntries[a].seq - txEntries[b].seq) < 0;
+}
+
+void CanHandler::txHeapUp(uint8_t pos)
+{
+    uint8_t slot = txHeap[pos];
+    while (pos > 0)
+    {
+        uint8_t parent = (pos - 1) / 2;
+        if (!txBefore(slot, txHeap[parent])) break;
+        txHeap[pos] = txHeap[parent];
+        pos = parent;
+    }
+    txHeap[pos] = slot;
+}
+
+void CanHandler::txHeapDown(uint8_t pos)
+{
+    uint8_t slot = txHeap[pos];
+    while (true)
+    {
+        int child = 2 * pos + 1;
+        if (child >= txDepth) break;
+        if (child + 1 < txDepth && txBefore(txHeap[child + 1], txHeap[child])) child++;
+        if (!txBefore(txHeap[child], slot)) break;
+        txHeap[pos] = txHeap[child];
+        pos = child;
+    }
+    txHeap[pos] = slot;
+}
+
+/*
+ * Move waiting frames into transmit mailboxes, best first, until the queue is empty or the mailboxes
+ * are full again. Frames that waited longer than their maxAge are dropped on the way.
+ */
+void CanHandler::serviceTxQueue()
+{
+    if (txDepth == 0) return;
+    uint32_t now = micros();
+    while (txDepth)
+    {
+        uint8_t slot = txHeap[0];
+        TxEntry &entry = txEntries[slot];
+        uint32_t waited = now - entry.queuedAt;
+        if (entry.maxAge && waited > entry.maxAge) txStale++;
+        else
+        {
+            bool accepted = txFramesFD ? writeFrame(txFramesFD[slot], entry.classic) : writeFrame(txFrames[slot]);
+            if (!accepted) return; //all mailboxes still busy
+            if (waited > txLatencyMax) txLatencyMax = waited;
+            txLatencySum += waited;
+            txLatencyCount++;
+        }
+        txFreeSlots[txNumFree++] = slot;
+        txDepth--;
+        if (txDepth)
+        {
+            txHeap[0] = txHeap[txDepth];
+            txHeapDown(0);
+        }
+    }
+}
+
+uint32_t CanHandler::getTxQueueDepth()
+{
+    return txDepth;
+}
+
+uint32_t CanHandler::getTxQueueHighWater()
+{
+    return txHighWater;
+}
+
+uint32_t CanHandler::getTxQueuedCount()
+{
+    return txQueued;
+}
+
+uint32_t CanHandler::getTxFailedCount()
+{
+    return txFailed;
+}
+
+uint32_t CanHandler::getTxStaleCount()
+{
+    return txStale;
+}
+
+uint32_t CanHandler::getTxSupersededCount()
+{
+    return txSuperseded;
+}
+
+uint32_t CanHandler::getTxLatencyMax()
+{
+    return txLatencyMax;
+}
+
+//average time in microseconds queued frames waited for a mailbox
+uint32_t CanHandler::getTxLatencyAverage()
+{
+    if (txLatencyCount == 0) return 0;
+    return (uint32_t)(txLatencySum / txLatencyCount);
+}
+
+/*
+ * Put a frame on the periodic schedule. It is sent every period microseconds from a hardware timer
+ * interrupt so its timing doesn't depend on how busy the main loop is. The first send is phase
+ * microseconds from now. Give frames with the same period different phases to spread them out.
+ * CFG_CAN_PERIODIC_LEAD microseconds before each send loop() calls the observer's handlePeriodicFrame()
+ * with a copy of the last frame to turn into the next one (alive counters, checksums, current commands).
+ * Observers that only change the frame once in a while can leave that alone and call updatePeriodic()
+ * instead. If loop() stops getting new frames ready the same one is sent at most CFG_CAN_PERIODIC_STALE
+ * times, then the slot goes quiet until it does again. A device that listens for these frames will
+ * then see them time out rather than keep acting on an old command.
+ * Returns the slot number or -1 if all slots are in use.
+ */
+int CanHandler::addPeriodic(CanObserver *observer, const CAN_message_t &frame, uint32_t period, uint32_t phase)
+{
+    if (!observer || period == 0) return -1;
+    for (int i = 0; i < CFG_CAN_PERIODIC_SLOTS; i++)
+    {
+        PeriodicSlot &slot = periodicSlots[i];
+        if (slot.observer) continue;
+        slot.period = period;
+        slot.frames[0] = frame;
+        slot.frames[1] = frame;
+        slot.active = 0;
+        slot.ready = false;
+        slot.sent = 0;
+        slot.handled = 0;
+        slot.stale = 0;
+        slot.missed = 0;
+        slot.retries = 0;
+        slot.withheld = 0;
+        slot.jitterMax = 0;
+        slot.jitterSum = 0;
+        slot.nextDue = micros() + phase;
+        portMEMORY_BARRIER(); //slot must be complete before the interrupt can see it
+        slot.observer = observer;
+        numPeriodicSlots++;
+
+        if (!periodicTimerStarted)
+        {
+            periodicTimer.begin(periodicTrampoline);
+            periodicTimerStarted = true;
+        }
+        //the timer might be set for later than this slot's first send
+        uint32_t primask = disableInterrupts();
+        handlePeriodicInterrupt();
+        restoreInterrupts(primask);
+        return i;
     }
-    else //multi-frame sending
+    Logger::error("No free periodic CAN slot for id %X", frame.id);
+    return -1;
+}
+
+//replace the frame a slot sends, starting with its next send
+void CanHandler::updatePeriodic(int slot, const CAN_message_t &frame)
+{
+    if (slot < 0 || slot >= CFG_CAN_PERIODIC_SLOTS || !periodicSlots[slot].observer) return;
+    PeriodicSlot &s = periodicSlots[slot];
+    s.ready = false; //keeps the interrupt from switching frames while the new one is copied in
+    portMEMORY_BARRIER();
+    s.frames[s.active ^ 1] = frame;
+    portMEMORY_BARRIER();
+    s.ready = true;
+}
+
+void CanHandler::removePeriodic(int slot)
+{
+    if (slot < 0 || slot >= CFG_CAN_PERIODIC_SLOTS || !periodicSlots[slot].observer) return;
+    periodicSlots[slot].observer = NULL; //the timer notices on its own and stops once no slots are left
+    numPeriodicSlots--;
+}
+
+bool CanHandler::getPeriodicStats(int slot, PeriodicStats &stats)
+{
+    if (slot < 0 || slot >= CFG_CAN_PERIODIC_SLOTS || !periodicSlots[slot].observer) return false;
+    PeriodicSlot &s = periodicSlots[slot];
+    uint32_t primask = disableInterrupts();
+    stats.id = s.frames[s.active].id;
+    stats.period = s.period;
+    stats.sent = s.sent;
+    stats.missed = s.missed;
+    stats.retries = s.retries;
+    stats.withheld = s.withheld;
+    stats.jitterMax = s.jitterMax;
+    stats.jitterAverage = s.sent ? (uint32_t)(s.jitterSum / s.sent) : 0;
+    restoreInterrupts(primask);
+    return true;
+}
+
+/*
+ * Runs in the timer interrupt. Send everything that is due on all buses and set the timer for
+ * whatever comes up next.
+ */
+void CanHandler::handlePeriodicInterrupt()
+{
+    uint32_t wait, busWait;
+    do
     {
-        int temp = length;
-        uint8_t idx = 0;
-        int base;
+        wait = canHandlerBus0.runPeriodic();
+        busWait = canHandlerBus1.runPeriodic();
+        if (busWait < wait) wait = busWait;
+        busWait = canHandlerBus2.runPeriodic();
+        if (busWait < wait) wait = busWait;
+    } while (wait == 0); //something came due while the others were being sent
+    if (wait != PERIODIC_IDLE) periodicTimer.trigger(wait);
+}
+
+/*
+ * Sends the frames due on this bus. Each send is scheduled from when the last one was due, not when
+ * it went out, so the lateness of one send doesn't carry over to the next. A frame that couldn't go
+ * out before its next one was due skips the sends it missed instead of sending a burst to catch up.
+ * A frame loop() hasn't replaced for CFG_CAN_PERIODIC_STALE sends is held back until it does.
+ * Returns microseconds until the next frame on this bus is due, 0 if one already is or PERIODIC_IDLE.
+ */
+uint32_t CanHandler::runPeriodic()
+{
+    uint32_t wait = PERIODIC_IDLE;
+    if (numPeriodicSlots == 0) return wait;
+    for (int i = 0; i < CFG_CAN_PERIODIC_SLOTS; i++)
+    {
+        PeriodicSlot &slot = periodicSlots[i];
+        if (!slot.observer) continue;
+        uint32_t now = micros();
+        int32_t until = (int32_t)(slot.nextDue - now);
+        if (until <= 0)
+        {
+            uint32_t late = now - slot.nextDue;
+            if (late >= slot.period)
+            {
+                uint32_t skipped = late / slot.period;
+                slot.missed += skipped;
+                slot.nextDue += skipped * slot.period;
+                late -= skipped * slot.period;
+            }
+            if (slot.ready)
+            {
+                slot.active ^= 1;
+                slot.ready = false;
+                slot.stale = 0;
+            }
+            if (slot.stale >= CFG_CAN_PERIODIC_STALE) //loop() has stopped keeping this frame current
+            {
+                slot.withheld++;
+                slot.nextDue += slot.period;
+                until = (int32_t)(slot.nextDue - micros());
+                if (until < 0) until = 0;
+            }
+            else if (writePeriodic(slot.frames[slot.active]))
+            {
+                slot.sent++;
+                slot.stale++;
+                slot.jitterSum += late;
+                if (late > slot.jitterMax) slot.jitterMax = late;
+                slot.nextDue += slot.period;
+                until = (int32_t)(slot.nextDue - micros());
+                if (until < 0) until = 0;
+            }
+            else //all mailboxes busy. Try again soon
+            {
+                slot.retries++;
+                until = CFG_CAN_PERIODIC_RETRY;
+            }
+        }
+        if ((uint32_t)until < wait) wait = until;
+    }
+    return wait;
+}
+
+//straight to a mailbox from the timer interrupt. Logging the frame is left to loop()
+bool CanHandler::writePeriodic(const CAN_message_t &msg)
+{
+    if (canBusNode == CAN_BUS_0) return Can0.write(msg);
+    if (canBusNode == CAN_BUS_1) return Can1.write(msg);
+    CANFD_message_t fdMsg;
+    bridgeToFD(msg, fdMsg);
+    return Can2.write(fdMsg);
+}
+
+/*
+ * Main loop side of the periodic schedule. Log what the timer sent and, once the next send is less
+ * than CFG_CAN_PERIODIC_LEAD away, have the observer get the frame ready for it. Building it just
+ * before it goes instead of just after the last send keeps the commands in it a period fresher.
+ */
+void CanHandler::servicePeriodic()
+{
+    for (int i = 0; i < CFG_CAN_PERIODIC_SLOTS; i++)
+    {
+        PeriodicSlot &slot = periodicSlots[i];
+        if (!slot.observer) continue;
+        uint32_t sent = slot.sent;
+        if (sent != slot.handled)
+        {
+            slot.handled = sent;
+            //only the main loop writes to the frames so the one last sent can't change under us
+            logSentFrame(slot.frames[slot.active]);
+        }
+        if (slot.ready) continue; //already built, or updatePeriodic() gave it the next frame
+        if ((int32_t)(slot.nextDue - micros()) > CFG_CAN_PERIODIC_LEAD) continue;
+        uint8_t next = slot.active ^ 1; //can't change while ready is false
+        slot.frames[next] = slot.frames[slot.active];
+        slot.observer->handlePeriodicFrame(i, slot.frames[next]);
+        portMEMORY_BARRIER();
+        slot.ready = true;
+    }
+}
+
+/*
+ * ISO-TP (ISO 15765-2) lets messages of up to 4095 bytes (more with the escape sequence) travel over CAN.
+ * Short ones go as a single frame. Longer ones start with a first frame, the receiver answers with a
+ * flow control frame giving a block size and the minimum gap it wants between frames (STmin) and then
+ * the rest follows as consecutive frames. Nothing in here blocks. Received frames are handled as they
+ * come in through process() and consecutive frames are sent from loop() when their time comes.
+ *
+ * A session listens on rxId and sends on txId. Received messages are put together right in rxBuffer,
+ * which belongs to the observer, and handed over with handleISOTPMessage(). The buffer is only
+ * written while a message is coming in so it is safe to use it until the next one starts. With fd set
+ * (CAN2 only) frames carry up to 64 bytes instead of 8.
+ * Returns the session number or -1 if there is no free session.
+ */
+int CanHandler::openISOTP(CanObserver *observer, uint32_t rxId, uint32_t txId, bool extended, uint8_t *rxBuffer, uint16_t rxBufferSize, bool fd)
+{
+    if (fd && canBusNode != CAN_BUS_2)
+    {
+        Logger::warn("CAN-FD ISO-TP is only possible on CAN2. Using 8 byte frames on CAN%i", canBusNode);
+        fd = false;
+    }
+
+    for (int i = 0; i < CFG_ISOTP_SESSIONS; i++)
+    {
+        IsoTPSession &session = isoTPSessions[i];
+        if (session.observer != NULL) continue;
+        session.rxId = rxId;
+        session.txId = txId;
+        session.extended = extended;
+        session.fd = fd;
+        session.rxBuffer = rxBuffer;
+        session.rxBufferSize = rxBufferSize;
+        session.rxActive = false;
+        session.txData = NULL;
+        session.txState = ISOTP_TX_IDLE;
+        session.observer = observer;
+        numISOTPSessions++;
+        rebuildDispatchIndex(); //hardware filters have to let rxId through now
+        return i;
+    }
+    Logger::error("no free ISO-TP session on CAN%i, increase CFG_ISOTP_SESSIONS", canBusNode);
+    return -1;
+}
+
+void CanHandler::closeISOTP(int session)
+{
+    if (session < 0 || session >= CFG_ISOTP_SESSIONS || isoTPSessions[session].observer == NULL) return;
+    isoTPSessions[session].observer = NULL;
+    numISOTPSessions--;
+    rebuildDispatchIndex();
+}
+
+bool CanHandler::isISOTPBusy(int session)
+{
+    if (session < 0 || session >= CFG_ISOTP_SESSIONS) return false;
+    return isoTPSessions[session].txState != ISOTP_TX_IDLE;
+}
+
+/*
+ * Start sending a message. Doesn't copy data, it is sent straight out of the caller's buffer so that
+ * must stay untouched until the observer gets handleISOTPSent(). Returns false if the session is
+ * still busy with the last message or the transmit queue is too full to take its first frame.
+ */
+bool CanHandler::sendISOTP(int session, const uint8_t *data, uint16_t length)
+{
+    uint8_t frame[64];
+
+    if (session < 0 || session >= CFG_ISOTP_SESSIONS) return false;
+    IsoTPSession &s = isoTPSessions[session];
+    if (s.observer == NULL || s.txState != ISOTP_TX_IDLE || length == 0) return false;
+
+    uint8_t frameSize = s.fd ? 64 : 8;
+    if (length <= 7) //single frame
+    {
+        frame[0] = (SINGLE << 4) | length;
+        memcpy(&frame[1], data, length);
+        if (!sendISOTPFrame(s, frame, length + 1)) return false;
+        s.txCount = length;
+        s.txState = ISOTP_TX_DONE;
+    }
+    else if (s.fd && length <= 62) //CAN-FD single frame, length goes in the second byte
+    {
+        frame[0] = SINGLE << 4;
+        frame[1] = length;
+        memcpy(&frame[2], data, length);
+        if (!sendISOTPFrame(s, frame, length + 2)) return false;
+        s.txCount = length;
+        s.txState = ISOTP_TX_DONE;
+    }
+    else
+    {
+        int header = 2;
+        if (length <= 4095)
+        {
+            frame[0] = (FIRST << 4) | (length >> 8);
+            frame[1] = length & 0xFF;
+        }
+        else //escape sequence for lengths that don't fit in 12 bits
+        {
+            frame[0] = FIRST << 4;
+            frame[1] = 0;
+            frame[2] = 0;
+            frame[3] = 0;
+            frame[4] = length >> 8;
+            frame[5] = length & 0xFF;
+            header = 6;
+        }
+        memcpy(&frame[header], data, frameSize - header);
+        if (!sendISOTPFrame(s, frame, frameSize)) return false;
+        s.txCount = frameSize - header;
+        s.txSeq = 1;
+        s.txWaits = 0;
+        s.txWaitStart = millis();
+        s.txState = ISOTP_TX_WAIT_FC;
+    }
+    s.txData = data;
+    s.txLength = length;
+    return true;
+}
+
+//pads the frame out to a length the bus allows and sends it on the session's id. False if the transmit queue is full
+bool CanHandler::sendISOTPFrame(IsoTPSession &session, const uint8_t *data, uint8_t len)
+{
+    if (session.fd)
+    {
+        CANFD_message_t frame;
+        static const uint8_t fdSizes[] = {8, 12, 16, 20, 24, 32, 48, 64};
+        uint8_t size = 64;
+        for (uint8_t fdSize : fdSizes)
+        {
+            if (len <= fdSize)
+            {
+                size = fdSize;
+                break;
+            }
+        }
+        frame.id = session.txId;
+        frame.flags.extended = session.extended;
+        frame.brs = 1;
+        frame.edl = 1;
+        frame.len = size;
+        memcpy(frame.buf, data, len);
+        memset(&frame.buf[len], CFG_ISOTP_PADDING, size - len);
+        return sendFrameFD(frame);
+    }
+    else
+    {
+        CAN_message_t frame;
+        frame.id = session.txId;
+        frame.flags.extended = session.extended;
         frame.len = 8;
-        frame.buf[0] = FIRST + (length >> 8);
-        frame.buf[1] = (length & 0xFF);
-        for (int i = 0; i < 6; i++) frame.buf[i + 2] = data[i];
-        sendFrame(frame);
-        temp -= 6;
-        base = 6;
-        while (temp > 7)
+        memcpy(frame.buf, data, len);
+        memset(&frame.buf[len], CFG_ISOTP_PADDING, 8 - len);
+        return sendFrame(frame);
+    }
+}
+
+void CanHandler::sendISOTPFlowControl(IsoTPSession &session, ISOTP_FLOW_STATUS status)
+{
+    uint8_t frame[3];
+    frame[0] = (FLOW << 4) | status;
+    frame[1] = CFG_ISOTP_BLOCK_SIZE;
+    frame[2] = CFG_ISOTP_STMIN;
+    //the sender won't go on without it, so a message that can't be answered is dropped right away
+    if (!sendISOTPFrame(session, frame, 3) && session.rxActive)
+    {
+        Logger::warn("No room to send ISO-TP flow control on id %X. Message dropped", session.txId);
+        session.rxActive = false;
+    }
+}
+
+//the next consecutive frame. If it can't be queued nothing changes so the same frame is tried again
+bool CanHandler::sendISOTPConsecutive(IsoTPSession &session)
+{
+    uint8_t frame[64];
+    uint16_t len = (session.fd ? 63 : 7);
+    if (len > session.txLength - session.txCount) len = session.txLength - session.txCount;
+
+    frame[0] = (CONSEC << 4) | session.txSeq;
+    memcpy(&frame[1], &session.txData[session.txCount], len);
+    if (!sendISOTPFrame(session, frame, len + 1)) return false;
+    session.txCount += len;
+    session.txSeq = (session.txSeq + 1) & 0xF;
+    return true;
+}
+
+//STmin is either milliseconds (0-127) or 100-900 microseconds (0xF1-0xF9). Anything else means the longest
+static uint32_t isoTPStMinMicros(uint8_t stMin)
+{
+    if (stMin <= 0x7F) return stMin * 1000ul;
+    if (stMin >= 0xF1 && stMin <= 0xF9) return (stMin - 0xF0) * 100ul;
+    return 127000ul;
+}
+
+/*
+ * Hands a received frame to whichever ISO-TP session listens on its id. Data from first and
+ * consecutive frames goes straight into the session's buffer.
+ */
+void CanHandler::processISOTP(uint32_t id, bool extended, const uint8_t *data, uint8_t len)
+{
+    for (int i = 0; i < CFG_ISOTP_SESSIONS; i++)
+    {
+        IsoTPSession &s = isoTPSessions[i];
+        if (s.observer == NULL || s.rxId != id || s.extended != extended || len == 0) continue;
+
+        uint16_t msgLen;
+        int header;
+        switch (data[0] >> 4)
+        {
+        case SINGLE:
+            msgLen = data[0] & 0xF;
+            header = 1;
+            if (msgLen == 0 && len > 8) //CAN-FD single frame
+            {
+                msgLen = data[1];
+                header = 2;
+            }
+            if (msgLen == 0 || msgLen + header > len) break;
+            s.rxActive = false; //a new message ends anything that was still coming in
+            if (msgLen > s.rxBufferSize)
+            {
+                Logger::warn("ISO-TP message on id %X is too long (%i bytes)", id, msgLen);
+                break;
+            }
+            memcpy(s.rxBuffer, &data[header], msgLen);
+            s.observer->handleISOTPMessage(i, s.rxBuffer, msgLen);
+            break;
+        case FIRST:
+            if (len < 8) break;
+            msgLen = ((data[0] & 0xF) << 8) | data[1];
+            header = 2;
+            if (msgLen == 0) //escape sequence, 32 bit length
+            {
+                if (data[2] || data[3]) msgLen = 0xFFFF; //far too long for us anyway
+                else msgLen = (data[4] << 8) | data[5];
+                header = 6;
+            }
+            if (msgLen > s.rxBufferSize)
+            {
+                Logger::warn("ISO-TP message on id %X is too long (%i bytes)", id, msgLen);
+                s.rxActive = false;
+                sendISOTPFlowControl(s, ISOTP_FC_OVERFLOW);
+                break;
+            }
+            s.rxLength = msgLen;
+            s.rxCount = len - header;
+            if (s.rxCount > msgLen) s.rxCount = msgLen;
+            memcpy(s.rxBuffer, &data[header], s.rxCount);
+            s.rxSeq = 1;
+            s.rxBlockCount = 0;
+            s.rxActive = true;
+            s.rxLastTime = millis();
+            sendISOTPFlowControl(s, ISOTP_FC_CTS);
+            break;
+        case CONSEC:
+        {
+            if (!s.rxActive) break;
+            if ((data[0] & 0xF) != s.rxSeq)
+            {
+                Logger::warn("ISO-TP frame out of sequence on id %X. Message dropped", id);
+                s.rxActive = false;
+                break;
+            }
+            uint16_t chunk = len - 1;
+            if (chunk > s.rxLength - s.rxCount) chunk = s.rxLength - s.rxCount;
+            memcpy(&s.rxBuffer[s.rxCount], &data[1], chunk);
+            s.rxCount += chunk;
+            s.rxSeq = (s.rxSeq + 1) & 0xF;
+            s.rxLastTime = millis();
+            if (s.rxCount >= s.rxLength)
+            {
+                s.rxActive = false;
+                s.observer->handleISOTPMessage(i, s.rxBuffer, s.rxLength);
+            }
+            else if (CFG_ISOTP_BLOCK_SIZE && ++s.rxBlockCount >= CFG_ISOTP_BLOCK_SIZE)
+            {
+                s.rxBlockCount = 0;
+                sendISOTPFlowControl(s, ISOTP_FC_CTS);
+            }
+            break;
+        }
+        case FLOW:
+            if (s.txState != ISOTP_TX_WAIT_FC || len < 3) break;
+            switch (data[0] & 0xF)
+            {
+            case ISOTP_FC_CTS:
+                s.txBlockSize = data[1];
+                s.txBlockLeft = data[1];
+                s.txStMin = isoTPStMinMicros(data[2]);
+                s.txWaits = 0;
+                s.txWaitStart = millis(); //while sending, when a frame last got out
+                s.txNextTime = micros();
+                s.txState = ISOTP_TX_SENDING;
+                break;
+            case ISOTP_FC_WAIT:
+                s.txWaitStart = millis();
+                if (++s.txWaits > CFG_ISOTP_MAX_WAITS) s.txState = ISOTP_TX_FAILED;
+                break;
+            default: //overflow or garbage. Either way the receiver won't take it
+                s.txState = ISOTP_TX_FAILED;
+                break;
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * Called from loop(). Sends the consecutive frames that are due, times out transfers where the other
+ * side went quiet and tells observers about finished sends.
+ */
+void CanHandler::serviceISOTP()
+{
+    for (int i = 0; i < CFG_ISOTP_SESSIONS; i++)
+    {
+        IsoTPSession &s = isoTPSessions[i];
+        if (s.observer == NULL) continue;
+
+        if (s.rxActive && (millis() - s.rxLastTime) > CFG_ISOTP_TIMEOUT)
         {
-            frame.len = 8;
-            frame.buf[0] = CONSEC + (idx << 4);
-            idx = (idx + 1) & 0xF;
-            for (int i = 0; i < 7; i++) frame.buf[i + 1] = data[i + base];
-            sendFrame(frame);
-            temp -= 7;
-            base += 7;
+            Logger::warn("ISO-TP receive on id %X timed out", s.rxId);
+            s.rxActive = false;
         }
-        if (temp > 0)
+
+        switch (s.txState)
         {
-            frame.len = temp + 1;
-            frame.buf[0] = CONSEC + (idx << 4);
-            for (int i = 0; i < temp; i++) frame.buf[i + 1] = data[i + base];
-            sendFrame(frame);
+        case ISOTP_TX_IDLE:
+            break;
+        case ISOTP_TX_WAIT_FC:
+            if ((millis() - s.txWaitStart) > CFG_ISOTP_TIMEOUT)
+            {
+                Logger::warn("No ISO-TP flow control for id %X", s.txId);
+                s.txState = ISOTP_TX_FAILED;
+            }
+            break;
+        case ISOTP_TX_SENDING:
+            for (int burst = 0; burst < CFG_ISOTP_TX_BURST; burst++)
+            {
+                if ((int32_t)(micros() - s.txNextTime) < 0) break;
+                if (!sendISOTPConsecutive(s))
+                {
+                    //transmit queue full. Try again next pass unless it's been stuck for too long
+                    if ((millis() - s.txWaitStart) > CFG_ISOTP_TIMEOUT)
+                    {
+                        Logger::warn("ISO-TP send on id %X stalled, transmit queue stays full", s.txId);
+                        s.txState = ISOTP_TX_FAILED;
+                    }
+                    break;
+                }
+                s.txWaitStart = millis();
+                s.txNextTime = micros() + s.txStMin;
+                if (s.txCount >= s.txLength)
+                {
+                    s.txState = ISOTP_TX_DONE;
+                    break;
+                }
+                if (s.txBlockSize && --s.txBlockLeft == 0)
+                {
+                    s.txWaitStart = millis();
+                    s.txState = ISOTP_TX_WAIT_FC;
+                    break;
+                }
+            }
+            break;
+        case ISOTP_TX_DONE:
+        case ISOTP_TX_FAILED:
+            {
+                bool success = (s.txState == ISOTP_TX_DONE);
+                s.txState = ISOTP_TX_IDLE;
+                s.txData = NULL;
+                s.observer->handleISOTPSent(i, success);
+            }
+            break;
         }
     }
 }
@@ -1185,6 +2497,10 @@ void CanObserver::setAttachedCANBus(int bus)
 void CanObserver::setCANOpenMode(bool en)
 {
     canOpenMode = en;
+    //the dispatch index sorts canopen observers separately so it has to be redone if we're already attached
+    canHandlerBus0.rebuildDispatchIndex();
+    canHandlerBus1.rebuildDispatchIndex();
+    canHandlerBus2.rebuildDispatchIndex();
 }
 
 void CanObserver::setNodeID(unsigned int id)
@@ -1243,3 +2559,18 @@ void CanObserver::handleSDOResponse(SDO_FRAME &frame)
 {
     Logger::error("CanObserver does not implement handleSDOResponse(), frame.id=%d", frame.nodeID);
 }
+
+void CanObserver::handleISOTPMessage(int session, const uint8_t *data, uint16_t length)
+{
+    Logger::error("CanObserver does not implement handleISOTPMessage(), session=%i", session);
+}
+
+//observers that don't care when their messages finish sending don't need to implement this
+void CanObserver::handleISOTPSent(int session, bool success)
+{
+}
+
+//periodic frames are sent as they are unless the observer changes them here
+void CanObserver::handlePeriodicFrame(int slot, CAN_message_t &frame)
+{
+}
@@ -66,6 +66,33 @@ enum ISOTP_MODE
     FLOW = 3
 };
 
+//flow status sent in ISO-TP flow control frames
+enum ISOTP_FLOW_STATUS
+{
+    ISOTP_FC_CTS = 0,
+    ISOTP_FC_WAIT = 1,
+    ISOTP_FC_OVERFLOW = 2
+};
+
+enum ISOTP_TX_STATE
+{
+    ISOTP_TX_IDLE,
+    ISOTP_TX_WAIT_FC,   //waiting for the receiver's flow control
+    ISOTP_TX_SENDING,   //sending consecutive frames, paced by the receiver's STmin
+    ISOTP_TX_DONE,      //last frame is out, the observer hears about it on the next loop()
+    ISOTP_TX_FAILED
+};
+
+//priority class of a frame to send. Frames waiting for a transmit mailbox go out by class
+//and within a class by CAN arbitration id, just like they would win arbitration on the bus
+enum CAN_TX_PRIORITY
+{
+    CAN_TX_CRITICAL = 0,    //motor commands and anything else safety related
+    CAN_TX_HIGH = 1,
+    CAN_TX_NORMAL = 2,
+    CAN_TX_LOW = 3          //displays, logging and other nice to haves
+};
+
 class CanHandler;
 
 class CanObserver
@@ -77,6 +104,9 @@ public:
     virtual void handlePDOFrame(const CAN_message_t &frame);
     virtual void handleSDORequest(SDO_FRAME &frame);
     virtual void handleSDOResponse(SDO_FRAME &frame);
+    virtual void handleISOTPMessage(int session, const uint8_t *data, uint16_t length);
+    virtual void handleISOTPSent(int session, bool success);
+    virtual void handlePeriodicFrame(int slot, CAN_message_t &frame);
     void setCANOpenMode(bool en);
     bool isCANOpen();
     void setNodeID(unsigned int id);
@@ -148,9 +178,29 @@ public:
         CAN_BUS_2
     };
 
+    //how well a periodic frame keeps to its schedule. Times in microseconds
+    struct PeriodicStats {
+        uint32_t id;
+        uint32_t period;
+        uint32_t sent;
+        uint32_t missed;    // sends skipped because the frame couldn't go out before the next one was due
+        uint32_t retries;   // times all transmit mailboxes were busy when the frame was due
+        uint32_t withheld;  // sends dropped because loop() hadn't built a new frame in CFG_CAN_PERIODIC_STALE periods
+        uint32_t jitterMax; // how late a send was compared to its schedule
+        uint32_t jitterAverage;
+    };
+
+    //one acceptance filter as programmed into the FlexCAN hardware
+    struct HardwareFilter {
+        uint32_t id;
+        uint32_t mask;
+        bool extended;
+    };
+
     CanHandler(CanBusNode busNumber);
     void setup();
     void loop();
+    void processGVRET();
     uint32_t getBusSpeed();
     uint32_t getBusFDSpeed();
     void setBusSpeed(uint32_t newSpeed);
@@ -158,13 +208,28 @@ public:
     void attach(CanObserver *observer, uint32_t id, uint32_t mask, bool extended);
     void detach(CanObserver *observer, uint32_t id, uint32_t mask);
     void detachAll(CanObserver *observer);
+    void queueFrame(const CAN_message_t &msg);
+    void queueFrame(const CANFD_message_t &msg_fd);
     void process(const CAN_message_t &msg);
     void process(const CANFD_message_t &msg_fd);
     void prepareOutputFrame(CAN_message_t &frame, uint32_t id);
     void CANIO(const CAN_message_t& frame);
-    void sendFrame(const CAN_message_t& frame);
-    void sendFrameFD(const CANFD_message_t& framefd);
-    void sendISOTP(int id, int length, uint8_t *data);
+    bool sendFrame(const CAN_message_t& frame, CAN_TX_PRIORITY priority = CAN_TX_NORMAL, uint32_t maxAge = 0);
+    bool sendFrameFD(const CANFD_message_t& framefd, CAN_TX_PRIORITY priority = CAN_TX_NORMAL, uint32_t maxAge = 0);
+
+    //ISO-TP (ISO 15765-2) transport. See openISOTP() in CanHandler.cpp
+    int openISOTP(CanObserver *observer, uint32_t rxId, uint32_t txId, bool extended, uint8_t *rxBuffer, uint16_t rxBufferSize, bool fd = false);
+    void closeISOTP(int session);
+    bool sendISOTP(int session, const uint8_t *data, uint16_t length);
+    bool isISOTPBusy(int session);
+
+    //frames sent on a fixed schedule from a hardware timer. See addPeriodic() in CanHandler.cpp
+    int addPeriodic(CanObserver *observer, const CAN_message_t &frame, uint32_t period, uint32_t phase = 0);
+    void updatePeriodic(int slot, const CAN_message_t &frame);
+    void removePeriodic(int slot);
+    bool getPeriodicStats(int slot, PeriodicStats &stats);
+    static void handlePeriodicInterrupt(); // must be public, it is called from the timer interrupt
+    void updateHardwareFilters(); // reprogram the acceptance filters, e.g. when a CAN recording starts or stops
     void setSWMode(SWMode newMode);
     SWMode getSWMode();
 
@@ -179,6 +244,25 @@ public:
     void sendHeartbeat();
     void setMasterID(int id);
 
+    //statistics
+    uint32_t getFramesPerSecond();
+    uint32_t getFrameCount();
+    uint32_t getRxQueueHighWater();
+    uint32_t getRxOverflowCount();
+    int getNumHardwareFilters();
+    uint32_t getTxQueueDepth();
+    uint32_t getTxQueueHighWater();
+    uint32_t getTxQueuedCount();
+    uint32_t getTxFailedCount();
+    uint32_t getTxStaleCount();
+    uint32_t getTxSupersededCount();
+    uint32_t getTxLatencyMax();
+    uint32_t getTxLatencyAverage();
+    static uint32_t getGVRETDropCount();
+    static void serviceGVRET();
+
+    void rebuildDispatchIndex();
+
 protected:
 
 private:
@@ -186,16 +270,132 @@ private:
         uint32_t id;    // what id to listen to
         uint32_t mask;  // the CAN frame mask to listen to
         bool extended;  // are extended frames expected
-        uint8_t mailbox;    // which mailbox is this observer assigned to
         CanObserver *observer;  // the observer object (e.g. a device)
     };
 
+    //an observer whose mask doesn't cover the whole id. Any matching id lies in [low, high]
+    struct MaskRange {
+        uint32_t low;   // id & mask
+        uint32_t high;  // id | ~mask
+        uint32_t mask;
+        uint8_t slot;   // index into observerData
+    };
+
+    //one ISO-TP connection. The receive and send sides run independently of each other
+    struct IsoTPSession {
+        CanObserver *observer;  // NULL if this session is free
+        uint32_t rxId;          // requests and flow control from the other side come in on this id
+        uint32_t txId;          // we send on this id
+        bool extended;
+        bool fd;                // 64 byte CAN-FD frames. CAN2 only
+
+        uint8_t *rxBuffer;      // the observer's buffer. Frames are copied straight into it
+        uint16_t rxBufferSize;
+        uint16_t rxLength;      // length announced by the first frame
+        uint16_t rxCount;       // bytes received so far
+        uint8_t rxSeq;          // sequence number the next consecutive frame must have
+        uint8_t rxBlockCount;   // consecutive frames since our last flow control
+        bool rxActive;
+        uint32_t rxLastTime;    // millis() of the last frame received
+
+        const uint8_t *txData;  // the observer's buffer. Must stay untouched until handleISOTPSent()
+        uint16_t txLength;
+        uint16_t txCount;       // bytes sent so far
+        uint8_t txSeq;
+        uint8_t txBlockSize;    // block size from the receiver's flow control. 0 = no limit
+        uint8_t txBlockLeft;    // consecutive frames left until the next flow control
+        uint8_t txWaits;        // WAIT flow controls in a row
+        uint32_t txStMin;       // microseconds the receiver wants between consecutive frames
+        uint32_t txNextTime;    // micros() when the next consecutive frame may go
+        uint32_t txWaitStart;   // millis() we started waiting for flow control. While sending, when a frame last got queued
+        ISOTP_TX_STATE txState;
+    };
+
+    //a frame on the periodic schedule. The timer interrupt sends frames[active]. The main loop fills in
+    //the other one and sets ready, then the interrupt switches over to it on the next send
+    struct PeriodicSlot {
+        CanObserver *observer;      // NULL if this slot is free
+        uint32_t period;            // microseconds
+        volatile uint32_t nextDue;  // micros() the next send is due
+        CAN_message_t frames[2];
+        volatile uint8_t active;
+        volatile bool ready;
+        volatile uint32_t sent;
+        uint32_t handled;           // sends loop() has logged
+        volatile uint8_t stale;     // times frames[active] has been sent
+        volatile uint32_t missed;
+        volatile uint32_t retries;
+        volatile uint32_t withheld;
+        volatile uint32_t jitterMax;
+        uint64_t jitterSum;
+    };
+
+    //a frame waiting in the transmit queue. The frame itself is in the same slot of txFrames or txFramesFD
+    struct TxEntry {
+        uint32_t key;       // priority class and arbitration id, see txKey(). Lowest goes first
+        uint32_t seq;       // frames with the same key go out in the order they were sent
+        uint32_t queuedAt;  // micros() when the frame was handed to us
+        uint32_t maxAge;    // microseconds after which the frame isn't worth sending any more. 0 = no limit
+        bool classic;       // CAN2 only. A classic frame bridged to FD, logged as classic when it goes out
+    };
+
     CanBusNode canBusNode;  // indicator to which can bus this instance is assigned to
     CanObserverData observerData[CFG_CAN_NUM_OBSERVERS];    // Can observers
+
+    //dispatch index built from observerData by rebuildDispatchIndex() whenever it changes
+    uint8_t exactIndex[CFG_CAN_DISPATCH_HASH_SIZE]; // open addressed hash of slots with a full mask, keyed by id
+    MaskRange maskIndex[CFG_CAN_NUM_OBSERVERS];     // partial mask observers sorted by range.low
+    uint8_t numMaskEntries;
+    uint8_t canOpenIndex[CFG_CAN_NUM_OBSERVERS];    // canopen observers see everything and sort it out below
+    uint8_t numCanOpenEntries;
+    IsoTPSession isoTPSessions[CFG_ISOTP_SESSIONS];
+    uint8_t numISOTPSessions;   // sessions in use, so buses without any skip the ISO-TP code quickly
+
+    //transmit queue for when all the transmit mailboxes are busy. A binary heap of slot numbers ordered
+    //by TxEntry key and seq. Only used from the main loop
+    CAN_message_t *txFrames;    // CAN0 and CAN1
+    CANFD_message_t *txFramesFD; // CAN2. Classic frames are stored as FD ones
+    TxEntry txEntries[CFG_CAN_TX_QUEUE_SIZE];
+    uint8_t txHeap[CFG_CAN_TX_QUEUE_SIZE];
+    uint8_t txFreeSlots[CFG_CAN_TX_QUEUE_SIZE];
+    uint8_t txDepth;
+    uint8_t txNumFree;
+    uint32_t txSeq;
+    uint32_t txHighWater;
+    uint32_t txQueued;          // frames that had to wait for a mailbox
+    uint32_t txFailed;          // frames thrown away because the queue was full
+    uint32_t txStale;           // frames dropped because they waited longer than their maxAge
+    uint32_t txSuperseded;      // queued frames replaced by a newer copy of the same periodic frame
+    uint32_t txLatencyMax;      // longest a queued frame waited, in microseconds
+    uint64_t txLatencySum;
+    uint32_t txLatencyCount;
+
+    PeriodicSlot periodicSlots[CFG_CAN_PERIODIC_SLOTS];
+    uint8_t numPeriodicSlots;
+
+    uint32_t frameCount;        // total frames received on this bus
+    uint32_t fpsWindowCount;    // frames received since fpsWindowStart
+    uint32_t fpsWindowStart;
+    uint32_t framesPerSecond;   // frames received during the last full second
+
+    //receive rings. The CAN interrupt is the only producer and loop() the only consumer so
+    //head is only written by queueFrame() and tail only by loop(). Both run freely and get masked on use.
+    CAN_message_t *rxRing;
+    volatile uint32_t rxHead;
+    volatile uint32_t rxTail;
+    CANFD_message_t *rxRingFD; // only allocated for CAN2
+    volatile uint32_t rxHeadFD;
+    volatile uint32_t rxTailFD;
+    volatile uint32_t rxHighWater;  // deepest either ring has been
+    volatile uint32_t rxOverflows;  // frames thrown away because a ring was full
+
+    bool hwReady;           // setup() has started the bus so its filters can be programmed
+    int numHwFilters;       // filters currently programmed, -1 if the hardware accepts everything
     uint32_t busSpeed;
     uint32_t fdSpeed;
     SWMode swmode;
-    bool binOutput;
+    static bool binOutput;  // SavvyCAN asked for binary GVRET output. Shared, it's one USB port for all buses
+    bool frameLogging;      // debug logging of every frame, refreshed once per loop() instead of per frame
     GVRET_STATE gvretState;
     int gvretStep;
     CAN_message_t build_out_frame;
@@ -204,10 +404,29 @@ private:
     void logFrame(const CAN_message_t &msg);
     void logFrame(const CANFD_message_t &msg_fd);
     int8_t findFreeObserverData();
-    int8_t findFreeMailbox();
+    int buildHardwareFilters(HardwareFilter *filters, int maxFilters);
+    int findMatchingObservers(uint32_t id, uint8_t *slots);
+    void countFrame();
     uint8_t checksumCalc(uint8_t *buffer, int length);
     void sendFrameToUSB(const CAN_message_t &msg, int busNum = -1);
     void sendFrameToUSB(const CANFD_message_t &msg, int busNum = -1);
+    bool writeFrame(const CAN_message_t &msg);
+    bool writeFrame(const CANFD_message_t &msg, bool classic);
+    void logSentFrame(const CAN_message_t &msg);
+    void logSentFrame(const CANFD_message_t &msg);
+    int reserveTxSlot(uint32_t id, bool extended, CAN_TX_PRIORITY priority, uint32_t maxAge);
+    bool txBefore(uint8_t a, uint8_t b);
+    void txHeapUp(uint8_t pos);
+    void txHeapDown(uint8_t pos);
+    void serviceTxQueue();
+    uint32_t runPeriodic();
+    void servicePeriodic();
+    bool writePeriodic(const CAN_message_t &msg);
+    void processISOTP(uint32_t id, bool extended, const uint8_t *data, uint8_t len);
+    void serviceISOTP();
+    bool sendISOTPFrame(IsoTPSession &session, const uint8_t *data, uint8_t len);
+    void sendISOTPFlowControl(IsoTPSession &session, ISOTP_FLOW_STATUS status);
+    bool sendISOTPConsecutive(IsoTPSession &session);
 
     //canopen support functions
     void sendNMTMsg(int, int);
@@ -0,0 +1,390 @@
+/*
+ * CanRecorder.cpp
+ *
+Copyright (c) 2022 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "CanRecorder.h"
+#include "CanHandler.h"
+#include "Logger.h"
+
+#if (CFG_CANREC_NUM_SECTORS & (CFG_CANREC_NUM_SECTORS - 1))
+#error "CFG_CANREC_NUM_SECTORS must be a power of two"
+#endif
+
+extern SdFs sdCard;
+extern bool sdCardPresent;
+
+//sector buffers live in the second RAM bank, they're big and don't need to be fast
+DMAMEM static uint8_t sectors[CFG_CANREC_NUM_SECTORS][CANREC_SECTOR_SIZE];
+
+CanRecorder::CanRecorder()
+{
+    recording = false;
+    syncDue = false;
+    file = &files[0];
+    nextFile = &files[1];
+    nextState = CANREC_NEXT_SEARCH;
+    nextFileNumber = 0;
+    headSector = 0;
+    headOffset = 0;
+    headStarted = 0;
+    tailSector = 0;
+    fileBytes = 0;
+    fileNumber = 0;
+    lastMicros = 0;
+    microsHigh = 0;
+    recordedFrames = 0;
+    droppedFrames = 0;
+}
+
+/*
+ * Start recording into a new file. Returns false if there is no sdCard or the file couldn't be made.
+ */
+bool CanRecorder::start()
+{
+    if (recording) return true;
+    if (!sdCardPresent)
+    {
+        Logger::error("Can't record CAN traffic without an sdCard");
+        return false;
+    }
+
+    headSector = 0;
+    tailSector = 0;
+    recordedFrames = 0;
+    droppedFrames = 0;
+    lastMicros = micros();
+    startSector();
+
+    //the first file is made ready right here, later ones in the background while this one fills
+    nextFileNumber = fileNumber;
+    nextState = CANREC_NEXT_SEARCH;
+    if (!switchFile()) return false;
+    setRecording(true);
+    Logger::info("Recording CAN traffic to CAN%05u.BIN", fileNumber);
+    return true;
+}
+
+/*
+ * Stop recording. Whatever is still buffered gets written out right now so this call
+ * can take a little while.
+ */
+void CanRecorder::stop()
+{
+    if (!recording) return;
+    setRecording(false);
+
+    if (headOffset > 0)
+    {
+        memset(&sectors[headSector & (CFG_CANREC_NUM_SECTORS - 1)][headOffset], 0, CANREC_SECTOR_SIZE - headOffset);
+        headSector++;
+        headOffset = 0;
+    }
+    while (tailSector != headSector)
+    {
+        if (!writeSector()) break;
+    }
+    closeFile();
+    discardNextFile();
+    Logger::info("CAN recording stopped. %u frames recorded, %u dropped", recordedFrames, droppedFrames);
+}
+
+/*
+ * Called from the main loop. Writes at most one full sector and only if the card is idle. A write to a
+ * card that isn't busy goes straight out without waiting so this never stalls the loop. When there's
+ * nothing to write the next file gets a step closer to ready, so switching files when this one is
+ * full doesn't have to look for a name or preallocate.
+ */
+void CanRecorder::loop()
+{
+    if (!recording) return;
+    checkClock(micros());
+    //on a quiet bus the head sector could sit in RAM for ages. Don't let it
+    if (tailSector == headSector && headOffset > 6 && (millis() - headStarted) >= CFG_CANREC_FLUSH_MS) flushHeadSector();
+    if (file->isBusy()) return;
+    if (tailSector == headSector)
+    {
+        if (syncDue)
+        {
+            file->sync(); //directory entry catches up so the file reads right after a power cut
+            syncDue = false;
+        }
+        else if (nextState < CANREC_NEXT_READY) prepareNextFile();
+        return;
+    }
+    if (!writeSector())
+    {
+        Logger::error("CAN recording write failed. Recording stopped");
+        setRecording(false);
+        closeFile();
+        discardNextFile();
+        return;
+    }
+    if (fileBytes + CANREC_SECTOR_SIZE > CFG_CANREC_FILE_SIZE)
+    {
+        if (!switchFile())
+        {
+            Logger::error("No next CAN recording file. Recording stopped");
+            setRecording(false);
+            return;
+        }
+    }
+}
+
+//pad out the head sector and start a new one so it gets written. Only called when the ring is empty
+void CanRecorder::flushHeadSector()
+{
+    memset(&sectors[headSector & (CFG_CANREC_NUM_SECTORS - 1)][headOffset], 0, CANREC_SECTOR_SIZE - headOffset);
+    headSector++;
+    startSector();
+    syncDue = true;
+}
+
+/*
+ * The hardware filters only let through what observers asked for. A recording wants every frame so
+ * the filters are opened up while it runs and put back when it stops.
+ */
+void CanRecorder::setRecording(bool state)
+{
+    recording = state;
+    canHandlerBus0.updateHardwareFilters();
+    canHandlerBus1.updateHardwareFilters();
+    canHandlerBus2.updateHardwareFilters();
+}
+
+bool CanRecorder::writeSector()
+{
+    uint8_t *sector = sectors[tailSector & (CFG_CANREC_NUM_SECTORS - 1)];
+    if (file->write(sector, CANREC_SECTOR_SIZE) != CANREC_SECTOR_SIZE) return false;
+    tailSector++;
+    fileBytes += CANREC_SECTOR_SIZE;
+    return true;
+}
+
+void CanRecorder::record(const CAN_message_t &msg, int bus, bool transmitted)
+{
+    if (!recording) return;
+    checkClock(micros());
+    uint8_t *rec = reserve(10 + msg.len);
+    if (!rec)
+    {
+        droppedFrames++;
+        return;
+    }
+    rec[0] = CANREC_VALID | (bus & CANREC_BUS_MASK);
+    if (msg.flags.extended) rec[0] |= CANREC_EXTENDED;
+    if (transmitted) rec[0] |= CANREC_TX;
+    rec[1] = msg.len;
+    memcpy(&rec[2], &lastMicros, 4);
+    memcpy(&rec[6], &msg.id, 4);
+    memcpy(&rec[10], msg.buf, msg.len);
+    recordedFrames++;
+}
+
+void CanRecorder::record(const CANFD_message_t &msg, int bus, bool transmitted)
+{
+    if (!recording) return;
+    checkClock(micros());
+    uint8_t *rec = reserve(10 + msg.len);
+    if (!rec)
+    {
+        droppedFrames++;
+        return;
+    }
+    rec[0] = CANREC_VALID | CANREC_FD | (bus & CANREC_BUS_MASK);
+    if (msg.flags.extended) rec[0] |= CANREC_EXTENDED;
+    if (msg.brs) rec[0] |= CANREC_BRS;
+    if (transmitted) rec[0] |= CANREC_TX;
+    rec[1] = msg.len;
+    memcpy(&rec[2], &lastMicros, 4);
+    memcpy(&rec[6], &msg.id, 4);
+    memcpy(&rec[10], msg.buf, msg.len);
+    recordedFrames++;
+}
+
+/*
+ * Get space for a record of len bytes in the head sector. If it won't fit the rest of the
+ * sector is zeroed (padding) and the next one is started, provided the card has kept up.
+ * Returns NULL if all sectors are full.
+ */
+uint8_t *CanRecorder::reserve(uint32_t len)
+{
+    if (headOffset + len > CANREC_SECTOR_SIZE)
+    {
+        uint8_t *sector = sectors[headSector & (CFG_CANREC_NUM_SECTORS - 1)];
+        memset(&sector[headOffset], 0, CANREC_SECTOR_SIZE - headOffset);
+        headOffset = CANREC_SECTOR_SIZE;
+        //one sector is always the one being filled so the ring holds one less than its size
+        if ((headSector + 1 - tailSector) >= CFG_CANREC_NUM_SECTORS) return NULL;
+        headSector++;
+        startSector();
+    }
+    uint8_t *ptr = &sectors[headSector & (CFG_CANREC_NUM_SECTORS - 1)][headOffset];
+    headOffset += len;
+    return ptr;
+}
+
+//every sector starts with the upper half of the clock so it can be decoded without the ones before it
+void CanRecorder::startSector()
+{
+    headOffset = 0;
+    headStarted = millis();
+    addTimeRecord();
+}
+
+void CanRecorder::addTimeRecord()
+{
+    uint8_t *rec = &sectors[headSector & (CFG_CANREC_NUM_SECTORS - 1)][headOffset];
+    rec[0] = CANREC_VALID | CANREC_TIME;
+    rec[1] = 4;
+    memcpy(&rec[2], &microsHigh, 4);
+    headOffset += 6;
+}
+
+//micros() wraps every 71 minutes. Note when it does and put a time record in the stream
+void CanRecorder::checkClock(uint32_t now)
+{
+    if (now < lastMicros)
+    {
+        microsHigh++;
+        if (headOffset + 6 <= CANREC_SECTOR_SIZE) addTimeRecord();
+        //otherwise the next sector starts with one anyway
+    }
+    lastMicros = now;
+}
+
+/*
+ * One step towards having the next unused CANxxxxx.BIN open and preallocated, so the card never has to go
+ * looking for free clusters in the middle of a capture. Each call does at most one exists() or the open
+ * and preallocate. Called while the card is idle.
+ */
+void CanRecorder::prepareNextFile()
+{
+    char filename[16];
+
+    switch (nextState)
+    {
+    case CANREC_NEXT_SEARCH:
+        nextFileNumber++;
+        snprintf(filename, sizeof(filename), "CAN%05u.BIN", (unsigned int)nextFileNumber);
+        if (nextFileNumber >= 99999 || !sdCard.exists(filename)) nextState = CANREC_NEXT_ALLOCATE;
+        break;
+    case CANREC_NEXT_ALLOCATE:
+        snprintf(filename, sizeof(filename), "CAN%05u.BIN", (unsigned int)nextFileNumber);
+        if (!nextFile->open(filename, O_RDWR | O_CREAT | O_TRUNC))
+        {
+            Logger::error("Could not create CAN recording file %s", filename);
+            nextState = CANREC_NEXT_FAILED;
+            break;
+        }
+        if (!nextFile->preAllocate(CFG_CANREC_FILE_SIZE))
+        {
+            Logger::error("Could not preallocate %s. Card full?", filename);
+            nextFile->remove();
+            nextState = CANREC_NEXT_FAILED;
+            break;
+        }
+        nextState = CANREC_NEXT_READY;
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Close the current file and carry on in the one prepareNextFile() got ready. If the card filled the
+ * current file before that was done the rest happens right here.
+ */
+bool CanRecorder::switchFile()
+{
+    while (nextState < CANREC_NEXT_READY) prepareNextFile();
+    closeFile();
+    if (nextState != CANREC_NEXT_READY) return false;
+
+    FsFile *full = file;
+    file = nextFile;
+    nextFile = full;
+    fileNumber = nextFileNumber;
+    nextState = CANREC_NEXT_SEARCH;
+    return writeHeader();
+}
+
+bool CanRecorder::writeHeader()
+{
+    CanRecFileHeader *header;
+    uint8_t headerSector[CANREC_SECTOR_SIZE];
+
+    memset(headerSector, 0, CANREC_SECTOR_SIZE);
+    header = (CanRecFileHeader *)headerSector;
+    memcpy(header->magic, CANREC_MAGIC, 8);
+    header->version = CANREC_VERSION;
+    header->sectorSize = CANREC_SECTOR_SIZE;
+    header->fileNumber = fileNumber;
+    header->startMillis = millis();
+    header->timeHigh = microsHigh;
+    header->buildNum = CFG_BUILD_NUM;
+    header->busSpeed[0] = canHandlerBus0.getBusSpeed();
+    header->busSpeed[1] = canHandlerBus1.getBusSpeed();
+    header->busSpeed[2] = canHandlerBus2.getBusSpeed();
+    if (file->write(headerSector, CANREC_SECTOR_SIZE) != CANREC_SECTOR_SIZE)
+    {
+        Logger::error("Could not write header to CAN%05u.BIN", fileNumber);
+        file->close();
+        return false;
+    }
+    fileBytes = CANREC_SECTOR_SIZE;
+    return true;
+}
+
+//give back the preallocated space that didn't get used
+void CanRecorder::closeFile()
+{
+    if (!file->isOpen()) return;
+    file->truncate();
+    file->close();
+}
+
+//the recording is over before the file made ready for it got used. Don't leave it behind
+void CanRecorder::discardNextFile()
+{
+    if (nextFile->isOpen()) nextFile->remove();
+    nextState = CANREC_NEXT_SEARCH;
+}
+
+uint32_t CanRecorder::getRecordedFrames()
+{
+    return recordedFrames;
+}
+
+uint32_t CanRecorder::getDroppedFrames()
+{
+    return droppedFrames;
+}
+
+uint32_t CanRecorder::getFileNumber()
+{
+    return fileNumber;
+}
+
+CanRecorder canRecorder;
@@ -0,0 +1,136 @@
+/*
+ * CanRecorder.h
+ *
+ * Records every frame from all three CAN buses to the sdCard in a compact binary format.
+ * Meant for long captures at full bus load so nothing in here is allowed to block the caller.
+ * Frames are packed into 512 byte sectors in RAM and whole sectors get written out from loop()
+ * whenever the card isn't busy. Files are preallocated and rotated once they fill up.
+ * tools/canrec2csv.py turns the files into candump logs or SavvyCAN CSV.
+ *
+Copyright (c) 2022 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef CANRECORDER_H_
+#define CANRECORDER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include <FlexCAN_T4.h>
+#include "SdFat.h"
+
+/*
+File layout:
+The first sector of every file is a CanRecFileHeader, zero padded to 512 bytes.
+After that come data sectors. Records never cross a sector boundary. Each record starts
+with a flags byte and a length byte:
+    flags, len, timestamp (uint32, low 32 bits of micros), id (uint32), data[len]
+except for time records which are just
+    flags, len (4), upper 32 bits of the microsecond clock (uint32)
+Every data sector starts with a time record so any sector can be decoded on its own.
+A flags byte of 0 means the rest of the sector is padding.
+Everything is little endian.
+*/
+
+#define CANREC_SECTOR_SIZE  512
+#define CANREC_MAGIC        "GVCANREC"
+#define CANREC_VERSION      1
+
+#define CANREC_VALID        0x80 // set for every record. 0 means padding, skip to the next sector
+#define CANREC_TIME         0x40 // time record, data is the upper 32 bits of the microsecond clock
+#define CANREC_TX           0x20 // frame was sent by GEVCU rather than received
+#define CANREC_EXTENDED     0x10
+#define CANREC_BRS          0x08 // CAN-FD bit rate switch
+#define CANREC_FD           0x04 // CAN-FD frame
+#define CANREC_BUS_MASK     0x03
+
+//the file after the current one is made ready a step at a time while the card is idle
+enum CANREC_NEXT_STATE
+{
+    CANREC_NEXT_SEARCH,     // looking for an unused file name, one exists() per pass
+    CANREC_NEXT_ALLOCATE,   // name found, open and preallocate it
+    CANREC_NEXT_READY,
+    CANREC_NEXT_FAILED
+};
+
+struct CanRecFileHeader
+{
+    char magic[8];
+    uint16_t version;
+    uint16_t sectorSize;
+    uint32_t fileNumber;
+    uint32_t startMillis;   // millis() when the file was opened
+    uint32_t timeHigh;      // upper 32 bits of the microsecond clock when the file was opened
+    uint32_t buildNum;
+    uint32_t busSpeed[3];
+};
+
+class CanRecorder
+{
+public:
+    CanRecorder();
+    bool start();
+    void stop();
+    void loop();
+    void record(const CAN_message_t &msg, int bus, bool transmitted);
+    void record(const CANFD_message_t &msg, int bus, bool transmitted);
+    inline bool isRecording() { return recording; }
+    uint32_t getRecordedFrames();
+    uint32_t getDroppedFrames();
+    uint32_t getFileNumber();
+
+private:
+    uint8_t *reserve(uint32_t len);
+    void startSector();
+    void addTimeRecord();
+    void checkClock(uint32_t now);
+    void prepareNextFile();
+    bool switchFile();
+    bool writeHeader();
+    void closeFile();
+    void discardNextFile();
+    void flushHeadSector();
+    bool writeSector();
+    void setRecording(bool state);
+
+    FsFile files[2];
+    FsFile *file;               // the one being written
+    FsFile *nextFile;           // preallocated and waiting to take over when file is full
+    CANREC_NEXT_STATE nextState;
+    uint32_t nextFileNumber;
+    bool recording;
+    bool syncDue;               // a sector was flushed early. Update the directory entry once the card is idle
+    uint32_t headSector;        // sector currently being filled. Free running, masked on use
+    uint32_t headOffset;        // bytes used in the head sector
+    uint32_t headStarted;       // millis() when the head sector was started
+    uint32_t tailSector;        // next full sector to be written to the card
+    uint32_t fileBytes;         // bytes written to the current file, header included
+    uint32_t fileNumber;
+    uint32_t lastMicros;
+    uint32_t microsHigh;        // extends micros() to 64 bits so timestamps survive the 71 minute wrap
+    uint32_t recordedFrames;
+    uint32_t droppedFrames;     // frames that found the sector buffer full
+};
+
+extern CanRecorder canRecorder;
+
+#endif /* CANRECORDER_H_ */
@@ -0,0 +1,301 @@
+/*
+ * CanSignal.h
+ *
+ * DBC style descriptions of the signals inside CAN frames. A signal is a constexpr CanSignalDef
+ * with the same start bit, length, byte order, sign, scale and offset a DBC file would give it.
+ * Drivers load a received payload into a CanPayload once and pull out each signal with
+ * get<SIGNAL>() (getUnsigned<SIGNAL>() for unsigned 32 bit ones) or value<SIGNAL>(). Outgoing frames are put together with CanPayloadBuilder.
+ * The signal description is a template argument so all the shifts and masks are worked out at
+ * compile time and every signal comes down to a shift and a mask, no loops over bits or bytes.
+ *
+ * A CanFrameLayout lists the signals of a whole frame along with the struct members they go in
+ * and decodes (or encodes) all of them in one pass.
+ *
+ * Only the first 8 bytes of a payload are looked at. Signals can be up to 32 bits long.
+ * Outside of an Arduino build this only needs the C library so host side tools (like the decoder
+ * benchmarks tools/dbc2device.py writes) can use it as is. tools/cansignal_test.cpp checks it
+ * against a plain bit by bit implementation.
+ *
+Copyright (c) 2022 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef CAN_SIGNAL_H_
+#define CAN_SIGNAL_H_
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <FlexCAN_T4.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#endif
+
+enum CanByteOrder
+{
+    CAN_INTEL,      //little endian, @1 in a DBC file
+    CAN_MOTOROLA    //big endian, @0 in a DBC file
+};
+
+/*
+ * startBit is numbered like DBC files do, byte * 8 + bit within the byte (bit 0 being the least
+ * significant). For Intel signals it is the least significant bit of the signal, for Motorola ones
+ * the most significant bit. The physical value is raw * scale + offset.
+ * Declare them static constexpr at file scope so they can be used as template arguments:
+ *     static constexpr CanSignalDef DMOC_SPEED = {7, 16, CAN_MOTOROLA, false, 1.0f, -20000.0f};
+ */
+struct CanSignalDef
+{
+    uint8_t startBit;
+    uint8_t length;
+    CanByteOrder order;
+    bool isSigned;
+    float scale;
+    float offset;
+};
+
+/*
+ * The payload is kept as one 64 bit number loaded little endian (byte 0 lowest) and the same loaded
+ * big endian (byte 0 highest). Intel signals are a plain bit field of the first, Motorola ones of the
+ * second. This is where the signal's least significant bit ends up.
+ */
+constexpr int canSignalShift(const CanSignalDef &signal)
+{
+    return (signal.order == CAN_INTEL) ? signal.startBit
+           : 56 - (signal.startBit & 0xF8) + (signal.startBit & 7) - (signal.length - 1);
+}
+
+constexpr uint32_t canSignalMask(const CanSignalDef &signal)
+{
+    return (signal.length >= 32) ? 0xFFFFFFFFul : ((1ul << signal.length) - 1);
+}
+
+//smallest and largest raw value the signal can hold. 64 bits wide so unsigned 32 bit signals fit
+constexpr int64_t canSignalMin(const CanSignalDef &signal)
+{
+    return signal.isSigned ? -(int64_t)(canSignalMask(signal) >> 1) - 1 : 0;
+}
+
+constexpr int64_t canSignalMax(const CanSignalDef &signal)
+{
+    return signal.isSigned ? (int64_t)(canSignalMask(signal) >> 1) : (int64_t)canSignalMask(signal);
+}
+
+#define CAN_SIGNAL_CHECK(signal) \
+    static_assert(signal.length >= 1 && signal.length <= 32, "CAN signals must be 1 to 32 bits long"); \
+    static_assert(canSignalShift(signal) >= 0 && canSignalShift(signal) + signal.length <= 64, "CAN signal doesn't fit in 8 bytes")
+
+//a received payload, ready to have signals taken out of it
+class CanPayload
+{
+public:
+    explicit CanPayload(const uint8_t *buf, uint8_t len = 8)
+    {
+        uint8_t bytes[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        memcpy(bytes, buf, (len < 8) ? len : 8);
+        memcpy(&intel, bytes, 8); //Teensy is little endian
+        motorola = __builtin_bswap64(intel);
+    }
+
+#ifdef ARDUINO
+    explicit CanPayload(const CAN_message_t &frame) : CanPayload(frame.buf, frame.len) {}
+#endif
+
+    /*
+     * Raw value of the signal, sign extended if it is signed. An unsigned 32 bit signal doesn't fit
+     * an int32_t, values from 0x80000000 up come back negative. Use getUnsigned() for those.
+     */
+    template<const CanSignalDef &S> int32_t get() const
+    {
+        uint32_t raw = getUnsigned<S>();
+        if (S.isSigned && S.length < 32) return ((int32_t)(raw << (32 - S.length))) >> (32 - S.length);
+        return (int32_t)raw;
+    }
+
+    //raw bits of the signal, not sign extended. The whole range of an unsigned 32 bit signal fits
+    template<const CanSignalDef &S> uint32_t getUnsigned() const
+    {
+        CAN_SIGNAL_CHECK(S);
+        return (uint32_t)(((S.order == CAN_INTEL) ? intel : motorola) >> canSignalShift(S)) & canSignalMask(S);
+    }
+
+    //the signal with scale and offset applied
+    template<const CanSignalDef &S> float value() const
+    {
+        return (S.isSigned ? (float)get<S>() : (float)getUnsigned<S>()) * S.scale + S.offset;
+    }
+
+private:
+    uint64_t intel;
+    uint64_t motorola;
+};
+
+//builds an outgoing payload. Bits no signal was set for are 0
+class CanPayloadBuilder
+{
+public:
+    CanPayloadBuilder() : intel(0), motorola(0) {}
+
+    //raw value, clamped to what the signal can hold. Unsigned 32 bit signals need setUnsigned()
+    template<const CanSignalDef &S> void set(int32_t raw)
+    {
+        if (raw < canSignalMin(S)) raw = (int32_t)canSignalMin(S);
+        if (raw > canSignalMax(S)) raw = (int32_t)canSignalMax(S);
+        put<S>((uint32_t)raw);
+    }
+
+    //raw value of an unsigned signal, clamped to what the signal can hold
+    template<const CanSignalDef &S> void setUnsigned(uint32_t raw)
+    {
+        if (raw > canSignalMask(S)) raw = canSignalMask(S);
+        put<S>(raw);
+    }
+
+    //physical value. Scale and offset are taken back out and the result rounded to the nearest raw value
+    template<const CanSignalDef &S> void setValue(float value)
+    {
+        float raw = (value - S.offset) * (1.0f / S.scale);
+        if (raw <= (float)canSignalMin(S)) put<S>((uint32_t)canSignalMin(S));
+        else if (raw >= (float)canSignalMax(S)) put<S>((uint32_t)canSignalMax(S));
+        else if (S.isSigned) put<S>((uint32_t)(int32_t)lroundf(raw));
+        else put<S>((uint32_t)(raw + 0.5f)); //lroundf would overflow the 32 bit long past 0x7FFFFFFF
+    }
+
+    //writes all 8 bytes
+    void store(uint8_t *buf) const
+    {
+        uint64_t bytes = intel | __builtin_bswap64(motorola);
+        memcpy(buf, &bytes, 8);
+    }
+
+#ifdef ARDUINO
+    void store(CAN_message_t &frame) const
+    {
+        store(frame.buf);
+    }
+#endif
+
+private:
+    template<const CanSignalDef &S> void put(uint32_t raw)
+    {
+        CAN_SIGNAL_CHECK(S);
+        uint64_t bits = (uint64_t)(raw & canSignalMask(S)) << canSignalShift(S);
+        if (S.order == CAN_INTEL) intel |= bits;
+        else motorola |= bits;
+    }
+
+    uint64_t intel;
+    uint64_t motorola;
+};
+
+/*
+ * One signal of a frame layout and the struct member it goes in. Use CAN_FIELD to declare them.
+ * Floating point members get the physical value, integer and bool members the raw one.
+ */
+template<const CanSignalDef &S, typename P, P member> struct CanField;
+
+template<const CanSignalDef &S, typename T, typename V, V T::*member>
+struct CanField<S, V T::*, member>
+{
+    static void decode(const CanPayload &payload, T &out)
+    {
+        load(payload, out.*member);
+    }
+
+    static void encode(const T &in, CanPayloadBuilder &builder)
+    {
+        store(builder, in.*member);
+    }
+
+private:
+    static void load(const CanPayload &payload, float &v) { v = payload.value<S>(); }
+    static void load(const CanPayload &payload, double &v) { v = payload.value<S>(); }
+    template<typename I> static void load(const CanPayload &payload, I &v)
+    {
+        v = S.isSigned ? (I)payload.get<S>() : (I)payload.getUnsigned<S>();
+    }
+    static void store(CanPayloadBuilder &builder, float v) { builder.setValue<S>(v); }
+    static void store(CanPayloadBuilder &builder, double v) { builder.setValue<S>((float)v); }
+    template<typename I> static void store(CanPayloadBuilder &builder, I v)
+    {
+        if (S.isSigned) builder.set<S>((int32_t)v);
+        else builder.setUnsigned<S>((v > 0) ? (uint32_t)v : 0);
+    }
+};
+
+#define CAN_FIELD(signal, type, member) CanField<signal, decltype(&type::member), &type::member>
+
+/*
+ * All the signals of one frame. The payload is loaded once and the field list is expanded at
+ * compile time, so decode() is the same straight line code as a get<>() per signal written out
+ * by hand.
+ *     struct CodaFeedback { float torque; float dcVoltage; };
+ *     typedef CanFrameLayout<CodaFeedback,
+ *         CAN_FIELD(CODA_TORQUE, CodaFeedback, torque),
+ *         CAN_FIELD(CODA_DC_VOLTAGE, CodaFeedback, dcVoltage)> CodaFeedbackFrame;
+ *     CodaFeedback feedback;
+ *     CodaFeedbackFrame::decode(frame, feedback);
+ */
+template<typename T, typename... Fields>
+class CanFrameLayout
+{
+public:
+    static void decode(const CanPayload &payload, T &out)
+    {
+        int expand[] = {0, (Fields::decode(payload, out), 0)...};
+        (void)expand;
+    }
+
+    static void decode(const uint8_t *buf, uint8_t len, T &out)
+    {
+        decode(CanPayload(buf, len), out);
+    }
+
+    //bits no field covers are 0
+    static void encode(const T &in, CanPayloadBuilder &builder)
+    {
+        int expand[] = {0, (Fields::encode(in, builder), 0)...};
+        (void)expand;
+    }
+
+    static void encode(const T &in, uint8_t *buf)
+    {
+        CanPayloadBuilder builder;
+        encode(in, builder);
+        builder.store(buf);
+    }
+
+#ifdef ARDUINO
+    static void decode(const CAN_message_t &frame, T &out)
+    {
+        decode(CanPayload(frame), out);
+    }
+
+    static void encode(const T &in, CAN_message_t &frame)
+    {
+        encode(in, frame.buf);
+    }
+#endif
+};
+
+#endif /* CAN_SIGNAL_H_ */
@@ -26,10 +26,32 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "CrashHandler.h"
 #include "eeprom_layout.h"
+#include "CanRecorder.h"
+#include "DeviceManager.h"
+#include "FaultHandler.h"
+#include "SdFat.h"
+
+#if (CFG_FLIGHTREC_CRUMBS & (CFG_FLIGHTREC_CRUMBS - 1)) || (CFG_FLIGHTREC_TICKS & (CFG_FLIGHTREC_TICKS - 1)) || (CFG_FLIGHTREC_FRAMES & (CFG_FLIGHTREC_FRAMES - 1))
+#error "CFG_FLIGHTREC_CRUMBS, CFG_FLIGHTREC_TICKS and CFG_FLIGHTREC_FRAMES must be powers of two"
+#endif
+
+static_assert(sizeof(FlightRecorder) <= 0xFFFF, "Flight recorder is too big for its size field. Make the CFG_FLIGHTREC_ sizes smaller");
+
+extern SdFs sdCard;
+extern bool sdCardPresent;
+extern unsigned long _heap_start; //from the Teensy linker script. The RAM2 heap starts here and grows up
+
+//DMAMEM isn't zeroed at start up so whatever was recorded before a reset is still here. Cache line
+//aligned so flushing an entry never writes back anything else
+DMAMEM static FlightRecorder flightRecording __attribute__((aligned(32)));
 
 CrashHandler::CrashHandler()
 {
+    flight = &flightRecording;
     lastBootCrashed = false;
+    lastFlight = NULL;
+    resetStatus = 0;
+    recording = false; //not until the last recording has been looked at
 }
 
 /*
@@ -39,7 +61,38 @@ the bc structure should not change during runtime so it's probably OK to leave t
 */
 void CrashHandler::analyzeCrashDataOnStartup()
 {
-    if ( CrashReport )
+    //printing the crash report clears the reset reason so grab it first
+    resetStatus = SRC_SRSR;
+    bool watchdog = (resetStatus & (SRC_SRSR_WDOG_RST_B | SRC_SRSR_WDOG3_RST_B)) != 0;
+
+    //the heap starts right after the DMAMEM variables so it can never grow over the recording. Make sure
+    if ((uint32_t)(flight + 1) > (uint32_t)&_heap_start)
+    {
+        Serial.println("Flight recorder overlaps the heap! It is turned off");
+    }
+    else
+    {
+        //keep the recording from before the reset if something went wrong. It gets saved once the sdCard is up
+        if ((CrashReport || watchdog) && flightRecordValid(flight))
+        {
+            lastFlight = new FlightRecorder;
+            if (lastFlight) memcpy(lastFlight, flight, sizeof(FlightRecorder));
+        }
+        startFlightRecorder();
+    }
+
+    if (watchdog && !CrashReport)
+    {
+        Serial.println("SYSTEM WAS RESET BY THE WATCHDOG!");
+        lastBootCrashed = true;
+        for (int i = 0; i < 6; i++) storedCrumbs[i] = 0;
+        if (lastFlight && lastFlight->currentObserver)
+        {
+            Serial.printf("TickObserver %08X had been running for %u us\n", (unsigned int)lastFlight->currentObserver,
+                          (unsigned int)((lastFlight->lastCycles - lastFlight->currentStart) / (lastFlight->cpuHz / 1000000)));
+        }
+    }
+    else if ( CrashReport )
     {
         Serial.println("SYSTEM CRASHED! Analyzing the crash data.");
         lastBootCrashed = true;
@@ -69,6 +122,162 @@ bool CrashHandler::bCrashed()
     return lastBootCrashed;
 }
 
+//a recording left over from before the reset is only any use if it was made by this build
+bool CrashHandler::flightRecordValid(FlightRecorder *rec)
+{
+    return rec->magic == FLIGHTREC_MAGIC && rec->version == FLIGHTREC_VERSION && rec->size == sizeof(FlightRecorder)
+           && rec->buildNum == CFG_BUILD_NUM;
+}
+
+void CrashHandler::startFlightRecorder()
+{
+    memset(flight, 0, sizeof(FlightRecorder));
+    flight->magic = FLIGHTREC_MAGIC;
+    flight->version = FLIGHTREC_VERSION;
+    flight->size = sizeof(FlightRecorder);
+    flight->buildNum = CFG_BUILD_NUM;
+    flight->cpuHz = F_CPU_ACTUAL;
+    flight->numCrumbs = CFG_FLIGHTREC_CRUMBS;
+    flight->numTicks = CFG_FLIGHTREC_TICKS;
+    flight->numFrames = CFG_FLIGHTREC_FRAMES;
+    arm_dcache_flush((void *)flight, sizeof(FlightRecorder));
+    recording = true;
+}
+
+/*
+ * Write the recording from before the crash to the next free CRASHxxx.BIN on the sdCard. Called once the card
+ * is mounted. Does nothing if the last reset wasn't a crash.
+ */
+void CrashHandler::saveFlightRecord()
+{
+    FlightRecFileHeader header;
+    FlightRecName name;
+    FsFile file;
+    char filename[16];
+    int fileNumber = 0;
+
+    if (!lastFlight) return;
+    if (!sdCardPresent)
+    {
+        Serial.println("No sdCard. Flight recorder data from before the crash is lost");
+        delete lastFlight;
+        lastFlight = NULL;
+        return;
+    }
+
+    do {
+        fileNumber++;
+        snprintf(filename, sizeof(filename), "CRASH%03u.BIN", fileNumber);
+    } while (sdCard.exists(filename) && fileNumber < 999);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FLIGHTREC_FILE_MAGIC, 8);
+    header.version = FLIGHTREC_VERSION;
+    header.buildNum = CFG_BUILD_NUM;
+    header.resetStatus = resetStatus;
+    memcpy(header.crashCrumbs, storedCrumbs, sizeof(storedCrumbs));
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    {
+        if (!deviceManager.getDeviceByIdx(i)) break;
+        header.numNames++;
+    }
+    header.numNames++; //the fault handler
+
+    if (!file.open(filename, O_RDWR | O_CREAT | O_TRUNC))
+    {
+        Serial.printf("Could not create %s for the flight recorder data\n", filename);
+    }
+    else
+    {
+        file.write(&header, sizeof(header));
+        //devices are all static objects so the addresses are the same as before the crash
+        for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+        {
+            Device *dev = deviceManager.getDeviceByIdx(i);
+            if (!dev) break;
+            memset(&name, 0, sizeof(name));
+            name.address = (uint32_t)static_cast<TickObserver *>(dev);
+            strncpy(name.name, dev->getShortName(), sizeof(name.name) - 1);
+            file.write(&name, sizeof(name));
+        }
+        memset(&name, 0, sizeof(name));
+        name.address = (uint32_t)static_cast<TickObserver *>(&faultHandler);
+        strcpy(name.name, "FaultHandler");
+        file.write(&name, sizeof(name));
+        file.write(lastFlight, sizeof(FlightRecorder));
+        file.close();
+        Serial.printf("Flight recorder data from before the crash saved to %s\n", filename);
+    }
+    delete lastFlight;
+    lastFlight = NULL;
+}
+
+//timestamp for a new entry. Also notes it as the newest thing that happened
+uint32_t CrashHandler::stamp()
+{
+    uint32_t now = ARM_DWT_CYCCNT;
+    flight->lastCycles = now;
+    flight->lastMillis = millis();
+    return now;
+}
+
+void CrashHandler::tickStarted(TickObserver *observer)
+{
+    if (!recording) return;
+    flight->currentStart = stamp();
+    flight->currentObserver = (uint32_t)observer;
+    flushHeader();
+}
+
+void CrashHandler::tickFinished()
+{
+    if (!recording) return;
+    FlightRecTick *tick = &flight->ticks[flight->tickHead++ & (CFG_FLIGHTREC_TICKS - 1)];
+    tick->cycles = flight->currentStart;
+    tick->duration = stamp() - flight->currentStart;
+    tick->observer = flight->currentObserver;
+    flight->currentObserver = 0;
+    arm_dcache_flush(tick, sizeof(FlightRecTick));
+    flushHeader();
+}
+
+FlightRecFrame *CrashHandler::nextFrame(int bus)
+{
+    if (!recording || bus < 0 || bus >= FLIGHTREC_NUM_BUSES) return NULL;
+    FlightRecFrame *frame = &flight->frames[bus][flight->frameHead[bus]++ & (CFG_FLIGHTREC_FRAMES - 1)];
+    frame->cycles = stamp();
+    return frame;
+}
+
+void CrashHandler::recordFrame(const CAN_message_t &msg, int bus, bool transmitted)
+{
+    FlightRecFrame *frame = nextFrame(bus);
+    if (!frame) return;
+    frame->id = msg.id;
+    frame->flags = CANREC_VALID | bus;
+    if (msg.flags.extended) frame->flags |= CANREC_EXTENDED;
+    if (transmitted) frame->flags |= CANREC_TX;
+    frame->len = msg.len;
+    memcpy(frame->data, msg.buf, 8);
+    arm_dcache_flush(frame, sizeof(FlightRecFrame));
+    flushHeader();
+}
+
+void CrashHandler::recordFrame(const CANFD_message_t &msg, int bus, bool transmitted)
+{
+    FlightRecFrame *frame = nextFrame(bus);
+    if (!frame) return;
+    frame->id = msg.id;
+    frame->flags = CANREC_VALID | CANREC_FD | bus;
+    if (msg.flags.extended) frame->flags |= CANREC_EXTENDED;
+    if (msg.brs) frame->flags |= CANREC_BRS;
+    if (transmitted) frame->flags |= CANREC_TX;
+    frame->len = msg.len;
+    memcpy(frame->data, msg.buf, 8);
+    arm_dcache_flush(frame, sizeof(FlightRecFrame));
+    flushHeader();
+}
+
 void CrashHandler::decodeBreadcrumbToSerial(uint32_t val)
 {
   Serial.write( (val >> 27) + 0x40);
@@ -107,6 +316,14 @@ void CrashHandler::addBreadcrumb(uint32_t crumb)
     bc->value[5] = crumb;
     //have to flush to RAM or it will stay in cache. Here is where our delay really triggers
     arm_dcache_flush((void *)bc, sizeof(struct crashreport_breadcrumbs_struct));
+
+    //and the longer history in the flight recorder
+    if (!recording) return;
+    FlightRecCrumb *entry = &flight->crumbs[flight->crumbHead++ & (CFG_FLIGHTREC_CRUMBS - 1)];
+    entry->cycles = stamp();
+    entry->crumb = crumb;
+    arm_dcache_flush(entry, sizeof(FlightRecCrumb));
+    flushHeader();
 }
 
 //If you've already dropped a breadcrumb and just want to update the 7 digit number on the end
@@ -117,9 +334,16 @@ void CrashHandler::addBreadcrumb(uint32_t crumb)
 //note that this still calls dcache flush and so still causes a healthy processing delay
 void CrashHandler::updateBreadcrumb(uint8_t crumb)
 {
-    bc->value[5] = (bc->value[5] & 0xFFFFFFF8) + (crumb & 0x7F);
+    bc->value[5] = (bc->value[5] & 0xFFFFFF80) + (crumb & 0x7F);
     //have to flush to RAM or it will stay in cache
     arm_dcache_flush((void *)bc, sizeof(struct crashreport_breadcrumbs_struct));
+
+    if (!recording) return;
+    FlightRecCrumb *entry = &flight->crumbs[(flight->crumbHead - 1) & (CFG_FLIGHTREC_CRUMBS - 1)];
+    entry->cycles = stamp();
+    entry->crumb = bc->value[5];
+    arm_dcache_flush(entry, sizeof(FlightRecCrumb));
+    flushHeader();
 }
 
 CrashHandler crashHandler;
@@ -39,9 +39,95 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "config.h"
 #include "Logger.h"
 #include "MemCache.h"
+#include "TickHandler.h"
+#include <FlexCAN_T4.h>
 
 extern MemCache *memCache;
 
+/*
+Flight recorder:
+A record of what the system was doing lately, kept in RAM that survives a reset (but not a power cut).
+It's a DMAMEM variable so the linker puts it in RAM2 below the heap and nothing clears it at start up.
+Being placed by the linker it can move between builds, which is fine since only a recording made by
+the same build is used.
+It holds the last CFG_FLIGHTREC_CRUMBS breadcrumbs, the last CFG_FLIGHTREC_TICKS ticks that ran with
+how long they took, the last CFG_FLIGHTREC_FRAMES CAN frames on each bus and the TickObserver running
+right now. Timestamps are ARM_DWT_CYCCNT so they cost next to nothing but wrap every ~7 seconds.
+Each entry is flushed out of the data cache as soon as it's written or a reset would lose it.
+After a crash or watchdog reset the old recording is copied out at start up and saved to the
+sdCard as CRASHxxx.BIN:
+    FlightRecFileHeader, FlightRecName[numNames], FlightRecorder
+The names let the decoder (tools/flightrec.py) turn TickObserver addresses back into devices.
+Everything is little endian.
+*/
+
+#define FLIGHTREC_MAGIC         0x52464756 //"VGFR"
+#define FLIGHTREC_VERSION       1
+#define FLIGHTREC_NUM_BUSES     3
+#define FLIGHTREC_FILE_MAGIC    "GVFLIGHT"
+
+struct FlightRecCrumb
+{
+    uint32_t cycles;
+    uint32_t crumb;
+};
+
+struct FlightRecTick
+{
+    uint32_t cycles;    // when handleTick() started
+    uint32_t duration;  // cycles it took
+    uint32_t observer;  // TickObserver address
+};
+
+struct FlightRecFrame
+{
+    uint32_t cycles;
+    uint32_t id;
+    uint8_t flags;      // CANREC_ flags, see CanRecorder.h
+    uint8_t len;        // full length. Only the first 8 bytes of an FD frame are kept
+    uint8_t data[8];
+    uint16_t reserved;
+};
+
+struct FlightRecorder
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;
+    uint32_t buildNum;
+    uint32_t cpuHz;
+    uint16_t numCrumbs;
+    uint16_t numTicks;
+    uint16_t numFrames;     // per bus
+    uint16_t reserved;
+    uint32_t lastCycles;    // timestamp of the newest entry of any kind
+    uint32_t lastMillis;    // millis() at that moment
+    uint32_t currentObserver; // TickObserver in handleTick() right now. 0 between ticks
+    uint32_t currentStart;  // when it started
+    uint32_t crumbHead;     // free running counts, masked on use
+    uint32_t tickHead;
+    uint32_t frameHead[FLIGHTREC_NUM_BUSES];
+    FlightRecCrumb crumbs[CFG_FLIGHTREC_CRUMBS];
+    FlightRecTick ticks[CFG_FLIGHTREC_TICKS];
+    FlightRecFrame frames[FLIGHTREC_NUM_BUSES][CFG_FLIGHTREC_FRAMES];
+};
+
+struct FlightRecFileHeader
+{
+    char magic[8];
+    uint16_t version;
+    uint16_t numNames;
+    uint32_t buildNum;      // firmware that saved the file. The names come from it
+    uint32_t resetStatus;   // SRC_SRSR after the reset
+    uint32_t crashCrumbs[6]; // the breadcrumbs from the Teensy crash report
+};
+
+struct FlightRecName
+{
+    uint32_t address;
+    char name[16];
+};
+
 #ifndef ENCODE_BREAD
 #define ENCODE_BREAD(a) ( (((a[0]-0x40) & 0x1F) << 27) + (((a[1] - 0x40) & 0x1F) << 22) + (((a[2] - 0x40) & 0x1F) << 17) + (((a[3] - 0x40) & 0x1F) << 12) + (((a[4] - 0x40) & 0x1F) << 7) )
 #endif
@@ -54,10 +140,26 @@ public:
     void addBreadcrumb(uint32_t crumb);
     void updateBreadcrumb(uint8_t crumb);
     void analyzeCrashDataOnStartup();
+    void saveFlightRecord();
     bool bCrashed();
 
+    void tickStarted(TickObserver *observer);
+    void tickFinished();
+    void recordFrame(const CAN_message_t &msg, int bus, bool transmitted);
+    void recordFrame(const CANFD_message_t &msg, int bus, bool transmitted);
+
 private:
+    void startFlightRecorder();
+    bool flightRecordValid(FlightRecorder *rec);
+    FlightRecFrame *nextFrame(int bus);
+    uint32_t stamp();
+    inline void flushHeader() { arm_dcache_flush((void *)flight, offsetof(FlightRecorder, crumbs)); }
+
     struct crashreport_breadcrumbs_struct *bc = (struct crashreport_breadcrumbs_struct *)0x2027FFC0;
+    FlightRecorder *flight;
+    FlightRecorder *lastFlight; //copy of the recording from before the crash until it's saved. NULL if there isn't one
+    uint32_t resetStatus;
+    bool recording;
     uint32_t storedCrumbs[6]; //store the breadcrumbs from latest start up in RAM so we can keep accessing them whenever
     bool lastBootCrashed;
 };
@@ -39,12 +39,39 @@
 
 const char *CFG_VAR_TYPE_NAMES[7] = {"BYTE","STRING","INT16","UINT16","INT32","UINT32","FLOAT"};
 
-DeviceManager::DeviceManager() {
-    throttle = nullptr;
-    brake = nullptr;
-    motorController = nullptr;
+#if (CFG_STATUS_MAX_ENTRIES & 31)
+#error "CFG_STATUS_MAX_ENTRIES must be a multiple of 32"
+#endif
+
+#if (CFG_STATUS_HASH_SIZE & (CFG_STATUS_HASH_SIZE - 1)) || (CFG_STATUS_HASH_SIZE < 2 * CFG_STATUS_MAX_ENTRIES)
+#error "CFG_STATUS_HASH_SIZE must be a power of two and at least twice CFG_STATUS_MAX_ENTRIES"
+#endif
+
+#if (CFG_DEV_MGR_ID_HASH_SIZE & (CFG_DEV_MGR_ID_HASH_SIZE - 1)) || (CFG_DEV_MGR_ID_HASH_SIZE < 2 * CFG_DEV_MGR_MAX_DEVICES)
+#error "CFG_DEV_MGR_ID_HASH_SIZE must be a power of two and at least twice CFG_DEV_MGR_MAX_DEVICES"
+#endif
+
+#define STATUS_INDEX_EMPTY 0xFFFF
+#define DEVICE_INDEX_EMPTY 0xFF
+
+static inline uint32_t statusHash(const void *ptr)
+{
+    //variables are at least 2 byte aligned most of the time, drop the low bit and mix the rest
+    uint32_t h = ((uint32_t)ptr >> 1) * 2654435761ul;
+    return (h >> 16) & (CFG_STATUS_HASH_SIZE - 1);
+}
+
+static inline uint32_t deviceHash(DeviceId id)
+{
+    return ((id * 2654435761ul) >> 16) & (CFG_DEV_MGR_ID_HASH_SIZE - 1);
+}
+
+DeviceManager::DeviceManager() : accelerator(DEVICE_THROTTLE), brake(DEVICE_BRAKE), motorController(DEVICE_MOTORCTRL) {
     for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
         devices[i] = nullptr;
+    generation = 1;
+    indexDirty = true;
+    rebuildStatusIndex();
 }
 
 /*
@@ -55,55 +82,62 @@ void DeviceManager::addDevice(Device *device) {
         int8_t i = findDevice(NULL);
         if (i != -1) {
             devices[i] = device;
+            devicesChanged();
         } else {
             Logger::error("unable to register device, max number of devices reached.");
         }
     }
-    /*
-    switch (device->getType()) {
-    case DEVICE_THROTTLE:
-    	throttle = (Throttle *) device;
-    	break;
-    case DEVICE_BRAKE:
-    	brake = (Throttle *) device;
-    	break;
-    case DEVICE_MOTORCTRL:
-    	motorController = (MotorController *) device;
-    	break;
-    }
-    */
 }
 
 /*
  * Remove the specified device from the list of registered devices
  */
 void DeviceManager::removeDevice(Device *device) {
-    int8_t i = findDevice(NULL);
-    if (i != -1)
+    int8_t i = findDevice(device);
+    if (i != -1) {
         devices[i] = NULL;
-    switch (device->getType()) {
-    case DEVICE_THROTTLE:
-        throttle = NULL;
-        break;
-    case DEVICE_BRAKE:
-        brake = NULL;
-        break;
-    case DEVICE_MOTORCTRL:
-        motorController = NULL;
-        break;
-    case DEVICE_ANY:
-    case DEVICE_BMS:
-    case DEVICE_CHARGER:
-    case DEVICE_DISPLAY:
-    case DEVICE_MISC:
-    case DEVICE_WIFI:
-    case DEVICE_IO:
-    case DEVICE_DCDC:
-    case DEVICE_NONE:
-        break;
+        devicesChanged();
     }
 }
 
+/*
+ * Something changed that lookups depend on - a device came or went or devices got enabled. Lookup
+ * structures get rebuilt when next used and every DeviceHandle looks its device up again.
+ */
+void DeviceManager::devicesChanged() {
+    indexDirty = true;
+    generation++;
+}
+
+void DeviceManager::rebuildDeviceIndex() {
+    int8_t typeLast[DEVICE_NONE + 1];
+
+    memset(idIndex, DEVICE_INDEX_EMPTY, sizeof(idIndex));
+    for (int t = 0; t <= DEVICE_NONE; t++) {
+        typeFirst[t] = -1;
+        typeLast[t] = -1;
+        typeCount[t] = 0;
+    }
+
+    //in devices[] order so the first device of a type or ID is still the one that's found
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++) {
+        typeNext[i] = -1;
+        if (!devices[i]) continue;
+
+        uint32_t pos = deviceHash(devices[i]->getId());
+        while (idIndex[pos] != DEVICE_INDEX_EMPTY) pos = (pos + 1) & (CFG_DEV_MGR_ID_HASH_SIZE - 1);
+        idIndex[pos] = i;
+
+        DeviceType type = devices[i]->getType();
+        if (type < DEVICE_ANY || type > DEVICE_NONE) continue;
+        if (typeLast[type] == -1) typeFirst[type] = i;
+        else typeNext[typeLast[type]] = i;
+        typeLast[type] = i;
+        typeCount[type]++;
+    }
+    indexDirty = false;
+}
+
 /*Add a new tick handler to the specified device. It should
  //technically be possible to register for multiple intervals
  //and be called for all of them but support for that is not
@@ -131,7 +165,18 @@ void DeviceManager::removeDevice(Device *device) {
  */
 void DeviceManager::sendMessage(DeviceType devType, DeviceId devId, uint32_t msgType, void* message)
 {
-    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    if (indexDirty) rebuildDeviceIndex();
+
+    //a message for one device or one type of device only needs to look at those
+    bool byType = (devId == INVALID) && (devType != DEVICE_ANY);
+    int i = 0;
+    if (devId != INVALID) {
+        Device *dev = getDeviceByID(devId);
+        i = dev ? findDevice(dev) : -1;
+    }
+    else if (byType) i = (devType <= DEVICE_NONE) ? typeFirst[devType] : -1;
+
+    for ( ; i >= 0 && i < CFG_DEV_MGR_MAX_DEVICES; i = byType ? typeNext[i] : i + 1)
     {
         if (devices[i] ) //does this object exist        
         {
@@ -148,12 +193,30 @@ void DeviceManager::sendMessage(DeviceType devType, DeviceId devId, uint32_t msg
                 }
             }
         }
+        if (devId != INVALID) break;
     }
+
+    //devices decide whether they're enabled while starting up
+    if (msgType == MSG_STARTUP || msgType == MSG_SETUP) devicesChanged();
 }
 
-void DeviceManager::addStatusEntry(StatusEntry entry)
+bool DeviceManager::addStatusEntry(StatusEntry entry)
 {
+    if (statusEntries.size() >= CFG_STATUS_MAX_ENTRIES)
+    {
+        Logger::error("Too many status entries. Could not add %s", entry.statusName.c_str());
+        return false;
+    }
+    uint16_t idx = statusEntries.size();
+    entry.eventDriven = false;
+    entry.lastSent = 0;
     statusEntries.push_back(entry);
+
+    uint32_t h = statusHash(entry.varPtr);
+    while (statusIndex[h] != STATUS_INDEX_EMPTY) h = (h + 1) & (CFG_STATUS_HASH_SIZE - 1);
+    statusIndex[h] = idx;
+    polledEntries[idx >> 5] |= 1ul << (idx & 31);
+    return true;
 }
 
 //Since entries are put into the vector by copy we can't just search for this entry. We have to search for
@@ -166,18 +229,76 @@ void DeviceManager::removeStatusEntry(StatusEntry entry)
 void DeviceManager::removeStatusEntry(String statusName)
 {
     for (std::vector<StatusEntry>::iterator it = statusEntries.begin(); it != statusEntries.end(); ) {
-        if (it->statusName == statusName) statusEntries.erase(it);
+        if (it->statusName == statusName) it = statusEntries.erase(it);
         else ++it;
     }
+    rebuildStatusIndex();
 }
 
 //if a device is unloaded it'd be necessary to remove all entries it added. We do that here.
 void DeviceManager::removeAllEntriesForDevice(Device *dev)
 {
     for (std::vector<StatusEntry>::iterator it = statusEntries.begin(); it != statusEntries.end(); ) {
-        if (it->device == dev) statusEntries.erase(it);
+        if (it->device == dev) it = statusEntries.erase(it);
         else ++it;
     }
+    rebuildStatusIndex();
+}
+
+/*
+ * Removing entries shifts the ones after it so the hash and both bitmaps have to be redone.
+ * That only happens when a device gets unloaded so it doesn't need to be quick. Every
+ * event driven entry is marked dirty so a change that was pending isn't lost.
+ */
+void DeviceManager::rebuildStatusIndex()
+{
+    for (int i = 0; i < CFG_STATUS_HASH_SIZE; i++) statusIndex[i] = STATUS_INDEX_EMPTY;
+    for (int i = 0; i < CFG_STATUS_MAX_ENTRIES / 32; i++)
+    {
+        dirtyEntries[i] = 0;
+        polledEntries[i] = 0;
+    }
+
+    for (uint16_t idx = 0; idx < statusEntries.size(); idx++)
+    {
+        uint32_t h = statusHash(statusEntries[idx].varPtr);
+        while (statusIndex[h] != STATUS_INDEX_EMPTY) h = (h + 1) & (CFG_STATUS_HASH_SIZE - 1);
+        statusIndex[h] = idx;
+        if (statusEntries[idx].eventDriven) dirtyEntries[idx >> 5] |= 1ul << (idx & 31);
+        else polledEntries[idx >> 5] |= 1ul << (idx & 31);
+    }
+}
+
+//returns the index into statusEntries for the entry that points at this variable or -1 if there isn't one
+int DeviceManager::findStatusEntry(const void *varPtr)
+{
+    uint32_t h = statusHash(varPtr);
+    while (statusIndex[h] != STATUS_INDEX_EMPTY)
+    {
+        uint16_t idx = statusIndex[h];
+        if (statusEntries[idx].varPtr == varPtr) return idx;
+        h = (h + 1) & (CFG_STATUS_HASH_SIZE - 1);
+    }
+    return -1;
+}
+
+/*
+ * Called by Device::setStatus() when a device writes a new value to one of its status variables.
+ * Just marks the entry dirty, the observers hear about it on the next tick. The first call for
+ * an entry takes it off the polled list for good.
+ * The bit operations are atomic as CAN frames can get handled from interrupt context.
+ */
+void DeviceManager::statusChanged(const void *varPtr)
+{
+    int idx = findStatusEntry(varPtr);
+    if (idx < 0) return; //not registered (yet). Devices set up their variables before adding the entries
+    uint32_t bit = 1ul << (idx & 31);
+    if (!statusEntries[idx].eventDriven)
+    {
+        statusEntries[idx].eventDriven = true;
+        __atomic_fetch_and(&polledEntries[idx >> 5], ~bit, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_or(&dirtyEntries[idx >> 5], bit, __ATOMIC_RELAXED);
 }
 
 void DeviceManager::printAllStatusEntries()
@@ -187,7 +308,8 @@ void DeviceManager::printAllStatusEntries()
     for (std::vector<StatusEntry>::iterator it = statusEntries.begin(); it != statusEntries.end(); ++it) 
     {
         dev = (Device *)it->device;
-        Logger::console("Name: %s Type: %s   dev: %s", it->statusName.c_str(), CFG_VAR_TYPE_NAMES[it->varType], dev->getShortName());
+        Logger::console("Name: %s Type: %s   dev: %s   %s", it->statusName.c_str(), CFG_VAR_TYPE_NAMES[it->varType], dev->getShortName(),
+                        it->eventDriven ? "event" : "polled");
     }
 }
 
@@ -223,28 +345,57 @@ void DeviceManager::dispatchToObservers(const StatusEntry &entry)
         if (statusObservers[i]) statusObservers[i]->handleMessage(MSG_CONFIG_CHANGE, &entry);
 }
 
+//status changes only go out to displays and the like
+TickPriority DeviceManager::getTickPriority()
+{
+    return TICK_PRIORITY_TELEMETRY;
+}
+
 /*
-  Every tick we go through the entire list of status entries and see if there value has changed. 
-  If it has we need to issue a message to registered listeners. It may bear consideration that 
-  the observer callbacks should be done via a queue and not all at once instantly. This processor
-  is extremely fast but some entries are going to update all of the time and thus we could end up
-  with a huge number of calls here.
+  Every tick we look at the entries that were marked dirty by setStatus() since the last one plus
+  whichever entries are still polled (devices that assign their status variables directly).
+  Entries that haven't changed and have no setStatus() calls cost nothing other than a zero bit.
+  Changes within an entry's deadband are skipped, the comparison is always against the last value
+  sent so slow drift still gets through once it adds up. An entry that changed again before its
+  minInterval ran out stays dirty and goes out on a later tick with whatever the value is then.
 */
 void DeviceManager::handleTick()
 {
-    double currVal = 0.0;
-    for (std::vector<StatusEntry>::iterator it = statusEntries.begin(); it != statusEntries.end(); ++it) 
+    uint32_t now = millis();
+    int numEntries = statusEntries.size();
+    for (int word = 0; word < CFG_STATUS_MAX_ENTRIES / 32; word++)
     {
-        currVal = it->getValueAsDouble();
-        if ( fabs(currVal - it->lastValue) > 0.001) //has the value changed?
+        if (word * 32 >= numEntries) break;
+        uint32_t dirty = __atomic_exchange_n(&dirtyEntries[word], 0, __ATOMIC_RELAXED);
+        uint32_t pending = dirty | polledEntries[word];
+        while (pending)
         {
-            Logger::avalanche("Value of %s has changed", it->statusName.c_str());
-            dispatchToObservers(*it);
-            it->lastValue = currVal;
+            int bit = __builtin_ctz(pending);
+            pending &= pending - 1;
+            int idx = (word * 32) + bit;
+            if (idx >= numEntries) break;
+            checkStatusEntry(idx, !(dirty & (1ul << bit)), now);
         }
     }
 }
 
+void DeviceManager::checkStatusEntry(int idx, bool polled, uint32_t now)
+{
+    StatusEntry &entry = statusEntries[idx];
+    double currVal = entry.getValueAsDouble();
+    if (fabs(currVal - entry.lastValue) <= entry.deadband) return; //not enough of a change
+    if (entry.minInterval && (uint32_t)(now - entry.lastSent) < entry.minInterval)
+    {
+        //too soon. Polled entries get looked at again next tick anyway, published ones have to stay dirty
+        if (!polled) __atomic_fetch_or(&dirtyEntries[idx >> 5], 1ul << (idx & 31), __ATOMIC_RELAXED);
+        return;
+    }
+    Logger::avalanche("Value of %s has changed", entry.statusName.c_str());
+    entry.lastValue = currVal;
+    entry.lastSent = now;
+    dispatchToObservers(entry);
+}
+
 void DeviceManager::setup()
 {
     tickHandler.detach(this);
@@ -253,9 +404,9 @@ void DeviceManager::setup()
 
     tickHandler.attach(this, 100000ul); //10 times per second
 
-    //this should be large enough that you don't cause it to have to enlarge but not so large
-    //that all RAM is taken up needlessly. So, tweak it in use to be big enough but not much more biggerer
-    statusEntries.reserve(200);
+    //addStatusEntry() stops at CFG_STATUS_MAX_ENTRIES so reserving that many means the vector never has to
+    //grow (and copy every entry) while devices are adding theirs
+    statusEntries.reserve(CFG_STATUS_MAX_ENTRIES);
 }
 
 uint8_t DeviceManager::getNumThrottles() {
@@ -279,8 +430,8 @@ uint8_t DeviceManager::getNumDisplays() {
 }
 
 Throttle *DeviceManager::getAccelerator() {
-    //try to find one if nothing registered. Cache it if we find one
-    if (!throttle) throttle = (Throttle *)getDeviceByType(DEVICE_THROTTLE);
+    //only looked up again if the devices changed
+    Throttle *throttle = accelerator.get();
 
     //if there is no throttle then instantiate a dummy throttle
     //so down range code doesn't puke
@@ -293,26 +444,25 @@ Throttle *DeviceManager::getAccelerator() {
 }
 
 Throttle *DeviceManager::getBrake() {
+    Throttle *brakeDev = brake.get();
 
-    if (!brake) brake = (Throttle *)getDeviceByType(DEVICE_BRAKE);
-
-    if (!brake)
+    if (!brakeDev)
     {
         Logger::avalanche("getBrake() called but there is no registered brake!");
         return 0; //NULL!
     }
-    return brake;
+    return brakeDev;
 }
 
 MotorController *DeviceManager::getMotorController() {
-    if (!motorController) motorController = (MotorController *)getDeviceByType(DEVICE_MOTORCTRL);
+    MotorController *controller = motorController.get();
 
-    if (!motorController)
+    if (!controller)
     {
         Logger::avalanche("getMotorController() called but there is no registered motor controller!");
         return 0; //NULL!
     }
-    return motorController;
+    return controller;
 }
 
 /*
@@ -322,12 +472,11 @@ but sometimes you can't help it.
 */
 Device *DeviceManager::getDeviceByID(DeviceId id)
 {
-    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    if (indexDirty) rebuildDeviceIndex();
+    for (uint32_t pos = deviceHash(id); idIndex[pos] != DEVICE_INDEX_EMPTY; pos = (pos + 1) & (CFG_DEV_MGR_ID_HASH_SIZE - 1))
     {
-        if (devices[i])
-        {
-            if (devices[i]->getId() == id) return devices[i];
-        }
+        Device *dev = devices[idIndex[pos]];
+        if (dev && dev->getId() == id) return dev;
     }
     Logger::avalanche("getDeviceByID - No device with ID: %X", (int)id);
     return 0; //NULL!
@@ -335,7 +484,7 @@ Device *DeviceManager::getDeviceByID(DeviceId id)
 
 Device *DeviceManager::getDeviceByIdx(int idx)
 {
-    if (idx < 0 || idx > CFG_DEV_MGR_MAX_DEVICES) return nullptr;
+    if (idx < 0 || idx >= CFG_DEV_MGR_MAX_DEVICES) return nullptr;
     return devices[idx];
 }
 
@@ -345,11 +494,12 @@ a given type.
 */
 Device *DeviceManager::getDeviceByType(DeviceType type)
 {
-    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    if (indexDirty) rebuildDeviceIndex();
+    if (type >= DEVICE_ANY && type <= DEVICE_NONE)
     {
-        if (devices[i] && devices[i]->isEnabled())
+        for (int i = typeFirst[type]; i != -1; i = typeNext[i])
         {
-            if (devices[i]->getType() == type) return devices[i];
+            if (devices[i] && devices[i]->isEnabled()) return devices[i];
         }
     }
     Logger::avalanche("getDeviceByType - No devices of type: %X", (int)type);
@@ -372,12 +522,9 @@ int8_t DeviceManager::findDevice(Device *device) {
  * Count the number of registered devices of a certain type.
  */
 uint8_t DeviceManager::countDeviceType(DeviceType deviceType) {
-    uint8_t count = 0;
-    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++) {
-        if (devices[i]->getType() == deviceType)
-            count++;
-    }
-    return count;
+    if (indexDirty) rebuildDeviceIndex();
+    if (deviceType < DEVICE_ANY || deviceType > DEVICE_NONE) return 0;
+    return typeCount[deviceType];
 }
 
 /*
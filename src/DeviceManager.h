@@ -40,16 +40,39 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 class MotorController; // cyclic reference between MotorController and DeviceManager
 
+/*
+ * A device that is looked up once and then remembered. Code that needs another device on every tick keeps one
+ * of these instead of asking DeviceManager every time. It only looks again after devices were added or removed,
+ * or after start up when devices get enabled. By type it finds the first enabled device of that type, by ID
+ * the device with that ID. get() returns NULL if there is no such device.
+ */
+template <class T> class DeviceHandle
+{
+public:
+    DeviceHandle(DeviceType devType) : type(devType), id(INVALID), generation(0), device(nullptr) {}
+    DeviceHandle(DeviceId devId) : type(DEVICE_ANY), id(devId), generation(0), device(nullptr) {}
+    T *get();
+    inline T *operator->() { return get(); }
+    inline operator T *() { return get(); }
+
+private:
+    DeviceType type;
+    DeviceId id;
+    uint32_t generation; //DeviceManager generation device was found in
+    T *device;
+};
+
 class DeviceManager: public TickObserver {
 public:
     DeviceManager();    // private constructor
     void addDevice(Device *device);
     void removeDevice(Device *device);
-    void addStatusEntry(StatusEntry entry);
+    bool addStatusEntry(StatusEntry entry);
     void removeStatusEntry(StatusEntry entry);
     void removeStatusEntry(String statusName);
     void removeAllEntriesForDevice(Device *dev);
     void printAllStatusEntries();
+    void statusChanged(const void *varPtr);
     void sendMessage(DeviceType deviceType, DeviceId deviceId, uint32_t msgType, void* message);
     void dispatchToObservers(const StatusEntry &entry);
     bool addStatusObserver(Device *dev);
@@ -70,29 +93,59 @@ public:
     Device *updateWifiByID(DeviceId);
     const ConfigEntry* findConfigEntry(const char *settingName, Device **matchingDevice);
     void handleTick();
+    TickPriority getTickPriority();
     void setup();
     void createJsonConfigDoc(DynamicJsonDocument &doc);
     void createJsonConfigDocForID(DynamicJsonDocument &doc, DeviceId id);
     void createJsonDeviceList(DynamicJsonDocument &doc);
+    void devicesChanged();
+    inline uint32_t getGeneration() { return generation; }
 protected:
 
 private:
     Device *devices[CFG_DEV_MGR_MAX_DEVICES];
     Device *statusObservers[CFG_STATUS_NUM_OBSERVERS];
 
-    Throttle *throttle;
-    Throttle *brake;
-    MotorController *motorController;
+    DeviceHandle<Throttle> accelerator;
+    DeviceHandle<Throttle> brake;
+    DeviceHandle<MotorController> motorController;
+
+    //lookup structures for devices[]. Built the first time they're needed after a device was added or removed.
+    //Devices register from the Device constructor, before their ID and type can be asked, so it can't happen then
+    uint8_t idIndex[CFG_DEV_MGR_ID_HASH_SIZE]; // open addressed hash of devices[] indexes, keyed by DeviceId
+    int8_t typeFirst[DEVICE_NONE + 1]; // first device of each type, -1 if none
+    int8_t typeNext[CFG_DEV_MGR_MAX_DEVICES]; // next device of the same type, -1 at the end
+    uint8_t typeCount[DEVICE_NONE + 1];
+    bool indexDirty;
+    uint32_t generation; // bumped whenever a remembered lookup may no longer be right
 
     std::vector<StatusEntry> statusEntries;
+    uint16_t statusIndex[CFG_STATUS_HASH_SIZE]; // open addressed hash of statusEntries indexes, keyed by variable address
+    volatile uint32_t dirtyEntries[CFG_STATUS_MAX_ENTRIES / 32]; // entries written through setStatus() since the last tick
+    uint32_t polledEntries[CFG_STATUS_MAX_ENTRIES / 32]; // entries nobody publishes, these get checked every tick
 
+    int findStatusEntry(const void *varPtr);
+    void rebuildStatusIndex();
+    void checkStatusEntry(int idx, bool polled, uint32_t now);
     int8_t findDevice(Device *device);
     uint8_t countDeviceType(DeviceType deviceType);
+    void rebuildDeviceIndex();
     void __populateJsonEntry(DynamicJsonDocument &doc, Device *dev);
 };
 
 extern DeviceManager deviceManager;
 
+template <class T> T *DeviceHandle<T>::get()
+{
+    if (generation != deviceManager.getGeneration())
+    {
+        Device *dev = (id != INVALID) ? deviceManager.getDeviceByID(id) : deviceManager.getDeviceByType(type);
+        device = static_cast<T *>(dev);
+        generation = deviceManager.getGeneration();
+    }
+    return device;
+}
+
 #endif
 
 
@@ -0,0 +1,251 @@
+/*
+ * DeviceStartup.cpp
+ *
+Copyright (c) 2022 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "DeviceStartup.h"
+#include "DeviceManager.h"
+#include "CanHandler.h"
+#include "FaultHandler.h"
+#include "FaultCodes.h"
+#include "Logger.h"
+
+static const char *START_STATE_NAMES[] = {"disabled", "waiting", "starting", "ready", "FAILED"};
+
+DeviceStartup::DeviceStartup()
+{
+    numEntries = 0;
+    running = false;
+    finished = false;
+    beginTime = 0;
+    finishTime = 0;
+}
+
+/*
+ * Every device gets MSG_STARTUP right away. That only sets up the preference handler so it's quick
+ * and it's what tells us which devices are enabled. Enabled devices then get started from loop()
+ * as their dependencies come up.
+ */
+void DeviceStartup::begin()
+{
+    deviceManager.sendMessage(DEVICE_ANY, INVALID, MSG_STARTUP, NULL);
+
+    numEntries = 0;
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++)
+    {
+        Device *dev = deviceManager.getDeviceByIdx(i);
+        if (!dev) continue;
+        StartEntry &entry = entries[numEntries++];
+        entry.device = dev;
+        entry.setupStart = 0;
+        entry.readyTime = 0;
+        entry.setupMicros = 0;
+        entry.state = dev->isEnabled() ? START_WAITING : START_DISABLED;
+    }
+    beginTime = millis();
+    running = true;
+    finished = false;
+
+    //devices that don't have to wait on anything get started right here, same as they used to
+    loop();
+}
+
+/*
+ * Returns 1 if everything the device depends on is ready, 0 if it still has to wait and -1 if
+ * something it needs failed. Depending on a device that isn't there or isn't enabled is fine,
+ * that just means the car doesn't have one. CAN buses are checked after setup(), see canBusesUp()
+ */
+int DeviceStartup::checkDependencies(StartEntry &entry)
+{
+    const DeviceDependency *deps;
+    uint8_t numDeps = entry.device->getDependencies(&deps);
+    int result = 1;
+
+    for (int d = 0; d < numDeps; d++)
+    {
+        if (deps[d].kind == DEP_CANBUS) continue;
+        for (int i = 0; i < numEntries; i++)
+        {
+            StartEntry &other = entries[i];
+            if (&other == &entry) continue;
+            if (deps[d].kind == DEP_DEVICE_ID && other.device->getId() != deps[d].value) continue;
+            if (deps[d].kind == DEP_DEVICE_TYPE && other.device->getType() != deps[d].value) continue;
+            if (other.state == START_DISABLED) continue;
+            if (other.state == START_FAILED) return -1;
+            if (other.state != START_READY) result = 0;
+        }
+    }
+    return result;
+}
+
+bool DeviceStartup::canBusesUp(StartEntry &entry)
+{
+    CanHandler *buses[3] = {&canHandlerBus0, &canHandlerBus1, &canHandlerBus2};
+    const DeviceDependency *deps;
+    uint8_t numDeps = entry.device->getDependencies(&deps);
+
+    for (int d = 0; d < numDeps; d++)
+    {
+        if (deps[d].kind != DEP_CANBUS) continue;
+        if (deps[d].value > 2 || buses[deps[d].value]->getBusSpeed() == 0) return false;
+    }
+    return true;
+}
+
+void DeviceStartup::startDevice(StartEntry &entry)
+{
+    entry.setupStart = millis();
+    uint32_t start = micros();
+    entry.device->handleMessage(MSG_SETUP, NULL);
+    entry.setupMicros = micros() - start;
+    entry.state = START_SETUP;
+}
+
+void DeviceStartup::finishDevice(StartEntry &entry, DeviceStartState state)
+{
+    entry.readyTime = millis();
+    if (state == START_READY)
+    {
+        Logger::debug("%s ready at %ums (setup() took %uus)", entry.device->getShortName(), entry.readyTime, entry.setupMicros);
+    }
+    else
+    {
+        //a device that got partway up must not keep running half set up
+        if (entry.state == START_SETUP) entry.device->disableDevice();
+        faultHandler.raiseFault(entry.device->getId(), FAULT_DEVICE_STARTUP, false);
+    }
+    entry.state = state;
+}
+
+/*
+ * Moves every device along as far as it can go. Keeps going around until nothing changes so a chain
+ * of devices that are ready straight after setup() all come up in one call.
+ */
+void DeviceStartup::loop()
+{
+    if (!running) return;
+
+    bool progress;
+    do
+    {
+        progress = false;
+        for (int i = 0; i < numEntries; i++)
+        {
+            StartEntry &entry = entries[i];
+            if (entry.state == START_WAITING)
+            {
+                int deps = checkDependencies(entry);
+                if (deps > 0) startDevice(entry);
+                else if (deps < 0)
+                {
+                    Logger::error("%s not started. A device it depends on failed", entry.device->getShortName());
+                    finishDevice(entry, START_FAILED);
+                }
+                if (deps != 0) progress = true;
+            }
+            if (entry.state == START_SETUP)
+            {
+                SetupStatus status = entry.device->setupStatus();
+                if (status == SETUP_DONE && canBusesUp(entry))
+                {
+                    finishDevice(entry, START_READY);
+                    progress = true;
+                }
+                else if (status == SETUP_FAILED)
+                {
+                    Logger::error("%s failed to start", entry.device->getShortName());
+                    finishDevice(entry, START_FAILED);
+                    progress = true;
+                }
+                else if ((millis() - entry.setupStart) > CFG_DEV_SETUP_TIMEOUT)
+                {
+                    if (status == SETUP_DONE) Logger::error("%s not started. Its CAN bus is not running", entry.device->getShortName());
+                    else Logger::error("%s took too long to start", entry.device->getShortName());
+                    finishDevice(entry, START_FAILED);
+                    progress = true;
+                }
+            }
+        }
+    } while (progress);
+
+    //nothing is starting and nothing can move. Whatever is still waiting is waiting on itself
+    bool starting = false;
+    bool waiting = false;
+    for (int i = 0; i < numEntries; i++)
+    {
+        if (entries[i].state == START_SETUP) starting = true;
+        if (entries[i].state == START_WAITING) waiting = true;
+    }
+    if (waiting && !starting)
+    {
+        for (int i = 0; i < numEntries; i++)
+        {
+            if (entries[i].state != START_WAITING) continue;
+            Logger::error("%s not started. Its dependencies form a loop", entries[i].device->getShortName());
+            finishDevice(entries[i], START_FAILED);
+        }
+        waiting = false;
+    }
+
+    if (!waiting && !starting)
+    {
+        running = false;
+        finished = true;
+        finishTime = millis();
+        deviceManager.devicesChanged();
+        int failed = 0;
+        for (int i = 0; i < numEntries; i++) if (entries[i].state == START_FAILED) failed++;
+        if (failed) Logger::warn("Device startup done %ums after power on. %i devices failed to start", finishTime, failed);
+        else Logger::info("All devices started %ums after power on", finishTime);
+    }
+}
+
+DeviceStartState DeviceStartup::getState(Device *device)
+{
+    for (int i = 0; i < numEntries; i++)
+    {
+        if (entries[i].device == device) return entries[i].state;
+    }
+    return START_DISABLED;
+}
+
+void DeviceStartup::printStatus()
+{
+    if (finished) Logger::console("Device startup took %ums (done %ums after power on)", finishTime - beginTime, finishTime);
+    else Logger::console("Device startup still running (%ums so far)", millis() - beginTime);
+    for (int i = 0; i < numEntries; i++)
+    {
+        StartEntry &entry = entries[i];
+        if (entry.state == START_DISABLED) continue;
+        if (entry.state == START_WAITING)
+        {
+            Logger::console("%-12s waiting", entry.device->getShortName());
+            continue;
+        }
+        Logger::console("%-12s %-8s setup() at %5ums took %6uus, ready at %5ums", entry.device->getShortName(),
+                        START_STATE_NAMES[entry.state], entry.setupStart, entry.setupMicros, entry.readyTime);
+    }
+}
+
+DeviceStartup deviceStartup;
@@ -0,0 +1,83 @@
+/*
+ * DeviceStartup.h
+ *
+ * Brings devices up in dependency order without holding up the main loop. Devices say what they need
+ * (other devices, every device of a type, a CAN bus) and only get setup() called once all of that is
+ * ready. A device that needs time to come up reports SETUP_PENDING from setupStatus() instead of
+ * blocking in setup(), so devices that don't depend on each other come up side by side.
+ *
+Copyright (c) 2022 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef DEVICE_STARTUP_H_
+#define DEVICE_STARTUP_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "devices/Device.h"
+
+enum DeviceStartState {
+    START_DISABLED, //not enabled, never started
+    START_WAITING,  //waiting on dependencies
+    START_SETUP,    //setup() was called, waiting for the device to say it is ready
+    START_READY,
+    START_FAILED
+};
+
+class DeviceStartup
+{
+public:
+    DeviceStartup();
+    void begin();
+    void loop();
+    inline bool isFinished() { return finished; }
+    inline uint32_t getFinishTime() { return finishTime; }
+    DeviceStartState getState(Device *device);
+    void printStatus();
+
+private:
+    struct StartEntry
+    {
+        Device *device;
+        uint32_t setupStart; //millis() when setup() was called
+        uint32_t readyTime; //millis() when the device became ready or failed
+        uint32_t setupMicros; //how long the setup() call itself took
+        DeviceStartState state;
+    };
+
+    StartEntry entries[CFG_DEV_MGR_MAX_DEVICES];
+    uint8_t numEntries;
+    bool running;
+    bool finished;
+    uint32_t beginTime;
+    uint32_t finishTime;
+
+    int checkDependencies(StartEntry &entry);
+    bool canBusesUp(StartEntry &entry);
+    void startDevice(StartEntry &entry);
+    void finishDevice(StartEntry &entry, DeviceStartState state);
+};
+
+extern DeviceStartup deviceStartup;
+
+#endif /* DEVICE_STARTUP_H_ */
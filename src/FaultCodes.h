@@ -124,6 +124,9 @@ enum FAULTCODE {
     //A cell in the HV pack is too hot
     FAULT_HV_CELL_OVERTEMP = 0x0AB1, //P0AB1
 
+    //A device did not start up. It timed out, depended on a device that failed or was part of a dependency loop
+    FAULT_DEVICE_STARTUP = 0xCE10, //U0E10
+
     //BMS failed to initialize properly
     FAULT_BMS_INIT = 0xCC10, //U0C10
 
@@ -27,8 +27,16 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "FaultHandler.h"
 #include "eeprom_layout.h"
 
+#if (CFG_FAULT_INDEX_SIZE & (CFG_FAULT_INDEX_SIZE - 1)) || (CFG_FAULT_INDEX_SIZE <= CFG_FAULT_HISTORY_SIZE)
+#error "CFG_FAULT_INDEX_SIZE must be a power of two and more than CFG_FAULT_HISTORY_SIZE"
+#endif
+
 FaultHandler::FaultHandler()
 {
+    for (int i = 0; i < CFG_FAULT_INDEX_SIZE; i++) codeIndex[i].used = false;
+    dirtyRecords = 0;
+    coalesced = 0;
+    recordWrites = 0;
 }
 
 void FaultHandler::setup()
@@ -37,76 +45,183 @@ void FaultHandler::setup()
 
     Logger::info("Initializing Fault Handler", FAULTSYS, this);
 
-    //loadFromEEPROM();
+    loadFromEEPROM();
 
-    //Use the heartbeat interval because it's slow and already exists so we can piggyback on the interrupt
-    //so as to not create more timers than necessary.
-    //tickHandler.attach(this, CFG_TICK_INTERVAL_HEARTBEAT);
+    tickHandler.attach(this, CFG_TICK_INTERVAL_FAULTS);
 }
 
 
-//Every tick update the global time and save it to EEPROM (delayed saving)
+//Every tick update the global time. Every so often save it to EEPROM. Also write out any fault
+//records that were held back by the rate limit
 void FaultHandler::handleTick()
 {
     globalTime = baseTime + (millis() / 100);
-    memCache->Write(EE_FAULT_LOG + EEFAULT_RUNTIME, globalTime);
+    if (globalTime - savedTime >= CFG_FAULT_RUNTIME_SAVE)
+    {
+        recordStore.write(FAULTSYS, FAULT_KEY_RUNTIME, &globalTime, sizeof(globalTime));
+        savedTime = globalTime;
+    }
+
+    if (dirtyRecords == 0) return;
+    for (int i = 0; i < CFG_FAULT_INDEX_SIZE; i++)
+    {
+        FaultCodeEntry *entry = &codeIndex[i];
+        if (entry->used && entry->dirty && (globalTime - entry->lastSaved) >= CFG_FAULT_RATE_LIMIT) saveRecord(entry);
+    }
 }
 
-uint16_t FaultHandler::raiseFault(uint16_t device, uint16_t code, bool ongoing = false)
+/*
+ * Find the index entry for a device and fault code. Open addressing with linear probing.
+ * Entries are never removed so a search can stop at the first unused slot.
+ * Once the index is full a new code takes over the entry of the code saved longest ago whose record
+ * has since been written over in the history. The index is bigger than the history so there always is
+ * one. Nothing is ever emptied so from then on every search runs through the whole index and still
+ * finds all the other codes, and repeats of a new code keep going through the rate limit.
+ */
+FaultHandler::FaultCodeEntry *FaultHandler::findCode(uint16_t device, uint16_t code, bool create)
 {
-    return 0; //this function is broken.
-    bool incPtr = false;
-    globalTime = baseTime + (millis() / 100);
+    uint32_t hash = ((((uint32_t)device) << 16) | code) * 2654435761ul;
+    uint32_t pos = (hash >> 16) & (CFG_FAULT_INDEX_SIZE - 1);
 
-    //first try to see if this fault is already registered as ongoing. If so don't update the time but set ongoing status if necessary
-    bool found = false;
-    for (int j = 0; j < CFG_FAULT_HISTORY_SIZE; j++)
+    for (int i = 0; i < CFG_FAULT_INDEX_SIZE; i++)
     {
-        if (faultList[j].ongoing && faultList[j].device == device && faultList[j].faultCode == code)
+        FaultCodeEntry *entry = &codeIndex[pos];
+        if (!entry->used)
         {
-            found = true;
-            //faultList[j].timeStamp = globalTime;
-            faultList[j].ongoing = ongoing;
-            break; //quit searching
+            if (!create) return NULL;
+            entry->used = true;
+            entry->device = device;
+            entry->code = code;
+            entry->slot = FAULT_NO_SLOT;
+            entry->dirty = false;
+            entry->occurrences = 0;
+            entry->lastSaved = 0;
+            return entry;
         }
+        if (entry->device == device && entry->code == code) return entry;
+        pos = (pos + 1) & (CFG_FAULT_INDEX_SIZE - 1);
     }
+    if (!create) return NULL;
 
-    //nothing ongoing to register a new one
-    if (!found)
+    FaultCodeEntry *oldest = NULL;
+    for (int i = 0; i < CFG_FAULT_INDEX_SIZE; i++)
     {
-        faultList[faultWritePointer].timeStamp = globalTime;
-        faultList[faultWritePointer].ack = false;
-        faultList[faultWritePointer].device = device;
-        faultList[faultWritePointer].faultCode = code;
-        faultList[faultWritePointer].ongoing = ongoing;
-        incPtr = true;
+        FaultCodeEntry *entry = &codeIndex[i];
+        if (entry->dirty || activeRecord(entry)) continue;
+        if (!oldest || entry->lastSaved < oldest->lastSaved) oldest = entry;
     }
+    if (!oldest)
+    {
+        Logger::error("Fault index is full! Raise CFG_FAULT_INDEX_SIZE");
+        return NULL;
+    }
+    Logger::debug("Fault index is full, %x of device %x replaces %x of device %x", code, device, oldest->code, oldest->device);
+    oldest->device = device;
+    oldest->code = code;
+    oldest->slot = FAULT_NO_SLOT;
+    oldest->occurrences = 0;
+    oldest->lastSaved = 0;
+    return oldest;
+}
 
-    //write back to EEPROM cache
-    memCache->Write(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT) * faultWritePointer, &faultList[faultWritePointer], sizeof(FAULT));
+//the newest record of this fault, if the circular buffer hasn't written over it since
+FAULT *FaultHandler::activeRecord(FaultCodeEntry *entry)
+{
+    if (!entry || entry->slot == FAULT_NO_SLOT) return NULL;
+    FAULT *fault = &faultList[entry->slot];
+    if (fault->device != entry->device || fault->faultCode != entry->code) return NULL;
+    return fault;
+}
 
-    if (incPtr)
+//the record changed. Write it now if the rate limit allows, otherwise handleTick gets to it later
+void FaultHandler::markDirty(FaultCodeEntry *entry)
+{
+    if (!entry->dirty)
     {
-        //Cause the memory caching system to immediately write the page but only if incPtr is set (only if this is a new fault)
-        memCache->InvalidateAddress(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT)* faultWritePointer);
-        faultWritePointer = (faultWritePointer + 1) % CFG_FAULT_HISTORY_SIZE;
-        memCache->Write(EE_FAULT_LOG + EEFAULT_WRITEPTR , faultWritePointer);
-        //Cause the page to be immediately fully aged so that it is written very soon.
-        memCache->AgeFullyAddress(EE_FAULT_LOG + EEFAULT_WRITEPTR);
-        //Also announce fault on the console
-        Logger::error(FAULTSYS, "Fault %x raised by device %x at uptime %i", code, device, globalTime);
+        entry->dirty = true;
+        dirtyRecords++;
     }
+    if ((globalTime - entry->lastSaved) >= CFG_FAULT_RATE_LIMIT) saveRecord(entry);
 }
 
-void FaultHandler::cancelOngoingFault(uint16_t device, uint16_t code)
+void FaultHandler::saveRecord(FaultCodeEntry *entry)
 {
-    for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++)
+    if (entry->dirty)
+    {
+        entry->dirty = false;
+        dirtyRecords--;
+    }
+    entry->lastSaved = globalTime;
+    if (!activeRecord(entry)) return; //written over by a newer fault, nothing left to save
+    recordStore.write(FAULTSYS, entry->slot, &faultList[entry->slot], sizeof(FAULT));
+    recordWrites++;
+}
+
+/*
+ * Raise a fault. If the same device already has this fault ongoing, or raised it less than CFG_FAULT_RATE_LIMIT
+ * ago, it's counted in that record instead of taking a new one. That way a flapping input that raises the same
+ * fault every tick costs one record written at most once per CFG_FAULT_RATE_LIMIT and one line on the console.
+ * Returns the slot the fault is stored in.
+ */
+uint16_t FaultHandler::raiseFault(uint16_t device, uint16_t code, bool ongoing = false)
+{
+    globalTime = baseTime + (millis() / 100);
+
+    FaultCodeEntry *entry = findCode(device, code, true);
+    FAULT *fault = activeRecord(entry);
+    if (entry) entry->occurrences++;
+
+    if (fault && (fault->ongoing || (globalTime - fault->lastTime) < CFG_FAULT_RATE_LIMIT))
+    {
+        fault->lastTime = globalTime;
+        if (fault->count < 0xFFFF) fault->count++;
+        fault->ongoing = ongoing;
+        coalesced++;
+        markDirty(entry);
+        return entry->slot;
+    }
+
+    //a new fault (or one that's been quiet for a while) gets its own record
+    uint16_t slot = faultWritePointer;
+    faultList[slot].timeStamp = globalTime;
+    faultList[slot].lastTime = globalTime;
+    faultList[slot].ack = false;
+    faultList[slot].device = device;
+    faultList[slot].faultCode = code;
+    faultList[slot].count = 1;
+    faultList[slot].ongoing = ongoing;
+
+    if (entry)
     {
-        if (faultList[i].ongoing && faultList[i].device == device && faultList[i].faultCode == code)
+        entry->slot = slot;
+        if (entry->dirty)
         {
-            setFaultOngoing(i, false);
+            entry->dirty = false;
+            dirtyRecords--;
         }
+        entry->lastSaved = globalTime;
     }
+    recordStore.write(FAULTSYS, slot, &faultList[slot], sizeof(FAULT));
+    recordWrites++;
+
+    faultWritePointer = (faultWritePointer + 1) % CFG_FAULT_HISTORY_SIZE;
+    recordStore.write(FAULTSYS, FAULT_KEY_WRITEPTR, &faultWritePointer, sizeof(faultWritePointer));
+    //a new fault should get to the EEPROM very soon, not whenever the page ages out
+    recordStore.flushSoon();
+    //Also announce fault on the console
+    Logger::error(FAULTSYS, "Fault %x raised by device %x at uptime %i", code, device, globalTime);
+    return slot;
+}
+
+//goes through the rate limit too, a fault that flaps on and off shouldn't write on every change
+void FaultHandler::cancelOngoingFault(uint16_t device, uint16_t code)
+{
+    FaultCodeEntry *entry = findCode(device, code, false);
+    FAULT *fault = activeRecord(entry);
+    if (!fault || !fault->ongoing) return;
+    globalTime = baseTime + (millis() / 100);
+    fault->ongoing = false;
+    markDirty(entry);
 }
 
 uint16_t FaultHandler::getFaultCount()
@@ -122,62 +237,75 @@ uint16_t FaultHandler::getFaultCount()
     return count;
 }
 
-//the fault handler isn't a device per se and uses more memory than a device would normally be allocated so
-//it does not use PrefHandler
+//the fault handler isn't a device per se and doesn't use PrefHandler but it does keep
+//its records in the same record store
 void FaultHandler::loadFromEEPROM()
 {
-    uint8_t validByte;
-    memCache->Read(EE_FAULT_LOG, &validByte);
-    if (validByte == 0xB2) //magic byte value for a valid fault cache
+    if (recordStore.read(FAULTSYS, FAULT_KEY_WRITEPTR, &faultWritePointer, sizeof(faultWritePointer)))
     {
-        memCache->Read(EE_FAULT_LOG + EEFAULT_READPTR, &faultReadPointer);
-        memCache->Read(EE_FAULT_LOG + EEFAULT_WRITEPTR, &faultWritePointer);
-        memCache->Read(EE_FAULT_LOG + EEFAULT_RUNTIME, &globalTime);
-        baseTime = globalTime;
+        recordStore.read(FAULTSYS, FAULT_KEY_READPTR, &faultReadPointer, sizeof(faultReadPointer));
+        if (!recordStore.read(FAULTSYS, FAULT_KEY_RUNTIME, &globalTime, sizeof(globalTime))) globalTime = 0;
+        baseTime = savedTime = globalTime;
         for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++)
         {
-            memCache->Read(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT) * i, &faultList[i], sizeof(FAULT));
+            //records saved before the fault record had counts are a different size and don't load
+            if (!recordStore.read(FAULTSYS, i, &faultList[i], sizeof(FAULT))) clearFault(i);
         }
+        buildIndex();
     }
-    else //reinitialize the fault cache storage
-    {
-        validByte = 0xB2;
-        memCache->Write(EE_FAULT_LOG, validByte);
-        memCache->Write(EE_FAULT_LOG + EEFAULT_READPTR, (uint16_t)0);
-        memCache->Write(EE_FAULT_LOG + EEFAULT_WRITEPTR, (uint16_t)0);
-        globalTime = baseTime = millis() / 100;
-        memCache->Write(EE_FAULT_LOG + EEFAULT_RUNTIME, globalTime);
-
-        FAULT tempFault;
-        tempFault.ack = true;
-        tempFault.device = 0xFFFF;
-        tempFault.faultCode = 0xFFFF;
-        tempFault.ongoing = false;
-        tempFault.timeStamp = 0;
+    else //reinitialize the fault log
+    {
+        faultReadPointer = 0;
+        faultWritePointer = 0;
+        globalTime = baseTime = savedTime = millis() / 100;
         for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++)
         {
-            faultList[i] = tempFault;
+            clearFault(i);
         }
         saveToEEPROM();
     }
 }
 
+void FaultHandler::clearFault(int faultnum)
+{
+    faultList[faultnum].ack = true;
+    faultList[faultnum].device = 0xFFFF;
+    faultList[faultnum].faultCode = 0xFFFF;
+    faultList[faultnum].ongoing = false;
+    faultList[faultnum].timeStamp = 0;
+    faultList[faultnum].lastTime = 0;
+    faultList[faultnum].count = 0;
+}
+
+//point the index at the newest record of every fault in the log. Oldest slot first so newer ones win
+void FaultHandler::buildIndex()
+{
+    for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++)
+    {
+        uint16_t slot = (faultWritePointer + i) % CFG_FAULT_HISTORY_SIZE;
+        if (faultList[slot].device == 0xFFFF) continue;
+        FaultCodeEntry *entry = findCode(faultList[slot].device, faultList[slot].faultCode, true);
+        if (entry) entry->slot = slot;
+    }
+}
+
+//only records that actually changed get written
 void FaultHandler::saveToEEPROM()
 {
-    memCache->Write(EE_FAULT_LOG + EEFAULT_READPTR, faultReadPointer);
-    memCache->Write(EE_FAULT_LOG + EEFAULT_WRITEPTR, faultWritePointer);
-    memCache->Write(EE_FAULT_LOG + EEFAULT_RUNTIME, globalTime);
+    recordStore.write(FAULTSYS, FAULT_KEY_READPTR, &faultReadPointer, sizeof(faultReadPointer));
+    recordStore.write(FAULTSYS, FAULT_KEY_WRITEPTR, &faultWritePointer, sizeof(faultWritePointer));
+    recordStore.write(FAULTSYS, FAULT_KEY_RUNTIME, &globalTime, sizeof(globalTime));
     for (int i = 0; i < CFG_FAULT_HISTORY_SIZE; i++)
     {
-        memCache->Write(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT) * i, &faultList[i], sizeof(FAULT));
+        recordStore.write(FAULTSYS, i, &faultList[i], sizeof(FAULT));
     }
 }
 
 void FaultHandler::writeFaultToEEPROM(int faultnum)
 {
-    if (faultnum > 0 && faultnum < CFG_FAULT_HISTORY_SIZE)
+    if (faultnum >= 0 && faultnum < CFG_FAULT_HISTORY_SIZE)
     {
-        memCache->Write(EE_FAULT_LOG + EEFAULT_FAULTS_START + sizeof(FAULT) * faultnum, &faultList[faultnum], sizeof(FAULT));
+        recordStore.write(FAULTSYS, faultnum, &faultList[faultnum], sizeof(FAULT));
     }
 }
 
@@ -188,7 +316,7 @@ bool FaultHandler::getNextFault(FAULT *fault)
     {
         j = (faultReadPointer + i + 1) % CFG_FAULT_HISTORY_SIZE;
         if (faultList[j].ack == false) {
-            fault = &faultList[j];
+            *fault = faultList[j];
             faultReadPointer = j;
             return true;
         }
@@ -198,8 +326,8 @@ bool FaultHandler::getNextFault(FAULT *fault)
 
 bool FaultHandler::getFault(uint16_t fault, FAULT *outFault)
 {
-    if (fault > 0 && fault < CFG_FAULT_HISTORY_SIZE) {
-        outFault = &faultList[fault];
+    if (fault < CFG_FAULT_HISTORY_SIZE) {
+        *outFault = faultList[fault];
         return true;
     }
     return false;
@@ -207,7 +335,7 @@ bool FaultHandler::getFault(uint16_t fault, FAULT *outFault)
 
 uint16_t FaultHandler::setFaultACK(uint16_t fault)
 {
-    if (fault > 0 && fault < CFG_FAULT_HISTORY_SIZE)
+    if (fault < CFG_FAULT_HISTORY_SIZE)
     {
         faultList[fault].ack = 1;
         writeFaultToEEPROM(fault);
@@ -218,7 +346,7 @@ uint16_t FaultHandler::setFaultACK(uint16_t fault)
 
 uint16_t FaultHandler::setFaultOngoing(uint16_t fault, bool ongoing)
 {
-    if (fault > 0 && fault < CFG_FAULT_HISTORY_SIZE)
+    if (fault < CFG_FAULT_HISTORY_SIZE)
     {
         faultList[fault].ongoing = ongoing;
         writeFaultToEEPROM(fault);
@@ -227,6 +355,15 @@ uint16_t FaultHandler::setFaultOngoing(uint16_t fault, bool ongoing)
     return 0xFFFF;
 }
 
+void FaultHandler::printStatistics()
+{
+    int codes = 0;
+    for (int i = 0; i < CFG_FAULT_INDEX_SIZE; i++) if (codeIndex[i].used) codes++;
+    Logger::console("Faults: %u unacknowledged, %u distinct faults seen, %u repeats counted in existing records",
+                    getFaultCount(), codes, coalesced);
+    Logger::console("%u fault records written, %u waiting on the rate limit", recordWrites, dirtyRecords);
+}
+
 FaultHandler faultHandler;
 
 
@@ -37,18 +37,31 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "Logger.h"
 #include "FaultCodes.h"
 #include "MemCache.h"
+#include "RecordStore.h"
 
 extern MemCache *memCache;
 
+//The fault log is kept in the record store with FAULTSYS as the owner. Each fault slot is a record
+//keyed by its slot number and these hold the rest
+#define FAULT_KEY_READPTR       0x10000
+#define FAULT_KEY_WRITEPTR      0x10001
+#define FAULT_KEY_RUNTIME       0x10002
+
+#define FAULT_NO_SLOT               0xFFFF
+
 //structure to use for storing and retrieving faults.
 //Stores the info a fault record will contain.
+//Repeats of a fault that come in while it is ongoing or within CFG_FAULT_RATE_LIMIT of the last one
+//don't get a record of their own, they bump count and lastTime of the record already there
 typedef struct {
-    uint32_t timeStamp; //number of
+    uint32_t timeStamp; //run time (tenths of a second) when the fault first happened
+    uint32_t lastTime; //run time of the latest repeat
     uint16_t device; //which device is generating this fault
     uint16_t faultCode; //set by the device itself. There is a universal list of codes
+    uint16_t count; //how many times it happened. Stops at 65535
     uint8_t ack : 1; ////whether this fault has been acknowledged or not 1 = ack'd
     uint8_t ongoing : 1; //whether fault still seems to be happening currently 1 = still going on
-} FAULT; //should be 9 bytes because the bottom two are bit fields in a single byte
+} FAULT; //16 bytes, the bottom two are bit fields in a single byte
 
 
 class FaultHandler : public TickObserver {
@@ -61,20 +74,44 @@ public:
     uint16_t getFaultCount();
     void handleTick();
     void setup();
+    void printStatistics();
 
     uint16_t setFaultACK(uint16_t fault); //acknowledge the fault # - returns fault # if successful (0xFFFF otherwise)
     uint16_t setFaultOngoing(uint16_t fault, bool ongoing); //set value of ongoing flag - returns fault # on success
 
 private:
+    //one per (device, code) seen. Never removed, like the record store index
+    struct FaultCodeEntry
+    {
+        uint16_t device;
+        uint16_t code;
+        uint16_t slot; //faultList slot with the newest record of this fault or FAULT_NO_SLOT
+        bool used;
+        bool dirty; //the record in slot changed but hasn't been written yet
+        uint32_t occurrences; //times raised since start up, repeats included
+        uint32_t lastSaved; //run time the record was last written
+    };
+
     void loadFromEEPROM();
     void saveToEEPROM();
     void writeFaultToEEPROM(int faultnum);
+    void clearFault(int faultnum);
+    FaultCodeEntry *findCode(uint16_t device, uint16_t code, bool create);
+    FAULT *activeRecord(FaultCodeEntry *entry);
+    void markDirty(FaultCodeEntry *entry);
+    void saveRecord(FaultCodeEntry *entry);
+    void buildIndex();
 
     uint16_t  faultWritePointer; //fault # we're up to for writing. Location in EEPROM is start + (fault_ptr * sizeof(FAULT))
     uint16_t  faultReadPointer;  //fault # we're at when reading.
     FAULT faultList[CFG_FAULT_HISTORY_SIZE]; //store up to 50 faults for a long history. 50*9 = 450 bytes of EEPROM
     uint32_t globalTime; //how long the unit has been running in total (across all start ups).
     uint32_t baseTime; //the time loaded at system start up. millis() / 100 is added to this to get the above time
+    uint32_t savedTime; //globalTime when it was last saved
+    FaultCodeEntry codeIndex[CFG_FAULT_INDEX_SIZE];
+    uint16_t dirtyRecords; //records waiting for their rate limit to run out before they're written
+    uint32_t coalesced; //repeats folded into an existing record instead of getting their own
+    uint32_t recordWrites;
 };
 
 extern FaultHandler faultHandler;
@@ -46,6 +46,10 @@ bool Heartbeat::getThrottleDebug() {
     return throttleDebug;
 }
 
+TickPriority Heartbeat::getTickPriority() {
+    return TICK_PRIORITY_HOUSEKEEPING;
+}
+
 void Heartbeat::handleTick() {
     // Print a dot if no other output has been made since the last tick
     uint32_t timeSinceLogging = millis() - Logger::getLastLogTime();
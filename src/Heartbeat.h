@@ -39,6 +39,7 @@ public:
     Heartbeat();
     void setup();
     void handleTick();
+    TickPriority getTickPriority();
     void setThrottleDebug(bool debug);
     bool getThrottleDebug();
 
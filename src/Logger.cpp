@@ -46,8 +46,158 @@ FsFile file;
 // RingBuf for File type FsFile.
 RingBuf<FsFile, RING_BUF_CAPACITY> rb;
 
+#if (CFG_LOG_QUEUE_SIZE & (CFG_LOG_QUEUE_SIZE - 1))
+#error "CFG_LOG_QUEUE_SIZE must be a power of two"
+#endif
+
+/*
+ * Log calls don't format anything. They copy the format pointer, the time, the device and the raw
+ * arguments into logQueue and return. Logger::loop() does the formatting and printing later on.
+ * Format strings are always literals so the pointer stays good. %s arguments are copied since
+ * they often point at stack buffers.
+ * Entries are 8 byte aligned and never wrap. If one doesn't fit at the end of the queue a skip
+ * entry fills the rest and it goes at the start instead.
+ */
+enum LogEntryState
+{
+    LOG_ENTRY_PENDING = 0,  // space reserved but the caller is still copying into it
+    LOG_ENTRY_READY = 1,
+    LOG_ENTRY_SKIP = 2
+};
+
+struct LogEntryHeader
+{
+    uint16_t size;          // whole entry including this header and padding
+    volatile uint8_t state;
+    int8_t level;
+    DeviceId deviceId;
+    uint16_t reserved;
+    uint32_t timestamp;     // micros() when the call was made
+    const char *format;
+};
+
+enum LogArgType
+{
+    LOG_ARG_NONE,
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LONGLONG,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER,
+    LOG_ARG_PERCENT
+};
+
+#define LOG_ALIGN(x)        (((x) + 7) & ~7u)
+#define LOG_LINE_SIZE       256
+#define LOG_MAX_ENTRY       512
+
+DMAMEM static uint8_t logQueue[CFG_LOG_QUEUE_SIZE] __attribute__((aligned(8)));
+static volatile uint32_t logHead = 0; // free running byte counters, masked on use
+static volatile uint32_t logTail = 0;
+
 uint32_t Logger::lastLogTime = 0;
+bool Logger::deferred = false;
+uint32_t Logger::dropped = 0;
+uint32_t Logger::highWater = 0;
+
+static inline bool inInterrupt()
+{
+    uint32_t ipsr;
+    __asm__ volatile("mrs %0, ipsr" : "=r" (ipsr));
+    return (ipsr & 0x1FF) != 0;
+}
+
+/*
+ * Parse one conversion spec. fmt points just past the '%'. Returns a pointer past the conversion
+ * character and sets the type of argument it consumes plus how many '*' ints come before it.
+ * Unsupported conversions come back as LOG_ARG_NONE and the rest of the format is printed as is.
+ */
+static const char *parseSpec(const char *fmt, LogArgType &type, int &stars)
+{
+    int longs = 0;
+    stars = 0;
+    while (*fmt && strchr("-+ #0", *fmt)) fmt++;
+    if (*fmt == '*') { stars++; fmt++; }
+    while (*fmt >= '0' && *fmt <= '9') fmt++;
+    if (*fmt == '.')
+    {
+        fmt++;
+        if (*fmt == '*') { stars++; fmt++; }
+        while (*fmt >= '0' && *fmt <= '9') fmt++;
+    }
+    while (*fmt && strchr("hlzjt", *fmt))
+    {
+        if (*fmt == 'l') longs++;
+        else if (*fmt != 'h') longs = 1; //size_t, intmax_t, ptrdiff_t are long sized on this platform
+        fmt++;
+    }
+    switch (*fmt)
+    {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        type = (longs >= 2) ? LOG_ARG_LONGLONG : (longs ? LOG_ARG_LONG : LOG_ARG_INT);
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        type = LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        type = LOG_ARG_STRING;
+        break;
+    case 'p':
+        type = LOG_ARG_POINTER;
+        break;
+    case '%':
+        type = LOG_ARG_PERCENT;
+        break;
+    default:
+        type = LOG_ARG_NONE;
+        return fmt;
+    }
+    return fmt + 1;
+}
+
+static uint32_t argSize(LogArgType type)
+{
+    switch (type)
+    {
+    case LOG_ARG_INT: return sizeof(int);
+    case LOG_ARG_LONG: return sizeof(long);
+    case LOG_ARG_POINTER: return sizeof(void *);
+    case LOG_ARG_LONGLONG: return sizeof(long long);
+    case LOG_ARG_DOUBLE: return sizeof(double);
+    default: return 0;
+    }
+}
 
+/*
+ * Reserve size bytes (already aligned) in the queue. Returns NULL if it's full.
+ * Log calls can come from interrupts too so this is done with interrupts off.
+ */
+static uint8_t *reserveEntry(uint32_t size, uint32_t &highWater)
+{
+    uint8_t *entry = NULL;
+    uint32_t primask = disableInterrupts();
+    uint32_t offset = logHead & (CFG_LOG_QUEUE_SIZE - 1);
+    uint32_t toEnd = CFG_LOG_QUEUE_SIZE - offset;
+    uint32_t needed = (size > toEnd) ? (toEnd + size) : size;
+    uint32_t used = logHead - logTail;
+    if (used + needed <= CFG_LOG_QUEUE_SIZE)
+    {
+        if (size > toEnd)
+        {
+            LogEntryHeader *skip = (LogEntryHeader *)&logQueue[offset];
+            skip->size = toEnd;
+            skip->state = LOG_ENTRY_SKIP;
+            offset = 0;
+        }
+        entry = &logQueue[offset];
+        ((LogEntryHeader *)entry)->state = LOG_ENTRY_PENDING;
+        logHead += needed;
+        if (used + needed > highWater) highWater = used + needed;
+    }
+    restoreInterrupts(primask);
+    return entry;
+}
 void Logger::initializeFile()
 {
     // Open or create file - truncate existing file.
@@ -72,10 +222,11 @@ void Logger::initializeFile()
     Serial.println("Initialized RingBuff");
 }
 
-//if there is a sector to write or 1 second has gone by then save the data
+//print whatever is queued, then if there is a sector to write or 1 second has gone by save the data
 void Logger::loop()
 {
     static uint32_t lastWriteTime = 0;
+    flush(CFG_LOG_BUDGET_US);
     if (!sdCardPresent) return;
     size_t n = rb.bytesUsed();
     int ret = 0;
@@ -96,6 +247,186 @@ void Logger::loop()
     }
 }
 
+/*
+ * Format and print queued messages until the queue is empty, USB can't take any more, or
+ * budgetMicros is used up (0 = no limit). Returns true if everything got printed.
+ */
+bool Logger::flush(uint32_t budgetMicros)
+{
+    static bool flushing = false;
+    char line[LOG_LINE_SIZE];
+    uint32_t startTime = micros();
+    bool done = true;
+
+    //printing to USB can call yield() which can end up back in here via the serial console
+    if (flushing) return false;
+    flushing = true;
+
+    if (dropped)
+    {
+        uint32_t primask = disableInterrupts();
+        uint32_t count = dropped;
+        dropped = 0;
+        restoreInterrupts(primask);
+        snprintf(line, LOG_LINE_SIZE, "W(%f) %u log messages dropped, queue was full", micros() / 1000000.0f, (unsigned int)count);
+        Serial.println(line);
+        if (sdCardPresent) rb.println(line);
+    }
+
+    while (logTail != logHead)
+    {
+        LogEntryHeader *header = (LogEntryHeader *)&logQueue[logTail & (CFG_LOG_QUEUE_SIZE - 1)];
+        if (header->state == LOG_ENTRY_PENDING) //caller got interrupted mid copy. Get it next time
+        {
+            done = false;
+            break;
+        }
+        if (header->state == LOG_ENTRY_READY)
+        {
+            //don't let a slow or full USB connection block. If nobody is connected it just gets skipped
+            if (Serial && Serial.availableForWrite() < LOG_LINE_SIZE)
+            {
+                done = false;
+                break;
+            }
+            formatEntry((const uint8_t *)header, line, LOG_LINE_SIZE);
+            Serial.println(line);
+            if (sdCardPresent) rb.println(line);
+        }
+        logTail += header->size;
+        if (budgetMicros && (micros() - startTime) >= budgetMicros)
+        {
+            done = (logTail == logHead);
+            break;
+        }
+    }
+    flushing = false;
+    return done;
+}
+
+/*
+ * Turn a queued entry back into a line of text. Same output the logger always produced:
+ * level, timestamp in seconds, [device] then the message.
+ */
+int Logger::formatEntry(const uint8_t *entry, char *line, int lineSize)
+{
+    const LogEntryHeader *header = (const LogEntryHeader *)entry;
+    const uint8_t *args = entry + LOG_ALIGN(sizeof(LogEntryHeader));
+    const char *fmt = header->format;
+    char spec[24];
+    int pos;
+
+    switch (header->level)
+    {
+    case Avalanche: line[0] = '~'; break;
+    case Debug: line[0] = 'D'; break;
+    case Info: line[0] = 'I'; break;
+    case Warn: line[0] = 'W'; break;
+    default: line[0] = 'E'; break;
+    }
+    pos = 1 + snprintf(line + 1, lineSize - 1, "(%f) ", header->timestamp / 1000000.0f);
+
+    if (header->deviceId)
+    {
+        Device *dev = deviceManager.getDeviceByID(header->deviceId);
+        if (dev) pos += snprintf(line + pos, lineSize - pos, "[%s] ", dev->getShortName());
+        else pos += snprintf(line + pos, lineSize - pos, " ");
+    }
+
+    while (*fmt && pos < lineSize - 1)
+    {
+        if (*fmt != '%')
+        {
+            line[pos++] = *fmt++;
+            continue;
+        }
+
+        LogArgType type;
+        int stars;
+        const char *specStart = fmt;
+        const char *specEnd = parseSpec(fmt + 1, type, stars);
+        if (type == LOG_ARG_NONE)
+        {
+            //can't make sense of it so print the rest literally
+            while (*fmt && pos < lineSize - 1) line[pos++] = *fmt++;
+            break;
+        }
+        if (type == LOG_ARG_PERCENT)
+        {
+            line[pos++] = '%';
+            fmt = specEnd;
+            continue;
+        }
+
+        //copy the spec, substituting the stored values for any '*'
+        int specLen = 0;
+        for (const char *c = specStart; c < specEnd && specLen < (int)sizeof(spec) - 12; c++)
+        {
+            if (*c == '*')
+            {
+                int val;
+                memcpy(&val, args, sizeof(int));
+                args += sizeof(int);
+                specLen += snprintf(spec + specLen, sizeof(spec) - specLen, "%d", val);
+            }
+            else spec[specLen++] = *c;
+        }
+        spec[specLen] = 0;
+
+        int avail = lineSize - pos;
+        int written = 0;
+        switch (type)
+        {
+        case LOG_ARG_INT:
+        {
+            int val;
+            memcpy(&val, args, sizeof(val));
+            written = snprintf(line + pos, avail, spec, val);
+            break;
+        }
+        case LOG_ARG_LONG:
+        {
+            long val;
+            memcpy(&val, args, sizeof(val));
+            written = snprintf(line + pos, avail, spec, val);
+            break;
+        }
+        case LOG_ARG_LONGLONG:
+        {
+            long long val;
+            memcpy(&val, args, sizeof(val));
+            written = snprintf(line + pos, avail, spec, val);
+            break;
+        }
+        case LOG_ARG_DOUBLE:
+        {
+            double val;
+            memcpy(&val, args, sizeof(val));
+            written = snprintf(line + pos, avail, spec, val);
+            break;
+        }
+        case LOG_ARG_POINTER:
+        {
+            void *val;
+            memcpy(&val, args, sizeof(val));
+            written = snprintf(line + pos, avail, spec, val);
+            break;
+        }
+        case LOG_ARG_STRING:
+            written = snprintf(line + pos, avail, spec, (const char *)args);
+            args += strlen((const char *)args) + 1;
+            break;
+        default:
+            break;
+        }
+        args += argSize(type);
+        pos += (written < avail) ? written : (avail - 1);
+        fmt = specEnd;
+    }
+    line[pos] = 0;
+    return pos;
+}
+
 /*
  * Output a very verbose debugging message with a variable amount of parameters.
  * printf() style, see Logger::log()
@@ -233,6 +564,8 @@ void Logger::error(DeviceId deviceId, const char *message, ...) {
  * printf() style, see Logger::logMessage()
  */
 void Logger::console(const char *message, ...) {
+    //console output is interactive and goes straight out. Print anything older first so the order stays sane
+    if (!inInterrupt()) flush(0);
     va_list args;
     va_start(args, message);
     char buff[200];
@@ -264,6 +597,29 @@ uint32_t Logger::getLastLogTime() {
     return lastLogTime;
 }
 
+/*
+ * Once the system is up log messages are queued and printed from loop(). Until then
+ * (during setup) they go straight out so nothing is lost if start up hangs.
+ */
+void Logger::setDeferred(bool defer) {
+    deferred = defer;
+    if (!defer) flush(0);
+}
+
+/*
+ * Number of messages thrown away since the last time that was reported because the queue was full.
+ */
+uint32_t Logger::getDroppedCount() {
+    return dropped;
+}
+
+/*
+ * Most bytes ever waiting in the log queue.
+ */
+uint32_t Logger::getQueueHighWater() {
+    return highWater;
+}
+
 /*
  * Returns if debug log level is enabled. This can be used in time critical
  * situations to prevent unnecessary string concatenation (if the message won't
@@ -280,67 +636,133 @@ boolean Logger::isDebug() {
 }
 
 /*
- * Output a log message (called by debug(), info(), warn(), error(), console())
- *
- * Supports printf() like syntax:
+ * Queue a log message (called by debug(), info(), warn(), error())
  *
+ * Supports printf() like syntax. Nothing gets formatted here, the arguments are copied
+ * into the queue and Logger::loop() formats them later. That keeps this cheap enough to
+ * call from handleTick() and interrupts without holding anything up.
  */
 void Logger::log(DeviceId deviceId, LogLevel level, const char *format, va_list args) {
+    if (level == Off) return;
     lastLogTime = millis();
     uint32_t thisTime = micros();
-    String outputString;// = String(lastLogTime) + " - ";
 
-    switch (level) {
-    case Off:
+    //first pass works out how much room the arguments need
+    uint32_t size = LOG_ALIGN(sizeof(LogEntryHeader));
+    const char *fmt = format;
+    va_list sizeArgs;
+    va_copy(sizeArgs, args);
+    while ((fmt = strchr(fmt, '%')))
+    {
+        LogArgType type;
+        int stars;
+        fmt = parseSpec(fmt + 1, type, stars);
+        if (type == LOG_ARG_NONE) break;
+        for (int i = 0; i < stars; i++)
+        {
+            va_arg(sizeArgs, int);
+            size += sizeof(int);
+        }
+        switch (type)
+        {
+        case LOG_ARG_STRING:
+        {
+            const char *str = va_arg(sizeArgs, const char *);
+            size += (str ? strnlen(str, CFG_LOG_MAX_STRING - 1) : 6) + 1;
+            break;
+        }
+        case LOG_ARG_INT: va_arg(sizeArgs, int); break;
+        case LOG_ARG_LONG: va_arg(sizeArgs, long); break;
+        case LOG_ARG_LONGLONG: va_arg(sizeArgs, long long); break;
+        case LOG_ARG_DOUBLE: va_arg(sizeArgs, double); break;
+        case LOG_ARG_POINTER: va_arg(sizeArgs, void *); break;
+        default: break;
+        }
+        size += argSize(type);
+    }
+    va_end(sizeArgs);
+    size = LOG_ALIGN(size);
+
+    uint8_t *entry = (size <= LOG_MAX_ENTRY) ? reserveEntry(size, highWater) : NULL;
+    if (!entry)
+    {
+        dropped++;
         return;
-        break;
-    case Avalanche:
-        outputString += "~";
-        break;
-    case Debug:
-        //Serial.print("D");
-        outputString += "D";
-        break;
-    case Info:
-        //Serial.print("I");
-        outputString += "I";
-        break;
-    case Warn:
-        //Serial.print("W");
-        outputString += "W";
-        break;
-    case Error:
-        //Serial.print("E");
-        outputString += "E";
-        break;
     }
-    char buff[200];
-    snprintf(buff, 200, "(%f) ", thisTime / 1000000.0f);
-    outputString += buff;
-
-    if (deviceId)
-        outputString += printDeviceName(deviceId);
-        //Serial.print(printDeviceName(deviceId));
-
-    //outputString += logMessage(format, args);
-    //Serial.println(outputString);
-    vsnprintf(buff, 200, format, args);
-    outputString += buff;
-    //outputString += "\n";
-    Serial.println(outputString);
-    if (sdCardPresent) rb.println(outputString);
-}
 
-/*
- * When the deviceId is specified when calling the logger, print the name
- * of the device after the log-level. This makes it easier to identify the
- * source of the logged message.
- */
-String Logger::printDeviceName(DeviceId deviceId) {
-    Device *dev = deviceManager.getDeviceByID(deviceId);
-    if (!dev) return String(" ");
-    String devString = String("[") + dev->getShortName() + String("] ");
-    return devString;
-}
+    LogEntryHeader *header = (LogEntryHeader *)entry;
+    header->size = size;
+    header->level = level;
+    header->deviceId = deviceId;
+    header->timestamp = thisTime;
+    header->format = format;
+
+    //second pass copies them. Args are stored unaligned and read back with memcpy
+    uint8_t *out = entry + LOG_ALIGN(sizeof(LogEntryHeader));
+    fmt = format;
+    while ((fmt = strchr(fmt, '%')))
+    {
+        LogArgType type;
+        int stars;
+        fmt = parseSpec(fmt + 1, type, stars);
+        if (type == LOG_ARG_NONE) break;
+        for (int i = 0; i < stars; i++)
+        {
+            int val = va_arg(args, int);
+            memcpy(out, &val, sizeof(val));
+            out += sizeof(val);
+        }
+        switch (type)
+        {
+        case LOG_ARG_INT:
+        {
+            int val = va_arg(args, int);
+            memcpy(out, &val, sizeof(val));
+            break;
+        }
+        case LOG_ARG_LONG:
+        {
+            long val = va_arg(args, long);
+            memcpy(out, &val, sizeof(val));
+            break;
+        }
+        case LOG_ARG_LONGLONG:
+        {
+            long long val = va_arg(args, long long);
+            memcpy(out, &val, sizeof(val));
+            break;
+        }
+        case LOG_ARG_DOUBLE:
+        {
+            double val = va_arg(args, double);
+            memcpy(out, &val, sizeof(val));
+            break;
+        }
+        case LOG_ARG_POINTER:
+        {
+            void *val = va_arg(args, void *);
+            memcpy(out, &val, sizeof(val));
+            break;
+        }
+        case LOG_ARG_STRING:
+        {
+            const char *str = va_arg(args, const char *);
+            if (!str) str = "(null)";
+            size_t len = strnlen(str, CFG_LOG_MAX_STRING - 1);
+            memcpy(out, str, len);
+            out[len] = 0;
+            out += len + 1;
+            break;
+        }
+        default:
+            break;
+        }
+        out += argSize(type);
+    }
 
+    portMEMORY_BARRIER();
+    header->state = LOG_ENTRY_READY;
 
+    //until setup is done print right away, as long as this isn't an interrupt
+    if (!deferred && !inInterrupt()) flush(0);
+}
@@ -54,12 +54,18 @@ public:
     static boolean isDebug();
     static void initializeFile();
     static void loop();
+    static void setDeferred(bool);
+    static uint32_t getDroppedCount();
+    static uint32_t getQueueHighWater();
 private:
     static uint32_t lastLogTime;
+    static bool deferred;
+    static uint32_t dropped;
+    static uint32_t highWater;
 
     static void log(DeviceId, LogLevel, const char *format, va_list);
-    static String logMessage(const char *format, va_list args);
-    static String printDeviceName(DeviceId);
+    static bool flush(uint32_t budgetMicros);
+    static int formatEntry(const uint8_t *entry, char *line, int lineSize);
 };
 
 #endif /* LOGGER_H_ */
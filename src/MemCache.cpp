@@ -25,6 +25,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "MemCache.h"
+#include "imx_rt1060_i2c_driver.h"
 #include <Watchdog_t4.h>
 
 extern WDT_T4<WDT3> wdt;
@@ -33,105 +34,221 @@ MemCache::MemCache()
 {
 }
 
+/*
+ * Every cache page sits in one of two lists. Clean (and unused) pages are kept in least recently
+ * used order so the page to throw out is always the clean tail. Dirty pages are kept in the order
+ * they became dirty so the one that has waited the longest to be written is always the dirty head.
+ * pageIndex maps EEPROM pages straight to cache pages so lookups never have to search.
+ */
 void MemCache::setup() {
     tickHandler.detach(this);
+    for (int c = 0; c < EEPROM_NUM_PAGES; c++) pageIndex[c] = PAGE_NONE;
+    cleanHead = cleanTail = PAGE_NONE;
+    dirtyHead = dirtyTail = PAGE_NONE;
     for (int c = 0; c < NUM_CACHED_PAGES; c++) {
-        pages[c].address = 0xFFFFFF; //maximum number. This is way over what our chip will actually support so it signals unused
-        pages[c].age = 0;
+        pages[c].address = PAGE_UNUSED; //signals unused
+        pages[c].dirtySince = 0;
         pages[c].dirty = false;
+        list_insert(c, cleanHead, cleanTail, false);
     }
-    //WriteTimer = 0;
+    tickCount = 0;
+    writeState = WB_IDLE;
+    writeSlot = PAGE_NONE;
+    writeAddress = PAGE_UNUSED;
+    pagesWritten = 0;
+    writeErrors = 0;
+    stallMicros = 0;
+    maxStallMicros = 0;
 
     tickHandler.attach(this, CFG_TICK_INTERVAL_MEM_CACHE);
 }
 
 
-//Handle aging of dirty pages and flushing of aged out dirty pages
+//flushing dirty pages can wait a few ms for anything more important
+TickPriority MemCache::getTickPriority()
+{
+    return TICK_PRIORITY_HOUSEKEEPING;
+}
+
+//Aging is just counting ticks. loop() starts writing a dirty page once it has been dirty for MAX_AGE ticks.
+//Only the oldest dirty page can have aged out.
 void MemCache::handleTick()
 {
-    int c;
-    cache_age();
-    for (c = 0; c<NUM_CACHED_PAGES; c++) {
-        if ((pages[c].age == MAX_AGE) && (pages[c].dirty)) {
-            FlushPage(c);
+    tickCount++;
+}
+
+/*
+ * Called from the main loop. Moves the write-back engine along: starts writing the oldest dirty page
+ * once it has aged out, notices when the I2C transfer is done and polls the EEPROM until it has
+ * finished programming the page. Never waits for anything.
+ */
+void MemCache::loop()
+{
+    runWriteBack(true);
+}
+
+void MemCache::runWriteBack(bool startNew)
+{
+    switch (writeState) {
+    case WB_IDLE:
+        if (!startNew || dirtyHead == PAGE_NONE) return;
+        if ((tickCount - pages[dirtyHead].dirtySince) < MAX_AGE) return;
+        startWrite(dirtyHead);
+        break;
+    case WB_WRITING:
+        if (!Master.finished()) {
+            if ((uint32_t)(millis() - writeStarted) > EEPROM_WRITE_TIMEOUT_MS * 4) { //bus is stuck. Start() aborts it next time
+                writeErrors++;
+                writeState = WB_IDLE;
+                Logger::error("EEPROM page %u write never finished", writeAddress);
+                if (writeAddress < EEPROM_NUM_PAGES && pageIndex[writeAddress] == writeSlot) cache_setdirty(writeSlot);
+            }
+            return;
+        }
+        if (Master.get_transaction_count() != writeTransaction) {
+            //somebody used Wire after the transfer ended so the result is gone. Assume the worst and
+            //write the page again later, the EEPROM still has to be waited for in case it did go through
+            if (writeAddress < EEPROM_NUM_PAGES && pageIndex[writeAddress] == writeSlot) cache_setdirty(writeSlot);
+        }
+        else if (Master.has_error()) {
+            writeErrors++;
+            writeState = WB_IDLE;
+            Logger::error("EEPROM page %u write failed with I2C error %i", writeAddress, (int)Master.error());
+            //still cached? Then it's still dirty. It'll be tried again once it ages out
+            if (writeAddress < EEPROM_NUM_PAGES && pageIndex[writeAddress] == writeSlot) cache_setdirty(writeSlot);
             return;
         }
+        writeState = WB_PROGRAMMING;
+        writeStarted = millis(); //programming timeout counts from the end of the transfer
+        lastPoll = micros();
+        break;
+    case WB_PROGRAMMING:
+        if ((uint32_t)(micros() - lastPoll) < EEPROM_POLL_US) return;
+        if (!Master.finished()) return;
+        Master.write_async(writeI2CId, writeBuffer, 0, true); //address only. NAKed until programming is done
+        writeTransaction = Master.get_transaction_count();
+        lastPoll = micros();
+        writeState = WB_POLLING;
+        break;
+    case WB_POLLING:
+        if (!Master.finished()) return;
+        if (Master.get_transaction_count() != writeTransaction) { //result got lost, poll again
+            writeState = WB_PROGRAMMING;
+            return;
+        }
+        if (!Master.has_error()) {
+            pagesWritten++;
+            writeState = WB_IDLE;
+            return;
+        }
+        if ((uint32_t)(millis() - writeStarted) > EEPROM_WRITE_TIMEOUT_MS) {
+            writeErrors++;
+            writeState = WB_IDLE;
+            Logger::error("EEPROM never finished programming page %u", writeAddress);
+            return;
+        }
+        writeState = WB_PROGRAMMING;
+        break;
     }
 }
 
-//this function flushes the first dirty page it finds. It should try to wait until enough time has elapsed since
-//a previous page has been written. Remember that page writes take about 7ms.
+/*
+ * Send a dirty page to the EEPROM. The page is copied out first and marked clean so it can keep being
+ * read and written while the transfer happens. A write during the transfer just makes it dirty again.
+ */
+bool MemCache::startWrite(uint8_t page)
+{
+    uint32_t addr;
+    if (writeState != WB_IDLE || !Master.finished()) return false;
+    if (!pages[page].dirty) return false;
+
+    addr = pages[page].address << 8;
+    writeBuffer[0] = ((addr & 0xFF00) >> 8);
+    writeBuffer[1] = 0; //pages are 256 bytes so LSB is always 0 for the start of a page
+    memcpy(&writeBuffer[2], pages[page].data, 256);
+    writeI2CId = 0b01010000 + ((addr >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
+    writeSlot = page;
+    writeAddress = pages[page].address;
+    writeStarted = millis();
+    cache_setclean(page);
+
+    writeState = WB_WRITING;
+    Master.write_async(writeI2CId, writeBuffer, 258, true);
+    writeTransaction = Master.get_transaction_count();
+    return true;
+}
+
+//Let the page write in progress (if any) finish. This does block so the time is counted as stalled
+void MemCache::waitWriteBack()
+{
+    if (writeState == WB_IDLE) return;
+    uint32_t start = micros();
+    while (writeState != WB_IDLE) runWriteBack(false);
+    uint32_t stall = micros() - start;
+    stallMicros += stall;
+    if (stall > maxStallMicros) maxStallMicros = stall;
+}
+
+//Write a page out right now and wait until the EEPROM has it. Returns false if the write failed
+bool MemCache::writePageNow(uint8_t page)
+{
+    uint32_t errors;
+    waitWriteBack();
+    if (!pages[page].dirty) return true;
+    errors = writeErrors;
+    if (!startWrite(page)) return false;
+    waitWriteBack();
+    return (writeErrors == errors);
+}
+
+//this function writes out the oldest dirty page and waits for it. Used when every cache page is
+//dirty and one has to be freed up right now.
 void MemCache::FlushSinglePage()
 {
-    int c;
-    for (c = 0; c<NUM_CACHED_PAGES; c++) {
-        if (pages[c].dirty) {
-            cache_writepage(c);
-            pages[c].dirty = false;
-            pages[c].age = 0; //freshly flushed!
-            delay(10); //naughty! But, for testing we'll allow it. TODO: switch to non-blocking wait
-            return;
-        }
-    }
+    if (dirtyHead == PAGE_NONE) return;
+    writePageNow(dirtyHead);
 }
 
-//Flush every dirty page. It will block for 10ms per page so maybe things will be blocked for a long, long time
-//DO NOT USE THIS FUNCTION UNLESS YOU CAN ACCEPT THAT!
+//Flush every dirty page. This waits for each page to be programmed (about 5ms each) so things will be
+//blocked for a while if there are a lot of them. DO NOT USE THIS FUNCTION UNLESS YOU CAN ACCEPT THAT!
 void MemCache::FlushAllPages()
 {
-    int c;
-    for (c = 0; c < NUM_CACHED_PAGES; c++) {
-        if (pages[c].dirty) { //found a dirty page so flush it
-            cache_writepage(c);
-            pages[c].dirty = false;
-            delay(10); //10ms is longest it would take to write a page according to datasheet
-            wdt.feed();
-        }
+    while (dirtyHead != PAGE_NONE) {
+        if (!writePageNow(dirtyHead)) break; //EEPROM isn't working. Don't spin here forever
+        wdt.feed();
     }
+    waitWriteBack();
 }
 
 //Flush a given page by the page ID. This is NOT by address so act accordingly. Likely no external code should ever use this
 void MemCache::FlushPage(uint8_t page) {
-    if (pages[page].dirty) {
-        cache_writepage(page);
-        pages[page].dirty = false;
-        pages[page].age = 0; //freshly flushed!
-        delay(10);
-    }
+    if (page >= NUM_CACHED_PAGES) return;
+    if (pages[page].dirty) writePageNow(page);
 }
 
 //Flush a page by taking an address within the page.
 void MemCache::FlushAddress(uint32_t address) {
-    uint32_t addr;
-    uint8_t c;
-
-    addr = address >> 8; //kick it down to the page we're talking about
-    c = cache_hit(addr);
-    if (c != 0xFF) FlushPage(c);
+    uint8_t c = cache_hit(address >> 8); //kick it down to the page we're talking about
+    if (c != PAGE_NONE) FlushPage(c);
 }
 
 //Like FlushPage but also marks the page invalid (unused) so if another read request comes it it'll have to be re-read from EEPROM
 void MemCache::InvalidatePage(uint8_t page)
 {
     if (page > NUM_CACHED_PAGES - 1) return; //invalid page, buddy!
-    if (pages[page].dirty) {
-        cache_writepage(page);
-        delay(10);
-    }
+    if (pages[page].dirty) writePageNow(page);
+    list_remove(page);
     pages[page].dirty = false;
-    pages[page].address = 0xFFFFFF;
-    pages[page].age = 0;
+    if (pages[page].address != PAGE_UNUSED) pageIndex[pages[page].address] = PAGE_NONE;
+    pages[page].address = PAGE_UNUSED;
+    list_insert(page, cleanHead, cleanTail, false); //first to be reused
 }
 
 //Mark a given page unused given an address within that page. Will write the page out if it was dirty.
 void MemCache::InvalidateAddress(uint32_t address)
 {
-    uint32_t addr;
-    uint8_t c;
-
-    addr = address >> 8; //kick it down to the page we're talking about
-    c = cache_hit(addr);
-    if (c != 0xFF) InvalidatePage(c);
+    uint8_t c = cache_hit(address >> 8); //kick it down to the page we're talking about
+    if (c != PAGE_NONE) InvalidatePage(c);
 }
 
 //Mark all page cache entries unused (go back to clean slate). It will try to write any dirty pages so be prepared to wait.
@@ -145,47 +262,30 @@ void MemCache::InvalidateAll()
 }
 
 //Cause a given page to be fully aged which will cause it to be written at the next opportunity
+//A clean page that is fully aged is simply the first one to be thrown out
 void MemCache::AgeFullyPage(uint8_t page)
 {
-    if (page < NUM_CACHED_PAGES) { //if we did indeed have that page in cache
-        pages[page].age = MAX_AGE;
+    if (page >= NUM_CACHED_PAGES) return;
+    list_remove(page);
+    if (pages[page].dirty) {
+        pages[page].dirtySince = tickCount - MAX_AGE;
+        list_insert(page, dirtyHead, dirtyTail, true);
     }
+    else list_insert(page, cleanHead, cleanTail, false);
 }
 
 //Cause the page containing the given address to be fully aged and thus written as soon as possible.
 void MemCache::AgeFullyAddress(uint32_t address)
 {
-    uint8_t thisCache;
-    uint32_t page_addr;
-
-    page_addr = address >> 8; //kick it down to the page we're talking about
-    thisCache = cache_hit(page_addr);
-
-    if (thisCache != 0xFF) { //if we did indeed have that page in cache
-        pages[thisCache].age = MAX_AGE;
-    }
+    uint8_t thisCache = cache_hit(address >> 8); //kick it down to the page we're talking about
+    if (thisCache != PAGE_NONE) AgeFullyPage(thisCache); //if we did indeed have that page in cache
 }
 
 //Write data into the memory cache. Takes the place of direct EEPROM writes
 //There are lots of versions of this
 boolean MemCache::Write(uint32_t address, uint8_t valu)
 {
-    uint32_t addr;
-    uint8_t c;
-
-    addr = address >> 8; //kick it down to the page we're talking about
-    c = cache_hit(addr);
-    if (c == 0xFF) 	{
-        c = cache_findpage(); //try to free up a page
-        if (c != 0xFF) c = cache_readpage(addr); //and populate it with the existing data
-    }
-    if (c != 0xFF) {
-        pages[c].data[(uint16_t)(address & 0x00FF)] = valu;
-        pages[c].dirty = true;
-        pages[c].address = addr; //set this in case we actually are setting up a new cache page
-        return true;
-    }
-    return false;
+    return Write(address, &valu, 1);
 }
 
 boolean MemCache::Write(uint32_t address, uint16_t valu)
@@ -209,51 +309,32 @@ boolean MemCache::Write(uint32_t address, float valu)
     return result;
 }
 
+//copies a page worth at a time. Most writes fit in one page so this is usually a single lookup and memcpy.
+//A chunk that covers a whole page replaces all of it so the page isn't read in from EEPROM first
 boolean MemCache::Write(uint32_t address, const void* data, uint16_t len)
 {
-    uint32_t addr;
+    const uint8_t *src = (const uint8_t *)data;
     uint8_t c;
-    uint16_t count;
-
-    for (count = 0; count < len; count++) {
-        addr = (address+count) >> 8; //kick it down to the page we're talking about
-        c = cache_hit(addr);
-        if (c == 0xFF) {
-            c = cache_findpage(); //try to find a page that either isn't loaded or isn't dirty
-            if (c != 0xFF) c = cache_readpage(addr); //and populate it with the existing data
-        }
-        if (c != 0xFF) { //could we find a suitable cache page to write to?
-            pages[c].data[(uint16_t)((address+count) & 0x00FF)] = *(uint8_t *)( ((uint8_t *)data) + count);
-            pages[c].dirty = true;
-            pages[c].address = addr; //set this in case we actually are setting up a new cache page
-        }
-        else break;
+    uint16_t offset, chunk;
+
+    while (len > 0) {
+        offset = address & 0x00FF;
+        chunk = 256 - offset;
+        if (chunk > len) chunk = len;
+        c = cache_getpage(address >> 8, chunk < 256);
+        if (c == PAGE_NONE) return false; //couldn't find a suitable cache page to write to
+        memcpy(&pages[c].data[offset], src, chunk);
+        cache_setdirty(c);
+        address += chunk;
+        src += chunk;
+        len -= chunk;
     }
-
-    if (c != 0xFF) return true; //all ok!
-    return false;
+    return true; //all ok!
 }
 
 boolean MemCache::Read(uint32_t address, uint8_t* valu)
 {
-    uint32_t addr;
-    uint8_t c;
-
-    addr = address >> 8; //kick it down to the page we're talking about
-    c = cache_hit(addr);
-
-    if (c == 0xFF) { //page isn't cached. Search the cache, potentially dump a page and bring this one in
-        c = cache_readpage(addr);
-    }
-
-    if (c != 0xFF) {
-        *valu = pages[c].data[(uint16_t)(address & 0x00FF)];
-        if (!pages[c].dirty) pages[c].age = 0; //reset age since we just used it
-        return true; //all ok!
-    }
-    else {
-        return false;
-    }
+    return Read(address, valu, 1);
 }
 
 boolean MemCache::Read(uint32_t address, uint16_t* valu)
@@ -279,94 +360,198 @@ boolean MemCache::Read(uint32_t address, float* valu)
 
 boolean MemCache::Read(uint32_t address, void* data, uint16_t len)
 {
-    uint32_t addr;
+    uint8_t *dest = (uint8_t *)data;
     uint8_t c;
-    uint16_t count;
+    uint16_t offset, chunk;
+
+    while (len > 0) {
+        c = cache_getpage(address >> 8);
+        if (c == PAGE_NONE) return false; //bust out if we run into trouble
+        offset = address & 0x00FF;
+        chunk = 256 - offset;
+        if (chunk > len) chunk = len;
+        memcpy(dest, &pages[c].data[offset], chunk);
+        cache_touch(c); //reset age since we just used it
+        address += chunk;
+        dest += chunk;
+        len -= chunk;
+    }
+    return true; //all ok!
+}
 
-    for (count = 0; count < len; count++) {
-        addr = (address + count) >> 8;
-        c = cache_hit(addr);
-        if (c == 0xFF) { //page isn't cached. Search the cache, potentially dump a page and bring this one in
-            c = cache_readpage(addr);
-        }
-        if (c != 0xFF) {
-            *(uint8_t *)( ((uint8_t *)data) + count) = pages[c].data[(uint16_t)((address + count) & 0x00FF)];
-            if (!pages[c].dirty) pages[c].age = 0; //reset age since we just used it
+/*
+ * Bring a range of EEPROM into the cache. Pages that are already cached are skipped. Each run of
+ * uncached pages sets the EEPROM address once and then does back to back current address reads,
+ * the EEPROM keeps counting up on its own so it's one long sequential read broken into 256 byte
+ * pieces (the most the I2C driver will do at once). This waits for the reads so it's meant for boot.
+ * Nothing may be written to the EEPROM while a run is open, so a dirty page is only ever flushed
+ * before a run starts and a run ends (with a stop) when it would need more than the clean pages there are.
+ * Returns the number of pages read.
+ */
+uint32_t MemCache::Prefetch(uint32_t address, uint32_t len)
+{
+    uint32_t page, last, addr, count = 0;
+    uint8_t buffer[2];
+    uint8_t i2c_id, c;
+    uint16_t e;
+    bool endOfRun;
+
+    if (len == 0) return 0;
+    page = address >> 8;
+    last = (address + len - 1) >> 8;
+    if (last >= EEPROM_NUM_PAGES) last = EEPROM_NUM_PAGES - 1;
+    waitWriteBack(); //the EEPROM doesn't answer while it's programming a page
+
+    while (page <= last) {
+        if (cache_hit(page) != PAGE_NONE) {
+            page++;
+            continue;
         }
-        else break; //bust the for loop if we run into trouble
-    }
+        addr = page << 8;
+        buffer[0] = ((addr & 0xFF00) >> 8);
+        buffer[1] = 0;
+        i2c_id = 0b01010000 + ((addr >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
+        if (cleanTail == PAGE_NONE) FlushSinglePage(); //every page is dirty. Free one up before the read starts
+        if (cleanTail == PAGE_NONE) return count;
+        Wire.beginTransmission(i2c_id);
+        Wire.write(buffer, 2);
+        Wire.endTransmission(false); //do NOT generate stop
 
-    if (c != 0xFF) return true; //all ok!
-    return false;
+        do {
+            c = cache_findpage(false);
+            //the run ends at the end of the range, at a page we already have, where the chip select bits change
+            //or when this is the last clean page (the next one could only come from flushing a dirty page)
+            endOfRun = (c == PAGE_NONE) || (page == last) || (cache_hit(page + 1) != PAGE_NONE) || (((page + 1) & 0xFF) == 0)
+                       || (cleanHead == cleanTail);
+            if (c == PAGE_NONE) {
+                Wire.requestFrom(i2c_id, 1); //just to finish the transaction with a stop
+                return count;
+            }
+            Wire.requestFrom(i2c_id, 256, endOfRun);
+            if (Wire.available() != 256) { //requestFrom() returns a uint8_t so 256 bytes reads as 0. Ask available() instead
+                Logger::error("EEPROM prefetch of page %u failed", page);
+                if (!endOfRun) Wire.requestFrom(i2c_id, 1);
+                return count;
+            }
+            for (e = 0; e < 256; e++) pages[c].data[e] = Wire.read();
+            pages[c].address = page;
+            pageIndex[page] = c;
+            cache_touch(c);
+            count++;
+            page++;
+        } while (!endOfRun);
+    }
+    return count;
 }
 
 boolean MemCache::isWriting()
 {
-    //if (WriteTimer) return true;
-    return false;
+    return (writeState != WB_IDLE);
+}
+
+uint32_t MemCache::countDirtyPages()
+{
+    uint32_t count = 0;
+    for (uint8_t c = dirtyHead; c != PAGE_NONE; c = pages[c].next) count++;
+    return count;
 }
 
+//address here is the EEPROM page number. Returns the cache page holding it or PAGE_NONE
 uint8_t MemCache::cache_hit(uint32_t address)
 {
-    uint8_t c;
-    for (c = 0; c < NUM_CACHED_PAGES; c++) {
-        if (pages[c].address == address) {
-            return c;
-        }
-    }
-    return 0xFF;
+    if (address >= EEPROM_NUM_PAGES) return PAGE_NONE;
+    return pageIndex[address];
 }
 
-void MemCache::cache_age()
+//returns the cache page for this EEPROM page, bringing it in from EEPROM if it isn't cached yet.
+//Without fill the caller is about to overwrite the whole page so an uncached one is just claimed, not read
+uint8_t MemCache::cache_getpage(uint32_t addr, bool fill)
 {
-    uint8_t c;
-    for (c = 0; c < NUM_CACHED_PAGES; c++) {
-        if (pages[c].age < MAX_AGE) {
-            pages[c].age++;
-        }
+    uint8_t c = cache_hit(addr);
+    if (c != PAGE_NONE) return c;
+    if (fill) return cache_readpage(addr); //page isn't cached. Potentially dump a page and bring this one in
+    if (addr >= EEPROM_NUM_PAGES) return PAGE_NONE;
+    c = cache_findpage();
+    if (c != PAGE_NONE) {
+        pages[c].address = addr;
+        pageIndex[addr] = c;
+        cache_touch(c);
     }
+    return c;
 }
 
-//try to find an empty page or one that can be removed from cache
-uint8_t MemCache::cache_findpage()
+//clean pages move to the front of the LRU list when used. Dirty ones stay where they are, they're waiting to be written
+void MemCache::cache_touch(uint8_t page)
 {
-    uint8_t c;
-    uint8_t old_c, old_v;
-    for (c = 0; c<NUM_CACHED_PAGES; c++) {
-        if (pages[c].address == 0xFFFFFF) { //found an empty cache page so populate it and return its number
-            pages[c].age = 0;
-            pages[c].dirty = false;
-            return c;
-        }
+    if (pages[page].dirty || cleanHead == page) return;
+    list_remove(page);
+    list_insert(page, cleanHead, cleanTail, true);
+}
+
+void MemCache::cache_setdirty(uint8_t page)
+{
+    if (pages[page].dirty) return;
+    list_remove(page);
+    pages[page].dirty = true;
+    pages[page].dirtySince = tickCount;
+    list_insert(page, dirtyHead, dirtyTail, false);
+}
+
+//freshly flushed pages count as just used
+void MemCache::cache_setclean(uint8_t page)
+{
+    if (!pages[page].dirty) return;
+    list_remove(page);
+    pages[page].dirty = false;
+    list_insert(page, cleanHead, cleanTail, true);
+}
+
+//takes a page out of whichever list it is in now. The dirty flag says which one that is
+void MemCache::list_remove(uint8_t page)
+{
+    uint8_t &head = pages[page].dirty ? dirtyHead : cleanHead;
+    uint8_t &tail = pages[page].dirty ? dirtyTail : cleanTail;
+    if (pages[page].prev != PAGE_NONE) pages[pages[page].prev].next = pages[page].next;
+    else head = pages[page].next;
+    if (pages[page].next != PAGE_NONE) pages[pages[page].next].prev = pages[page].prev;
+    else tail = pages[page].prev;
+    pages[page].prev = pages[page].next = PAGE_NONE;
+}
+
+void MemCache::list_insert(uint8_t page, uint8_t &head, uint8_t &tail, bool atHead)
+{
+    if (atHead) {
+        pages[page].prev = PAGE_NONE;
+        pages[page].next = head;
+        if (head != PAGE_NONE) pages[head].prev = page;
+        else tail = page;
+        head = page;
     }
-    //if we got here then there are no free pages so scan to find the oldest one which isn't dirty
-    old_c = 0xFF;
-    old_v = 0;
-    for (c = 0; c<NUM_CACHED_PAGES; c++) {
-        if (!pages[c].dirty && pages[c].age >= old_v) {
-            old_c = c;
-            old_v = pages[c].age;
-        }
+    else {
+        pages[page].next = PAGE_NONE;
+        pages[page].prev = tail;
+        if (tail != PAGE_NONE) pages[tail].next = page;
+        else head = page;
+        tail = page;
     }
-    if (old_c == 0xFF) { //no pages were not dirty - try to free one up
+}
+
+//get a cache page to load a new EEPROM page into. That's the least recently used clean page.
+//If every page is dirty one has to be written out first, unless canFlush is false (an EEPROM read is open)
+uint8_t MemCache::cache_findpage(bool canFlush)
+{
+    uint8_t c;
+    if (cleanTail == PAGE_NONE) {
+        if (!canFlush) return PAGE_NONE;
         FlushSinglePage(); //try to free up a page
-        //now try to find the free page (if one was freed)
-        old_v = 0;
-        for (c=0; c<NUM_CACHED_PAGES; c++) {
-            if (!pages[c].dirty && pages[c].age >= old_v) {
-                old_c = c;
-                old_v = pages[c].age;
-            }
-        }
-        if (old_c == 0xFF) return 0xFF; //if nothing worked then give up
+        if (cleanTail == PAGE_NONE) return PAGE_NONE; //if nothing worked then give up
     }
 
     //If we got to this point then we have a page to use
-    pages[old_c].age = 0;
-    pages[old_c].dirty = false;
-    pages[old_c].address = 0xFFFFFF; //mark it unused
-
-    return old_c;
+    c = cleanTail;
+    if (pages[c].address != PAGE_UNUSED) pageIndex[pages[c].address] = PAGE_NONE;
+    pages[c].address = PAGE_UNUSED; //mark it unused
+    return c;
 }
 
 uint8_t MemCache::cache_readpage(uint32_t addr)
@@ -375,9 +560,11 @@ uint8_t MemCache::cache_readpage(uint32_t addr)
     uint32_t address = addr << 8;
     uint8_t buffer[3];
     uint8_t i2c_id;
+    if (addr >= EEPROM_NUM_PAGES) return PAGE_NONE;
     c = cache_findpage();
+    waitWriteBack(); //the EEPROM doesn't answer while it's programming a page
     Logger::avalanche("ReadPage");
-    if (c != 0xFF) {
+    if (c != PAGE_NONE) {
         buffer[0] = ((address & 0xFF00) >> 8);
         //buffer[1] = (address & 0x00FF);
         buffer[1] = 0; //the pages are 256 bytes so the start of a page is always 00 for the LSB
@@ -396,30 +583,18 @@ uint8_t MemCache::cache_readpage(uint32_t addr)
             }
         }
         pages[c].address = addr;
-        pages[c].age = 0;
-        pages[c].dirty = false;
+        pageIndex[addr] = c;
+        cache_touch(c);
     }
     return c;
 }
 
-boolean MemCache::cache_writepage(uint8_t page)
+void MemCache::printStatistics()
 {
-    uint16_t d;
-    uint32_t addr;
-    uint8_t buffer[258];
-    uint8_t i2c_id;
-    addr = pages[page].address << 8;
-    buffer[0] = ((addr & 0xFF00) >> 8);
-    //buffer[1] = (addr & 0x00FF);
-    buffer[1] = 0; //pages are 256 bytes so LSB is always 0 for the start of a page
-    i2c_id = 0b01010000 + ((addr >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
-    for (d = 0; d < 256; d++) {
-        buffer[d + 2] = pages[page].data[d];
-    }
-    Wire.beginTransmission(i2c_id);
-    Wire.write(buffer, 258);
-    Wire.endTransmission(true);
-    return true;
+    Logger::console("EEPROM cache: %u pages written, %u write errors, %u dirty pages waiting", pagesWritten, writeErrors, countDirtyPages());
+    //the blocking figure is an estimate, the old code waited a fixed 10ms after every page
+    Logger::console("Time stalled waiting on EEPROM writes: %ums total, longest %uus (blocking writes would have been about %ums)",
+                    stallMicros / 1000, maxStallMicros, pagesWritten * 10);
 }
 
 //Nuke it from orbit. It's the only way to be sure.
@@ -433,6 +608,7 @@ void MemCache::nukeFromOrbit()
     uint8_t buffer[258];
     uint8_t i2c_id;
 
+    waitWriteBack();
     for (d = 0; d < 256; d++) buffer[d+2] = 0xFF;
 
     for (int page = 0; page < 1024; page++)
@@ -40,30 +40,37 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 //number of cached pages here.
 #define NUM_CACHED_PAGES   128
 
-//maximum allowable age of a cache
+//number of 256 byte pages in the EEPROM (256KB). Pages past this can't be cached
+#define EEPROM_NUM_PAGES   1024
+
+//number of MemCache ticks a dirty page waits before it gets written out. See the notes below
 #define MAX_AGE  128
 
-/* # of system ticks per aging cycle. There are 128 aging levels total so
-// multiply 128 by this aging period and multiple that by system tick duration
-// to determine how long it will take for a page to age out fully and get written
-// if dirty. For instance, 128 levels * 500 aging period * 10ms (100Hz tick) = 640 seconds
-// EEPROM handles about 1 million write cycles. So, a flush time of 100 seconds means that
-// continuous writing would last 100M seconds which is 3.17 years
-// Another way to look at it is that 128 aging levels * 40ms tick is 5.12 seconds to flush for
-// each aging period below. Adjust acccordingly.
-*/
-#define AGING_PERIOD       60
+#define PAGE_NONE      0xFF     //end of a page list / no cache page
+#define PAGE_UNUSED    0xFFFFFF //address of a cache page that holds nothing
+
+//After a page is sent the EEPROM goes off and programs it for up to 10ms (usually ~5) and won't
+//answer its address until it's done. The write-back engine checks for that ACK this often
+#define EEPROM_POLL_US          500
+//give up on a page write if the EEPROM still hasn't answered after this long
+#define EEPROM_WRITE_TIMEOUT_MS 25
 
 #define CFG_TICK_INTERVAL_MEM_CACHE                 40000
 
-//Current parameters as of 26th of August 2021 = 128 * 40ms * 60 = 307.2 seconds to flush = about 10 years EEPROM life
-//Note that this is 10 years STRAIGHT. As in, you never turned it off for 10 years and every chance it got it wrote the page.
-//This should be plenty of EEPROM life.
+//A dirty page is written MAX_AGE ticks after it first got dirty, 128 * 40ms = 5.12 seconds. Writes that land on
+//the page in the meantime go out with it. There used to be an AGING_PERIOD multiplier here but nothing ever used it,
+//the flush time has been 5.12 seconds all along.
+//Settings and faults go to the RecordStore which only ever appends, so a page gets written at most once per record
+//that lands on it (~16 for small records) each time the store comes around to it, no matter how short the flush time
+//is. The store is 512 pages so that works out to roughly 8GB of records appended before any page reaches a million
+//writes, or over 15 years of saving a setting every single second. The flush time doesn't limit EEPROM life so it
+//is kept short, which means very little is lost if the power goes.
 
 class MemCache: public TickObserver {
 public:
     void setup();
     void handleTick();
+    TickPriority getTickPriority();
     void FlushSinglePage();
     void FlushAllPages();
     void FlushPage(uint8_t page);
@@ -74,6 +81,9 @@ public:
     void AgeFullyPage(uint8_t page);
     void AgeFullyAddress(uint32_t address);
     void nukeFromOrbit();
+    uint32_t Prefetch(uint32_t address, uint32_t len);
+    void loop();
+    void printStatistics();
 
     boolean Write(uint32_t address, uint8_t valu);
     boolean Write(uint32_t address, uint16_t valu);
@@ -93,19 +103,56 @@ public:
 private:
     typedef struct {
         uint8_t data[256];
-        uint32_t address; //address of start of page
-        uint8_t age; //
+        uint32_t address; //EEPROM page number (address >> 8) or PAGE_UNUSED
+        uint32_t dirtySince; //tick count when the page was first written to after it was last flushed
+        uint8_t prev; //links in either the clean list (most recently used first) or the dirty list (oldest first)
+        uint8_t next;
         boolean dirty;
     } PageCache;
 
+    enum WriteBackState {
+        WB_IDLE,
+        WB_WRITING,     //page data is going out over I2C
+        WB_PROGRAMMING, //EEPROM is busy programming the page, waiting to poll it
+        WB_POLLING      //address only probe in flight to see if the EEPROM is done
+    };
+
     PageCache pages[NUM_CACHED_PAGES];
+    uint8_t pageIndex[EEPROM_NUM_PAGES]; //EEPROM page -> cache page or PAGE_NONE
+    uint8_t cleanHead, cleanTail; //clean and unused pages, least recently used at the tail
+    uint8_t dirtyHead, dirtyTail; //dirty pages in the order they got dirty. The head is the next to be flushed
+    uint32_t tickCount;
+
+    //write-back engine. Dirty pages are copied to writeBuffer and sent with the asynchronous I2C
+    //master calls then the EEPROM is polled until it ACKs again. Nothing in here waits.
+    volatile WriteBackState writeState;
+    uint8_t writeBuffer[258]; //2 address bytes then the page
+    uint8_t writeSlot; //cache page being written
+    uint32_t writeAddress; //and the EEPROM page it holds
+    uint8_t writeI2CId;
+    uint32_t writeTransaction; //I2C transaction count right after ours started. Tells if error() is still about ours
+    uint32_t writeStarted; //millis() when the page went out, then when the EEPROM started programming it
+    uint32_t lastPoll; //micros() of the last ACK poll
+    uint32_t pagesWritten;
+    uint32_t writeErrors;
+    uint32_t stallMicros; //total time callers were held up waiting on EEPROM writes
+    uint32_t maxStallMicros;
+
     boolean isWriting();
+    uint32_t countDirtyPages();
+    void runWriteBack(bool startNew);
+    bool startWrite(uint8_t page);
+    void waitWriteBack();
+    bool writePageNow(uint8_t page);
     uint8_t cache_hit(uint32_t address);
-    void cache_age();
-    uint8_t cache_findpage();
+    uint8_t cache_findpage(bool canFlush = true);
     uint8_t cache_readpage(uint32_t addr);
-    boolean cache_writepage(uint8_t page);
-    uint8_t agingTimer;
+    uint8_t cache_getpage(uint32_t addr, bool fill = true);
+    void cache_touch(uint8_t page);
+    void cache_setdirty(uint8_t page);
+    void cache_setclean(uint8_t page);
+    void list_remove(uint8_t page);
+    void list_insert(uint8_t page, uint8_t &head, uint8_t &tail, bool atHead);
 };
 
 #endif /* MEM_CACHE_H_ */
@@ -28,11 +28,20 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "PrefHandler.h"
+#include "DeviceManager.h"
+
+bool PrefHandler::tableValid = false;
+PrefHandler *PrefHandler::transactionOwner = NULL;
+PrefHandler::StagedSetting PrefHandler::staged[RECSTORE_MAX_BATCH];
+uint8_t PrefHandler::stageData[CFG_PREF_TRANSACTION_SIZE];
+uint8_t PrefHandler::numStaged = 0;
+uint16_t PrefHandler::stageUsed = 0;
 
 PrefHandler::PrefHandler() {
     lkg_address = EE_MAIN_OFFSET; //default to normal mode
     base_address = 0;
-    semKeyLookup = false;
+    deviceID = 0;
+    use_lkg = false;
 }
 
 bool PrefHandler::isEnabled()
@@ -54,6 +63,7 @@ void PrefHandler::setEnabledStatus(bool en)
     }
 
     memCache->Write(EE_DEVICE_TABLE + (2 * position), id);
+    deviceManager.devicesChanged(); //lookups by type only return enabled devices
 }
 
 void PrefHandler::dumpDeviceTable()
@@ -72,10 +82,16 @@ void PrefHandler::checkTableValidity()
     uint16_t id;
     uint8_t failures = 0;
 
+    if (tableValid) return; //every PrefHandler calls this but it only needs doing once
+
     while (failures < 3)
     {
         memCache->Read(EE_DEVICE_TABLE, &id);
-        if (id == 0xDEAD) return;
+        if (id == 0xDEAD)
+        {
+            tableValid = true;
+            return;
+        }
         failures++;
         delay(5); //just a small delay
         memCache->InvalidateAll(); //clear the cache so the next read is from EEPROM not the cache
@@ -123,6 +139,28 @@ void PrefHandler::initDevTable()
     id = 0xDEAD;
     memCache->Write(EE_DEVICE_TABLE, id);
     memCache->FlushAllPages();
+    tableValid = true;
+}
+
+/*
+ * Called once at boot before any device is set up. The device table is pulled into the cache in one
+ * sequential read and validated here so the PrefHandler constructors don't each have to. Then the
+ * record store is mounted, which reads the sectors holding the settings and fault log in long reads
+ * too. If the store had to be started from scratch the settings in the old layout get copied over.
+ * Returns the number of milliseconds it took.
+ */
+uint32_t PrefHandler::bootPrefetch()
+{
+    uint32_t start = millis();
+
+    memCache->Prefetch(EE_DEVICE_TABLE, 128);
+    checkTableValidity();
+
+    recordStore.mount();
+    if (recordStore.wasFormatted()) migrateLegacySettings();
+
+    Logger::info("Loaded device table and record store in %ums", millis() - start);
+    return millis() - start;
 }
 
 //Given a device ID we must search the 64 entry table found in EEPROM to see if the device
@@ -131,7 +169,7 @@ PrefHandler::PrefHandler(DeviceId id_in) {
     uint16_t id;
 
     enabled = false;
-    semKeyLookup = false;
+    use_lkg = false;
 
     checkTableValidity();
 
@@ -198,235 +236,233 @@ bool PrefHandler::setDeviceStatus(uint16_t device, bool enabled)
 }
 
 PrefHandler::~PrefHandler() {
+    abortTransaction();
 }
 
 void PrefHandler::LKG_mode(bool mode) {
+    use_lkg = mode;
     if (mode) lkg_address = EE_LKG_OFFSET;
     else lkg_address = EE_MAIN_OFFSET;
 }
 
-//given a hash value it looks for that in the table. If it finds
-//the hash it'll return 5 bytes higher which skips the hash and length
-//so the return location will be the start of the actual value itself.
-uint32_t PrefHandler::findSettingLocation(uint32_t hash)
+//all the typed writes end up here. Outside of a transaction the value goes straight to the record store,
+//which doesn't write anything if the value hasn't changed
+bool PrefHandler::writeValue(const PrefKey &key, const void *val, uint8_t len)
 {
-    while (semKeyLookup);
-    semKeyLookup = true;
-    Logger::avalanche("Key lookup for %x", hash);
-    uint32_t readHash;
-    uint8_t readLength;
-    for (uint32_t idx = SETTINGS_START; idx < EE_DEVICE_SIZE;)
+    uint8_t storedLen;
+    StagedSetting *stage;
+    Logger::avalanche("Key write for %s (%x)", key.name, key.hash);
+    if (recordStore.find(owner(), key.hash, &storedLen) && storedLen != len)
     {
-        memCache->Read((uint32_t)idx + base_address + lkg_address, &readHash);
-        if (readHash == hash) //matched! return the address + 5 which is the start of the actual value
-        {
-            semKeyLookup = false;
-            return (idx + 5);
-        }
-        //otherwise, read length then skip the 4 for hash, 1 for length, and length too.
-        idx += 4;
-        memCache->Read((uint32_t)idx + base_address + lkg_address, &readLength);
-        idx += 1 + readLength;
+        Logger::error("Attempt to write improper length to variable %s!", key.name);
+        return false;
     }
-    semKeyLookup = false;
-    return 0xFFFFFFFFul;
-}
 
-//Works similarly to above but finds a hash value that has not been initialized and
-//returns the address of the hash value (not 5 higher as with the above function)
-uint32_t PrefHandler::findEmptySettingLoc()
-{
-    uint32_t readHash;
-    uint8_t readLength;
-    for (uint32_t idx = SETTINGS_START; idx < EE_DEVICE_SIZE;)
+    if (transactionOwner == this)
     {
-        memCache->Read((uint32_t)idx + base_address + lkg_address, &readHash);
-        Logger::avalanche("Read Hash = %x", readHash);
-        if (readHash == 0xFFFFFFFFul) //it's empty! Return this exact address
+        stage = findStaged(key.hash);
+        if (stage)
         {
-            return (idx);
+            if (stage->len != len)
+            {
+                Logger::error("Attempt to write improper length to variable %s!", key.name);
+                return false;
+            }
+            memcpy(&stageData[stage->offset], val, len);
+            return true;
         }
-        //otherwise, read length then skip the 4 for hash, 1 for length, and length too.
-        idx += 4;
-        memCache->Read((uint32_t)idx + base_address + lkg_address, &readLength);
-        Logger::avalanche("Read length: %u", readLength);
-        idx += 1 + readLength;
+        //a setting that is being saved with the value it already has isn't dirty. Nothing to stage
+        if (recordStore.matches(owner(), key.hash, val, len)) return true;
+        if (numStaged >= RECSTORE_MAX_BATCH || (stageUsed + len) > CFG_PREF_TRANSACTION_SIZE)
+        {
+            Logger::warn("Too many settings changed at once for device %X, saving them in parts", deviceID);
+            commitTransaction();
+            beginTransaction();
+        }
+        stage = &staged[numStaged++];
+        stage->hash = key.hash;
+        stage->offset = stageUsed;
+        stage->len = len;
+        memcpy(&stageData[stageUsed], val, len);
+        stageUsed += len;
+        return true;
     }
-    return 0xFFFFFFFFul;
+
+    if (!recordStore.write(owner(), key.hash, val, len))
+    {
+        Logger::error("Could not store variable %s!", key.name);
+        return false;
+    }
+    return true;
 }
 
-uint32_t PrefHandler::keyToAddress(const char *key, bool createIfNecessary)
+//reads see what a transaction has staged so far, same as if it had been written already
+bool PrefHandler::readValue(const PrefKey &key, void *val, uint8_t len)
 {
-    Logger::avalanche("Key look up for %s", key);
-    uint32_t hash = fnvHash(key);
-    uint32_t address = findSettingLocation(hash);
-    if (address >= EE_DEVICE_SIZE) 
+    if (transactionOwner == this)
     {
-        if (createIfNecessary)
+        StagedSetting *stage = findStaged(key.hash);
+        if (stage)
         {
-            Logger::avalanche("Must create new entry for this setting");
-            address = findEmptySettingLoc();        
-            if (address >= EE_DEVICE_SIZE) return 0xFFFFFFFFul;
-            //write the hash value to this entry because it's new
-            Logger::avalanche("Setting stored at %x", address);
-            memCache->Write((uint32_t)address + base_address + lkg_address, hash);
-            uint8_t len = 0; //don't know length yet. Set it to zero.
-            address += 4; //increment past hash location
-            memCache->Write((uint32_t)address + base_address + lkg_address, len);
-            address += 1; //increment past length too
+            if (stage->len != len) return false;
+            memcpy(val, &stageData[stage->offset], len);
+            return true;
         }
     }
-    Logger::avalanche("Key: %s Returned Addr: %x", key, address);
-    return address;
+    return recordStore.read(owner(), key.hash, val, len);
 }
 
-bool PrefHandler::write(const char *key, uint8_t val) {
-    uint32_t address = keyToAddress(key, true);
-    uint8_t len;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
-    {
-        len = 1;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
-    }
-    else if (len != 1)
+PrefHandler::StagedSetting *PrefHandler::findStaged(uint32_t hash)
+{
+    for (int i = 0; i < numStaged; i++)
     {
-        Logger::error("Attempt to write improper length to variable %s!", key);
-        return false;
+        if (staged[i].hash == hash) return &staged[i];
     }
-    //then return whether we could write the value into the memory cache
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val);
+    return NULL;
 }
 
-bool PrefHandler::write(const char *key, uint16_t val) {
-    uint32_t address = keyToAddress(key, true);
-    uint8_t len;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
-    {
-        len = 2;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
-    }
-    else if (len != 2)
+/*
+ * Start collecting writes instead of storing each one as it comes. The usual way to use this is
+ * around a whole saveConfiguration() - see Device::commitConfiguration(). Settings that still have
+ * the value they're stored with are dropped right away so only the ones that changed get written.
+ */
+void PrefHandler::beginTransaction()
+{
+    if (transactionOwner == this) return;
+    if (transactionOwner)
     {
-        Logger::error("Attempt to write improper length to variable %s!", key);
-        return false;
+        Logger::warn("Transaction for device %X still open, committing it", transactionOwner->deviceID);
+        transactionOwner->commitTransaction();
     }
-    //then return whether we could write the value into the memory cache    
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val);
+    transactionOwner = this;
+    numStaged = 0;
+    stageUsed = 0;
 }
 
-bool PrefHandler::write(const char *key, uint32_t val) {
-    uint32_t address = keyToAddress(key, true);
-    uint8_t len;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
+/*
+ * Store everything staged since beginTransaction() as one batch in the record store. Either all
+ * of it survives a power cut or none of it does. The records are packed together in one or two
+ * pages which get written out right away.
+ */
+bool PrefHandler::commitTransaction()
+{
+    uint16_t size = 0;
+    uint8_t count = 0;
+    uint8_t written = 0;
+    bool ok = true;
+
+    if (transactionOwner != this) return false;
+
+    //a setting changed and then changed back is no longer dirty
+    for (int i = 0; i < numStaged; i++)
     {
-        len = 4;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
+        staged[i].changed = !recordStore.matches(owner(), staged[i].hash, &stageData[staged[i].offset], staged[i].len);
+        if (!staged[i].changed) continue;
+        size += RECSTORE_RECORD_SIZE(staged[i].len);
+        count++;
     }
-    else if (len != 4)
+
+    if (count > 0)
     {
-        Logger::error("Attempt to write improper length to variable %s!", key);
-        return false;
+        if (!recordStore.beginBatch(size)) ok = false;
+        for (int i = 0; ok && i < numStaged; i++)
+        {
+            if (!staged[i].changed) continue;
+            written++;
+            ok = recordStore.write(owner(), staged[i].hash, &stageData[staged[i].offset], staged[i].len, written < count);
+        }
+        if (ok) recordStore.endBatch();
+        else recordStore.abortBatch(); //none of it may count, not even on the next mount
     }
-    //then return whether we could write the value into the memory cache    
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val);
+
+    if (ok) Logger::debug("Saved %u changed settings for device %X", count, deviceID);
+    else Logger::error("Could not store the settings of device %X!", deviceID);
+
+    transactionOwner = NULL;
+    numStaged = 0;
+    stageUsed = 0;
+    return ok;
 }
 
-bool PrefHandler::write(const char *key, float val) {
-    uint32_t address = keyToAddress(key, true);    
-    uint8_t len;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
-    {
-        len = 4;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
-    }
-    else if (len != 4)
-    {
-        Logger::error("Attempt to write improper length to variable %s!", key);
-        return false;
-    }
-    //then return whether we could write the value into the memory cache    
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val);
+void PrefHandler::abortTransaction()
+{
+    if (transactionOwner != this) return;
+    transactionOwner = NULL;
+    numStaged = 0;
+    stageUsed = 0;
 }
 
-bool PrefHandler::write(const char *key, const char *val, size_t maxlen) {
-    uint32_t address = keyToAddress(key, true);    
-    uint8_t len;
+bool PrefHandler::write(PrefKey key, uint8_t val) {
+    return writeValue(key, &val, sizeof(val));
+}
+
+bool PrefHandler::write(PrefKey key, uint16_t val) {
+    return writeValue(key, &val, sizeof(val));
+}
+
+bool PrefHandler::write(PrefKey key, uint32_t val) {
+    return writeValue(key, &val, sizeof(val));
+}
+
+bool PrefHandler::write(PrefKey key, float val) {
+    return writeValue(key, &val, sizeof(val));
+}
+
+//strings always take up maxlen + 1 bytes so the record doesn't change length when the string does
+bool PrefHandler::write(PrefKey key, const char *val, size_t maxlen) {
+    uint8_t buffer[255];
     size_t stringLen = strlen(val);
-    if (stringLen > maxlen) stringLen = maxlen;
-    memCache->Read((uint32_t)address + base_address + lkg_address - 1, &len);
-    if (len == 0)
-    {
-        len = maxlen + 1;
-        memCache->Write((uint32_t)address + base_address + lkg_address - 1, len);
-    }
-    else if (len != (maxlen + 1))
+    if (maxlen >= sizeof(buffer))
     {
-        Logger::error("Attempt to write improper length to variable %s!", key);
+        Logger::error("Variable %s is too long to store!", key.name);
         return false;
     }
-    //then return whether we could write the value into the memory cache    
-    return memCache->Write((uint32_t)address + base_address + lkg_address, val, stringLen + 1);
+    if (stringLen > maxlen) stringLen = maxlen;
+    memset(buffer, 0, maxlen + 1);
+    memcpy(buffer, val, stringLen);
+    return writeValue(key, buffer, maxlen + 1);
 }
 
 
-bool PrefHandler::read(const char *key, uint8_t *val, uint8_t defval) {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + base_address + lkg_address, val);
-    else 
-    {
-        *val = defval;
-        return true;
-    }
+bool PrefHandler::read(PrefKey key, uint8_t *val, uint8_t defval) {
+    if (!readValue(key, val, sizeof(*val))) *val = defval;
+    return true;
 }
 
-bool PrefHandler::read(const char *key, uint16_t *val, uint16_t defval) {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + base_address + lkg_address, val);
-    else 
-    {
-        *val = defval;
-        return true;
-    }
+bool PrefHandler::read(PrefKey key, uint16_t *val, uint16_t defval) {
+    if (!readValue(key, val, sizeof(*val))) *val = defval;
+    return true;
 }
 
-bool PrefHandler::read(const char *key, uint32_t *val, uint32_t defval) {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + base_address + lkg_address, val);
-    else 
-    {
-        *val = defval;
-        return true;
-    }
+bool PrefHandler::read(PrefKey key, uint32_t *val, uint32_t defval) {
+    if (!readValue(key, val, sizeof(*val))) *val = defval;
+    return true;
 }
 
-bool PrefHandler::read(const char *key, float *val, float defval) {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) return memCache->Read((uint32_t)address + base_address + lkg_address, val);
-    else 
-    {
-        *val = defval;
-        return true;
-    }
+bool PrefHandler::read(PrefKey key, float *val, float defval) {
+    if (!readValue(key, val, sizeof(*val))) *val = defval;
+    return true;
 }
 
-bool PrefHandler::read(const char *key, char *val, const char* defval)
+bool PrefHandler::read(PrefKey key, char *val, const char* defval)
 {
-    uint32_t address = keyToAddress(key, false);
-    if (address < EE_DEVICE_SIZE) 
+    uint8_t buffer[256];
+    uint8_t len;
+    StagedSetting *stage = (transactionOwner == this) ? findStaged(key.hash) : NULL;
+    uint32_t address = recordStore.find(owner(), key.hash, &len);
+    if (stage)
     {
-        uint8_t c;
-        int i = 0;
-        while ( memCache->Read((uint32_t)address + base_address + lkg_address + i, &c) )
-        {
-            *val++ = c;
-            i++;
-            if (c == 0) break;
-        }
-        *val = 0;
+        len = stage->len;
+        memcpy(buffer, &stageData[stage->offset], len);
+        buffer[len] = 0;
+        strcpy(val, (char *)buffer);
+        return true;
+    }
+    if (address && memCache->Read(address, buffer, len))
+    {
+        //copy up to the terminator. Strings moved over from the old layout can have junk after it
+        buffer[len] = 0;
+        strcpy(val, (char *)buffer);
         return true;
     }
     else 
@@ -436,88 +472,78 @@ bool PrefHandler::read(const char *key, char *val, const char* defval)
     }
 }
 
-uint8_t PrefHandler::calcChecksum() {
-    uint16_t counter;
-    uint8_t accum = 0;
-    uint8_t temp;
-    for (counter = 1; counter < EE_DEVICE_SIZE; counter++) {
-        memCache->Read((uint32_t)counter + base_address + lkg_address, &temp);
-        accum += temp;
-    }
-    return accum;
-}
-
-//calculate the current checksum and save it to the proper place
+//every record in the store has its own CRC now so there is no block checksum to keep up to date.
+//Kept so the devices don't all need changing.
 void PrefHandler::saveChecksum() {
-    uint8_t csum;
-    csum = calcChecksum();
-    Logger::debug("New checksum: %x", csum);
-    memCache->Write(EE_CHECKSUM + base_address + lkg_address, csum);
 }
 
 bool PrefHandler::checksumValid() {
-    //get checksum from EEPROM and calculate the current checksum to see if they match
-    uint8_t stored_chk, calc_chk;
-    uint16_t stored_id;
-
-    memCache->Read(EE_CHECKSUM + base_address + lkg_address, &stored_chk);
-    
-    calc_chk = calcChecksum();
-    
-    if (calc_chk != stored_chk)
-    {
-        Logger::error("Checksum didn't match        Stored: %X Calc: %X", stored_chk, calc_chk);
-        return false;
-    }    
-
-    Logger::info("Checksum matches Value: %X", calc_chk);
-    
-    memCache->Read(EE_DEVICE_ID + base_address + lkg_address, &stored_id);
-    if (stored_id == 0xFFFF) //didn't used to store the device ID properly so fix that
-    {
-        stored_id = deviceID;
-        memCache->Write(EE_DEVICE_ID + base_address + lkg_address, deviceID);
-    }
-    if (stored_id != deviceID)
-    {
-        Logger::error("ID mismatch in EEPROM. Resetting settings.        Stored: %X Proper: %X", stored_id, deviceID);
-        return false;
-    }
-
-    return true;
+    return recordStore.isMounted();
 }
 
 void PrefHandler::forceCacheWrite()
 {
+    if (transactionOwner == this) return; //the commit gets its records written right away anyway
     memCache->FlushAllPages();
 }
 
-//Use FNV-1a hash to turn an input string into a 32 bit hash value.
-uint32_t PrefHandler::fnvHash(const char *input)
+//Resets the settings for this particular PrefHandler instance. They're all deleted from the
+//record store and the cache flushed so the settings will be fresh thereafter.
+void PrefHandler::resetEEPROM()
 {
-    uint32_t hash = 2166136261ul;
-    char c;
-    while (*input)
-    {
-        c = *input++;
-        c = toupper(c); //force all names to uppercase just to make it consistent
-        hash = hash ^ c;
-        hash = hash * 16777619;
-    }
-    return hash;
+    abortTransaction();
+    recordStore.removeAll(owner());
+    memCache->FlushAllPages();
 }
 
-//Resets the EEPROM storage for this particular PrefHandler instance. Everything will be reset
-//to 0xFF's and the cache flushed so the settings will be fresh thereafter. 
-void PrefHandler::resetEEPROM()
+/*
+ * Settings used to be packed into a 1K block per device, a chain of hash, length, value records.
+ * The first time the record store is set up every device in the table has its block copied over.
+ * The old blocks are left alone. The LKG blocks are skipped, nothing ever switched to LKG mode
+ * so they only ever held the main settings of other devices (the two areas overlap).
+ */
+void PrefHandler::migrateLegacySettings()
 {
-    //write over all the settings 32 bits at a time
-    uint32_t val = 0xFFFFFFFFul;
-    for (uint32_t idx = SETTINGS_START; idx < EE_DEVICE_SIZE; idx = idx + 4)
+    uint16_t id;
+    uint32_t count = 0;
+
+    for (int x = 1; x < 64; x++)
     {
-        memCache->Write((uint32_t)idx + base_address + lkg_address, val);
+        memCache->Read(EE_DEVICE_TABLE + (2 * x), &id);
+        id &= 0x7FFF;
+        if (id == 0) continue;
+        count += migrateBlock(EE_DEVICES_BASE + (EE_DEVICE_SIZE * x) + EE_MAIN_OFFSET, id);
     }
     memCache->FlushAllPages();
+    Logger::info("Moved %u settings into the record store", count);
 }
 
+uint32_t PrefHandler::migrateBlock(uint32_t address, uint16_t owner)
+{
+    uint8_t value[255];
+    uint32_t hash;
+    uint16_t storedId;
+    uint8_t len;
+    uint32_t count = 0;
 
+    memCache->Prefetch(address, EE_DEVICE_SIZE);
+    memCache->Read(address + EE_DEVICE_ID, &storedId);
+    //older builds didn't store the ID. Anything else means the block belongs to some other device
+    if (storedId != owner && storedId != 0xFFFF) return 0;
+
+    for (uint32_t idx = SETTINGS_START; idx + 5 <= EE_DEVICE_SIZE;)
+    {
+        memCache->Read(address + idx, &hash);
+        if (hash == 0xFFFFFFFFul) break;
+        memCache->Read(address + idx + 4, &len);
+        if (idx + 5 + len > EE_DEVICE_SIZE) break;
+        //the old lookup stopped at the first match so a later duplicate was never seen
+        if (len > 0 && !recordStore.find(owner, hash, NULL))
+        {
+            memCache->Read(address + idx + 5, value, len);
+            if (recordStore.write(owner, hash, value, len)) count++;
+        }
+        idx += 5 + len;
+    }
+    return count;
+}
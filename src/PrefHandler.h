@@ -30,9 +30,11 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define PREF_HANDLER_H_
 
 #include <Arduino.h>
+#include <type_traits>
 #include "config.h"
 #include "eeprom_layout.h"
 #include "MemCache.h"
+#include "RecordStore.h"
 #include "devices/DeviceTypes.h"
 #include "Logger.h"
 
@@ -41,11 +43,42 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define PREF_MODE_LKG     true
 
 //we leave 20 bytes at the start of each device block. The first byte is the CRC, the next 2 are the device ID.
-//After that are 17 reserved bytes.
+//After that are 17 reserved bytes. Only used to move old settings into the record store now.
 #define SETTINGS_START  20
 
+//settings are stored in the record store with the device ID as the owner. The LKG copy sets the top bit
+#define PREF_OWNER_LKG  0x8000
+
 extern MemCache *memCache;
 
+//FNV-1a hash of a setting name, forced to uppercase. Written so it can be evaluated at compile time.
+//The stored hashes in EEPROM came from this function so it must never change.
+constexpr uint32_t prefUpper(char c)
+{
+    return (c >= 'a' && c <= 'z') ? (uint32_t)(c - 'a' + 'A') : (uint32_t)(uint8_t)c;
+}
+
+constexpr uint32_t prefHash(const char *input, uint32_t hash = 2166136261ul)
+{
+    return (*input == 0) ? hash : prefHash(input + 1, (hash ^ prefUpper(*input)) * 16777619ul);
+}
+
+/*
+ * A setting key - the name (only used for log messages) and its hash. Every read/write takes one of these.
+ * String literals convert implicitly and since the constructor is constexpr the compiler folds the hash
+ * into a constant at the call site. PREF_KEY("NAME") guarantees that even without optimization.
+ * A runtime string (a char buffer) still works, it just gets hashed on the spot.
+ */
+struct PrefKey
+{
+    const char *name;
+    uint32_t hash;
+    constexpr PrefKey(const char *key) : name(key), hash(prefHash(key)) {}
+    constexpr PrefKey(const char *key, uint32_t keyHash) : name(key), hash(keyHash) {}
+};
+
+#define PREF_KEY(k) PrefKey(k, std::integral_constant<uint32_t, prefHash(k)>::value)
+
 class PrefHandler {
 public:
 
@@ -53,18 +86,20 @@ public:
     PrefHandler(DeviceId id);
     ~PrefHandler();
     void LKG_mode(bool mode);
-    bool write(const char *key, uint8_t val);
-    bool write(const char *key, uint16_t val);
-    bool write(const char *key, uint32_t val);
-    bool write(const char *key, float val);
-    bool write(const char *key, const char *val, size_t maxlen);
-    bool read(const char *key, uint8_t *val, uint8_t defval);
-    bool read(const char *key, uint16_t *val, uint16_t defval);
-    bool read(const char *key, uint32_t *val, uint32_t defval);
-    bool read(const char *key, float *val, float defval);
-    bool read(const char *key, char *val, const char* defval);
-
-    uint8_t calcChecksum();
+    bool write(PrefKey key, uint8_t val);
+    bool write(PrefKey key, uint16_t val);
+    bool write(PrefKey key, uint32_t val);
+    bool write(PrefKey key, float val);
+    bool write(PrefKey key, const char *val, size_t maxlen);
+    bool read(PrefKey key, uint8_t *val, uint8_t defval);
+    bool read(PrefKey key, uint16_t *val, uint16_t defval);
+    bool read(PrefKey key, uint32_t *val, uint32_t defval);
+    bool read(PrefKey key, float *val, float defval);
+    bool read(PrefKey key, char *val, const char* defval);
+
+    void beginTransaction();
+    bool commitTransaction();
+    void abortTransaction();
     void saveChecksum();
     bool checksumValid();
     void forceCacheWrite();
@@ -74,22 +109,41 @@ public:
     static bool setDeviceStatus(uint16_t device, bool enabled);
     static void dumpDeviceTable();
     static void initDevTable();
-    void checkTableValidity();
+    static void checkTableValidity();
+    static uint32_t bootPrefetch();
+    static void migrateLegacySettings();
 
 private:
-    uint32_t base_address; //base address for the parent device
+    uint32_t base_address; //base address of the parent device's old settings block
     uint32_t lkg_address;
     uint16_t deviceID; //device ID of the device that registered this pref handler instance
     bool use_lkg; //use last known good config?
     bool enabled;
     int position; //position within the device table
-    volatile bool semKeyLookup;
 
-    uint32_t fnvHash(const char *input);
-    uint32_t findSettingLocation(uint32_t hash);
-    uint32_t findEmptySettingLoc();
-    uint32_t keyToAddress(const char *key, bool createIfNecessary);
+    //a setting written while a transaction is open. Its value is in stageData
+    struct StagedSetting
+    {
+        uint32_t hash;
+        uint16_t offset;
+        uint8_t len;
+        bool changed;
+    };
+
+    //only one PrefHandler can have a transaction open at once so they all share the staging area
+    static PrefHandler *transactionOwner;
+    static StagedSetting staged[RECSTORE_MAX_BATCH];
+    static uint8_t stageData[CFG_PREF_TRANSACTION_SIZE];
+    static uint8_t numStaged;
+    static uint16_t stageUsed;
+
+    inline uint16_t owner() { return deviceID | (use_lkg ? PREF_OWNER_LKG : 0); }
+    bool writeValue(const PrefKey &key, const void *val, uint8_t len);
+    bool readValue(const PrefKey &key, void *val, uint8_t len);
+    StagedSetting *findStaged(uint32_t hash);
     static void processAutoEntry(uint16_t val, uint16_t pos);
+    static uint32_t migrateBlock(uint32_t address, uint16_t owner);
+    static bool tableValid; //device table has been checked (or created) since boot
 };
 
 #endif
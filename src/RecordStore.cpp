@@ -0,0 +1,594 @@
+/*
+ * RecordStore.cpp
+ *
+Copyright (c) 2022 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "RecordStore.h"
+#include "Logger.h"
+
+#if (CFG_RECSTORE_INDEX_SIZE & (CFG_RECSTORE_INDEX_SIZE - 1))
+#error "CFG_RECSTORE_INDEX_SIZE must be a power of two"
+#endif
+
+#if (CFG_RECSTORE_WINDOW >= RECSTORE_NUM_SECTORS)
+#error "CFG_RECSTORE_WINDOW must be smaller than the number of record store sectors"
+#endif
+
+extern MemCache *memCache;
+
+RecordStore::RecordStore()
+{
+    mounted = false;
+    formatted = false;
+    compacting = false;
+    headSector = RECSTORE_NO_SECTOR;
+    tailSector = RECSTORE_NO_SECTOR;
+    sectorsInUse = 0;
+    headOffset = 0;
+    headSeq = 0;
+    lastRecord = 0;
+    lastRecordSize = 0;
+    batchStart = 0;
+    batchPending = false;
+    numPending = 0;
+    pendingBroken = false;
+    indexCount = 0;
+    recordsWritten = 0;
+    recordsSkipped = 0;
+    compactions = 0;
+    badRecords = 0;
+}
+
+/*
+ * Find the sectors in use, replay their records oldest first to build the index and pick up
+ * where the head left off. If nothing is in use the store is new and gets started in sector 0.
+ * Must be called after the MemCache is set up and before anything reads or writes records.
+ */
+void RecordStore::mount()
+{
+    uint32_t header[2];
+    uint8_t order[RECSTORE_NUM_SECTORS];
+    uint8_t count = 0;
+
+    memset(index, 0, sizeof(index));
+    indexCount = 0;
+    sectorsInUse = 0;
+    numPending = 0;
+    batchPending = false;
+
+    for (int s = 0; s < RECSTORE_NUM_SECTORS; s++)
+    {
+        memCache->Read(sectorAddress(s), header, RECSTORE_SECTOR_HEADER);
+        sectorInUse[s] = (header[0] == RECSTORE_MAGIC);
+        sectorSeq[s] = header[1];
+        if (!sectorInUse[s]) continue;
+        sectorsInUse++;
+        //insertion sort by sequence, there are only a handful
+        int pos = count++;
+        while (pos > 0 && sectorSeq[order[pos - 1]] > header[1])
+        {
+            order[pos] = order[pos - 1];
+            pos--;
+        }
+        order[pos] = s;
+    }
+
+    mounted = true;
+    if (count == 0)
+    {
+        Logger::info("Record store is empty. Starting a new one");
+        formatted = true;
+        headSector = RECSTORE_NUM_SECTORS - 1; //so the first one opened is sector 0
+        headSeq = 0;
+        if (!openNextSector()) mounted = false;
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        memCache->Prefetch(sectorAddress(order[i]), EE_RECORD_SECTOR_SIZE);
+        scanSector(order[i], i == (count - 1));
+    }
+    headSector = order[count - 1];
+    headSeq = sectorSeq[headSector];
+    tailSector = order[0];
+    Logger::info("Record store mounted. %u sectors in use, %u records", sectorsInUse, indexCount);
+}
+
+//spread the owners around too, they mostly use the same handful of setting names
+RecordStore::IndexEntry *RecordStore::indexFind(uint16_t owner, uint32_t key, bool create)
+{
+    uint32_t slot = (key ^ (owner * 2654435761ul)) & (CFG_RECSTORE_INDEX_SIZE - 1);
+    while (index[slot].used)
+    {
+        if (index[slot].key == key && index[slot].owner == owner) return &index[slot];
+        slot = (slot + 1) & (CFG_RECSTORE_INDEX_SIZE - 1);
+    }
+    //keep some slots free so probing stays short and a miss always ends on an empty slot
+    if (!create || indexCount >= (CFG_RECSTORE_INDEX_SIZE * 3) / 4) return NULL;
+    index[slot].used = true;
+    index[slot].key = key;
+    index[slot].owner = owner;
+    index[slot].address = 0;
+    index[slot].len = 0;
+    indexCount++;
+    return &index[slot];
+}
+
+uint16_t RecordStore::recordCRC(uint32_t seq, const uint8_t *record, uint16_t len)
+{
+    crc16.xmodem((const uint8_t *)&seq, 4);
+    return crc16.xmodem_upd(record, len);
+}
+
+/*
+ * Read the record at offset within a sector into rec (which must hold the largest possible record).
+ * Returns the size of the whole record or 0 if there isn't a good one there - that's the end of the sector.
+ */
+uint16_t RecordStore::readRecord(uint8_t sector, uint32_t offset, uint8_t *rec)
+{
+    uint32_t address = sectorAddress(sector) + offset;
+    uint16_t crc;
+    uint8_t len;
+
+    if (offset + RECSTORE_RECORD_HEADER + RECSTORE_RECORD_CRC > EE_RECORD_SECTOR_SIZE) return 0;
+    memCache->Read(address, rec, RECSTORE_RECORD_HEADER);
+    if (rec[0] != RECSTORE_VALUE && rec[0] != RECSTORE_VALUE_MORE && rec[0] != RECSTORE_VALUE_FIRST &&
+        rec[0] != RECSTORE_VALUE_LAST && rec[0] != RECSTORE_DELETE) return 0;
+    len = rec[1];
+    if (offset + RECSTORE_RECORD_HEADER + len + RECSTORE_RECORD_CRC > EE_RECORD_SECTOR_SIZE) return 0;
+    memCache->Read(address + RECSTORE_RECORD_HEADER, &rec[RECSTORE_RECORD_HEADER], len + RECSTORE_RECORD_CRC);
+    memcpy(&crc, &rec[RECSTORE_RECORD_HEADER + len], 2);
+    if (crc != recordCRC(sectorSeq[sector], rec, RECSTORE_RECORD_HEADER + len))
+    {
+        //most likely the power went while it was being written. Everything before it is fine
+        Logger::warn("Record store: bad record in sector %u at offset %u", sector, offset);
+        badRecords++;
+        return 0;
+    }
+    return RECSTORE_RECORD_HEADER + len + RECSTORE_RECORD_CRC;
+}
+
+/*
+ * Replay the records of one sector into the index. Records written as part of a batch are held back
+ * until the record that ends the batch turns up. If it never does the batch was cut short and none
+ * of it counts. A batch never spans sectors (see beginBatch) so an unfinished one can't carry over.
+ */
+void RecordStore::scanSector(uint8_t sector, bool isHead)
+{
+    uint8_t rec[RECSTORE_RECORD_HEADER + 255 + RECSTORE_RECORD_CRC];
+    uint32_t offset = RECSTORE_SECTOR_HEADER;
+    uint32_t batchOffset = 0; //where the unfinished batch starts
+    uint32_t dropped = 0;
+    uint16_t size, owner;
+    uint32_t key;
+    bool inBatch = false;
+
+    numPending = 0;
+    pendingBroken = false;
+    while ((size = readRecord(sector, offset, rec)) != 0)
+    {
+        memcpy(&owner, &rec[2], 2);
+        memcpy(&key, &rec[4], 4);
+        switch (rec[0])
+        {
+        case RECSTORE_VALUE_FIRST:
+            dropped += numPending;
+            numPending = 0;
+            pendingBroken = false;
+            inBatch = true;
+            batchOffset = offset;
+            addPending(owner, key, sectorAddress(sector) + offset, &rec[RECSTORE_RECORD_HEADER], rec[1]);
+            break;
+        case RECSTORE_VALUE_MORE: //outside a batch it's what's left of one that was written over. Ignore it
+            if (inBatch) addPending(owner, key, sectorAddress(sector) + offset, &rec[RECSTORE_RECORD_HEADER], rec[1]);
+            break;
+        case RECSTORE_VALUE_LAST:
+            if (inBatch && !pendingBroken)
+            {
+                applyPending();
+                indexApply(rec[0], owner, key, sectorAddress(sector) + offset, &rec[RECSTORE_RECORD_HEADER], rec[1]);
+            }
+            else if (inBatch) dropped += numPending + 1;
+            numPending = 0;
+            inBatch = false;
+            break;
+        default: //anything else in the middle of a batch means the batch never finished
+            dropped += numPending;
+            numPending = 0;
+            inBatch = false;
+            indexApply(rec[0], owner, key, sectorAddress(sector) + offset, &rec[RECSTORE_RECORD_HEADER], rec[1]);
+            break;
+        }
+        offset += size;
+    }
+    if (inBatch) dropped += numPending;
+    numPending = 0;
+    if (dropped) Logger::warn("Record store: dropped %u records of unfinished batches in sector %u", dropped, sector);
+
+    //a bad record at the end of the head just gets written over, and so does a batch that never ended
+    if (isHead) headOffset = inBatch ? batchOffset : offset;
+}
+
+//hold back a batch record until the record that ends the batch shows up
+void RecordStore::addPending(uint16_t owner, uint32_t key, uint32_t address, const uint8_t *data, uint8_t len)
+{
+    if (numPending >= RECSTORE_MAX_BATCH)
+    {
+        pendingBroken = true;
+        return;
+    }
+    pending[numPending].owner = owner;
+    pending[numPending].key = key;
+    pending[numPending].address = address;
+    pending[numPending].len = len;
+    memcpy(pending[numPending].value, data, (len < 4) ? len : 4);
+    numPending++;
+}
+
+void RecordStore::applyPending()
+{
+    for (int i = 0; i < numPending; i++)
+    {
+        indexApply(RECSTORE_VALUE, pending[i].owner, pending[i].key, pending[i].address, pending[i].value, pending[i].len);
+    }
+    numPending = 0;
+}
+
+//note where the newest record for owner/key is, or that it was deleted
+void RecordStore::indexApply(uint8_t type, uint16_t owner, uint32_t key, uint32_t address, const uint8_t *data, uint8_t len)
+{
+    IndexEntry *entry = indexFind(owner, key, type != RECSTORE_DELETE);
+    if (!entry)
+    {
+        if (type != RECSTORE_DELETE) Logger::error("Record store index is full! Raise CFG_RECSTORE_INDEX_SIZE");
+        return;
+    }
+    if (type == RECSTORE_DELETE)
+    {
+        entry->address = 0;
+        return;
+    }
+    entry->address = address;
+    entry->len = len;
+    entry->value = 0;
+    memcpy(&entry->value, data, (len < 4) ? len : 4);
+}
+
+//returns the EEPROM address of the value stored for owner/key and its length, or 0 if there isn't one
+uint32_t RecordStore::find(uint16_t owner, uint32_t key, uint8_t *len)
+{
+    IndexEntry *entry = indexFind(owner, key, false);
+    if (!entry || !entry->address) return 0;
+    if (len) *len = entry->len;
+    return entry->address + RECSTORE_RECORD_HEADER;
+}
+
+bool RecordStore::read(uint16_t owner, uint32_t key, void *data, uint8_t len)
+{
+    uint8_t storedLen;
+    uint32_t address = find(owner, key, &storedLen);
+    if (!address || storedLen != len) return false;
+    return memCache->Read(address, data, len);
+}
+
+//true if owner/key already holds exactly this value. Values of 4 bytes or less are checked without touching the EEPROM
+bool RecordStore::matches(uint16_t owner, uint32_t key, const void *data, uint8_t len)
+{
+    uint8_t stored[255];
+    uint32_t value = 0;
+
+    IndexEntry *entry = indexFind(owner, key, false);
+    if (!entry || !entry->address || entry->len != len) return false;
+    if (len <= 4)
+    {
+        memcpy(&value, data, len);
+        return (value == entry->value);
+    }
+    memCache->Read(entry->address + RECSTORE_RECORD_HEADER, stored, len);
+    return !memcmp(stored, data, len);
+}
+
+/*
+ * Store a value. Nothing is written if the value stored already matches so callers can save everything every time.
+ * Set more when this is part of a batch (see beginBatch) and another record of it follows.
+ */
+bool RecordStore::write(uint16_t owner, uint32_t key, const void *data, uint8_t len, bool more)
+{
+    uint8_t type = RECSTORE_VALUE;
+
+    if (!mounted) return false;
+
+    //the last record of a batch always has to go out, it's what makes the rest of the batch count
+    if ((more || !batchPending) && matches(owner, key, data, len))
+    {
+        recordsSkipped++;
+        return true;
+    }
+    if (more) type = batchPending ? RECSTORE_VALUE_MORE : RECSTORE_VALUE_FIRST;
+    else if (batchPending) type = RECSTORE_VALUE_LAST;
+    return append(type, owner, key, data, len);
+}
+
+/*
+ * Start a batch of records that should all count or none of them. size is the total of RECSTORE_RECORD_SIZE()
+ * for every record in it. Making room up front means the whole batch lands in one sector with nothing in between.
+ */
+bool RecordStore::beginBatch(uint16_t size)
+{
+    if (!mounted) return false;
+    if (size > EE_RECORD_SECTOR_SIZE - RECSTORE_SECTOR_HEADER) return false;
+    while (headOffset + size > EE_RECORD_SECTOR_SIZE)
+    {
+        if (!openNextSector()) return false;
+    }
+    batchStart = sectorAddress(headSector) + headOffset;
+    batchPending = false;
+    numPending = 0;
+    pendingBroken = false;
+    return true;
+}
+
+//The batch is done. Get every page it touched written right away, in order
+void RecordStore::endBatch()
+{
+    if (batchPending) //the last record never got written
+    {
+        abortBatch();
+        return;
+    }
+    uint32_t batchEnd = sectorAddress(headSector) + headOffset;
+    if (batchEnd <= batchStart) return;
+    for (uint32_t page = (batchEnd - 1) >> 8; page >= (batchStart >> 8); page--)
+    {
+        memCache->AgeFullyAddress(page << 8);
+    }
+}
+
+/*
+ * Writing the batch failed part way. Its records never made it into the index. Put the head back where
+ * the batch started so the next record goes over the top of it, and end the sector there for now in
+ * case the power goes before that happens. It would be ignored anyway, having no last record.
+ */
+void RecordStore::abortBatch()
+{
+    uint8_t end = 0xFF;
+    uint32_t batchEnd = sectorAddress(headSector) + headOffset;
+
+    if (batchEnd > batchStart && batchStart >= sectorAddress(headSector))
+    {
+        Logger::warn("Record store: batch of %u records abandoned", numPending);
+        memCache->Write(batchStart, end);
+        headOffset = batchStart - sectorAddress(headSector);
+    }
+    batchPending = false;
+    numPending = 0;
+    pendingBroken = false;
+}
+
+bool RecordStore::remove(uint16_t owner, uint32_t key)
+{
+    if (!mounted) return false;
+    IndexEntry *entry = indexFind(owner, key, false);
+    if (!entry || !entry->address) return true; //nothing there to begin with
+    return append(RECSTORE_DELETE, owner, key, NULL, 0);
+}
+
+void RecordStore::removeAll(uint16_t owner)
+{
+    for (int i = 0; i < CFG_RECSTORE_INDEX_SIZE; i++)
+    {
+        if (index[i].used && index[i].owner == owner && index[i].address) remove(owner, index[i].key);
+    }
+}
+
+bool RecordStore::hasRecords(uint16_t owner)
+{
+    for (int i = 0; i < CFG_RECSTORE_INDEX_SIZE; i++)
+    {
+        if (index[i].used && index[i].owner == owner && index[i].address) return true;
+    }
+    return false;
+}
+
+bool RecordStore::append(uint8_t type, uint16_t owner, uint32_t key, const void *data, uint8_t len)
+{
+    uint8_t rec[RECSTORE_RECORD_HEADER + 255 + RECSTORE_RECORD_CRC];
+    uint16_t total = RECSTORE_RECORD_HEADER + len + RECSTORE_RECORD_CRC;
+    uint16_t crc;
+    uint32_t address;
+
+    //get the index slot first. No sense writing a record that couldn't be found again
+    if (!indexFind(owner, key, type != RECSTORE_DELETE))
+    {
+        if (type == RECSTORE_DELETE) return true;
+        Logger::error("Record store index is full! Raise CFG_RECSTORE_INDEX_SIZE");
+        return false;
+    }
+    if ((type == RECSTORE_VALUE_FIRST || type == RECSTORE_VALUE_MORE) && numPending >= RECSTORE_MAX_BATCH)
+    {
+        Logger::error("Record store batch too long");
+        return false;
+    }
+
+    //opening a sector can compact the oldest one which appends too, so check again after
+    while (headOffset + total > EE_RECORD_SECTOR_SIZE)
+    {
+        if (!openNextSector()) return false;
+    }
+
+    rec[0] = type;
+    rec[1] = len;
+    memcpy(&rec[2], &owner, 2);
+    memcpy(&rec[4], &key, 4);
+    if (len) memcpy(&rec[RECSTORE_RECORD_HEADER], data, len);
+    crc = recordCRC(headSeq, rec, RECSTORE_RECORD_HEADER + len);
+    memcpy(&rec[RECSTORE_RECORD_HEADER + len], &crc, 2);
+
+    address = sectorAddress(headSector) + headOffset;
+    if (!memCache->Write(address, rec, total)) return false;
+    headOffset += total;
+    lastRecord = address;
+    lastRecordSize = total;
+    recordsWritten++;
+    batchPending = (type == RECSTORE_VALUE_FIRST || type == RECSTORE_VALUE_MORE);
+
+    //batch records only go into the index once the whole batch is written, same as at mount
+    if (type == RECSTORE_VALUE_FIRST) numPending = 0;
+    if (batchPending) addPending(owner, key, address, (const uint8_t *)data, len);
+    else
+    {
+        if (type == RECSTORE_VALUE_LAST) applyPending();
+        indexApply(type, owner, key, address, (const uint8_t *)data, len);
+    }
+    return true;
+}
+
+/*
+ * Move the head on to the next sector. That sector gets wiped first so nothing left over from the last
+ * time it was used can be mistaken for a record. Then, if that makes too many sectors in use, the oldest
+ * ones are compacted. Copying their live records may well open yet another sector but that one won't
+ * compact anything itself.
+ */
+bool RecordStore::openNextSector()
+{
+    uint8_t next = (headSector + 1) % RECSTORE_NUM_SECTORS;
+    uint8_t blank[256];
+    uint32_t header[2];
+
+    if (sectorInUse[next])
+    {
+        //only happens if the live records don't fit in the whole store
+        Logger::error("Record store is full!");
+        return false;
+    }
+
+    //whole pages at a time so the cache takes them as they are instead of reading the old sector in first
+    memset(blank, 0xFF, sizeof(blank));
+    for (uint32_t offset = 0; offset < EE_RECORD_SECTOR_SIZE; offset += sizeof(blank))
+    {
+        memCache->Write(sectorAddress(next) + offset, blank, sizeof(blank));
+    }
+    header[0] = RECSTORE_MAGIC;
+    header[1] = ++headSeq;
+    memCache->Write(sectorAddress(next), header, RECSTORE_SECTOR_HEADER);
+
+    headSector = next;
+    headOffset = RECSTORE_SECTOR_HEADER;
+    sectorInUse[next] = true;
+    sectorSeq[next] = headSeq;
+    sectorsInUse++;
+    if (tailSector == RECSTORE_NO_SECTOR) tailSector = next;
+
+    if (!compacting)
+    {
+        compacting = true;
+        for (int i = 0; i < RECSTORE_NUM_SECTORS && sectorsInUse > CFG_RECSTORE_WINDOW; i++)
+        {
+            if (tailSector == headSector) break;
+            compactSector(tailSector);
+        }
+        compacting = false;
+    }
+    return true;
+}
+
+//copy the records still in use out of a sector then free it. Deleted and replaced records just go away
+void RecordStore::compactSector(uint8_t sector)
+{
+    uint8_t rec[RECSTORE_RECORD_HEADER + 255 + RECSTORE_RECORD_CRC];
+    uint32_t offset = RECSTORE_SECTOR_HEADER;
+    uint16_t size, owner;
+    uint32_t key;
+    uint32_t copied = 0;
+    IndexEntry *entry;
+
+    while ((size = readRecord(sector, offset, rec)) != 0)
+    {
+        memcpy(&owner, &rec[2], 2);
+        memcpy(&key, &rec[4], 4);
+        entry = indexFind(owner, key, false);
+        if (entry && entry->address == (sectorAddress(sector) + offset))
+        {
+            if (!append(RECSTORE_VALUE, owner, key, &rec[RECSTORE_RECORD_HEADER], rec[1])) return;
+            copied++;
+        }
+        offset += size;
+    }
+    freeSector(sector);
+    compactions++;
+    Logger::debug("Record store compacted sector %u, %u live records moved", sector, copied);
+}
+
+/*
+ * Freeing is a single write to the sector header. The copied records were written to the cache before
+ * it so the MemCache flushes them first and a power cut in between leaves two good copies, not none.
+ */
+void RecordStore::freeSector(uint8_t sector)
+{
+    uint32_t magic = 0;
+    memCache->Write(sectorAddress(sector), magic);
+    sectorInUse[sector] = false;
+    sectorsInUse--;
+    findTail();
+}
+
+void RecordStore::findTail()
+{
+    tailSector = RECSTORE_NO_SECTOR;
+    for (int s = 0; s < RECSTORE_NUM_SECTORS; s++)
+    {
+        if (!sectorInUse[s]) continue;
+        if (tailSector == RECSTORE_NO_SECTOR || sectorSeq[s] < sectorSeq[tailSector]) tailSector = s;
+    }
+}
+
+/*
+ * Normally records reach the EEPROM whenever their page ages out of the cache. This gets the newest
+ * record written right away instead, for things that shouldn't be lost to a power cut.
+ * The page it ends on is aged first so the one it starts on goes out before it.
+ */
+void RecordStore::flushSoon()
+{
+    if (!lastRecordSize) return;
+    memCache->AgeFullyAddress(lastRecord + lastRecordSize - 1);
+    memCache->AgeFullyAddress(lastRecord);
+}
+
+void RecordStore::printStatistics()
+{
+    if (!mounted)
+    {
+        Logger::console("Record store is not mounted");
+        return;
+    }
+    Logger::console("Record store: %u of %u sectors in use, head is sector %u with %u bytes free",
+                    sectorsInUse, RECSTORE_NUM_SECTORS, headSector, EE_RECORD_SECTOR_SIZE - headOffset);
+    Logger::console("%u records written, %u unchanged values not rewritten, %u compactions, %u bad records found",
+                    recordsWritten, recordsSkipped, compactions, badRecords);
+    Logger::console("%u index slots used of %u. Each sector has been started about %u times",
+                    indexCount, CFG_RECSTORE_INDEX_SIZE, headSeq / RECSTORE_NUM_SECTORS);
+}
+
+RecordStore recordStore;
@@ -0,0 +1,166 @@
+/*
+ * RecordStore.h
+ *
+ * An append only, log structured store for small records in EEPROM. Device settings and the
+ * fault log live here. Every record carries its own CRC so a write torn by a power cut only loses
+ * that one record, never the ones around it. Writes are spread over the whole store instead of
+ * rewriting the same page in place so the EEPROM lasts a lot longer.
+ *
+Copyright (c) 2022 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef RECORD_STORE_H_
+#define RECORD_STORE_H_
+
+#include <Arduino.h>
+#include <FastCRC.h>
+#include "config.h"
+#include "eeprom_layout.h"
+#include "MemCache.h"
+
+/*
+Layout:
+The store is split into sectors of EE_RECORD_SECTOR_SIZE bytes. A sector in use starts with
+    magic (uint32, RECSTORE_MAGIC), sequence (uint32)
+where the sequence goes up by one every time a new sector is started. Anything else in the
+magic field means the sector is free. After the header come records, packed one after another:
+    type (uint8), len (uint8), owner (uint16), key (uint32), data[len], crc (uint16)
+The CRC (CRC16 XMODEM) covers the sector sequence and then the record from type to the end of
+the data. Mixing in the sequence means leftovers from the last time a sector was used never
+check out. Records never cross a sector boundary. The first byte that isn't a record type ends
+the sector.
+
+A batch of records that must all count or none of them is written as one RECSTORE_VALUE_FIRST record,
+RECSTORE_VALUE_MORE records and one RECSTORE_VALUE_LAST record. None of it counts unless the LAST record
+made it. Any other record that turns up before it means the batch was cut short. A batch that never
+ended is always the end of the head sector and the next record written goes over the top of it.
+
+The newest record for an (owner, key) pair is the live one. A RECSTORE_DELETE record says the
+pair has no value any more. New records go to the head sector. When it fills the next sector
+in line becomes the head, so all sectors get used in turn. Once more than CFG_RECSTORE_WINDOW
+sectors are in use the oldest one is compacted - its live records are copied to the head and
+it is freed. Everything is little endian.
+*/
+
+#define RECSTORE_MAGIC          0x53525647 //"GVRS"
+#define RECSTORE_NUM_SECTORS    (EE_RECORD_STORE_SIZE / EE_RECORD_SECTOR_SIZE)
+#define RECSTORE_SECTOR_HEADER  8
+#define RECSTORE_RECORD_HEADER  8
+#define RECSTORE_RECORD_CRC     2
+
+#define RECSTORE_RECORD_SIZE(len) (RECSTORE_RECORD_HEADER + (len) + RECSTORE_RECORD_CRC)
+
+#define RECSTORE_VALUE          0xA5
+#define RECSTORE_VALUE_MORE     0xA6 //a value in the middle of a batch
+#define RECSTORE_VALUE_FIRST    0xA7 //the value that starts a batch
+#define RECSTORE_VALUE_LAST     0xA8 //the value that ends a batch and makes the rest of it count
+#define RECSTORE_DELETE         0x5A
+
+#define RECSTORE_MAX_BATCH      64 //most records a single batch can have
+
+#define RECSTORE_NO_SECTOR      0xFF
+
+class RecordStore
+{
+public:
+    RecordStore();
+    void mount();
+    inline bool isMounted() { return mounted; }
+    inline bool wasFormatted() { return formatted; }
+    uint32_t find(uint16_t owner, uint32_t key, uint8_t *len);
+    bool read(uint16_t owner, uint32_t key, void *data, uint8_t len);
+    bool write(uint16_t owner, uint32_t key, const void *data, uint8_t len, bool more = false);
+    bool matches(uint16_t owner, uint32_t key, const void *data, uint8_t len);
+    bool beginBatch(uint16_t size);
+    void endBatch();
+    void abortBatch();
+    bool remove(uint16_t owner, uint32_t key);
+    void removeAll(uint16_t owner);
+    bool hasRecords(uint16_t owner);
+    void flushSoon();
+    void printStatistics();
+
+private:
+    struct IndexEntry
+    {
+        uint32_t key;
+        uint32_t address; //EEPROM address of the record (not its data). 0 if the record was deleted
+        uint32_t value; //small values (4 bytes or less) are kept here too so unchanged writes can be spotted quickly
+        uint16_t owner;
+        uint8_t len;
+        bool used;
+    };
+
+    //batch records waiting for the end of their batch, during mount and while a batch is being written
+    struct PendingRecord
+    {
+        uint32_t key;
+        uint32_t address;
+        uint16_t owner;
+        uint8_t len;
+        uint8_t value[4];
+    };
+
+    IndexEntry index[CFG_RECSTORE_INDEX_SIZE];
+    uint32_t sectorSeq[RECSTORE_NUM_SECTORS];
+    bool sectorInUse[RECSTORE_NUM_SECTORS];
+    uint8_t headSector;
+    uint8_t tailSector; //oldest sector in use, the next one to be compacted
+    uint8_t sectorsInUse;
+    uint32_t headOffset; //where the next record goes within the head sector
+    uint32_t headSeq;
+    uint32_t lastRecord; //EEPROM address and size of the newest record
+    uint16_t lastRecordSize;
+    uint32_t batchStart; //address of the first record of the current batch
+    bool batchPending; //the last record written was a RECSTORE_VALUE_FIRST or _MORE
+    PendingRecord pending[RECSTORE_MAX_BATCH];
+    uint8_t numPending;
+    bool pendingBroken; //a record of the batch didn't fit in pending so the batch can't count
+    uint16_t indexCount;
+    bool mounted;
+    bool formatted;
+    bool compacting;
+    uint32_t recordsWritten;
+    uint32_t recordsSkipped; //writes that didn't need to happen because the value was already stored
+    uint32_t compactions;
+    uint32_t badRecords;
+    FastCRC16 crc16;
+
+    IndexEntry *indexFind(uint16_t owner, uint32_t key, bool create);
+    void indexApply(uint8_t type, uint16_t owner, uint32_t key, uint32_t address, const uint8_t *data, uint8_t len);
+    void addPending(uint16_t owner, uint32_t key, uint32_t address, const uint8_t *data, uint8_t len);
+    void applyPending();
+    inline uint32_t sectorAddress(uint8_t sector) { return EE_RECORD_STORE + ((uint32_t)sector * EE_RECORD_SECTOR_SIZE); }
+    uint16_t recordCRC(uint32_t seq, const uint8_t *record, uint16_t len);
+    uint16_t readRecord(uint8_t sector, uint32_t offset, uint8_t *rec);
+    bool append(uint8_t type, uint16_t owner, uint32_t key, const void *data, uint8_t len);
+    bool openNextSector();
+    void freeSector(uint8_t sector);
+    void scanSector(uint8_t sector, bool isHead);
+    void compactSector(uint8_t sector);
+    void findTail();
+};
+
+extern RecordStore recordStore;
+
+#endif /* RECORD_STORE_H_ */
@@ -26,6 +26,10 @@
 
 #include "SerialConsole.h"
 #include <ArduinoJson.h>
+#include "CanRecorder.h"
+#include "RecordStore.h"
+#include "FaultHandler.h"
+#include "DeviceStartup.h"
 
 template<class T> inline Print &operator <<(Print &obj, T arg) { obj.print(arg); return obj; } //Lets us stream SerialUSB
 
@@ -193,75 +197,23 @@ void SerialConsole::updateSetting(const char *settingName, char *valu)
 {
     Device *deviceMatched;
     const ConfigEntry *entry = deviceManager.findConfigEntry(settingName, &deviceMatched);
-    uint8_t ui8;
-    float fl;
-    int16_t i16;
-    int32_t i32;
-    uint16_t ui16;
-    uint32_t ui32;
-
-    int result = 0;
+
     if (!entry)
     {
         Logger::console("No such configuration parameter exists!");
         return;
     }
-    switch (entry->varType)
-    {
-    case CFG_ENTRY_VAR_TYPE::BYTE:
-        ui8 = (uint8_t)strtol(valu, NULL, 0);
-        if (ui8 < entry->minValue.u_int) result = 1;
-        else if (ui8 > entry->maxValue.u_int) result = 2;
-        else *(uint8_t *)entry->varPtr = ui8;
-        break;
-    case CFG_ENTRY_VAR_TYPE::FLOAT:
-        fl = strtof(valu, NULL);
-        if (fl < entry->minValue.floating) result = 1;
-        else if (fl > entry->maxValue.floating) result = 2;
-        else *(float *)entry->varPtr = fl;
-        break;
-    case CFG_ENTRY_VAR_TYPE::INT16:
-        i16 = (int16_t)strtol(valu, NULL, 0);
-        if (i16 < entry->minValue.s_int) result = 1;
-        else if (i16 > entry->maxValue.s_int) result = 2;
-        else *(int16_t *)entry->varPtr = i16;
-        break;
-    case CFG_ENTRY_VAR_TYPE::INT32:
-        i32 = (int32_t)strtol(valu, NULL, 0);
-        if (i32 < entry->minValue.s_int) result = 1;
-        else if (i32 > entry->maxValue.s_int) result = 2;
-        else *(int32_t *)entry->varPtr = i32;
-        break;
-    case CFG_ENTRY_VAR_TYPE::STRING:
-        //this is an interesting one. It's easy in principle but we don't know
-        //the actual size of the storage buffer so it could overwrite memory.
-        //If this GEVCU thing gets popular it might be necessary to fix this
-        //otherwise this is the entry point to smashing the stack for fun and profit.
-        strcpy((char *)entry->varPtr, valu);
-        break;
-    case CFG_ENTRY_VAR_TYPE::UINT16:
-        ui16 = (uint16_t)strtol(valu, NULL, 0);
-        if (ui16 < entry->minValue.u_int) result = 1;
-        else if (ui16 > entry->maxValue.u_int) result = 2;
-        else *(uint16_t *)entry->varPtr = ui16;
-        break;
-    case CFG_ENTRY_VAR_TYPE::UINT32:
-        ui32 = (uint32_t)strtol(valu, NULL, 0);
-        if (ui32 < entry->minValue.u_int) result = 1;
-        else if (ui32 > entry->maxValue.u_int) result = 2;
-        else *(uint32_t *)entry->varPtr = ui32;
-        break;
-    }
-    if (result == 0) //value was stored
+    int result = deviceMatched->setConfigValue(entry, valu);
+    if (result == CFG_VALUE_SET)
     {
         Logger::console("%s was set as value for parameter %s", valu, settingName);
-        deviceMatched->saveConfiguration();
+        deviceMatched->commitConfiguration();
     }
-    if (result == 1) //value was too low
+    if (result == CFG_VALUE_TOO_LOW)
     {
         Logger::console("Value was below minimum value of %f for parameter %s", entry->minValue, settingName);
     }
-    if (result == 2) //value was too high
+    if (result == CFG_VALUE_TOO_HIGH)
     {
         Logger::console("Value was above maximum value of %f for parameter %s", entry->maxValue, settingName);
     }
@@ -290,6 +242,8 @@ void SerialConsole::printMenu() {
     Logger::console("   JSONDUMP=1 - Read config of every enabled device and store it in JSON format to sdcard");
     Logger::console("   JSONREAD=1 - Read JSON file from sdCard and update all devices accordingly");
     Logger::console("   NUKE=1 - Resets all device settings in EEPROM. You have been warned.");
+    Logger::console("   M = show EEPROM cache, record store and fault handler statistics");
+    Logger::console("   S = show device startup order and timing");
 
     deviceManager.printDeviceList();
 
@@ -321,6 +275,15 @@ void SerialConsole::printMenu() {
         Logger::console("   L = show raw analog/digital input/output values (toggle)");
     }
     Logger::console("   OUTPUT=<0-7> - toggles state of specified digital output");
+
+    Logger::console("\nCAN BUSES\n");
+    Logger::console("   C = show CAN bus statistics");
+    Logger::console("   CANREC=<0/1> - stop/start recording all CAN traffic to sdcard (CANxxxxx.BIN)");
+#ifdef CFG_TICK_PROFILING
+    Logger::console("\nPROFILING\n");
+    Logger::console("   T = show handleTick() execution time and latency for every device");
+    Logger::console("   t = reset tick profiling statistics");
+#endif
 }
 
 /*	There is a help menu (press H or h or ?)
@@ -448,6 +411,9 @@ void SerialConsole::handleConfigCmd() {
             memCache->nukeFromOrbit(); //then completely erase EEPROM
             Logger::console("Device settings have been nuked. Reboot to reload default settings");
         }
+    } else if (cmdString == String("CANREC")) {
+        if (newValue == 1) canRecorder.start();
+        else canRecorder.stop();
     } else if (cmdString == String("DUMP")) {
         if (newValue == 1) {
             generateEEPROMBinary();
@@ -517,7 +483,7 @@ void SerialConsole::handleShortCmd() {
         break;
     case 'Z': // save throttle settings
         if (accelerator) {
-            accelerator->saveConfiguration();
+            accelerator->commitConfiguration();
         }
         break;
     case 'b':
@@ -528,7 +494,7 @@ void SerialConsole::handleShortCmd() {
         break;
     case 'B':
         if (brake != NULL) {
-            brake->saveConfiguration();
+            brake->commitConfiguration();
         }
         break;
     
@@ -537,12 +503,32 @@ void SerialConsole::handleShortCmd() {
         {
             systemIO.calibrateADCOffset(i, true);
         }        
-        sysDev->saveConfiguration();
+        sysDev->commitConfiguration();
         systemIO.setup_ADC_params(); //change takes immediate effect
         break;
     case 'a':
         //deviceManager.sendMessage(DEVICE_ANY, ADABLUE, 0xDEADBEEF, nullptr);
         break;
+    case 'C':
+        printCanStats();
+        break;
+    case 'M':
+        memCache->printStatistics();
+        recordStore.printStatistics();
+        faultHandler.printStatistics();
+        break;
+    case 'S':
+        deviceStartup.printStatus();
+        break;
+#ifdef CFG_TICK_PROFILING
+    case 'T':
+        tickHandler.printProfile();
+        break;
+    case 't':
+        tickHandler.resetProfile();
+        Logger::console("Tick profiling statistics reset");
+        break;
+#endif
     case 'q':
         PrefHandler::dumpDeviceTable();
         break;
@@ -552,6 +538,38 @@ void SerialConsole::handleShortCmd() {
     }
 }
 
+void SerialConsole::printCanStats()
+{
+    CanHandler *buses[3] = {&canHandlerBus0, &canHandlerBus1, &canHandlerBus2};
+    for (int i = 0; i < 3; i++)
+    {
+        Logger::console("CAN%i: %u frames/sec, %u frames total, rx queue high water %u, rx overflows %u", i,
+                        buses[i]->getFramesPerSecond(), buses[i]->getFrameCount(),
+                        buses[i]->getRxQueueHighWater(), buses[i]->getRxOverflowCount());
+        if (buses[i]->getNumHardwareFilters() < 0) Logger::console("      hardware filters: accepting all traffic");
+        else Logger::console("      hardware filters: %i in use", buses[i]->getNumHardwareFilters());
+        Logger::console("      tx queue %u deep (high water %u), %u frames waited avg %uus max %uus, %u stale, %u replaced, %u lost to a full queue",
+                        buses[i]->getTxQueueDepth(), buses[i]->getTxQueueHighWater(), buses[i]->getTxQueuedCount(),
+                        buses[i]->getTxLatencyAverage(), buses[i]->getTxLatencyMax(), buses[i]->getTxStaleCount(),
+                        buses[i]->getTxSupersededCount(), buses[i]->getTxFailedCount());
+        CanHandler::PeriodicStats periodic;
+        for (int slot = 0; slot < CFG_CAN_PERIODIC_SLOTS; slot++)
+        {
+            if (!buses[i]->getPeriodicStats(slot, periodic)) continue;
+            Logger::console("      periodic %X every %uus: %u sent, %u missed, %u retries, %u withheld, jitter avg %uus max %uus",
+                            periodic.id, periodic.period, periodic.sent, periodic.missed, periodic.retries, periodic.withheld,
+                            periodic.jitterAverage, periodic.jitterMax);
+        }
+    }
+    Logger::console("GVRET frames dropped (USB not keeping up): %u", CanHandler::getGVRETDropCount());
+    if (canRecorder.isRecording())
+    {
+        Logger::console("Recording to CAN%05u.BIN: %u frames recorded, %u dropped (sdCard not keeping up)",
+                        canRecorder.getFileNumber(), canRecorder.getRecordedFrames(), canRecorder.getDroppedFrames());
+    }
+    else Logger::console("CAN recorder is idle");
+}
+
 void SerialConsole::generateEEPROMBinary()
 {
     // Open or create file - truncate existing file.
@@ -676,9 +694,9 @@ void SerialConsole::loadEEPROMJSON()
         JsonObject devObjs = obj.value().as<JsonObject>();
         uint16_t id = devObjs["DevID"];
         Serial.printf("Name: %s ID: %x\n", obj.key().c_str(), id);
+        Device *dev = deviceManager.getDeviceByID(id);
         for (auto devObj: devObjs) //get all the paramaters of the current device
         {
-            Device *dev = deviceManager.getDeviceByID(id);
             if (dev)
             {
                 const ConfigEntry *cfgEntry = dev->findConfigEntry(devObj.key().c_str());
@@ -713,6 +731,7 @@ void SerialConsole::loadEEPROMJSON()
                 }
             }
         }
+        if (dev) dev->commitConfiguration(); //only the settings that changed get written
     }
     Logger::console("Finished importing settings from JSON");
 }
@@ -3,10 +3,10 @@
  *
  * Class to which TickObserver objects can register to be triggered
  * on a certain interval.
- * TickObserver with the same interval are grouped to the same timer
- * and triggered in sequence per timer interrupt.
+ * One hardware timer drives a hierarchical timer wheel. Every attach() gets its own
+ * entry in the wheel so any number of observers and intervals can be registered.
  *
- * NOTE: The initialize() method must be called before a observer is registered !
+ * NOTE: The setup() method must be called before a observer is registered !
  *
  Copyright (c) 2021 Collin Kidder, Michael Neuweiler, Charles Galpin
 
@@ -32,237 +32,491 @@
  */
 
 #include "TickHandler.h"
+#include "DeviceManager.h"
+#include "CrashHandler.h"
 
-int timer;
-//we're using up to 9 timers and they are defined here so that they can
-//explicitly be set to the various hardware timers. This is used to spread out
-//which timers are used and to allow a wide range of max durations
-PeriodicTimer t1(GPT1); //[178.95697s max interval]
-PeriodicTimer t2(GPT2); //[178.95697s]
-PeriodicTimer t3(TMR4); //[55.922ms] - First three timers have PWM pins on them
-PeriodicTimer t4(TMR4); //[55.922ms] - However, GEVCU7 doesn't really do PWM so it might be OK if necessary
-PeriodicTimer t5(PIT);  //[178.95697s] - technically PIT has 4 channels but they all share an interrupt.
-PeriodicTimer t6(PIT);  //[178.95697s] - But that's handled in the library. We can actually register
-PeriodicTimer t7(PIT);  //[178.95697s] - different handlers for each timer.
-PeriodicTimer t8(PIT);  //[178.95697s]
-PeriodicTimer t9(TCK);  //[5s] these TCK timers can be efficient cycle-wise but
-PeriodicTimer t10(TCK);  //[5s] they require that the yield() function is called
-PeriodicTimer t11(TCK);  //[5s] which makes them sensitive to long running tasks
-PeriodicTimer t12(TCK);  //[5s] on the main execution thread. So, they're used last
-
-void timerTrampoline(int tim) {
-    tickHandler.handleInterrupt(tim);
+//the base tick used to be spread over 12 separate hardware timers, one per interval. Now there's
+//only the one. GPT1 has a 32 bit counter so it has no trouble with any sane base tick.
+static void timerTrampoline() {
+    tickHandler.handleInterrupt();
 }
 
-void emptyTimerInt()
-{
-
-}
-
-TickHandler::TickHandler() {
-    timers[0] = &t1;
-    timers[1] = &t2;
-    timers[2] = &t3;
-    timers[3] = &t4;
-    timers[4] = &t5;
-    timers[5] = &t6;
-    timers[6] = &t7;
-    timers[7] = &t8;
-    timers[8] = &t9;
-    timers[9] = &t10;
-    timers[10] = &t11;
-    timers[11] = &t12;
-
-    for (int i = 0; i < NUM_TIMERS; i++) {
-        timerEntry[i].interval = 0;
-        for (int j = 0; j < CFG_TIMER_NUM_OBSERVERS; j++) {
-            timerEntry[i].observer[j] = NULL;
-        }
+TickHandler::TickHandler() : baseTimer(GPT1) {
+    for (int i = 0; i < TICK_WHEEL_L0_SIZE; i++) wheel0[i].head = NULL;
+    for (int level = 0; level < TICK_WHEEL_LEVELS - 1; level++) {
+        for (int i = 0; i < TICK_WHEEL_LN_SIZE; i++) wheelN[level][i].head = NULL;
+    }
+    for (int prio = 0; prio < TICK_NUM_PRIORITIES; prio++) pendingList[prio] = NULL;
+    freeTimers = NULL;
+    baseTicks = 0;
+    baseTickCycles = 0;
+    wheelTime = 1; //base tick 1 is the first one the interrupt produces
+    numTimers = 0;
+    coalescedTicks = 0;
+    missedDeadlines = 0;
+#ifdef CFG_TICK_PROFILING
+    for (int i = 0; i < CFG_TICK_NUM_PROFILES; i++)
+    {
+        profiles[i].observer = NULL;
+        clearProfile(profiles[i]);
     }
-#ifdef CFG_TIMER_USE_QUEUING
-    bufferHead = bufferTail = 0;
 #endif
 }
 
 void TickHandler::setup()
 {
-    for (int i = 0; i < NUM_TIMERS; i++)
-    {
-        timers[i]->begin(emptyTimerInt, 100000, false); //the last param false means "don't start it"
-        timerEntry[i].maxInterval = (uint64_t)(timers[i]->getMaxPeriod() * 1000000.0); //getMaxPeriod returns value in seconds
-        //Logger::console("Timer %i max interval is: %lu", i, timerEntry[i].maxInterval);
-        timers[i]->stop(); //don't keep idle timers running
-    }
+    baseTimer.begin(timerTrampoline, CFG_TIMER_BASE_TICK);
 }
 
 /**
  * Register an observer to be triggered in a certain interval.
- * TickObservers with the same interval are grouped to one timer to save timers.
+ * The interval is rounded to the nearest multiple of CFG_TIMER_BASE_TICK.
  * A TickObserver may be registered multiple times with different intervals.
  *
- * First a timer with the same interval is looked up. If none found, a free one is
- * used. Then a free TickObserver slot (of max CFG_MAX_TICK_OBSERVERS) is looked up. If all went
- * well, the timer is configured and (re)started.
+ * Observers with the same interval are spread out over that interval instead of
+ * all coming due on the same base tick.
  */
 void TickHandler::attach(TickObserver* observer, uint32_t interval) {
-    timer = findTimer(interval);
-    if (timer == -1) {
-        timer = findFreeTimer(interval);	// no timer with given tick interval exist -> look for unused (interval == 0)
-        if (timer == -1) {
-            Logger::error("No free timer available for interval=%d", interval);
-            return;
-        }
-        timerEntry[timer].interval = interval;
-    }
+    TickTimer *timer = freeTimers;
+    if (timer) freeTimers = timer->next;
+    else timer = new TickTimer;
 
-    int observerIndex = findObserver(timer, 0);
-    if (observerIndex == -1) {
-        Logger::error("No free observer slot for timer %d with interval %d", timer, timerEntry[timer].interval);
-        return;
-    }
-    timerEntry[timer].observer[observerIndex] = observer;
-    Logger::debug("attached TickObserver (%X) as number %d to timer %d, %dus interval", observer, observerIndex, timer, interval);
-    //I might be dumb but using a line like:
-    // timers[timer]->beginPeriodic([timer]() { timerTrampoline(timer); }, interval);
-    // doesn't work. Instead the value passed by the lambda function ends up always being the last timer you made
-    // instead of each timer passing its own number. This is likely a failure of syntax on my part.
-    // This switch construct works around my ignorance. Anyone seeing this who knows C++ lambda functions
-    // better than I apparently do is free to correct the syntax and shrink this down to one line again.
-    switch (timer)
-    {
-    case 0:
-        timers[0]->begin([]() { timerTrampoline(0); }, interval);
-        break;
-    case 1:
-        timers[1]->begin([]() { timerTrampoline(1); }, interval);
-        break;
-    case 2:
-        timers[2]->begin([]() { timerTrampoline(2); }, interval);
-        break;
-    case 3:
-        timers[3]->begin([]() { timerTrampoline(3); }, interval);
-        break;
-    case 4:
-        timers[4]->begin([]() { timerTrampoline(4); }, interval);
-        break;
-    case 5:
-        timers[5]->begin([]() { timerTrampoline(5); }, interval);
-        break;
-    case 6:
-        timers[6]->begin([]() { timerTrampoline(6); }, interval);
-        break;
-    case 7:
-        timers[7]->begin([]() { timerTrampoline(7); }, interval);
-        break;
-    case 8:
-        timers[8]->begin([]() { timerTrampoline(8); }, interval);
-        break;
-    case 9:
-        timers[9]->begin([]() { timerTrampoline(9); }, interval);
-        break;
-    case 10:
-        timers[10]->begin([]() { timerTrampoline(10); }, interval);
-        break;
-    case 11:
-        timers[11]->begin([]() { timerTrampoline(11); }, interval);
-        break;
-    }
+    timer->observer = observer;
+    timer->interval = interval;
+    timer->periodTicks = (interval + CFG_TIMER_BASE_TICK / 2) / CFG_TIMER_BASE_TICK;
+    if (timer->periodTicks == 0) timer->periodTicks = 1;
+    timer->pending = false;
+    timer->nextPending = NULL;
+    timer->priority = observer->getTickPriority();
+#ifdef CFG_TICK_PROFILING
+    timer->profile = allocateProfile(observer, interval);
+#else
+    timer->profile = 0xFF;
+#endif
+
+    uint32_t offset = staggerOffset(interval, timer->periodTicks);
+    //the timer interrupt walks the wheel too (non-queuing mode) so it's changed with interrupts off
+    uint32_t primask = disableInterrupts();
+    timer->expires = wheelTime + offset;
+    insertTimer(timer);
+    numTimers++;
+    restoreInterrupts(primask);
+
+    Logger::debug("attached TickObserver (%X), %dus interval, priority %d, first tick in %d base ticks", observer, interval,
+                  timer->priority, offset);
 }
 
 /**
- * Remove an observer from all timers where it was registered.
+ * Remove an observer from all intervals it was registered with.
  */
 void TickHandler::detach(TickObserver* observer) {
-    for (int timer = 0; timer < NUM_TIMERS; timer++) {
-        for (int observerIndex = 0; observerIndex < CFG_TIMER_NUM_OBSERVERS; observerIndex++) {
-            if (timerEntry[timer].observer[observerIndex] == observer) {
-                Logger::debug("removing TickObserver (%X) as number %d from timer %d", observer, observerIndex, timer);
-                timerEntry[timer].observer[observerIndex] = NULL;
-                timers[timer]->stop();
+    int removed = 0;
+    uint32_t primask = disableInterrupts();
+    for (int level = 0; level < TICK_WHEEL_LEVELS; level++) {
+        int size = (level == 0) ? TICK_WHEEL_L0_SIZE : TICK_WHEEL_LN_SIZE;
+        for (int i = 0; i < size; i++) {
+            TickTimer *timer = (level == 0) ? wheel0[i].head : wheelN[level - 1][i].head;
+            while (timer) {
+                TickTimer *next = timer->next;
+                if (timer->observer == observer) {
+                    removeTimer(timer);
+                    //a pending tick for it is dropped too. Its list link is the only thing left pointing at it
+                    if (timer->pending) {
+                        TickTimer **link = &pendingList[timer->priority];
+                        while (*link && *link != timer) link = &(*link)->nextPending;
+                        if (*link) *link = timer->nextPending;
+                    }
+#ifdef CFG_TICK_PROFILING
+                    if (timer->profile != 0xFF) profiles[timer->profile].observer = NULL;
+#endif
+                    timer->observer = NULL;
+                    timer->next = freeTimers;
+                    freeTimers = timer;
+                    numTimers--;
+                    removed++;
+                }
+                timer = next;
             }
         }
     }
+    restoreInterrupts(primask);
+    if (removed) Logger::debug("removed TickObserver (%X) from %d interval(s)", observer, removed);
 }
 
-/**
- * Find a timer with a specified interval.
+/*
+ * Spread observers with the same interval over that interval so they don't all run on the
+ * same base tick. Each new one goes a golden ratio step further around, which keeps them
+ * roughly evenly spaced however many there end up being.
  */
-int TickHandler::findTimer(long interval) {
-    for (int i = 0; i < NUM_TIMERS; i++)
-    {
-        if (timerEntry[i].interval == interval)
-            return i;
+uint32_t TickHandler::staggerOffset(uint32_t interval, uint32_t periodTicks) {
+    uint32_t sameInterval = 0;
+    for (int level = 0; level < TICK_WHEEL_LEVELS; level++) {
+        int size = (level == 0) ? TICK_WHEEL_L0_SIZE : TICK_WHEEL_LN_SIZE;
+        for (int i = 0; i < size; i++) {
+            for (TickTimer *timer = (level == 0) ? wheel0[i].head : wheelN[level - 1][i].head; timer; timer = timer->next) {
+                if (timer->interval == interval) sameInterval++;
+            }
+        }
     }
-    return -1;
+    return 1 + (uint32_t)(((uint64_t)sameInterval * periodTicks * 40503u) >> 16) % periodTicks;
 }
 
-//find a free slot that supports the requested interval
-//does not currently do anything about potential for a timer
-//to be a crappy resolution for a given interval. For instance,
-//a timer that supports 1000 days is probably not the same timer
-//that would be best to handle a 10ms interval. But, the library
-//doesn't really expose a minimum granularity for each timer...
-int TickHandler::findFreeTimer(uint64_t interval)
-{
-    for (int i = 0; i < NUM_TIMERS; i++)
-    {
-        //find empty timer entry
-        if (timerEntry[i].interval == 0)
-        {
-            //check to see if this timer supports the interval length we're asking for
-            if (interval <= timerEntry[i].maxInterval) return i;
+/*
+ * Put a timer in the wheel slot for its expiry time. The further away it is the higher the level.
+ * Anything already due goes in the very next slot.
+ */
+void TickHandler::insertTimer(TickTimer *timer) {
+    int32_t delta = (int32_t)(timer->expires - wheelTime);
+    WheelSlot *slot;
+    if (delta < 0) {
+        slot = &wheel0[wheelTime & (TICK_WHEEL_L0_SIZE - 1)];
+    }
+    else if (delta < TICK_WHEEL_L0_SIZE) {
+        slot = &wheel0[timer->expires & (TICK_WHEEL_L0_SIZE - 1)];
+    }
+    else {
+        int level;
+        uint32_t expires = timer->expires;
+        for (level = 1; level < TICK_WHEEL_LEVELS; level++) {
+            if ((uint32_t)delta < (1ul << (TICK_WHEEL_L0_BITS + level * TICK_WHEEL_LN_BITS))) break;
+        }
+        if (level == TICK_WHEEL_LEVELS) {
+            //beyond the top of the wheel. Park it as far out as possible, it gets re-sorted when that slot cascades
+            level = TICK_WHEEL_LEVELS - 1;
+            expires = wheelTime + (1ul << (TICK_WHEEL_L0_BITS + level * TICK_WHEEL_LN_BITS)) - 1;
         }
+        int shift = TICK_WHEEL_L0_BITS + (level - 1) * TICK_WHEEL_LN_BITS;
+        slot = &wheelN[level - 1][(expires >> shift) & (TICK_WHEEL_LN_SIZE - 1)];
+    }
+    timer->prev = NULL;
+    timer->next = slot->head;
+    if (slot->head) slot->head->prev = timer;
+    slot->head = timer;
+    timer->slot = slot;
+}
+
+void TickHandler::removeTimer(TickTimer *timer) {
+    if (timer->next) timer->next->prev = timer->prev;
+    if (timer->prev) timer->prev->next = timer->next;
+    else timer->slot->head = timer->next;
+    timer->slot = NULL;
+}
+
+//move everything in one upper level slot down to wherever it belongs now
+void TickHandler::cascade(int level, int index) {
+    TickTimer *timer = wheelN[level - 1][index].head;
+    wheelN[level - 1][index].head = NULL;
+    while (timer) {
+        TickTimer *next = timer->next;
+        insertTimer(timer);
+        timer = next;
     }
-    return -1;
 }
 
 /*
- * Find a TickObserver in the list of a specific timer.
+ * Process one base tick. Cascade upper levels if this tick starts a new round of the one below,
+ * then everything in the current level 0 slot is due. Due timers go on the pending list for their
+ * priority and get rescheduled one period later so they never drift.
  */
-int TickHandler::findObserver(int timer, TickObserver *observer) {
-    for (int i = 0; i < CFG_TIMER_NUM_OBSERVERS; i++) {
-        if (timerEntry[timer].observer[i] == observer)
-            return i;
+void TickHandler::advanceWheel() {
+    uint32_t now = wheelTime;
+    int index = now & (TICK_WHEEL_L0_SIZE - 1);
+    if (index == 0) {
+        for (int level = 1; level < TICK_WHEEL_LEVELS; level++) {
+            int shift = TICK_WHEEL_L0_BITS + (level - 1) * TICK_WHEEL_LN_BITS;
+            int upper = (now >> shift) & (TICK_WHEEL_LN_SIZE - 1);
+            cascade(level, upper);
+            if (upper != 0) break;
+        }
+    }
+
+    //when the main loop falls behind this runs for ticks in the past. Work out when that tick really happened
+    uint32_t dueCycles = baseTickCycles - (baseTicks - now) * (F_CPU_ACTUAL / 1000000) * CFG_TIMER_BASE_TICK;
+
+    TickTimer *timer = wheel0[index].head;
+    wheel0[index].head = NULL;
+    wheelTime = now + 1;
+    while (timer) {
+        TickTimer *next = timer->next;
+        if (timer->pending) {
+            //still hasn't run since last time. Don't queue it twice, it'll just run once late
+            coalescedTicks++;
+#ifdef CFG_TICK_PROFILING
+            if (timer->profile != 0xFF) profiles[timer->profile].coalesced++;
+#endif
+        }
+        else {
+            timer->pending = true;
+            timer->queuedAt = dueCycles;
+            timer->nextPending = pendingList[timer->priority];
+            pendingList[timer->priority] = timer;
+        }
+        timer->expires += timer->periodTicks;
+        insertTimer(timer);
+        timer = next;
+    }
+}
+
+/*
+ * Take the pending tick that should run next off its list. Highest priority class first and
+ * within that the one with the least time left until (or most time past) its deadline.
+ */
+TickHandler::TickTimer *TickHandler::takeNextPending() {
+    uint32_t now = ARM_DWT_CYCCNT;
+    uint32_t cyclesPerMicro = F_CPU_ACTUAL / 1000000;
+    for (int prio = 0; prio < TICK_NUM_PRIORITIES; prio++) {
+        TickTimer **bestLink = NULL;
+        int32_t bestSlack = 0;
+        for (TickTimer **link = &pendingList[prio]; *link; link = &(*link)->nextPending) {
+            int32_t age = (now - (*link)->queuedAt) / cyclesPerMicro;
+            int32_t slack = (int32_t)(*link)->interval - age;
+            if (!bestLink || slack < bestSlack) {
+                bestLink = link;
+                bestSlack = slack;
+            }
+        }
+        if (bestLink) {
+            TickTimer *timer = *bestLink;
+            *bestLink = timer->nextPending;
+            timer->nextPending = NULL;
+            timer->pending = false;
+            return timer;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run pending ticks, most important first. The choice is made again after every tick
+ * so a critical tick that comes due while something else runs goes next.
+ */
+void TickHandler::runPending() {
+    TickTimer *timer;
+    uint32_t cyclesPerMicro = F_CPU_ACTUAL / 1000000;
+    while (true) {
+        //catch the wheel up to the hardware timer before picking what runs next
+        while ((int32_t)(baseTicks - wheelTime) >= 0) advanceWheel();
+        timer = takeNextPending();
+        if (!timer) break;
+
+        TickObserver *observer = timer->observer;
+        uint32_t queuedAt = timer->queuedAt;
+        uint32_t start = ARM_DWT_CYCCNT;
+        bool late = ((start - queuedAt) / cyclesPerMicro) > timer->interval;
+        if (late) missedDeadlines++;
+        crashHandler.tickStarted(observer);
+        observer->handleTick();
+        crashHandler.tickFinished();
+#ifdef CFG_TICK_PROFILING
+        if (late && timer->profile != 0xFF) profiles[timer->profile].missedDeadlines++;
+        recordTick(timer->profile, start - queuedAt, ARM_DWT_CYCCNT - start);
+#endif
     }
-    return -1;
 }
 
 #ifdef CFG_TIMER_USE_QUEUING
 /*
- * Check if a tick is available, forward it to registered observers.
+ * Called from the main loop. All the wheel work and every handleTick() happens here,
+ * the interrupt only counts base ticks.
  */
 void TickHandler::process() {
-    while (bufferHead != bufferTail) {
-        tickBuffer[bufferTail]->handleTick();
-        bufferTail = (bufferTail + 1) % CFG_TIMER_BUFFER_SIZE;
-        //Logger::debug("process, bufferHead=%d bufferTail=%d", bufferHead, bufferTail);
-    }
+    runPending();
 }
 
+//forget anything due but not run yet
 void TickHandler::cleanBuffer() {
-    bufferHead = bufferTail = 0;
+    for (int prio = 0; prio < TICK_NUM_PRIORITIES; prio++) {
+        while (pendingList[prio]) {
+            TickTimer *timer = pendingList[prio];
+            pendingList[prio] = timer->nextPending;
+            timer->nextPending = NULL;
+            timer->pending = false;
+        }
+    }
 }
-
 #endif //CFG_TIMER_USE_QUEUING
 
 /*
- * Handle the interrupt of any timer.
- * All the registered TickObservers of the timer are called.
+ * Number of times an observer came due again while its last tick still hadn't run. Those two
+ * ticks only run once. If this keeps going up something is hogging the main loop.
  */
-void TickHandler::handleInterrupt(int timerNumber) {
-    for (int i = 0; i < CFG_TIMER_NUM_OBSERVERS; i++) {
-        if (timerEntry[timerNumber].observer[i] != NULL) {
-#ifdef CFG_TIMER_USE_QUEUING
-            tickBuffer[bufferHead] = timerEntry[timerNumber].observer[i];
-            bufferHead = (bufferHead + 1) % CFG_TIMER_BUFFER_SIZE;
-            //Logger::debug("TN: %i bufferHead=%d, bufferTail=%d, observer=%x", timerNumber, bufferHead, bufferTail, timerEntry[timerNumber].observer[i]);
-#else
-            timerEntry[timerNumber].observer[i]->handleTick();
-#endif //CFG_TIMER_USE_QUEUING
+uint32_t TickHandler::getCoalescedTicks() {
+    return coalescedTicks;
+}
+
+/*
+ * Number of ticks that didn't start until more than one interval after they came due.
+ */
+uint32_t TickHandler::getMissedDeadlines() {
+    return missedDeadlines;
+}
+
+/*
+ * Base tick interrupt. With queuing on this only counts, process() does the rest from the
+ * main loop. Without it the ticks run right here.
+ */
+void TickHandler::handleInterrupt() {
+    baseTickCycles = ARM_DWT_CYCCNT;
+    baseTicks = baseTicks + 1;
+#ifndef CFG_TIMER_USE_QUEUING
+    runPending();
+#endif
+}
+
+#ifdef CFG_TICK_PROFILING
+/*
+ * Find a free profile slot for a newly attached observer. Returns 0xFF if they're all in use,
+ * in which case that observer just doesn't get profiled.
+ */
+uint8_t TickHandler::allocateProfile(TickObserver *observer, uint32_t interval) {
+    for (int i = 0; i < CFG_TICK_NUM_PROFILES; i++) {
+        if (profiles[i].observer == NULL) {
+            clearProfile(profiles[i]);
+            profiles[i].interval = interval;
+            profiles[i].observer = observer;
+            return i;
         }
     }
+    Logger::warn("No free tick profile slot for TickObserver (%X)", observer);
+    return 0xFF;
+}
+
+void TickHandler::clearProfile(TickProfile &profile) {
+    profile.count = 0;
+    profile.minCycles = 0xFFFFFFFF;
+    profile.maxCycles = 0;
+    profile.totalCycles = 0;
+    profile.maxLatency = 0;
+    profile.totalLatency = 0;
+    profile.overBudget = 0;
+    profile.missedDeadlines = 0;
+    profile.coalesced = 0;
+    memset(profile.histogram, 0, sizeof(profile.histogram));
+}
+
+void TickHandler::resetProfile() {
+    for (int i = 0; i < CFG_TICK_NUM_PROFILES; i++) clearProfile(profiles[i]);
+    coalescedTicks = 0;
+    missedDeadlines = 0;
 }
 
+static int profileBucket(uint32_t micros) {
+    if (micros < 4) return micros;
+    int octave = 31 - __builtin_clz(micros);
+    int idx = 4 + (octave - 2) * 2 + ((micros >> (octave - 1)) & 1);
+    return (idx < TICK_PROFILE_BUCKETS) ? idx : (TICK_PROFILE_BUCKETS - 1);
+}
+
+//upper limit (exclusive) in microseconds of what lands in this bucket
+static uint32_t profileBucketLimit(int idx) {
+    if (idx < 4) return idx + 1;
+    int octave = (idx - 4) / 2 + 2;
+    return (1ul << octave) + (((idx - 4) % 2) + 1) * (1ul << (octave - 1));
+}
+
+void TickHandler::recordTick(uint8_t idx, uint32_t latency, uint32_t cycles) {
+    if (idx == 0xFF) return;
+    TickProfile &profile = profiles[idx];
+    uint32_t cyclesPerMicro = F_CPU_ACTUAL / 1000000;
+    profile.count++;
+    profile.totalCycles += cycles;
+    if (cycles < profile.minCycles) profile.minCycles = cycles;
+    if (cycles > profile.maxCycles) profile.maxCycles = cycles;
+    profile.totalLatency += latency;
+    if (latency > profile.maxLatency) profile.maxLatency = latency;
+    uint32_t micros = cycles / cyclesPerMicro;
+    if (micros > profile.interval) profile.overBudget++;
+    profile.histogram[profileBucket(micros)]++;
+}
+
+/*
+ * Execution time in microseconds that percent of the ticks came in under. Only as precise as
+ * the histogram buckets so this is an upper bound, never more than the actual max though.
+ */
+uint32_t TickHandler::profilePercentile(const TickProfile &profile, int percent) {
+    uint32_t target = (profile.count * percent + 99) / 100;
+    uint32_t seen = 0;
+    uint32_t maxMicros = profile.maxCycles / (F_CPU_ACTUAL / 1000000);
+    if (profile.count == 0) return 0;
+    for (int i = 0; i < TICK_PROFILE_BUCKETS; i++) {
+        seen += profile.histogram[i];
+        if (seen >= target) {
+            uint32_t limit = profileBucketLimit(i);
+            return (limit < maxMicros) ? limit : maxMicros;
+        }
+    }
+    return maxMicros;
+}
+
+//nearly every observer is a device so try to find its name. Anything else just shows up by address
+const char *TickHandler::getObserverName(TickObserver *observer) {
+    for (int i = 0; i < CFG_DEV_MGR_MAX_DEVICES; i++) {
+        Device *dev = deviceManager.getDeviceByIdx(i);
+        if (!dev) break;
+        if (static_cast<TickObserver *>(dev) == observer) return dev->getShortName();
+    }
+    return NULL;
+}
+
+void TickHandler::printProfile() {
+    uint32_t cyclesPerMicro = F_CPU_ACTUAL / 1000000;
+    Logger::console("Tick profile (times in microseconds):");
+    Logger::console("Observer   Prio Interval   Count       Min    Avg    Max    P99   AvgLat MaxLat OverBudget Missed Coalesced");
+    for (int i = 0; i < CFG_TICK_NUM_PROFILES; i++) {
+        TickProfile &profile = profiles[i];
+        if (profile.observer == NULL) continue;
+        const char *name = getObserverName(profile.observer);
+        char addr[12];
+        if (!name) {
+            snprintf(addr, sizeof(addr), "%08X", (unsigned int)(uintptr_t)profile.observer);
+            name = addr;
+        }
+        uint32_t count = profile.count ? profile.count : 1;
+        Logger::console("%-10s %-4i %-10u %-11u %-6u %-6u %-6u %-6u %-6u %-6u %-10u %-6u %u", name, profile.observer->getTickPriority(),
+                        profile.interval, profile.count,
+                        profile.count ? profile.minCycles / cyclesPerMicro : 0,
+                        (uint32_t)(profile.totalCycles / count / cyclesPerMicro),
+                        profile.maxCycles / cyclesPerMicro, profilePercentile(profile, 99),
+                        (uint32_t)(profile.totalLatency / count / cyclesPerMicro),
+                        profile.maxLatency / cyclesPerMicro, profile.overBudget, profile.missedDeadlines, profile.coalesced);
+    }
+    Logger::console("All ticks: %u missed deadlines, %u coalesced", missedDeadlines, coalescedTicks);
+    Logger::console("Timer wheel: %u registrations, %uus base tick", numTimers, CFG_TIMER_BASE_TICK);
+}
+
+/*
+ * Same information as printProfile() for the ESP32 / web interface.
+ */
+void TickHandler::createJsonProfile(DynamicJsonDocument &doc) {
+    uint32_t cyclesPerMicro = F_CPU_ACTUAL / 1000000;
+    JsonArray entries = doc.createNestedArray("TickProfile");
+    for (int i = 0; i < CFG_TICK_NUM_PROFILES; i++) {
+        TickProfile &profile = profiles[i];
+        if (profile.observer == NULL) continue;
+        uint32_t count = profile.count ? profile.count : 1;
+        JsonObject entry = entries.createNestedObject();
+        const char *name = getObserverName(profile.observer);
+        if (name) entry["Name"] = name;
+        else entry["Address"] = (uint32_t)(uintptr_t)profile.observer;
+        entry["Priority"] = (int)profile.observer->getTickPriority();
+        entry["Interval"] = profile.interval;
+        entry["Count"] = profile.count;
+        entry["Min"] = profile.count ? profile.minCycles / cyclesPerMicro : 0;
+        entry["Avg"] = (uint32_t)(profile.totalCycles / count / cyclesPerMicro);
+        entry["Max"] = profile.maxCycles / cyclesPerMicro;
+        entry["P99"] = profilePercentile(profile, 99);
+        entry["AvgLatency"] = (uint32_t)(profile.totalLatency / count / cyclesPerMicro);
+        entry["MaxLatency"] = profile.maxLatency / cyclesPerMicro;
+        entry["OverBudget"] = profile.overBudget;
+        entry["MissedDeadlines"] = profile.missedDeadlines;
+        entry["Coalesced"] = profile.coalesced;
+    }
+    doc["MissedDeadlines"] = missedDeadlines;
+    doc["CoalescedTicks"] = coalescedTicks;
+    doc["BaseTick"] = CFG_TIMER_BASE_TICK;
+}
+#endif //CFG_TICK_PROFILING
+
 /*
  * Default implementation of the TickObserver method. Must be overwritten
  * by every sub-class.
@@ -271,4 +525,12 @@ void TickObserver::handleTick() {
     Logger::error("TickObserver does not implement handleTick()");
 }
 
+/*
+ * Most things are normal priority. Override this for anything safety critical
+ * or anything that can happily wait.
+ */
+TickPriority TickObserver::getTickPriority() {
+    return TICK_PRIORITY_NORMAL;
+}
+
 TickHandler tickHandler;
@@ -32,19 +32,67 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "config.h"
 #include <TeensyTimerTool.h>
+#include <ArduinoJson.h>
 #include "Logger.h"
 
 using namespace TeensyTimerTool;
 
-//its technically possible to register even more timers but the higher you go the more likely
-//you are to clobber timers being used by other things.
-#define NUM_TIMERS 12
+/*
+ * All ticks come from a hierarchical timer wheel driven by a single hardware timer firing every
+ * CFG_TIMER_BASE_TICK microseconds. The first level has one slot per base tick, each level above
+ * covers the whole range of the one below in each of its slots. Timers far in the future sit in
+ * the upper levels and cascade down as their time gets closer. Insertion and expiry are O(1) and
+ * there is no limit on the number of observers or distinct intervals.
+ */
+#define TICK_WHEEL_L0_BITS  8
+#define TICK_WHEEL_LN_BITS  6
+#define TICK_WHEEL_LEVELS   4   // 256 * 64 * 64 * 64 base ticks, about 18 hours at 1ms
+#define TICK_WHEEL_L0_SIZE  (1 << TICK_WHEEL_L0_BITS)
+#define TICK_WHEEL_LN_SIZE  (1 << TICK_WHEEL_LN_BITS)
+
+/*
+ * When several ticks are waiting to run the higher priority class always goes first.
+ * Within a class the tick closest to (or furthest past) its deadline goes first.
+ * A tick's deadline is one interval after its timer fired.
+ */
+enum TickPriority {
+    TICK_PRIORITY_CRITICAL = 0,     // motor control, throttle, contactors. Anything where late means unsafe
+    TICK_PRIORITY_NORMAL = 1,       // the default. BMS, chargers, DC/DC, general vehicle stuff
+    TICK_PRIORITY_TELEMETRY = 2,    // displays, diagnostics, wireless reporting
+    TICK_PRIORITY_HOUSEKEEPING = 3, // EEPROM cache flushing, heartbeat and the like
+    TICK_NUM_PRIORITIES = 4
+};
 
 class TickObserver {
 public:
     virtual void handleTick();
+    virtual TickPriority getTickPriority();
 };
 
+#ifdef CFG_TICK_PROFILING
+//execution time histogram. 1us buckets up to 4us then two buckets per power of two up to ~65ms
+#define TICK_PROFILE_BUCKETS 32
+
+/*
+ * Timing for one observer at one interval. All times are in CPU cycles (ARM_DWT_CYCCNT)
+ * and only converted to microseconds when reported.
+ */
+struct TickProfile {
+    TickObserver *observer; // NULL if this profile slot is free
+    uint32_t interval;
+    uint32_t count;
+    uint32_t minCycles;
+    uint32_t maxCycles;
+    uint64_t totalCycles;
+    uint32_t maxLatency;    // time from the timer interrupt queuing the tick to handleTick() starting
+    uint64_t totalLatency;
+    uint32_t overBudget;    // ticks that ran longer than the interval
+    uint32_t missedDeadlines; // ticks that started more than one interval after their timer fired
+    uint32_t coalesced;     // timer fired again before the last tick ran so the two became one
+    uint32_t histogram[TICK_PROFILE_BUCKETS]; // execution time in microseconds
+};
+#endif
+
 
 class TickHandler {
 public:
@@ -52,31 +100,70 @@ public:
     void setup();
     void attach(TickObserver *observer, uint32_t interval);
     void detach(TickObserver *observer);
-    void handleInterrupt(int timerNumber); // must be public when from the non-class functions
+    void handleInterrupt(); // must be public when from the non-class functions
 #ifdef CFG_TIMER_USE_QUEUING
     void cleanBuffer();
     void process();
 #endif
+    uint32_t getCoalescedTicks();
+    uint32_t getMissedDeadlines();
+#ifdef CFG_TICK_PROFILING
+    void printProfile();
+    void resetProfile();
+    void createJsonProfile(DynamicJsonDocument &doc);
+#endif
 
 protected:
 
 private:
-    struct TimerEntry {
-        long interval; // interval of timer in microseconds
-        uint64_t maxInterval; //maximum achieveable interval for this timer (in microseconds)
-        TickObserver *observer[CFG_TIMER_NUM_OBSERVERS]; // array of pointers to observers with this interval
+    struct TickTimer;
+    struct WheelSlot {
+        TickTimer *head;
     };
-    TimerEntry timerEntry[NUM_TIMERS]; // array of timer entries
-#ifdef CFG_TIMER_USE_QUEUING
-    TickObserver *tickBuffer[CFG_TIMER_BUFFER_SIZE];
-    volatile uint16_t bufferHead, bufferTail;
+    //one of these per attach() call. Lives in a wheel slot until it expires, then also on a pending list until it runs
+    struct TickTimer {
+        TickObserver *observer;
+        uint32_t interval;      // in microseconds
+        uint32_t periodTicks;   // interval in base ticks
+        uint32_t expires;       // base tick number this is next due
+        uint32_t queuedAt;      // ARM_DWT_CYCCNT of the base tick that made it due, valid while pending
+        TickTimer *next, *prev; // wheel slot list
+        WheelSlot *slot;        // which slot it's in
+        TickTimer *nextPending;
+        bool pending;
+        uint8_t priority;       // TickPriority, read when the observer attaches
+        uint8_t profile;        // index into profiles, 0xFF if none
+    };
+
+    WheelSlot wheel0[TICK_WHEEL_L0_SIZE];
+    WheelSlot wheelN[TICK_WHEEL_LEVELS - 1][TICK_WHEEL_LN_SIZE];
+    TickTimer *pendingList[TICK_NUM_PRIORITIES]; // due but not run yet
+    TickTimer *freeTimers;      // detached TickTimers kept for reuse
+    volatile uint32_t baseTicks; // counted up by the hardware timer interrupt
+    volatile uint32_t baseTickCycles; // ARM_DWT_CYCCNT at the last base tick
+    uint32_t wheelTime;         // next base tick the wheel will process
+    uint32_t numTimers;
+    uint32_t coalescedTicks;
+    uint32_t missedDeadlines;
+#ifdef CFG_TICK_PROFILING
+    TickProfile profiles[CFG_TICK_NUM_PROFILES];
+
+    uint8_t allocateProfile(TickObserver *observer, uint32_t interval);
+    void recordTick(uint8_t profile, uint32_t latency, uint32_t cycles);
+    void clearProfile(TickProfile &profile);
+    uint32_t profilePercentile(const TickProfile &profile, int percent);
+    const char *getObserverName(TickObserver *observer);
 #endif
-    
-    int findTimer(long interval);
-    int findFreeTimer(uint64_t interval);
-    int findObserver(int timerNumber, TickObserver *observer);
 
-    PeriodicTimer* timers[NUM_TIMERS];
+    void insertTimer(TickTimer *timer);
+    void removeTimer(TickTimer *timer);
+    void cascade(int level, int index);
+    void advanceWheel();
+    void runPending();
+    TickTimer *takeNextPending();
+    uint32_t staggerOffset(uint32_t interval, uint32_t periodTicks);
+
+    PeriodicTimer baseTimer;
 };
 
 extern TickHandler tickHandler;
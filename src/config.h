@@ -40,6 +40,20 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define portMEMORY_BARRIER()     __asm volatile ( "dmb" ::: "memory" )
 #define portDATA_SYNC_BARRIER()  __asm volatile ( "dsb" ::: "memory" )
 #define portINSTR_SYNC_BARRIER() __asm volatile ( "isb" )
+
+//turn interrupts off and return the old PRIMASK to hand to restoreInterrupts(). Nests, so it's fine to call
+//with interrupts already off. Keep what runs in between to a few instructions.
+static inline uint32_t disableInterrupts()
+{
+    uint32_t primask;
+    __asm__ volatile("mrs %0, primask\n" "cpsid i" : "=r" (primask) :: "memory");
+    return primask;
+}
+
+static inline void restoreInterrupts(uint32_t primask)
+{
+    __asm__ volatile("msr primask, %0" :: "r" (primask) : "memory");
+}
 #define CPU_RESTART_ADDR	((uint32_t *)0xE000ED0C)
 #define CPU_RESTART_VAL		(0x5FA0004)
 #define REBOOT			(*CPU_RESTART_ADDR = CPU_RESTART_VAL)
@@ -62,12 +76,56 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  * These values should normally not be changed.
  */
 #define CFG_DEV_MGR_MAX_DEVICES     60 // the maximum number of devices supported by the DeviceManager
+#define CFG_DEV_MGR_ID_HASH_SIZE    128 // slots in the DeviceId -> device index. Must be a power of two and at least 2x CFG_DEV_MGR_MAX_DEVICES
+#define CFG_DEV_MAX_DEPENDENCIES    4 // devices, device types or CAN buses a single device can wait on while starting up
+#define CFG_DEV_SETUP_TIMEOUT       5000 // ms a device gets after setup() to say it is ready before it is given up on
 #define CFG_CAN_NUM_OBSERVERS	    16 // maximum number of device subscriptions per CAN bus
+#define CFG_CAN_DISPATCH_HASH_SIZE  64 // slots in the exact id dispatch hash of each CAN bus. Must be a power of two and at least 2x CFG_CAN_NUM_OBSERVERS
+#define CFG_CAN_RX_RING_SIZE        256 // frames buffered between the CAN interrupt and CanHandler::loop(), per bus. Must be a power of two
+#define CFG_CANFD_RX_RING_SIZE      32 // same but for true CAN-FD frames on CAN2. Must be a power of two
+#define CFG_CAN_RX_BUDGET_US        500 // max time in microseconds each CanHandler::loop() pass spends dispatching received frames
+#define CFG_CAN_HW_FILTERING        // if defined, CanHandler programs the FlexCAN acceptance filters from the attached observers
+#define CFG_CAN_NUM_HW_FILTERS      8 // RX FIFO acceptance filters available on CAN0 and CAN1
+#define CFG_CANFD_NUM_RX_MAILBOXES  7 // mailboxes used for receive (and filtering) on CAN2. The rest of the 14 are used for transmit
+#define CFG_CAN_TX_QUEUE_SIZE       32 // frames per bus that can wait for a free transmit mailbox. At most 255
+#define CFG_CAN_PERIODIC_SLOTS      8 // frames per CAN bus that can be sent on a hardware timed schedule
+#define CFG_CAN_PERIODIC_RETRY      50 // us until a periodic frame that found all transmit mailboxes busy is tried again
+#define CFG_CAN_PERIODIC_LEAD       2000 // us before a periodic frame is due that loop() builds it. Should cover the longest loop() pass
+#define CFG_CAN_PERIODIC_STALE      3 // times one periodic frame may be sent before loop() has to replace it. After that the slot goes quiet
+#define CFG_ISOTP_SESSIONS          4 // ISO-TP sessions per CAN bus
+#define CFG_ISOTP_BLOCK_SIZE        0 // consecutive frames we let the other side send between our flow control frames. 0 = no limit
+#define CFG_ISOTP_STMIN             0 // ms we ask the other side to leave between consecutive frames
+#define CFG_ISOTP_TIMEOUT           1000 // ms to wait for flow control or the next consecutive frame before a transfer is dropped
+#define CFG_ISOTP_MAX_WAITS         10 // WAIT flow control frames in a row before a send is given up
+#define CFG_ISOTP_TX_BURST          4 // most consecutive frames one session sends per CanHandler::loop() pass
+#define CFG_ISOTP_PADDING           0xAA // filler for the unused bytes of ISO-TP frames
+#define CFG_GVRET_TX_BUFFER_SIZE    4096 // bytes of GVRET binary capture output gathered up before being handed to USB
+#define CFG_GVRET_TX_THRESHOLD      512 // once this much is buffered it gets sent right away (one high speed USB packet)
+#define CFG_GVRET_FLUSH_US          1000 // max time in microseconds captured frames may sit in the buffer before being sent anyway
+#define CFG_CANREC_FILE_SIZE        (128ul * 1024ul * 1024ul) // CAN recordings are preallocated to this size and a new file started when full
+#define CFG_CANREC_NUM_SECTORS      128  // 512 byte sectors buffered in RAM for the CAN recorder. Must be a power of two
+#define CFG_CANREC_FLUSH_MS         1000 // a partly filled CAN recording sector is padded out and written after this long. Bounds what a power cut loses
+#define CFG_LOG_QUEUE_SIZE          16384 // bytes of queued log messages waiting for Logger::loop() to format them. Must be a power of two
+#define CFG_LOG_BUDGET_US           300 // max time in microseconds each Logger::loop() pass spends formatting and printing queued messages
+#define CFG_LOG_MAX_STRING          64 // longest %s argument copied into a queued log message. Longer strings are cut off
 #define CFG_STATUS_NUM_OBSERVERS    4 //How many devices can register to get StatusEntry updates. Use sparingly!
-#define CFG_TIMER_NUM_OBSERVERS	    16 // the maximum number of supported observers per timer
-#define CFG_TIMER_USE_QUEUING	    // if defined, TickHandler uses a queuing buffer instead of direct calls from interrupts - MUCH safer!
-#define CFG_TIMER_BUFFER_SIZE	    100 // the size of the queuing buffer for TickHandler
+#define CFG_STATUS_MAX_ENTRIES      256 // maximum number of StatusEntry records. Must be a multiple of 32
+#define CFG_STATUS_HASH_SIZE        512 // slots in the variable address -> StatusEntry hash. Must be a power of two and at least 2x CFG_STATUS_MAX_ENTRIES
+#define CFG_TIMER_BASE_TICK         1000 // microseconds between hardware timer interrupts. All tick intervals are rounded to a multiple of this
+#define CFG_TIMER_USE_QUEUING	    // if defined, TickHandler queues ticks by priority and runs them from the main loop instead of direct calls from interrupts - MUCH safer!
+#define CFG_TICK_PROFILING          // if defined, TickHandler times every handleTick() call with the cycle counter. Costs a few cycles per tick
+#define CFG_TICK_NUM_PROFILES       32 // number of observer/interval registrations that can be profiled
+#define CFG_RECSTORE_INDEX_SIZE     2048 // slots in the (owner, key) -> EEPROM address index of the record store. Must be a power of two
+#define CFG_PREF_TRANSACTION_SIZE   1024 // bytes of setting values a PrefHandler transaction can hold before it has to be committed in parts
+#define CFG_RECSTORE_WINDOW         8 // sectors of the record store allowed in use before the oldest gets compacted. Boot time scans this many
 #define CFG_FAULT_HISTORY_SIZE	    50 //number of faults to store in eeprom. A circular buffer so the last 50 faults are always stored.
+#define CFG_FAULT_INDEX_SIZE        128 // slots in the (device, fault code) index of the fault handler. Must be a power of two and more than CFG_FAULT_HISTORY_SIZE
+#define CFG_FAULT_RATE_LIMIT        100 // tenths of a second. A fault raised again within this long of the last time is counted in the same record, which is written at most this often
+#define CFG_FAULT_RUNTIME_SAVE      600 // tenths of a second. The run time counter is only saved this often so it doesn't flood the record store
+#define CFG_TICK_INTERVAL_FAULTS    1000000 // microseconds between fault handler ticks
+#define CFG_FLIGHTREC_CRUMBS        64 // breadcrumbs kept by the crash flight recorder. Must be a power of two
+#define CFG_FLIGHTREC_TICKS         32 // tick dispatches (observer and run time) kept by the flight recorder. Must be a power of two
+#define CFG_FLIGHTREC_FRAMES        16 // CAN frames kept by the flight recorder for each bus. Must be a power of two
 
 /*
  * PIN ASSIGNMENT
@@ -30,6 +30,7 @@
 Device::Device() {
     deviceConfiguration = NULL;
     prefsHandler = NULL;
+    numDependencies = 0;
     //since all derived classes eventually call this base method this will cause every device to auto register itself with the device manager
     deviceManager.addDevice(this);
     commonName = "Generic Device";
@@ -51,10 +52,10 @@ void Device::disableDevice()
 {
     tickHandler.detach(this); //no longer receive ticks
 
-    //technically this should be a dynamic cast to see if the object really is a CAN observer
-    //but no-rtti is enabled so I can't do that. It should be OK anyway as nothing from the actual
-    //CanObserver class is being called. The memory address is all we need
-    CanObserver *obs = (CanObserver *)(this);
+    //no RTTI so a dynamic_cast isn't possible. A plain cast of this would be wrong as well,
+    //CanObserver is a second base class and lives at an offset within the object. Ask the
+    //device for it instead so detachAll gets the same pointer attach() and addPeriodic() saw.
+    CanObserver *obs = asCanObserver();
     if (obs) //if this device was a can observer then cancel those too.
     {
         canHandlerBus0.detachAll(obs);
@@ -63,6 +64,11 @@ void Device::disableDevice()
     }
 }
 
+CanObserver *Device::asCanObserver()
+{
+    return NULL;
+}
+
 const char* Device::getCommonName() {
     return commonName;
 }
@@ -74,10 +80,52 @@ const char* Device::getShortName() {
 void Device::handleTick() {
 }
 
+//forwarded so Device.h doesn't need to pull in DeviceManager.h
+void Device::statusChanged(const void *var)
+{
+    deviceManager.statusChanged(var);
+}
+
 uint32_t Device::getTickInterval() {
     return 0;
 }
 
+//Polled by DeviceStartup after setup() until it stops returning SETUP_PENDING. Devices that need
+//a while to come up (waiting on hardware and so on) override this instead of blocking in setup()
+SetupStatus Device::setupStatus() {
+    return SETUP_DONE;
+}
+
+uint8_t Device::getDependencies(const DeviceDependency **deps) {
+    *deps = dependencies;
+    return numDependencies;
+}
+
+void Device::dependsOn(DeviceId id) {
+    addDependency(DEP_DEVICE_ID, id);
+}
+
+void Device::dependsOnType(DeviceType type) {
+    addDependency(DEP_DEVICE_TYPE, type);
+}
+
+void Device::dependsOnCanBus(uint8_t bus) {
+    addDependency(DEP_CANBUS, bus);
+}
+
+void Device::addDependency(DependencyKind kind, uint16_t value) {
+    for (int i = 0; i < numDependencies; i++) {
+        if (dependencies[i].kind == kind && dependencies[i].value == value) return; //setup() can run more than once
+    }
+    if (numDependencies >= CFG_DEV_MAX_DEPENDENCIES) {
+        Logger::error("Too many dependencies for %s. Raise CFG_DEV_MAX_DEPENDENCIES", shortName);
+        return;
+    }
+    dependencies[numDependencies].kind = kind;
+    dependencies[numDependencies].value = value;
+    numDependencies++;
+}
+
 //just bubbles up the value from the preference handler.
 bool Device::isEnabled() {
     return prefsHandler->isEnabled();
@@ -128,6 +176,82 @@ void Device::zapConfiguration()
     loadConfiguration(); //then try to reload configuration to bring it back to defaults
 }
 
+//Save the configuration as one transaction. Only settings that actually changed get written and
+//they all go to EEPROM together. Use this instead of calling saveConfiguration() directly.
+void Device::commitConfiguration()
+{
+    if (!prefsHandler)
+    {
+        saveConfiguration();
+        return;
+    }
+    prefsHandler->beginTransaction();
+    saveConfiguration();
+    prefsHandler->commitTransaction();
+}
+
+//Parse valu and store it in the variable behind a config entry if it's within the entry's limits.
+//Returns CFG_VALUE_SET, CFG_VALUE_TOO_LOW or CFG_VALUE_TOO_HIGH. Nothing is saved, see commitConfiguration()
+//With store false the value is only checked, so a batch of settings can be validated before any is set
+int Device::setConfigValue(const ConfigEntry *entry, const char *valu, bool store)
+{
+    uint8_t ui8;
+    float fl;
+    int16_t i16;
+    int32_t i32;
+    uint16_t ui16;
+    uint32_t ui32;
+
+    int result = CFG_VALUE_SET;
+    switch (entry->varType)
+    {
+    case CFG_ENTRY_VAR_TYPE::BYTE:
+        ui8 = (uint8_t)strtol(valu, NULL, 0);
+        if (ui8 < entry->minValue.u_int) result = CFG_VALUE_TOO_LOW;
+        else if (ui8 > entry->maxValue.u_int) result = CFG_VALUE_TOO_HIGH;
+        else if (store) *(uint8_t *)entry->varPtr = ui8;
+        break;
+    case CFG_ENTRY_VAR_TYPE::FLOAT:
+        fl = strtof(valu, NULL);
+        if (fl < entry->minValue.floating) result = CFG_VALUE_TOO_LOW;
+        else if (fl > entry->maxValue.floating) result = CFG_VALUE_TOO_HIGH;
+        else if (store) *(float *)entry->varPtr = fl;
+        break;
+    case CFG_ENTRY_VAR_TYPE::INT16:
+        i16 = (int16_t)strtol(valu, NULL, 0);
+        if (i16 < entry->minValue.s_int) result = CFG_VALUE_TOO_LOW;
+        else if (i16 > entry->maxValue.s_int) result = CFG_VALUE_TOO_HIGH;
+        else if (store) *(int16_t *)entry->varPtr = i16;
+        break;
+    case CFG_ENTRY_VAR_TYPE::INT32:
+        i32 = (int32_t)strtol(valu, NULL, 0);
+        if (i32 < entry->minValue.s_int) result = CFG_VALUE_TOO_LOW;
+        else if (i32 > entry->maxValue.s_int) result = CFG_VALUE_TOO_HIGH;
+        else if (store) *(int32_t *)entry->varPtr = i32;
+        break;
+    case CFG_ENTRY_VAR_TYPE::STRING:
+        //this is an interesting one. It's easy in principle but we don't know
+        //the actual size of the storage buffer so it could overwrite memory.
+        //If this GEVCU thing gets popular it might be necessary to fix this
+        //otherwise this is the entry point to smashing the stack for fun and profit.
+        if (store) strcpy((char *)entry->varPtr, valu);
+        break;
+    case CFG_ENTRY_VAR_TYPE::UINT16:
+        ui16 = (uint16_t)strtol(valu, NULL, 0);
+        if (ui16 < entry->minValue.u_int) result = CFG_VALUE_TOO_LOW;
+        else if (ui16 > entry->maxValue.u_int) result = CFG_VALUE_TOO_HIGH;
+        else if (store) *(uint16_t *)entry->varPtr = ui16;
+        break;
+    case CFG_ENTRY_VAR_TYPE::UINT32:
+        ui32 = (uint32_t)strtol(valu, NULL, 0);
+        if (ui32 < entry->minValue.u_int) result = CFG_VALUE_TOO_LOW;
+        else if (ui32 > entry->maxValue.u_int) result = CFG_VALUE_TOO_HIGH;
+        else if (store) *(uint32_t *)entry->varPtr = ui32;
+        break;
+    }
+    return result;
+}
+
 const ConfigEntry* Device::findConfigEntry(const char *settingName)
 {
     for (size_t idx = 0; idx < cfgEntries.size(); idx++)
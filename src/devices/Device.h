@@ -37,6 +37,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "../FaultHandler.h"
 #include "../CrashHandler.h"
 
+class CanObserver;
+
 /*
  * A abstract class to hold device configuration. It is to be accessed
  * by sub-classes via getConfiguration() and then cast into its
@@ -49,6 +51,30 @@ class DeviceConfiguration {
 /*
  * A abstract class for all Devices.
  */
+//results of setConfigValue()
+#define CFG_VALUE_SET       0
+#define CFG_VALUE_TOO_LOW   1
+#define CFG_VALUE_TOO_HIGH  2
+
+//something a device needs before it can start. See DeviceStartup
+enum DependencyKind {
+    DEP_DEVICE_ID,   //one particular device
+    DEP_DEVICE_TYPE, //every enabled device of a type
+    DEP_CANBUS       //a CAN bus that must be running
+};
+
+struct DeviceDependency {
+    uint16_t value; //DeviceId, DeviceType or bus number depending on kind
+    DependencyKind kind;
+};
+
+//results of setupStatus()
+enum SetupStatus {
+    SETUP_PENDING,
+    SETUP_DONE,
+    SETUP_FAILED
+};
+
 class Device: public TickObserver {
 public:
     Device();
@@ -56,11 +82,14 @@ public:
     virtual void earlyInit();
     virtual void handleMessage(uint32_t, const void* );
     virtual void disableDevice();
+    virtual CanObserver *asCanObserver(); //devices that listen to CAN return their CanObserver base
     virtual DeviceType getType();
     virtual DeviceId getId();
     void handleTick();
     bool isEnabled();
     virtual uint32_t getTickInterval();
+    virtual SetupStatus setupStatus();
+    uint8_t getDependencies(const DeviceDependency **deps);
     const char* getCommonName();
     const char* getShortName();
 
@@ -68,9 +97,11 @@ public:
     virtual void saveConfiguration();
     DeviceConfiguration *getConfiguration();
     void zapConfiguration();
+    void commitConfiguration();
     void setConfiguration(DeviceConfiguration *);
     const std::vector<ConfigEntry> *getConfigEntries();
     const ConfigEntry* findConfigEntry(const char *settingName);
+    int setConfigValue(const ConfigEntry *entry, const char *valu, bool store = true);
 
 protected:
     PrefHandler *prefsHandler;
@@ -78,8 +109,28 @@ protected:
     const char *shortName;
     std::vector<ConfigEntry> cfgEntries;
 
+    //declare what has to be up before this device starts. Call from the constructor or, for things
+    //that come from the configuration like the CAN bus, from setup()
+    void dependsOn(DeviceId id);
+    void dependsOnType(DeviceType type);
+    void dependsOnCanBus(uint8_t bus);
+
+    //Write a variable that was registered as a StatusEntry. Observers only hear about it if the value really changed
+    template<typename T, typename V> void setStatus(T &var, V value)
+    {
+        T newValue = (T)value;
+        if (newValue == var) return;
+        var = newValue;
+        statusChanged(&var);
+    }
+    void statusChanged(const void *var);
+
 private:
     DeviceConfiguration *deviceConfiguration; // reference to the currently active configuration    
+    DeviceDependency dependencies[CFG_DEV_MAX_DEPENDENCIES];
+    uint8_t numDependencies;
+
+    void addDependency(DependencyKind kind, uint16_t value);
 };
 
 #endif /* DEVICE_H_ */
@@ -93,12 +93,13 @@ struct ConfigEntry
 from ConfigEntry in that you cannot edit these values. Instead these values are only updated by the device
 itself. The format here is a little bit weird but for reasons of making life easier on device developers.
 Since there is a pointer to the actual variable the device developer doesn't need to worry about updating
-these. All the developer needs to do is register these entries. Thinking to create a StatusManager
-class that has all these StatusEntry records in it. That one class would then periodically check
-for new data and update as needed. This would then show which items were changed and they could 
-be updated. But, the StatusManager would not be doing the updating. It should allow other devices
-to register callbacks that would happen when a status entry is updated. In this way something like the
-esp32 could receive a callback only when things update and thus updates would only happen when necessary.
+these. All the developer needs to do is register these entries. DeviceManager sends an update to the
+registered status observers (ESP32 and the like) whenever a value changes.
+A device that writes the variable with setStatus() tells DeviceManager about the change right when it happens,
+which marks the entry dirty and only dirty entries get looked at. Entries for variables that are just assigned
+directly are polled for changes instead. Once a variable has been published with setStatus() every write to it
+must go through setStatus() or the change will be missed.
+deadband and minInterval can be used to cut down on updates for values that jitter or change all the time.
 */
 struct StatusEntry
 {
@@ -107,6 +108,10 @@ struct StatusEntry
     CFG_ENTRY_VAR_TYPE varType;
     double lastValue;
     Device *device;
+    float deadband; //changes no bigger than this are not sent out
+    uint16_t minInterval; //minimum ms between updates sent to observers. 0 = every change
+    uint32_t lastSent; //millis() when an update for this entry last went out
+    bool eventDriven; //set once the device starts publishing this variable with setStatus(). Otherwise it is polled
 
     StatusEntry()
     {
@@ -115,15 +120,23 @@ struct StatusEntry
         varType = CFG_ENTRY_VAR_TYPE::BYTE;
         lastValue = 0.0;
         device = nullptr;
+        deadband = 0.001f;
+        minInterval = 0;
+        lastSent = 0;
+        eventDriven = false;
     }
 
-    StatusEntry(String name, void *ptr, CFG_ENTRY_VAR_TYPE type, double val, Device *dev)
+    StatusEntry(String name, void *ptr, CFG_ENTRY_VAR_TYPE type, double val, Device *dev, float dband = 0.001f, uint16_t interval = 0)
     {
         statusName = name;
         varPtr = ptr;
         varType = type;
         lastValue = val;
         device = dev;
+        deadband = dband;
+        minInterval = interval;
+        lastSent = 0;
+        eventDriven = false;
     }
 
     double getValueAsDouble()
@@ -138,7 +151,8 @@ struct StatusEntry
         if (varType == STRING) //this one is special. Sum all characters to give a numeric result
         {
             char *str = (char *)varPtr;
-            while (str) out += *str++;
+            out = 0.0;
+            while (*str) out += *str++;
             return out;
         }
         if (varType == INT16)
@@ -27,6 +27,18 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "ThinkBatteryManager.h"
+#include "CanSignal.h"
+
+//all multi byte values from the BMS are big endian, voltages, currents and temperatures in tenths
+static constexpr CanSignalDef THINK_INIT_OK = {48, 1, CAN_INTEL, false, 1.0f, 0.0f};           //0x300
+static constexpr CanSignalDef THINK_PACK_VOLTAGE = {7, 16, CAN_MOTOROLA, false, 0.1f, 0.0f};   //0x301
+static constexpr CanSignalDef THINK_PACK_CURRENT = {23, 16, CAN_MOTOROLA, false, 0.1f, 0.0f};
+static constexpr CanSignalDef THINK_GENERAL_ERROR = {0, 1, CAN_INTEL, false, 1.0f, 0.0f};      //0x302
+static constexpr CanSignalDef THINK_ISOLATION_ERROR = {16, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef THINK_MAX_DISCHARGE = {55, 16, CAN_MOTOROLA, true, 0.1f, 0.0f};
+static constexpr CanSignalDef THINK_MAX_CHARGE = {23, 16, CAN_MOTOROLA, true, 0.1f, 0.0f};     //0x303
+static constexpr CanSignalDef THINK_MAX_TEMP = {39, 16, CAN_MOTOROLA, true, 0.1f, 0.0f};       //0x304
+static constexpr CanSignalDef THINK_MIN_TEMP = {55, 16, CAN_MOTOROLA, true, 0.1f, 0.0f};
 
 ThinkBatteryManager::ThinkBatteryManager() : BatteryManager() {
     allowCharge = false;
@@ -57,6 +69,7 @@ void ThinkBatteryManager::setup() {
     cfgEntries.push_back(entry);
 
     setAttachedCANBus(config->canbusNum);
+    dependsOnCanBus(config->canbusNum);
 
     //Relevant BMS messages are 0x300 - 0x30F
     attachedCANBus->attach(this, 0x300, 0x7f0, false);
@@ -68,12 +81,12 @@ void ThinkBatteryManager::setup() {
 /*For all multibyte integers the format is MSB first, LSB last
 */
 void ThinkBatteryManager::handleCanFrame(const CAN_message_t &frame) {
-    int temp;
+    CanPayload payload(frame);
     crashHandler.addBreadcrumb(ENCODE_BREAD("THBMS") + 1);
     switch (frame.id) {
     case 0x300: //Start up message
         //we're not really interested in much here except whether init worked.
-        if ((frame.buf[6] & 1) == 0)  //there was an initialization error!
+        if (payload.get<THINK_INIT_OK>() == 0)  //there was an initialization error!
         {
             faultHandler.raiseFault(THINKBMS, FAULT_BMS_INIT, true);
             allowCharge = false;
@@ -87,11 +100,11 @@ void ThinkBatteryManager::handleCanFrame(const CAN_message_t &frame) {
     case 0x301: //System Data 0
         //first two bytes = current, next two voltage, next two DOD, last two avg. temp
         //readings in tenths
-        packVoltage = (frame.buf[0] * 256 + frame.buf[1]) / 10.0f;
-        packCurrent = (frame.buf[2] * 256 + frame.buf[3]) / 10.0f;
+        packVoltage = payload.value<THINK_PACK_VOLTAGE>();
+        packCurrent = payload.value<THINK_PACK_CURRENT>();
         break;
     case 0x302: //System Data 1
-        if ((frame.buf[0] & 1) == 1) //Byte 0 bit 0 = general error
+        if (payload.get<THINK_GENERAL_ERROR>()) //Byte 0 bit 0 = general error
         {
             faultHandler.raiseFault(THINKBMS, FAULT_BMS_MISC, true);
             allowDischarge = false;
@@ -101,7 +114,7 @@ void ThinkBatteryManager::handleCanFrame(const CAN_message_t &frame) {
         {
             faultHandler.cancelOngoingFault(THINKBMS, FAULT_BMS_MISC);
         }
-        if ((frame.buf[2] & 1) == 1) //Byte 2 bit 0 = general isolation error
+        if (payload.get<THINK_ISOLATION_ERROR>()) //Byte 2 bit 0 = general isolation error
         {
             faultHandler.raiseFault(THINKBMS, FAULT_HV_BATT_ISOLATION, true);
             allowDischarge = false;
@@ -113,14 +126,12 @@ void ThinkBatteryManager::handleCanFrame(const CAN_message_t &frame) {
         }
         //Min discharge voltage = bytes 4-5 - tenths of a volt
         //Max discharge current = bytes 6-7 - tenths of an amp
-        temp = (int16_t)(frame.buf[6] * 256 + frame.buf[7]);
-        if (temp > 0) allowDischarge = true;
+        if (payload.get<THINK_MAX_DISCHARGE>() > 0) allowDischarge = true;
         break;
     case 0x303: //System Data 2
         //bytes 0-1 = max charge voltage (tenths of volt)
         //bytes 2-3 = max charge current (tenths of amp)
-        temp = (int16_t)(frame.buf[2] * 256 + frame.buf[3]);
-        if (temp > 0) allowCharge = true;
+        if (payload.get<THINK_MAX_CHARGE>() > 0) allowCharge = true;
         //byte 4 bit 1 = regen braking OK, bit 2 = Discharging OK
         //byte 6 bit 3 = EPO (emergency power off) happened, bit 5 = battery pack fan is on
         break;
@@ -129,8 +140,8 @@ void ThinkBatteryManager::handleCanFrame(const CAN_message_t &frame) {
         //categories: 0 = no faults, 1 = Reserved, 2 = Warning, 3 = Delayed switch off, 4 = immediate switch off
         //bytes 4-5 = Pack max temperature (tenths of degree C) - Signed
         //byte 6-7 = Pack min temperature (tenths of a degree C) - Signed
-        lowestCellTemp = ((int16_t)(frame.buf[4] * 256 + frame.buf[5])) / 10.0f;
-        highestCellTemp = ((int16_t)(frame.buf[6] * 256 + frame.buf[7])) / 10.0f;
+        highestCellTemp = payload.value<THINK_MAX_TEMP>();
+        lowestCellTemp = payload.value<THINK_MIN_TEMP>();
         break;
     case 0x305: //System Data 4
         //byte 2 bits 0-3 = BMS state
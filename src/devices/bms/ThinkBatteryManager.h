@@ -53,6 +53,7 @@ public:
     void earlyInit();
     void handleTick();
     void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
     DeviceId getId();
     bool hasPackVoltage();
     bool hasPackCurrent();
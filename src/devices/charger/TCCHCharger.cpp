@@ -26,10 +26,20 @@ void TCCHChargerController::setup()
     entry = {"TCCH-CANBUS", "Set which CAN bus to connect to (0-2)", &config->canbusNum, CFG_ENTRY_VAR_TYPE::BYTE, 0, 2, 0, nullptr};
     cfgEntries.push_back(entry);
 
+    //setup() runs again after config changes. Start from scratch so nothing is attached or scheduled twice
+    cmdSlot = -1;
+    attachedCANBus->detachAll(this);
     setAttachedCANBus(config->canbusNum);
+    dependsOnCanBus(config->canbusNum);
 
     //watch for the charger status message
     attachedCANBus->attach(this, 0x18FF50E5, 0x1FFFFFFF, true);
+
+    //the command frame goes out on the CAN handler's hardware timer so it keeps coming steadily however busy the main loop is
+    CAN_message_t output;
+    buildCmd(output);
+    cmdSlot = attachedCANBus->addPeriodic(this, output, CFG_TICK_INTERVAL_TCCH);
+
     tickHandler.attach(this, CFG_TICK_INTERVAL_TCCH);
     crashHandler.addBreadcrumb(ENCODE_BREAD("TCCHC") + 0);
 }
@@ -65,14 +75,18 @@ void TCCHChargerController::handleTick()
 {
     ChargeController::handleTick(); //kick the ball up to papa
 
-    sendCmd();   //Send our Delphi voltage control command
+    //the command frame itself goes out on the CAN periodic schedule, see handlePeriodicFrame()
 }
 
-void TCCHChargerController::sendCmd()
+void TCCHChargerController::handlePeriodicFrame(int slot, CAN_message_t &frame)
+{
+    if (slot == cmdSlot) buildCmd(frame);
+}
+
+void TCCHChargerController::buildCmd(CAN_message_t &output)
 {
     TCCHChargerConfiguration *config = (TCCHChargerConfiguration *)getConfiguration();
 
-    CAN_message_t output;
     output.len = 8;
     output.id = 0x1806E5F4;
     output.flags.extended = 1;
@@ -89,7 +103,6 @@ void TCCHChargerController::sendCmd()
     output.buf[6] = 0; //unused
     output.buf[7] = 0; //unused
 
-    attachedCANBus->sendFrame(output);
     Logger::debug("TCCH Charger cmd: %X %X %X %X %X %X %X %X %X ",output.id, output.buf[0],
                   output.buf[1],output.buf[2],output.buf[3],output.buf[4],output.buf[5],output.buf[6],output.buf[7]);
     crashHandler.addBreadcrumb(ENCODE_BREAD("TCCHC") + 1);
@@ -34,10 +34,20 @@ void DelphiDCDCController::setup()
     entry = {"DELPHIDCDC-CANBUS", "Set which CAN bus to connect to (0-2)", &config->canbusNum, CFG_ENTRY_VAR_TYPE::BYTE, 0, 2, 0, nullptr};
     cfgEntries.push_back(entry);
 
+    //setup() runs again after config changes. Start from scratch so nothing is attached or scheduled twice
+    cmdSlot = -1;
+    attachedCANBus->detachAll(this);
     setAttachedCANBus(config->canbusNum);
+    dependsOnCanBus(config->canbusNum);
 
     attachedCANBus->attach(this, 0x1D5, 0x7ff, false);
     //Watch for 0x1D5 messages from Delphi converter
+
+    //the command frame goes out on the CAN handler's hardware timer so it keeps coming steadily however busy the main loop is
+    CAN_message_t output;
+    buildCmd(output);
+    cmdSlot = attachedCANBus->addPeriodic(this, output, CFG_TICK_INTERVAL_DCDC);
+
     tickHandler.attach(this, CFG_TICK_INTERVAL_DCDC);
     crashHandler.addBreadcrumb(ENCODE_BREAD("DELPH") + 0);
 }
@@ -47,7 +57,12 @@ void DelphiDCDCController::handleTick()
 {
     DCDCController::handleTick(); //kick the ball up to papa
 
-    sendCmd();   //Send our Delphi voltage control command
+    //the command frame itself goes out on the CAN periodic schedule, see handlePeriodicFrame()
+}
+
+void DelphiDCDCController::handlePeriodicFrame(int slot, CAN_message_t &frame)
+{
+    if (slot == cmdSlot) buildCmd(frame);
 }
 
 
@@ -66,11 +81,10 @@ This still allows for a max output of 16v which is way too much. So, it's a suff
 12v output it seems like.
 */
 
-void DelphiDCDCController::sendCmd()
+void DelphiDCDCController::buildCmd(CAN_message_t &output)
 {
     DelphiDCDCConfiguration *config = (DelphiDCDCConfiguration *)getConfiguration();
 
-    CAN_message_t output;
     output.len = 8;
     output.id = 0x1D7;
     output.flags.extended = 0; //standard frame
@@ -83,7 +97,6 @@ void DelphiDCDCController::sendCmd()
     output.buf[6] = 0;
     output.buf[7] = 0x00;
 
-    attachedCANBus->sendFrame(output);
     timestamp();
     Logger::debug("Delphi DC-DC cmd: %X %X %X %X %X %X %X %X %X  %d:%d:%d.%d",output.id, output.buf[0],
                   output.buf[1],output.buf[2],output.buf[3],output.buf[4],output.buf[5],output.buf[6],output.buf[7], hours, minutes, seconds, milliseconds);
@@ -52,6 +52,8 @@ class DelphiDCDCController: public DCDCController, CanObserver {
 public:
     virtual void handleTick();
     virtual void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
+    virtual void handlePeriodicFrame(int slot, CAN_message_t &frame);
     virtual void setup();
     virtual void earlyInit();
 
@@ -68,7 +70,8 @@ private:
     int seconds;
     int minutes;
     int hours;
-    void sendCmd();
+    int cmdSlot; //CAN periodic slot of the command frame
+    void buildCmd(CAN_message_t &output);
 };
 
 #endif /* DDCDC_H_ */
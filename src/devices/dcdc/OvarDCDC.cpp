@@ -26,10 +26,20 @@ void OvarDCDCController::setup()
     entry = {"OVARDCDC-CANBUS", "Set which CAN bus to connect to (0-2)", &config->canbusNum, CFG_ENTRY_VAR_TYPE::BYTE, 0, 2, 0, nullptr};
     cfgEntries.push_back(entry);
 
+    //setup() runs again after config changes. Start from scratch so nothing is attached or scheduled twice
+    cmdSlot = -1;
+    attachedCANBus->detachAll(this);
     setAttachedCANBus(config->canbusNum);
+    dependsOnCanBus(config->canbusNum);
 
     //watch for the DC/DC status message
     attachedCANBus->attach(this, 0x1806F4D5, 0x1FFFFFFF, true);
+
+    //the command frame goes out on the CAN handler's hardware timer so it keeps coming steadily however busy the main loop is
+    CAN_message_t output;
+    buildCmd(output);
+    cmdSlot = attachedCANBus->addPeriodic(this, output, CFG_TICK_INTERVAL_DCDC);
+
     tickHandler.attach(this, CFG_TICK_INTERVAL_DCDC);
     crashHandler.addBreadcrumb(ENCODE_BREAD("OVRDC") + 0);
 }
@@ -63,14 +73,18 @@ void OvarDCDCController::handleTick()
 {
     DCDCController::handleTick(); //kick the ball up to papa
 
-    sendCmd();   //Send our Delphi voltage control command
+    //the command frame itself goes out on the CAN periodic schedule, see handlePeriodicFrame()
 }
 
-void OvarDCDCController::sendCmd()
+void OvarDCDCController::handlePeriodicFrame(int slot, CAN_message_t &frame)
+{
+    if (slot == cmdSlot) buildCmd(frame);
+}
+
+void OvarDCDCController::buildCmd(CAN_message_t &output)
 {
     OvarDCDCConfiguration *config = (OvarDCDCConfiguration *)getConfiguration();
 
-    CAN_message_t output;
     output.len = 8;
     output.id = 0x1806D5F4;
     output.flags.extended = 1;
@@ -83,7 +97,6 @@ void OvarDCDCController::sendCmd()
     output.buf[6] = 0;
     output.buf[7] = 0;
 
-    attachedCANBus->sendFrame(output);
     Logger::debug("Ovar DC-DC cmd: %X %X %X %X %X %X %X %X %X",output.id, output.buf[0],
                   output.buf[1],output.buf[2],output.buf[3],output.buf[4],output.buf[5],output.buf[6],output.buf[7]);
     crashHandler.addBreadcrumb(ENCODE_BREAD("OVRDC") + 1);
@@ -50,6 +50,8 @@ class OvarDCDCController: public DCDCController, CanObserver {
 public:
     virtual void handleTick();
     virtual void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
+    virtual void handlePeriodicFrame(int slot, CAN_message_t &frame);
     virtual void setup();
     virtual void earlyInit();
 
@@ -62,5 +64,6 @@ public:
     virtual void saveConfiguration();
 
 private:
-    void sendCmd();
+    int cmdSlot; //CAN periodic slot of the command frame
+    void buildCmd(CAN_message_t &output);
 };
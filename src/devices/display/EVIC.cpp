@@ -66,6 +66,11 @@ void EVIC::setup() {
 
     Device::setup(); // run the parent class version of this function
 
+    //setup() runs again after config changes. Start from scratch so nothing is attached or scheduled twice
+    cmdSlot[0] = cmdSlot[1] = cmdSlot[2] = -1;
+    canHandlerBus0.detachAll(this);
+    canHandlerBus1.detachAll(this);
+
     // register ourselves as observer of all 0x404 and 0x505 can frames from JLD505
     canHandlerBus1.attach(this, 0x404, 0x7ff, false);
     canHandlerBus1.attach(this, 0x505, 0x7ff, false);
@@ -163,20 +168,52 @@ void EVIC::handleCanFrame(const CAN_message_t &frame)
     }
 }
 
+TickPriority EVIC::getTickPriority()
+{
+    return TICK_PRIORITY_TELEMETRY;
+}
+
 //This method handles periodic tick calls received from the tasker.
 
 void EVIC::handleTick()
 {
+    //The frames go out on the CAN handler's hardware timer so the display sees them every 100ms no matter
+    //how busy the main loop is. They're scheduled on the first tick, not in setup(), because the first one
+    //goes right away and needs the motor controller to be set up already.
+    for (int i = 0; i < 3; i++)
+    {
+        if (cmdSlot[i] >= 0) continue;
+        CAN_message_t output;
+        buildFrame(i, output);
+        cmdSlot[i] = canHandlerBus1.addPeriodic(this, output, CFG_TICK_INTERVAL_EVIC, i * 1000);
+    }
+}
 
-    if(testMode==0)
+void EVIC::handlePeriodicFrame(int slot, CAN_message_t &frame)
+{
+    for (int i = 0; i < 3; i++)
     {
-        sendCmdCurtis();
-        sendCmdOrion();
+        if (slot == cmdSlot[i]) buildFrame(i, frame);
     }
-    else
+}
+
+//frame 0 is the Curtis frame, 1 and 2 the two Orion BMS frames
+void EVIC::buildFrame(int which, CAN_message_t &output)
+{
+    switch (which)
     {
-        sendTestCmdCurtis();
-        sendTestCmdOrion();
+    case 0:
+        if (testMode) buildTestCmdCurtis(output);
+        else buildCmdCurtis(output);
+        break;
+    case 1:
+        if (testMode) buildTestCmdOrion(output);
+        else buildCmdOrion(output);
+        break;
+    case 2:
+        if (testMode) buildTestCmdOrionSOC(output);
+        else buildCmdOrionSOC(output);
+        break;
     }
 }
 
@@ -193,7 +230,7 @@ motor_amps	  40	16	0.1	0	-1000	2000	amps     signed
 motor_voltage	  56	16	0.1	0	0	1000	volts    signed
 */
 
-void EVIC::sendTestCmdCurtis()
+void EVIC::buildTestCmdCurtis(CAN_message_t &output)
 {
     rpm++;  //Increment all our test variables each time
     DCV++;
@@ -201,7 +238,6 @@ void EVIC::sendTestCmdCurtis()
     TEMPM++;
     TEMPI++;
 
-    CAN_message_t output;
     output.len = 8;
     output.id = 0x601;
     output.flags.extended = 0; //standard frame
@@ -214,8 +250,6 @@ void EVIC::sendTestCmdCurtis()
     output.buf[6] = highByte(DCV);
     output.buf[7] = lowByte(DCV);
 
-    canHandlerBus1.sendFrame(output);  //Mail it.
-
     timestamp();
 
     Logger::debug("EVIC Message: %X  %X %X %X %X %X %X %X %X  %d:%d:%d.%d",output.id, output.buf[0],
@@ -223,10 +257,9 @@ void EVIC::sendTestCmdCurtis()
 
 }
 
-void EVIC::sendTestCmdOrion()
+void EVIC::buildTestCmdOrion(CAN_message_t &output)
 {
     AH--;
-    CAN_message_t output;
     output.len = 8;
     output.id = 0x150;
     output.flags.extended = 0; //standard frame
@@ -239,13 +272,14 @@ void EVIC::sendTestCmdOrion()
     output.buf[6] = 0;  //Cell temp
     output.buf[7] = 0; //Cell temp
 
-    canHandlerBus1.sendFrame(output);  //Mail it.
     timestamp();
 
     Logger::debug("Orion Message1: %X  %X %X %X %X %X %X %X %X  %d:%d:%d.%d",output.id, output.buf[0],
                   output.buf[1],output.buf[2],output.buf[3],output.buf[4],output.buf[5],output.buf[6],output.buf[7], hours, minutes, seconds, milliseconds);
+}
 
-    //CAN_FRAME output;
+void EVIC::buildTestCmdOrionSOC(CAN_message_t &output)
+{
     output.len = 8;
     output.id = 0x650;
     output.flags.extended = 0; //standard frame
@@ -258,7 +292,6 @@ void EVIC::sendTestCmdOrion()
     output.buf[6] = 0;  //pack cycles MSB
     output.buf[7] = 0; //pack cycles LSB
 
-    canHandlerBus1.sendFrame(output);  //Mail it.
     timestamp();
 
     Logger::debug("Orion Message2: %X  %X %X %X %X %X %X %X %X  %d:%d:%d.%d",output.id, output.buf[0],
@@ -266,7 +299,7 @@ void EVIC::sendTestCmdOrion()
 
 }
 
-void EVIC::sendCmdCurtis()
+void EVIC::buildCmdCurtis(CAN_message_t &output)
 {
 
     MotorController* motorController = deviceManager.getMotorController();
@@ -277,7 +310,6 @@ void EVIC::sendCmdCurtis()
         dcVoltage=motorController->getDcVoltage();
 
     }
-    CAN_message_t output;
     output.len = 8;
     output.id = 0x601;
     output.flags.extended = 0; //standard frame
@@ -290,14 +322,13 @@ void EVIC::sendCmdCurtis()
     output.buf[6] = highByte(dcVoltage);
     output.buf[7] = lowByte(dcVoltage);
 
-    canHandlerBus1.sendFrame(output);  //Mail it.
     timestamp();
     Logger::debug("EVIC Message: %X  %X %X %X %X %X %X %X %X  %d:%d:%d.%d",output.id, output.buf[0],
                   output.buf[1],output.buf[2],output.buf[3],output.buf[4],output.buf[5],output.buf[6],output.buf[7], hours, minutes, seconds, milliseconds);
 
 }
 
-void EVIC::sendCmdOrion()
+void EVIC::buildCmdOrion(CAN_message_t &output)
 {
     elapsedtime = (millis() - timemark2);
     timemark2=millis();
@@ -333,7 +364,6 @@ void EVIC::sendCmdOrion()
     }
     //Provisional calculation from motorcontroller values is complete.  Or else we skipped all that anyway.
     //Assemble the output frame
-    CAN_message_t output;
     output.len = 8;
     output.id = 0x150;
     output.flags.extended = 0; //standard frame
@@ -346,11 +376,14 @@ void EVIC::sendCmdOrion()
     output.buf[6] = CellHi;  //Cell temp
     output.buf[7] = Cello; //Cell temp
 
-    canHandlerBus1.sendFrame(output);  //Mail it.
     timestamp();
     Logger::debug("Orion Message1: %X  %X %X %X %X %X %X %X %X  %d:%d:%d.%d",output.id, output.buf[0],
                   output.buf[1],output.buf[2],output.buf[3],output.buf[4],output.buf[5],output.buf[6],output.buf[7], hours, minutes, seconds, milliseconds);
+}
 
+//SOC frame. Built right after the one above so it carries the SOC just worked out there
+void EVIC::buildCmdOrionSOC(CAN_message_t &output)
+{
     //Assemble our 650 frame output;
     output.len = 8;
     output.id = 0x650;
@@ -369,7 +402,6 @@ void EVIC::sendCmdOrion()
     output.buf[6] = 0;  //pack cycles MSB
     output.buf[7] = 0; //pack cycles LSB
 
-    canHandlerBus1.sendFrame(output);  //Mail it.
     timestamp();
     Logger::debug("Orion Message2: %X  %X %X %X %X %X %X %X %X  %d:%d:%d.%d",output.id, output.buf[0],
                   output.buf[1],output.buf[2],output.buf[3],output.buf[4],output.buf[5],output.buf[6],output.buf[7], hours, minutes, seconds, milliseconds);
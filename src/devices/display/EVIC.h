@@ -57,7 +57,10 @@ public:
     EVIC();
     //EVIC(USARTClass *which);
     virtual void handleTick();
+    virtual TickPriority getTickPriority();
     virtual void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
+    virtual void handlePeriodicFrame(int slot, CAN_message_t &frame);
 
     virtual void setup(); //initialization on start up
     void earlyInit();
@@ -109,10 +112,13 @@ public:
     uint8_t Cello;
 
 private:
-    void sendTestCmdCurtis();
-    void sendTestCmdOrion();
-    void sendCmdCurtis();
-    void sendCmdOrion();
+    void buildFrame(int which, CAN_message_t &output);
+    void buildTestCmdCurtis(CAN_message_t &output);
+    void buildTestCmdOrion(CAN_message_t &output);
+    void buildTestCmdOrionSOC(CAN_message_t &output);
+    void buildCmdCurtis(CAN_message_t &output);
+    void buildCmdOrion(CAN_message_t &output);
+    void buildCmdOrionSOC(CAN_message_t &output);
 
     double AHf;
     double milliAH;
@@ -128,6 +134,7 @@ private:
     int8_t TEMPI;
 
     int tickCounter;
+    int cmdSlot[3]; //CAN periodic slots of the Curtis frame and the two Orion frames
     char buffer[30]; // a buffer for various string conversions
     uint32_t lastSentTime;
     boolean weHave505;
@@ -35,13 +35,6 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 UDSController udsctrl; //declared up here because it is actually used in this code.
 
-isotp<RX_BANKS_2, 512> udsIsoTPTargetted;
-isotp<RX_BANKS_2, 512> udsIsoTPBroadcast;
-
-extern FlexCAN_T4<CAN1, RX_SIZE_256, TX_SIZE_16> Can0;
-extern FlexCAN_T4<CAN2, RX_SIZE_256, TX_SIZE_16> Can1;
-extern FlexCAN_T4<CAN3, RX_SIZE_256, TX_SIZE_16> Can2;
-
 /*
 Basic firmware updating idea - use UDS commands but as simply as possible. First off, the other side
 must ask for security access level 3 and pass the chal/response. The challenge is 32 bits long
@@ -55,20 +48,28 @@ that does this is RAM resident this should work without crashing anything.
 
 */
 
-//bouncy bounce. Call the member function and that's all.
-void udsCallback(const ISOTP_data &iso_config, const uint8_t *buf)
+//Replies always go out through the targetted session. CanHandler sends them from sendBuffer a frame
+//at a time as the tester's flow control allows so sendBuffer can't be touched until that is done.
+void UDSController::sendReply(uint16_t length)
 {
-    udsctrl.handleIsoTP(iso_config, buf);
+    if (!udsBus->sendISOTP(targetSession, sendBuffer, length))
+    {
+        Logger::warn("UDS reply dropped, still sending the last one");
+    }
 }
 
-void UDSController::handleIsoTP(const ISOTP_data &iso_config, const uint8_t *buf)
+void UDSController::handleISOTPMessage(int session, const uint8_t *buf, uint16_t length)
 {
     UDSConfiguration* config = (UDSConfiguration *)getConfiguration();
-    ISOTP_data reply;
     uint32_t firmwareSize;
     uint32_t firmwareAddr;
 
     Logger::debug("UDS SID: %X config: %X", buf[0], config);
+    if (udsBus->isISOTPBusy(targetSession)) //tester didn't wait for the last reply, sendBuffer is still in use
+    {
+        Logger::warn("UDS request %X ignored, still sending the last reply", buf[0]);
+        return;
+    }
 
     switch (buf[0]) //first data byte is the UDS/OBDII function code
     {
@@ -77,11 +78,7 @@ void UDSController::handleIsoTP(const ISOTP_data &iso_config, const uint8_t *buf
         {
             sendBuffer[0] = buf[0] + 0x40; //0x40 signifies a reply instead of a request
             sendBuffer[1] = buf[1]; //which PID are we replying to?
-            reply.id = config->udsTx;
-            reply.flags.extended = config->useExtended;
-            reply.flags.usePadding = 1;
-            reply.separation_time = 1;
-            udsIsoTPTargetted.write(reply, sendBuffer, sendBuffer[511] + 2);
+            sendReply(sendBuffer[511] + 2);
         }
         break;
     case OBDII_SHOW_STORED_DTC: //should support this some day.
@@ -96,10 +93,6 @@ void UDSController::handleIsoTP(const ISOTP_data &iso_config, const uint8_t *buf
         Logger::debug("UDS Security Access");
         sendBuffer[0] = buf[0] + 0x40; //0x40 signifies a reply instead of a request
         sendBuffer[1] = buf[1]; //which security level are we replying to?        
-        reply.id = config->udsTx;
-        reply.flags.extended = config->useExtended;
-        reply.flags.usePadding = 1;
-        reply.separation_time = 1;
 
         if (buf[1] == 3) //requesting challenge seed
         {
@@ -115,7 +108,7 @@ void UDSController::handleIsoTP(const ISOTP_data &iso_config, const uint8_t *buf
             {
                 for (int i = 0; i < 4; i++) sendBuffer[i + 2] = 0; //all 0's means we're already unlocked
             }
-            udsIsoTPTargetted.write(reply, sendBuffer, 6);
+            sendReply(6);
         }
         else if (buf[1] == 4) //trying to unlock with response
         {
@@ -123,14 +116,14 @@ void UDSController::handleIsoTP(const ISOTP_data &iso_config, const uint8_t *buf
             if (validateResponse(&buf[2])) //enter security mode and confirm this with our reply
             {
                 inSecurityMode = true;
-                udsIsoTPTargetted.write(reply, sendBuffer, 2); //just 0x67 and security level means A-OK
+                sendReply(2); //just 0x67 and security level means A-OK
             }
             else //return "nice try, so sad"
             {
                 sendBuffer[0] = 0x7F; //the byte of doooooom
                 sendBuffer[1] = UDS_SECURITY_ACCESS; //The negative reply corresponds to this SID
                 sendBuffer[2] = 0x35; //invalid key!
-                udsIsoTPTargetted.write(reply, sendBuffer, 3);
+                sendReply(3);
                 generatedSeed = false; //can't try again on this seed!
             }
         }                
@@ -156,7 +149,7 @@ void UDSController::handleIsoTP(const ISOTP_data &iso_config, const uint8_t *buf
             sendBuffer[1] = 0x20; //16 bit reply with max packet size
             sendBuffer[2] = 0x1;
             sendBuffer[3] = 2;   //0x102 is 258 bytes.
-            udsIsoTPTargetted.write(reply, sendBuffer, 4);
+            sendReply(4);
         break;
     case UDS_TRANSFER_DATA: //a chunk of firmware data
         //buf[1] has the block sequence counter which had better be going up by one each time. Must fault
@@ -173,6 +166,9 @@ void UDSController::handleIsoTP(const ISOTP_data &iso_config, const uint8_t *buf
 UDSController::UDSController() : Device() {
     inSecurityMode = false;
     generatedSeed = false;
+    udsBus = &canHandlerBus0;
+    targetSession = -1;
+    broadcastSession = -1;
     commonName = "UDS Controller";
     shortName = "UDS";
 }
@@ -203,47 +199,35 @@ void UDSController::setup() {
     cfgEntries.push_back(entry);
     entry = {"UDS_BROADCAST", "Should GEVCU listen on broadcast address? (0=No 1=Yes)", &config->listenBroadcast, CFG_ENTRY_VAR_TYPE::BYTE, 0, 1, 0, nullptr};
     cfgEntries.push_back(entry);
-    entry = {"UDS_BUS", "Listen on which bus? CAN0=1, CAN1=1, CAN2=2", &config->udsBus, CFG_ENTRY_VAR_TYPE::BYTE, 0, 2, 0, nullptr};
+    entry = {"UDS_BUS", "Listen on which bus? CAN0=1, CAN1=2, CAN2=3", &config->udsBus, CFG_ENTRY_VAR_TYPE::BYTE, 1, 3, 0, nullptr};
+    cfgEntries.push_back(entry);
+    entry = {"UDS_FD", "Use CAN-FD ISO-TP with 64 byte frames? Only on CAN2 (0=No 1=Yes)", &config->useFD, CFG_ENTRY_VAR_TYPE::BYTE, 0, 1, 0, nullptr};
     cfgEntries.push_back(entry);
 
-    udsIsoTPTargetted.begin();
-    udsIsoTPTargetted.setBoundID(config->udsRx);
-    udsIsoTPTargetted.setBoundBus(config->udsBus);
-    udsIsoTPTargetted.setPadding(0xAA);
+    //setup() can run again after a config change. Start over with fresh sessions, maybe on another bus
+    udsBus->closeISOTP(targetSession);
+    udsBus->closeISOTP(broadcastSession);
+    targetSession = -1;
+    broadcastSession = -1;
 
     switch (config->udsBus)
     {
-    case 1:
-        udsIsoTPTargetted.setWriteBus(&Can0);
-        break;
     case 2:
-        udsIsoTPTargetted.setWriteBus(&Can1);
+        udsBus = &canHandlerBus1;
         break;
     case 3:
-        udsIsoTPTargetted.setWriteBus(&Can2);
+        udsBus = &canHandlerBus2;
+        break;
+    default:
+        udsBus = &canHandlerBus0;
         break;
     }
 
-    udsIsoTPTargetted.onReceive(udsCallback);
-
+    targetSession = udsBus->openISOTP(this, config->udsRx, config->udsTx, config->useExtended, recvBuffer, sizeof(recvBuffer), config->useFD);
+    if (targetSession < 0) Logger::error("UDS could not get an ISO-TP session");
     if (config->listenBroadcast)
     {
-        udsIsoTPBroadcast.begin();
-        udsIsoTPBroadcast.setBoundID(0x7DF);
-        udsIsoTPBroadcast.setBoundBus(config->udsBus);
-        switch (config->udsBus)
-        {
-        case 1:
-            udsIsoTPBroadcast.setWriteBus(_CAN1);
-            break;
-        case 2:
-            udsIsoTPBroadcast.setWriteBus(_CAN2);
-            break;
-        case 3:
-            udsIsoTPBroadcast.setWriteBus(_CAN3);
-            break;
-        }
-        udsIsoTPBroadcast.onReceive(udsCallback);
+        broadcastSession = udsBus->openISOTP(this, 0x7DF, config->udsTx, false, broadcastBuffer, sizeof(broadcastBuffer), config->useFD);
     }
     
 /*    
@@ -475,6 +459,11 @@ bool UDSController::validateResponse(const uint8_t *bytes)
     return true;
 }
 
+TickPriority UDSController::getTickPriority()
+{
+    return TICK_PRIORITY_TELEMETRY;
+}
+
 void UDSController::handleTick()
 {
 
@@ -499,6 +488,7 @@ void UDSController::loadConfiguration() {
     prefsHandler->read("udsUseExtended", &config->useExtended, 0);
     prefsHandler->read("udsBus", &config->udsBus, 1);
     prefsHandler->read("udsListenBroadcast", &config->listenBroadcast, 0);
+    prefsHandler->read("udsCanFD", &config->useFD, 0);
 }
 
 /*
@@ -514,6 +504,7 @@ void UDSController::saveConfiguration() {
     prefsHandler->write("udsUseExtended", config->useExtended);
     prefsHandler->write("udsBus", config->udsBus);
     prefsHandler->write("udsListenBroadcast", config->listenBroadcast);
+    prefsHandler->write("udsCanFD", config->useFD);
     prefsHandler->saveChecksum();
     prefsHandler->forceCacheWrite();
 }
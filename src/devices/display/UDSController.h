@@ -29,7 +29,6 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <Arduino.h>
 #include <FlexCAN_T4.h>
-#include <isotp.h>
 #include "../../config.h"
 #include "../io/Throttle.h"
 #include "../../DeviceManager.h"
@@ -104,6 +103,7 @@ public:
     uint8_t useExtended;
     uint8_t udsBus; //which bus to listen on
     uint8_t listenBroadcast; //also listen on 0x7DF?
+    uint8_t useFD; //64 byte CAN-FD ISO-TP frames. CAN2 only
 };
 
 class UDSController: public Device, CanObserver {
@@ -112,8 +112,10 @@ public:
     void setup();
     void earlyInit();
     void handleTick();
+    TickPriority getTickPriority();
     void handleCanFrame(const CAN_message_t &frame);
-    void handleIsoTP(const ISOTP_data &iso_config, const uint8_t *buf);
+    CanObserver *asCanObserver() { return this; }
+    void handleISOTPMessage(int session, const uint8_t *buf, uint16_t length);
     DeviceId getId();
 
     void loadConfiguration();
@@ -126,6 +128,12 @@ private:
     bool processShowCustomData(const CAN_message_t &inFrame, CAN_message_t& outFrame);
     void generateChallenge();
     bool validateResponse(const uint8_t *bytes);
+    void sendReply(uint16_t length);
+    CanHandler *udsBus;
+    int targetSession; //physical requests (and flow control for our replies) come in here
+    int broadcastSession; //functional requests on 0x7DF. Those are single frames so replies go out on targetSession
+    uint8_t recvBuffer[512];
+    uint8_t broadcastBuffer[64]; //functional requests are always single frames
     uint8_t sendBuffer[512];
     uint8_t challenge[4];
     bool inSecurityMode;
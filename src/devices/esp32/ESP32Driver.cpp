@@ -66,7 +66,17 @@ if the ESP32 side changes the value it must reply back with the change:
     "Valu":"New Value"
 }
 GEVCU knows the way the value should be interpreted so it can process things
-and do the actual setting update.
+and do the actual setting update. Several settings of one device can be changed
+at once and they are then saved together, all or none of them. If any setting
+is unknown or out of range none of them are changed:
+{
+    "DeviceID":"0x1000",
+    "Settings":[
+        {"CfgName":"SomeSetting", "Valu":"New Value"},
+        {"CfgName":"OtherSetting", "Valu":"12"}
+    ]
+}
+Device IDs can be sent as hex strings like above or as plain numbers.
 
 For #4 there is a special method:
 Send 0xB0 followed by the desired log number (0=current, 1-4 are historical)
@@ -178,6 +188,8 @@ ESP32Driver::ESP32Driver() : Device()
     shortName = "ESP32";
     currState = ESP32NS::RESET;
     desiredState = ESP32NS::RESET;
+    resetStep = 0;
+    resetTime = 0;
     systemAlive = false;
     systemEnabled = false;
 }
@@ -233,6 +245,12 @@ void ESP32Driver::setup()
     crashHandler.addBreadcrumb(ENCODE_BREAD("ESPTT") + 0);
 }
 
+//started once it is out of reset. It won't have booted yet but nothing else needs to wait for that
+SetupStatus ESP32Driver::setupStatus()
+{
+    return (currState == ESP32NS::NORMAL) ? SETUP_DONE : SETUP_PENDING;
+}
+
 void ESP32Driver::disableDevice()
 {
     Device::disableDevice(); //do the common stuff first
@@ -243,6 +261,10 @@ void ESP32Driver::disableDevice()
     fileSender = nullptr;
 }
 
+TickPriority ESP32Driver::getTickPriority() {
+    return TICK_PRIORITY_TELEMETRY;
+}
+
 void ESP32Driver::handleTick() {
 
     Device::handleTick(); //kick the ball up to papa
@@ -252,14 +274,26 @@ void ESP32Driver::handleTick() {
     {
         if (desiredState == ESP32NS::NORMAL)
         {
-            //TODO: this is naughty code! No delays allowed! Refactor this to remove the delays (use state machine?)
-            digitalWrite(ESP32_BOOT, HIGH);
-            digitalWrite(ESP32_ENABLE, LOW);
-            delay(40);
-            digitalWrite(ESP32_ENABLE, HIGH);
-            if (sysConfig->systemType == GEVCU7B) delay(400); //seems we have to wait this long otherwise it won't stick
-            else delay(40);
-            currState = ESP32NS::NORMAL;
+            //the reset pulse is spread over a few ticks so nothing else has to wait on it
+            if (resetStep == 0)
+            {
+                digitalWrite(ESP32_BOOT, HIGH);
+                digitalWrite(ESP32_ENABLE, LOW);
+                resetTime = millis();
+                resetStep = 1;
+            }
+            else if (resetStep == 1 && (millis() - resetTime) >= 40)
+            {
+                digitalWrite(ESP32_ENABLE, HIGH);
+                resetTime = millis();
+                resetStep = 2;
+            }
+            //7B seems to need 400ms otherwise it won't stick
+            else if (resetStep == 2 && (millis() - resetTime) >= ((sysConfig->systemType == GEVCU7B) ? 400u : 40u))
+            {
+                resetStep = 0;
+                currState = ESP32NS::NORMAL;
+            }
         }
     }
     crashHandler.updateBreadcrumb(2); //nothing above would add a breadcrumb so update the existing one
@@ -303,14 +337,20 @@ void ESP32Driver::processSerial()
                         {
                             sendDeviceList();
                         }
+#ifdef CFG_TICK_PROFILING
+                        if (doc["GetTickProfile"] == 1)
+                        {
+                            sendTickProfile();
+                        }
+#endif
 
-                        uint16_t devID = doc["GetDevConfig"];
+                        uint16_t devID = jsonDeviceID(doc["GetDevConfig"]);
                         if (devID > 0)
                         {
                             sendDeviceDetails(devID);
                         }
 
-                        devID = doc["DeviceID"];
+                        devID = jsonDeviceID(doc["DeviceID"]);
                         if (devID > 0)
                         {
                             processConfigReply(&doc);
@@ -358,6 +398,19 @@ void ESP32Driver::sendDeviceList()
     Serial.println();
 }
 
+#ifdef CFG_TICK_PROFILING
+//handleTick() timing for every device. Request with {"GetTickProfile":1}
+void ESP32Driver::sendTickProfile()
+{
+    DynamicJsonDocument doc(6000);
+
+    tickHandler.createJsonProfile(doc);
+
+    serializeJson(doc, Serial2);
+    Serial2.println();
+}
+#endif
+
 void ESP32Driver::sendDeviceDetails(uint16_t deviceID)
 {
     Device *dev = nullptr;
@@ -377,9 +430,77 @@ void ESP32Driver::sendDeviceDetails(uint16_t deviceID)
     //Serial.println();
 }
 
+//device IDs go out as "0x1000" strings but a plain number is fine too
+uint16_t ESP32Driver::jsonDeviceID(JsonVariant id)
+{
+    if (id.is<const char*>()) return strtoul(id.as<const char*>(), NULL, 0);
+    return id.as<uint16_t>();
+}
+
+//look up one CfgName/Valu pair and check the value against the limits of its config entry without setting it.
+//Returns the entry with the value as text in valu, or NULL if the setting can't be applied
+const ConfigEntry *ESP32Driver::checkConfigValue(Device *dev, JsonVariant setting, char *valu, size_t len)
+{
+    const char *name = setting["CfgName"];
+    JsonVariant value = setting["Valu"];
+
+    if (!name || value.isNull())
+    {
+        Logger::warn("Config reply for device %X without CfgName or Valu", dev->getId());
+        return NULL;
+    }
+    const ConfigEntry *entry = dev->findConfigEntry(name);
+    if (!entry)
+    {
+        Logger::warn("Device %X has no setting %s", dev->getId(), name);
+        return NULL;
+    }
+    if (value.is<const char*>()) snprintf(valu, len, "%s", value.as<const char*>());
+    else serializeJson(value, valu, len);
+    if (dev->setConfigValue(entry, valu, false) == CFG_VALUE_SET) return entry;
+    Logger::warn("%s is out of range for setting %s", valu, name);
+    return NULL;
+}
+
+//the ESP32 changed one or more settings of a device. See the top of this file for the format
 void ESP32Driver::processConfigReply(JsonDocument* doc)
 {
+    char valu[64];
+    const ConfigEntry *entry;
+    uint16_t devID = jsonDeviceID((*doc)["DeviceID"]);
+    Device *dev = deviceManager.getDeviceByID(devID);
+    if (!dev)
+    {
+        Logger::warn("Got settings for unknown device %X", devID);
+        return;
+    }
 
+    JsonArray settings = (*doc)["Settings"];
+    if (settings.isNull())
+    {
+        entry = checkConfigValue(dev, doc->as<JsonVariant>(), valu, sizeof(valu));
+        if (!entry) return;
+        dev->setConfigValue(entry, valu);
+    }
+    else
+    {
+        if (settings.size() == 0) return;
+        //all or none. Check every setting before changing any of them
+        for (JsonVariant setting : settings)
+        {
+            if (!checkConfigValue(dev, setting, valu, sizeof(valu)))
+            {
+                Logger::warn("Settings for device %X rejected, none were changed", devID);
+                return;
+            }
+        }
+        for (JsonVariant setting : settings)
+        {
+            entry = checkConfigValue(dev, setting, valu, sizeof(valu));
+            dev->setConfigValue(entry, valu);
+        }
+    }
+    dev->commitConfiguration();
 }
 
 
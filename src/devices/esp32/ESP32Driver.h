@@ -30,7 +30,9 @@ class ESP32Driver : public Device
 {
 public:
     virtual void handleTick();
+    virtual TickPriority getTickPriority();
     virtual void setup();
+    SetupStatus setupStatus();
     void earlyInit();
     void disableDevice();
     ESP32Driver();
@@ -45,11 +47,18 @@ private:
     void sendWirelessConfig();
     void sendDeviceList();
     void sendDeviceDetails(uint16_t deviceID);
+#ifdef CFG_TICK_PROFILING
+    void sendTickProfile();
+#endif
     void processConfigReply(JsonDocument* doc);
+    const ConfigEntry *checkConfigValue(Device *dev, JsonVariant setting, char *valu, size_t len);
+    uint16_t jsonDeviceID(JsonVariant id);
 
     String bufferedLine;
     ESP32NS::ESP32_STATE currState;
     ESP32NS::ESP32_STATE desiredState;
+    uint8_t resetStep; //how far along pulsing the enable line we are
+    uint32_t resetTime; //millis() of the last reset step
     bool systemAlive;
     bool systemEnabled;
     uint8_t serialReadBuffer[1024];
@@ -63,6 +63,7 @@ public:
 	void setup();
     void tearDown();
     void handleCanFrame(const CAN_message_t &);
+    CanObserver *asCanObserver() { return this; }
     void handleMessage(uint32_t, void*);
     void loadConfiguration();
     void saveConfiguration();
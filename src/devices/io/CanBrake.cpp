@@ -63,6 +63,7 @@ void CanBrake::setup() {
     cfgEntries.push_back(entry);
 
     setAttachedCANBus(config->canbusNum);
+    dependsOnCanBus(config->canbusNum);
 
     requestFrame.len = 0x08;
     requestFrame.flags.extended = 0x00;
@@ -62,6 +62,7 @@ void CanThrottle::setup() {
     cfgEntries.push_back(entry);
 
     setAttachedCANBus(config->canbusNum);
+    dependsOnCanBus(config->canbusNum);
 
     requestFrame.len = 0x08;
     requestFrame.flags.extended = 0x00;
@@ -58,6 +58,7 @@ public:
     void earlyInit();
     void handleTick();
     void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
     DeviceId getId();
 
     RawSignalData *acquireRawSignal();
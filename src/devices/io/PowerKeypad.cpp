@@ -44,6 +44,7 @@ void PowerkeyPad::setup()
     cfgEntries.push_back(entry);
 
     setAttachedCANBus(config->canbusNum);
+    dependsOnCanBus(config->canbusNum);
 
     attachedCANBus->attach(this, deviceID, 0x7F, false); //for canopen devices the ID and mask passed don't actually mean a thing
 	
@@ -68,6 +68,11 @@ void Throttle::setup()
 }
 
 
+//throttle and brake positions feed straight into the motor controller
+TickPriority Throttle::getTickPriority() {
+    return TICK_PRIORITY_CRITICAL;
+}
+
 /*
  * Controls the main flow of throttle data acquisiton, validation and mapping to
  * user defined behaviour.
@@ -100,6 +100,7 @@ public:
     Throttle();
     virtual int16_t getLevel();
     void handleTick();
+    TickPriority getTickPriority();
     virtual ThrottleStatus getStatus();
     virtual bool isFaulted();
     virtual DeviceType getType();
@@ -29,7 +29,7 @@
 /*
  * Constructor
  */
-HeatCoolController::HeatCoolController() : Device() {    
+HeatCoolController::HeatCoolController() : Device(), bmsHandle(DEVICE_BMS), motorHandle(DEVICE_MOTORCTRL), dcdcHandle(DEVICE_DCDC) {    
     commonName = "Heating and Cooling Controller";
     shortName = "HeatCool";
     isHeatOn = false;
@@ -125,9 +125,9 @@ void HeatCoolController::handleTick() {
         }
     }
 
-    BatteryManager *bms = static_cast<BatteryManager *>(deviceManager.getDeviceByType(DeviceType::DEVICE_BMS));
-    MotorController *mctl = static_cast<MotorController *>(deviceManager.getDeviceByType(DeviceType::DEVICE_MOTORCTRL));
-    DCDCController *dcdc = static_cast<DCDCController *>(deviceManager.getDeviceByType(DeviceType::DEVICE_DCDC));    
+    BatteryManager *bms = bmsHandle.get();
+    MotorController *mctl = motorHandle.get();
+    DCDCController *dcdc = dcdcHandle.get();
     if (bms && bms->hasTemperatures())
     {
         if (bms->getLowestTemperature() < config->heatOnTemperature)
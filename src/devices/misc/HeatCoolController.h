@@ -86,6 +86,9 @@ private:
     bool isHeatOn;
     bool isCoolOn[COOL_ZONES];
     bool isPumpOn;
+    DeviceHandle<BatteryManager> bmsHandle;
+    DeviceHandle<MotorController> motorHandle;
+    DeviceHandle<DCDCController> dcdcHandle;
 };
 
 #endif
@@ -29,7 +29,7 @@
 /*
  * Constructor
  */
-LightController::LightController() : Device() {    
+LightController::LightController() : Device(), motorHandle(DEVICE_MOTORCTRL), throttleHandle(DEVICE_THROTTLE), brakeHandle(DEVICE_BRAKE) {    
     commonName = "Light Controller";
     shortName = "LightCtrl";
 }
@@ -76,9 +76,9 @@ void LightController::handleTick() {
     //Logger::avalanche("Lighting Tick Handler");
 
     LightingConfiguration *config = (LightingConfiguration *) getConfiguration();
-    MotorController *mctl = static_cast<MotorController *>(deviceManager.getDeviceByType(DeviceType::DEVICE_MOTORCTRL));
-    Throttle *throttle = static_cast<Throttle *>(deviceManager.getDeviceByType(DeviceType::DEVICE_THROTTLE));
-    Throttle *brake = static_cast<Throttle *>(deviceManager.getDeviceByType(DeviceType::DEVICE_BRAKE));
+    MotorController *mctl = motorHandle.get();
+    Throttle *throttle = throttleHandle.get();
+    Throttle *brake = brakeHandle.get();
 
     if (config->brakeLightOutput < 255)
     {
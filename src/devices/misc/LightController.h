@@ -64,6 +64,9 @@ public:
 protected:
 
 private:
+    DeviceHandle<MotorController> motorHandle;
+    DeviceHandle<Throttle> throttleHandle;
+    DeviceHandle<Throttle> brakeHandle;
 };
 
 #endif
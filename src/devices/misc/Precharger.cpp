@@ -29,7 +29,7 @@
 /*
  * Constructor
  */
-Precharger::Precharger() : Device() {    
+Precharger::Precharger() : Device(), bmsHandle(DEVICE_BMS), motorHandle(DEVICE_MOTORCTRL) {    
     commonName = "Precharge Controller";
     shortName = "Precharge";
     state = PRECHARGE_INIT;
@@ -87,6 +87,11 @@ old status bitfield stuff from motorcontroller class. Should find a way to integ
 */
 
 
+//contactor sequencing. Being late here can weld contactors
+TickPriority Precharger::getTickPriority() {
+    return TICK_PRIORITY_CRITICAL;
+}
+
 /*
  * Process a timer event. This is where you should be doing checks and updates. 
  */
@@ -116,7 +121,7 @@ void Precharger::handleTick() {
         }
         if (config->prechargeType == PT_WAIT_FOR_VOLTAGE) 
         {
-            BatteryManager *bms = static_cast<BatteryManager *>(deviceManager.getDeviceByType(DeviceType::DEVICE_BMS));
+            BatteryManager *bms = bmsHandle.get();
             if (bms) targetVoltage = bms->getPackVoltage();
         }
         state = PRECHARGE_INPROGRESS;
@@ -138,7 +143,7 @@ void Precharger::handleTick() {
         }
         else if (config->prechargeType == PT_WAIT_FOR_VOLTAGE)
         {
-            MotorController *mc = static_cast<MotorController *>(deviceManager.getDeviceByType(DeviceType::DEVICE_MOTORCTRL));
+            MotorController *mc = motorHandle.get();
             if (mc)
             {
                 float progress = (float)mc->getDcVoltage() / (float)targetVoltage;
@@ -71,6 +71,7 @@ public:
     void setup();
     void earlyInit();
     void handleTick();
+    TickPriority getTickPriority();
     DeviceId getId();
     DeviceType getType();
 
@@ -84,6 +85,8 @@ private:
     uint32_t prechargeBeginTime;
     uint16_t targetVoltage;
     bool isPrecharged;
+    DeviceHandle<BatteryManager> bmsHandle;
+    DeviceHandle<MotorController> motorHandle;
 };
 
 #endif
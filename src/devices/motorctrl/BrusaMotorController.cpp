@@ -26,6 +26,50 @@
  */
 
 #include "BrusaMotorController.h"
+#include "CanSignal.h"
+
+//the DMC5 is big endian throughout
+//DMC_CTRL
+static constexpr CanSignalDef BRUSA_CTRL_FLAGS = {7, 8, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef BRUSA_CTRL_SPEED = {23, 16, CAN_MOTOROLA, true, 1.0f, 0.0f};
+static constexpr CanSignalDef BRUSA_CTRL_TORQUE = {39, 16, CAN_MOTOROLA, true, 0.01f, 0.0f};
+//DMC_CTRL2 and DMC_LIM are four unsigned words each
+static constexpr CanSignalDef BRUSA_WORD0 = {7, 16, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef BRUSA_WORD1 = {23, 16, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef BRUSA_WORD2 = {39, 16, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef BRUSA_WORD3 = {55, 16, CAN_MOTOROLA, false, 1.0f, 0.0f};
+//DMC_TRQS
+static constexpr CanSignalDef BRUSA_STATUS = {7, 16, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef BRUSA_TORQUE_AVAILABLE = {23, 16, CAN_MOTOROLA, true, 0.01f, 0.0f};
+static constexpr CanSignalDef BRUSA_TORQUE_ACTUAL = {39, 16, CAN_MOTOROLA, true, 0.01f, 0.0f};
+static constexpr CanSignalDef BRUSA_SPEED_ACTUAL = {55, 16, CAN_MOTOROLA, true, 1.0f, 0.0f};
+//DMC_ACTV
+static constexpr CanSignalDef BRUSA_DC_VOLTAGE = {7, 16, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef BRUSA_DC_CURRENT = {23, 16, CAN_MOTOROLA, true, 1.0f, 0.0f};
+static constexpr CanSignalDef BRUSA_AC_CURRENT = {39, 16, CAN_MOTOROLA, false, 0.4f, 0.0f};
+static constexpr CanSignalDef BRUSA_MECH_POWER = {55, 16, CAN_MOTOROLA, true, 0.16f, 0.0f};
+//DMC_TRQS2
+static constexpr CanSignalDef BRUSA_MAX_POSITIVE_TORQUE = {7, 16, CAN_MOTOROLA, true, 0.01f, 0.0f};
+static constexpr CanSignalDef BRUSA_MIN_NEGATIVE_TORQUE = {23, 16, CAN_MOTOROLA, true, 0.01f, 0.0f};
+static constexpr CanSignalDef BRUSA_LIMITER_STATE = {39, 8, CAN_MOTOROLA, false, 1.0f, 0.0f};
+//DMC_TEMP
+static constexpr CanSignalDef BRUSA_INVERTER_TEMP = {7, 16, CAN_MOTOROLA, true, 0.5f, 0.0f};
+static constexpr CanSignalDef BRUSA_MOTOR_TEMP = {23, 16, CAN_MOTOROLA, true, 0.5f, 0.0f};
+static constexpr CanSignalDef BRUSA_SYSTEM_TEMP = {39, 8, CAN_MOTOROLA, false, 1.0f, -50.0f};
+
+struct BrusaTorqueStatus
+{
+    uint16_t status;
+    float torqueAvailable;
+    float torqueActual;
+    int16_t speedActual;
+};
+
+typedef CanFrameLayout<BrusaTorqueStatus,
+        CAN_FIELD(BRUSA_STATUS, BrusaTorqueStatus, status),
+        CAN_FIELD(BRUSA_TORQUE_AVAILABLE, BrusaTorqueStatus, torqueAvailable),
+        CAN_FIELD(BRUSA_TORQUE_ACTUAL, BrusaTorqueStatus, torqueActual),
+        CAN_FIELD(BRUSA_SPEED_ACTUAL, BrusaTorqueStatus, speedActual)> BrusaTorqueStatusFrame;
 
 /*
  Warning:
@@ -105,46 +149,46 @@ void BrusaMotorController::handleTick() {
  */
 void BrusaMotorController::sendControl() {
     BrusaMotorControllerConfiguration *config = (BrusaMotorControllerConfiguration *)getConfiguration();
+    CanPayloadBuilder payload;
     prepareOutputFrame(CAN_ID_CONTROL);
 
-    speedRequested = 0;
-    torqueRequested = 0;
+    setStatus(speedRequested, 0);
+    setStatus(torqueRequested, 0);
 
-    outputFrame.buf[0] = enablePositiveTorqueSpeed; // | enableNegativeTorqueSpeed;
+    uint8_t flags = enablePositiveTorqueSpeed; // | enableNegativeTorqueSpeed;
     if (faulted) {
-        outputFrame.buf[0] |= clearErrorLatch;
+        flags |= clearErrorLatch;
     } else {
         if ((running || speedActual > 1000) && !systemIO.getDigitalIn(1)) { // see warning about field weakening current to prevent uncontrollable regen
-            outputFrame.buf[0] |= enablePowerStage;
+            flags |= enablePowerStage;
         }
         if (running) {
             if (config->enableOscillationLimiter)
-                outputFrame.buf[0] |= enableOscillationLimiter;
+                flags |= enableOscillationLimiter;
 
             if (powerMode == modeSpeed) {
-                outputFrame.buf[0] |= enableSpeedMode;
-                speedRequested = throttleRequested * config->speedMax / 1000;
-                torqueRequested = config->torqueMax; // positive number used for both speed directions
+                flags |= enableSpeedMode;
+                setStatus(speedRequested, throttleRequested * config->speedMax / 1000);
+                setStatus(torqueRequested, config->torqueMax); // positive number used for both speed directions
             } else { // torque mode
-                speedRequested = config->speedMax; // positive number used for both torque directions
-                torqueRequested = throttleRequested * config->torqueMax / 1000;
+                setStatus(speedRequested, config->speedMax); // positive number used for both torque directions
+                setStatus(torqueRequested, throttleRequested * config->torqueMax / 1000);
             }
 
             // set the speed in rpm
-            outputFrame.buf[2] = (speedRequested & 0xFF00) >> 8;
-            outputFrame.buf[3] = (speedRequested & 0x00FF);
+            payload.set<BRUSA_CTRL_SPEED>(speedRequested);
 
-            // set the torque in 0.01Nm (GEVCU uses Nm -> multiply by 100)
-            int16_t torq = torqueRequested * 100;
-            outputFrame.buf[4] = (torq & 0xFF00) >> 8;
-            outputFrame.buf[5] = (torq & 0x00FF);
+            // set the torque, sent in 0.01Nm
+            payload.setValue<BRUSA_CTRL_TORQUE>(torqueRequested);
         }
     }
+    payload.set<BRUSA_CTRL_FLAGS>(flags);
+    payload.store(outputFrame);
 
     if (Logger::isDebug())
         Logger::debug(BRUSA_DMC5, "requested Speed: %i rpm, requested Torque: %.2f Nm", speedRequested, (float)torqueRequested);
 
-    canHandlerIsolated.sendFrame(outputFrame);
+    canHandlerIsolated.sendFrame(outputFrame, CAN_TX_CRITICAL, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_BRUSA);
 }
 
 /*
@@ -155,18 +199,16 @@ void BrusaMotorController::sendControl() {
 void BrusaMotorController::sendControl2() {
     BrusaMotorControllerConfiguration *config = (BrusaMotorControllerConfiguration *)getConfiguration();
 
+    CanPayloadBuilder payload;
     prepareOutputFrame(CAN_ID_CONTROL_2);
     uint16_t torqSlew = (config->torqueSlewRate * 100);
-    outputFrame.buf[0] = (torqSlew & 0xFF00) >> 8;
-    outputFrame.buf[1] = (torqSlew & 0x00FF);
-    outputFrame.buf[2] = (config->speedSlewRate & 0xFF00) >> 8;
-    outputFrame.buf[3] = (config->speedSlewRate & 0x00FF);
-    outputFrame.buf[4] = (config->maxMechanicalPowerMotor & 0xFF00) >> 8;
-    outputFrame.buf[5] = (config->maxMechanicalPowerMotor & 0x00FF);
-    outputFrame.buf[6] = (config->maxMechanicalPowerRegen & 0xFF00) >> 8;
-    outputFrame.buf[7] = (config->maxMechanicalPowerRegen & 0x00FF);
-
-    canHandlerIsolated.sendFrame(outputFrame);
+    payload.set<BRUSA_WORD0>(torqSlew);
+    payload.set<BRUSA_WORD1>(config->speedSlewRate);
+    payload.set<BRUSA_WORD2>(config->maxMechanicalPowerMotor);
+    payload.set<BRUSA_WORD3>(config->maxMechanicalPowerRegen);
+    payload.store(outputFrame);
+
+    canHandlerIsolated.sendFrame(outputFrame, CAN_TX_CRITICAL, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_BRUSA);
 }
 
 /*
@@ -177,40 +219,30 @@ void BrusaMotorController::sendControl2() {
 void BrusaMotorController::sendLimits() {
     BrusaMotorControllerConfiguration *config = (BrusaMotorControllerConfiguration *)getConfiguration();
 
+    CanPayloadBuilder payload;
     prepareOutputFrame(CAN_ID_LIMIT);
     uint16_t dcVoltLim = config->dcVoltLimitMotor;
-    outputFrame.buf[0] = (dcVoltLim & 0xFF00) >> 8;
-    outputFrame.buf[1] = (dcVoltLim & 0x00FF);
+    payload.set<BRUSA_WORD0>(dcVoltLim);
 
     uint16_t dcVoltLimR = config->dcVoltLimitRegen;
-    outputFrame.buf[2] = (dcVoltLimR & 0xFF00) >> 8;
-    outputFrame.buf[3] = (dcVoltLimR & 0x00FF);
+    payload.set<BRUSA_WORD1>(dcVoltLimR);
     uint16_t dcCurrLimM = config->dcCurrentLimitMotor;
     uint16_t dcCurrLimR = config->dcCurrentLimitRegen;
-    outputFrame.buf[4] = (dcCurrLimM & 0xFF00) >> 8;
-    outputFrame.buf[5] = (dcCurrLimM & 0x00FF);
-    outputFrame.buf[6] = (dcCurrLimR & 0xFF00) >> 8;
-    outputFrame.buf[7] = (dcCurrLimR & 0x00FF);
+    payload.set<BRUSA_WORD2>(dcCurrLimM);
+    payload.set<BRUSA_WORD3>(dcCurrLimR);
+    payload.store(outputFrame);
 
-    canHandlerIsolated.sendFrame(outputFrame);
+    canHandlerIsolated.sendFrame(outputFrame, CAN_TX_CRITICAL, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_BRUSA);
 }
 
 /*
  * Prepare the CAN transmit frame.
- * Re-sets all parameters in the re-used frame.
+ * Re-sets all parameters in the re-used frame. The payload is written whole by CanPayloadBuilder::store()
  */
 void BrusaMotorController::prepareOutputFrame(uint32_t id) {
     outputFrame.len = 8;
     outputFrame.id = id;
     outputFrame.flags.extended = 0;
-
-    outputFrame.buf[1] = 0;
-    outputFrame.buf[2] = 0;
-    outputFrame.buf[3] = 0;
-    outputFrame.buf[4] = 0;
-    outputFrame.buf[5] = 0;
-    outputFrame.buf[6] = 0;
-    outputFrame.buf[7] = 0;
 }
 
 /*
@@ -249,18 +281,20 @@ void BrusaMotorController::handleCanFrame( const CAN_message_t &frame) {
  * available and current torque and speed.
  */
 void BrusaMotorController::processStatus(const uint8_t data[]) {
-    uint32_t brusaStatus = (uint32_t)(data[1] | (data[0] << 8));
-    torqueAvailable = (int16_t)(data[3] | (data[2] << 8)) / 100.0f;
-    torqueActual = (int16_t)(data[5] | (data[4] << 8)) / 100.0f;
-    speedActual = (int16_t)(data[7] | (data[6] << 8));
+    BrusaTorqueStatus status;
+    BrusaTorqueStatusFrame::decode(data, 8, status);
+    uint32_t brusaStatus = status.status;
+    setStatus(torqueAvailable, status.torqueAvailable);
+    setStatus(torqueActual, status.torqueActual);
+    setStatus(speedActual, status.speedActual);
 
     if(Logger::isDebug())
         Logger::debug(BRUSA_DMC5, "status: %X, torque avail: %.2fNm, actual torque: %.2fNm, speed actual: %urpm", brusaStatus, (float)torqueAvailable/100.0F, (float)torqueActual/100.0F, speedActual);
 
-    ready = (brusaStatus & stateReady) != 0 ? true : false;
-    running = (brusaStatus & stateRunning) != 0 ? true : false;
-    faulted = (brusaStatus & errorFlag) != 0 ? true : false;
-    warning = (brusaStatus & warningFlag) != 0 ? true : false;
+    setStatus(ready, (brusaStatus & stateReady) != 0 ? true : false);
+    setStatus(running, (brusaStatus & stateRunning) != 0 ? true : false);
+    setStatus(faulted, (brusaStatus & errorFlag) != 0 ? true : false);
+    setStatus(warning, (brusaStatus & warningFlag) != 0 ? true : false);
 }
 
 /*
@@ -270,10 +304,11 @@ void BrusaMotorController::processStatus(const uint8_t data[]) {
  * applied mechanical power.
  */
 void BrusaMotorController::processActualValues(const uint8_t data[]) {
-    dcVoltage = (data[1] | (data[0] << 8));
-    dcCurrent = (int16_t)(data[3] | (data[2] << 8)) / 1.0f;
-    acCurrent = (data[5] | (data[4] << 8)) / 2.5f;
-    mechanicalPower = (int16_t)(data[7] | (data[6] << 8)) / 6.25f;
+    CanPayload payload(data);
+    setStatus(dcVoltage, payload.value<BRUSA_DC_VOLTAGE>());
+    setStatus(dcCurrent, payload.value<BRUSA_DC_CURRENT>());
+    setStatus(acCurrent, payload.value<BRUSA_AC_CURRENT>());
+    setStatus(mechanicalPower, payload.value<BRUSA_MECH_POWER>());
 
     if (Logger::isDebug())
         Logger::debug(BRUSA_DMC5, "actual values: DC Volts: %.1fV, DC current: %.1fA, AC current: %fA, mechPower: %fkW", (float)dcVoltage, (float)dcCurrent, (float)acCurrent, (float)mechanicalPower);
@@ -300,9 +335,10 @@ void BrusaMotorController::processErrors(const uint8_t data[]) {
  * This message provides information about available torque.
  */
 void BrusaMotorController::processTorqueLimit(const uint8_t data[]) {
-    maxPositiveTorque = (int16_t)(data[1] | (data[0] << 8)) / 100.0f;
-    minNegativeTorque = (int16_t)(data[3] | (data[2] << 8)) / 100.0f;
-    limiterStateNumber = (uint8_t)data[4];
+    CanPayload payload(data);
+    maxPositiveTorque = payload.value<BRUSA_MAX_POSITIVE_TORQUE>();
+    minNegativeTorque = payload.value<BRUSA_MIN_NEGATIVE_TORQUE>();
+    limiterStateNumber = payload.get<BRUSA_LIMITER_STATE>();
 
     if (Logger::isDebug())
         Logger::debug(BRUSA_DMC5, "torque limit: max positive: %fNm, min negative: %fNm", (float) maxPositiveTorque, (float) minNegativeTorque, limiterStateNumber);
@@ -314,9 +350,10 @@ void BrusaMotorController::processTorqueLimit(const uint8_t data[]) {
  * This message provides information about motor and inverter temperatures.
  */
 void BrusaMotorController::processTemperature(const uint8_t data[]) {
-    temperatureInverter = (int16_t)(data[1] | (data[0] << 8)) * 0.5f;
-    temperatureMotor = (int16_t)(data[3] | (data[2] << 8)) * 0.5f;
-    temperatureSystem = (int16_t)(data[4] - 50) * 1.0f;
+    CanPayload payload(data);
+    setStatus(temperatureInverter, payload.value<BRUSA_INVERTER_TEMP>());
+    setStatus(temperatureMotor, payload.value<BRUSA_MOTOR_TEMP>());
+    setStatus(temperatureSystem, payload.value<BRUSA_SYSTEM_TEMP>());
 
     if (Logger::isDebug())
         Logger::debug(BRUSA_DMC5, "temperature: inverter: %fC, motor: %fC, system: %fC", (float)temperatureInverter, (float)temperatureMotor, (float)temperatureSystem);
@@ -157,6 +157,7 @@ public:
     BrusaMotorController();
     void handleTick();
     void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
     void setup();
     void earlyInit();
     DeviceId getId();
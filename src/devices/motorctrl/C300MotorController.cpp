@@ -65,7 +65,7 @@ void C300MotorController::setup() {
     canHandlerIsolated.attach(this, 0x0CFF7802, 0x0FFFF0FF, true);
 #endif
 
-    running = false;
+    setStatus(running, false);
     setPowerMode(modeTorque);
     setSelectedGear(NEUTRAL);
     setOpState(DISABLED );
@@ -94,11 +94,11 @@ void C300MotorController::handleCanFrame(const CAN_message_t &frame) {
         //byte 1 bit 4 = precharge complete (0 = unfinished, 1 = done!)
         //bytes 2-3 = motor torque (0.25nm scale 5000 offset just like command)
         //bytes 4-5 = motor speed (12000 offset, 1 RPM scale just like command)
-        faulted = ((frame.buf[0] & 7) > 0)?true:false;
-        ready = ((frame.buf[1] & 3) == 2)?true:false;
+        setStatus(faulted, ((frame.buf[0] & 7) > 0)?true:false);
+        setStatus(ready, ((frame.buf[1] & 3) == 2)?true:false);
         prechargeComplete = ((frame.buf[1] & 8) == 8) ? true : false;
-        speedActual = ((frame.buf[4] * 256) + frame.buf[5]) - 12000;
-        torqueActual = (((frame.buf[2] * 256) + frame.buf[3]) / 4.0f) - 5000;
+        setStatus(speedActual, ((frame.buf[4] * 256) + frame.buf[5]) - 12000);
+        setStatus(torqueActual, (((frame.buf[2] * 256) + frame.buf[3]) / 4.0f) - 5000);
         activityCount++;
         break;
     case 0x0CFF7B02: //torque limits and temperatures
@@ -108,18 +108,18 @@ void C300MotorController::handleCanFrame(const CAN_message_t &frame) {
         //byte 5 = IGBT temperature (-40 offset)
         //byte 6 = Motor temperature (-40 offset)
         //byte 7 = Motor controller temperature (-40 offset)
-        torqueAvailable = ((frame.buf[3] * 256) + frame.buf[4]);
-        temperatureMotor = frame.buf[6] - 40;
-        temperatureInverter = frame.buf[5] - 40;
-        temperatureSystem = frame.buf[7] - 40;
+        setStatus(torqueAvailable, ((frame.buf[3] * 256) + frame.buf[4]));
+        setStatus(temperatureMotor, frame.buf[6] - 40);
+        setStatus(temperatureInverter, frame.buf[5] - 40);
+        setStatus(temperatureSystem, frame.buf[7] - 40);
         activityCount++;
         break;
     case 0x0CFF7A02: //input voltage and current
         //byte 0 upper nibble = counter
         //byte 1-2 = controller input DC voltage (1 scale, no offset)
         //byte 3-4 = controller input DC amperage (1 scale 1000 offset)
-        dcVoltage = ((frame.buf[1] * 256) + frame.buf[2]);
-        dcCurrent = (((frame.buf[3] * 256) + frame.buf[4])) - 1000;
+        setStatus(dcVoltage, ((frame.buf[1] * 256) + frame.buf[2]));
+        setStatus(dcCurrent, (((frame.buf[3] * 256) + frame.buf[4])) - 1000);
         activityCount++;
         break;
     case 0x0CFF7C02: //fault reporting
@@ -148,8 +148,8 @@ void C300MotorController::handleCanFrame(const CAN_message_t &frame) {
         //byte 7 bit 0-3: Fault level (0 = nofaults, 1 = general serious, 2 = more serious 3 = critical)
         //byte 7 bit 4-7: Alive counter 0-15
         maxAllowedTorque = ((frame.buf[0] * 256) + frame.buf[1]) - 30000;
-        speedActual = ((frame.buf[2] * 256) + frame.buf[3]) - 12000;
-        torqueActual = (((frame.buf[4] * 256) + frame.buf[5]) / 4) - 30000;
+        setStatus(speedActual, ((frame.buf[2] * 256) + frame.buf[3]) - 12000);
+        setStatus(torqueActual, (((frame.buf[4] * 256) + frame.buf[5]) / 4) - 30000);
         //allowedToOperate = false;
         allowedToOperate = true;
         //if (frame.buf[6] & 1)
@@ -167,10 +167,10 @@ void C300MotorController::handleCanFrame(const CAN_message_t &frame) {
         //byte 4 - 5: Motor temperature 1 scale -40 offset
         //byte 6: Inverter temperature (1 scale) -40 offset
         //byte 7: not specified. No idea what it is. Reserved?
-        dcVoltage = ((frame.buf[0] * 256) + frame.buf[1]);
-        dcCurrent = (((frame.buf[2] * 256) + frame.buf[3])) - 10000;        
-        temperatureMotor = ((frame.buf[4] * 256) + frame.buf[5]) - 40;
-        temperatureInverter = frame.buf[6] - 40;      
+        setStatus(dcVoltage, ((frame.buf[0] * 256) + frame.buf[1]));
+        setStatus(dcCurrent, (((frame.buf[2] * 256) + frame.buf[3])) - 10000);        
+        setStatus(temperatureMotor, ((frame.buf[4] * 256) + frame.buf[5]) - 40);
+        setStatus(temperatureInverter, frame.buf[6] - 40);      
         activityCount++;
         break;
     case 0x1802D0EF:
@@ -236,11 +236,11 @@ void C300MotorController::handleTick() {
     {   //we set the RUNNING light on.  If no frames are received for 2 seconds, we set running OFF.
         if ((millis()-ms)>2000)
         {
-            running=false; // We haven't received any frames for over 2 seconds.  Otherwise online would be true.
+            setStatus(running, false); // We haven't received any frames for over 2 seconds.  Otherwise online would be true.
             ms=millis();   //Reset our 2 second timer
         }
     }
-    else running=true;
+    else setStatus(running, true);
     online=false;//This flag will be set to 1 by received frames.
 
 #ifdef CANADA_MODE
@@ -273,12 +273,12 @@ void C300MotorController::sendCmdUS()
 
     Logger::debug("Throttle requested: %i", throttleRequested);
 
-    torqueRequested = 0;
+    setStatus(torqueRequested, 0);
     if (actualState == ENABLE) { //don't even try sending torque commands until the DMOC reports it is ready
         //if (selectedGear == DRIVE) {
             //torqueMax is in Nm, throttle is -1000 to +1000 but we want the output to be
             //in 1/4 of a Nm. Divide by 1000 to get scale then multiply by 4 so really divide by 250
-            torqueRequested = (((long) throttleRequested * (long) config->torqueMax) / 250);
+            setStatus(torqueRequested, (((long) throttleRequested * (long) config->torqueMax) / 250));
             //if (speedActual < config->regenTaperUpper && torqueRequested < 0) taperRegen();
         //}
         //if (selectedGear == REVERSE) {
@@ -295,7 +295,7 @@ void C300MotorController::sendCmdUS()
         torqueCommand += (torqueRequested / 1.3f);   // else torque is reduced
     }
     
-    speedRequested = 12000;
+    setStatus(speedRequested, 12000);
     if (selectedGear == NEUTRAL) setOpState(DISABLED);
                                                                                           // torque mode
     output.buf[0] = ((operationState == ENABLE)?1:0) | ((selectedGear == DRIVE)?0:2) | (2 << 2) | (alive << 4);
@@ -310,7 +310,7 @@ void C300MotorController::sendCmdUS()
     Logger::debug("C300 Command tx: %X %X %X %X %X %X %X %X", output.buf[0], output.buf[1], output.buf[2], output.buf[3],
                   output.buf[4], output.buf[5], output.buf[6], output.buf[7]);
 
-    canHandlerIsolated.sendFrame(output);
+    canHandlerIsolated.sendFrame(output, CAN_TX_CRITICAL, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_C300);
 }
 
 //This inverter is controlled by only one ID. We send all commands in here
@@ -335,12 +335,12 @@ void C300MotorController::sendCmdCanada()
 
     Logger::debug("Throttle requested: %i", throttleRequested);
 
-    torqueRequested = 0;
+    setStatus(torqueRequested, 0);
     if (allowedToOperate) { //don't even try sending torque commands until the controller reports it is ready
         //if (selectedGear == DRIVE) {
             //torqueMax is in 1/10 of a Nm, throttle is -1000 to +1000, the output should still be
             //in 1/10 NM so we can just divide by 1000
-            torqueRequested = (((long) throttleRequested * (long) config->torqueMax) / 1000);
+            setStatus(torqueRequested, (((long) throttleRequested * (long) config->torqueMax) / 1000));
             //if (speedActual < config->regenTaperUpper && torqueRequested < 0) taperRegen();
         //}
         //if (selectedGear == REVERSE) {
@@ -351,7 +351,7 @@ void C300MotorController::sendCmdCanada()
 
     if (throttleRequested < 0) taperRegen();
 
-    if (selectedGear == REVERSE) torqueRequested *= -1;
+    if (selectedGear == REVERSE) setStatus(torqueRequested, -torqueRequested);
     if(speedActual < config->speedMax)
     {
         torqueCommand += torqueRequested;   //If actual rpm is less than max rpm, add torque to offset
@@ -361,7 +361,7 @@ void C300MotorController::sendCmdCanada()
         torqueCommand += (torqueRequested / 1.3f);   // else torque is reduced
     }
 
-    speedRequested = 24000; //12000 but the scale is 0.5
+    setStatus(speedRequested, 24000); //12000 but the scale is 0.5
     if (selectedGear == NEUTRAL) setOpState(DISABLED);
                                                                                           // torque mode
     output.buf[0] = (torqueCommand & 0xFF00) >> 8;
@@ -378,7 +378,7 @@ void C300MotorController::sendCmdCanada()
     Logger::debug("C300 Command tx: %X %X %X %X %X %X %X %X", output.buf[0], output.buf[1], output.buf[2], output.buf[3],
                   output.buf[4], output.buf[5], output.buf[6], output.buf[7]);
 
-    canHandlerIsolated.sendFrame(output);
+    canHandlerIsolated.sendFrame(output, CAN_TX_CRITICAL, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_C300);
 }
 
 //I don't believe motor controllers need to handle regen taper themselves. 
@@ -388,13 +388,13 @@ void C300MotorController::sendCmdCanada()
 void C300MotorController::taperRegen()
 {
     C300MotorControllerConfiguration *config = (C300MotorControllerConfiguration *)getConfiguration();
-    if (speedActual < config->regenTaperLower) torqueRequested = 0;
+    if (speedActual < config->regenTaperLower) setStatus(torqueRequested, 0);
     else if (speedActual > config->regenTaperUpper) torqueRequested = torqueRequested;
     else {        
         int32_t range = config->regenTaperUpper - config->regenTaperLower; //next phase is to not hard code this
         int32_t taper = speedActual - config->regenTaperLower;
         int32_t calc = (torqueRequested * taper) / range;
-        torqueRequested = (int16_t)calc;
+        setStatus(torqueRequested, (int16_t)calc);
     }
 }
 
@@ -49,6 +49,7 @@ class C300MotorController: public MotorController, CanObserver {
 public:
     virtual void handleTick();
     virtual void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
     virtual void setup();
     void earlyInit();
 
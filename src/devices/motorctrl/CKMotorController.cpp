@@ -58,7 +58,7 @@ void CKMotorController::setup() {
     // register ourselves as observer of 0x23x and 0x65x can frames
     canHandlerIsolated.attach(this, 0x410, 0x7f0, false);
 
-    running = false;
+    setStatus(running, false);
     setSelectedGear(NEUTRAL);
     setOpState(ENABLE);
     CK_milli = millis();
@@ -119,11 +119,11 @@ void CKMotorController::handleTick() {
     {   //we set the RUNNING light on.  If no frames are received for 2 seconds, we set running OFF.
         if ((millis()-CK_milli)>2000)
         {
-            running=false; // We haven't received any frames for over 2 seconds.  Otherwise online would be true.
+            setStatus(running, false); // We haven't received any frames for over 2 seconds.  Otherwise online would be true.
             CK_milli=millis();   //Reset our 2 second timer
         }
     }
-    else running=true;
+    else setStatus(running, true);
     online=false;//This flag will be set to 1 by received frames.
 
     sendPowerCmd();
@@ -143,30 +143,30 @@ void CKMotorController::sendPowerCmd() {
 	//obviously just for debugging during development. Do not leave these next lines here for long!
 	//operationState = MotorController::ENABLE;
 	//selectedGear = MotorController::DRIVE;
-	powerMode = MotorController::modeSpeed;
+	setStatus(powerMode, MotorController::modeSpeed);
 	actualState = MotorController::ENABLE;
 
 	if (operationState == ENABLE && selectedGear != NEUTRAL)
 	{
 		if (powerMode == modeSpeed)
 		{
-			torqueRequested = 0;
+			setStatus(torqueRequested, 0);
 			if (throttleRequested > 0)
 			{
-		        speedRequested = (( throttleRequested * config->speedMax) / 1000.0f);
+		        setStatus(speedRequested, (( throttleRequested * config->speedMax) / 1000.0f));
 			}
-			else speedRequested = 0;
+			else setStatus(speedRequested, 0);
 		}	
 		else if (powerMode == modeTorque)
 		{
-			speedRequested = 0;
-			torqueRequested = throttleRequested * config->torqueMax / 100.0f; //Send in 0.1Nm increments
+			setStatus(speedRequested, 0);
+			setStatus(torqueRequested, throttleRequested * config->torqueMax / 100.0f); //Send in 0.1Nm increments
 		}
 	}
 	else
 	{
-		speedRequested = 0;
-		torqueRequested = 0;
+		setStatus(speedRequested, 0);
+		setStatus(torqueRequested, 0);
 	}
 
 	output.buf[0] = (speedRequested & 0x00FF);
@@ -190,7 +190,7 @@ void CKMotorController::sendPowerCmd() {
 	
 	Logger::debug("CKInverter Sent Frame: %X  %X  %X  %X  %X  %X  %X  %X  %X", output.id, output.buf[0] , output.buf[1], output.buf[2], output.buf[3], output.buf[4], output.buf[5], output.buf[6]);
 
-    canHandlerIsolated.sendFrame(output);
+    canHandlerIsolated.sendFrame(output, CAN_TX_CRITICAL, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_CK);
 }
 
 //just a bog standard CRC8 calculation with custom generator byte. Good enough.
@@ -222,11 +222,11 @@ byte CKMotorController::calcChecksum(CAN_message_t& thisFrame)
 }
 	    
 void CKMotorController::setGear(Gears gear) {
-    selectedGear = gear;
+    setStatus(selectedGear, gear);
     //if the gear was just set to drive or reverse and the DMOC is not currently in enabled
     //op state then ask for it by name
     if (selectedGear != NEUTRAL) {
-        operationState = ENABLE;
+        setStatus(operationState, ENABLE);
     }
     //should it be set to standby when selecting neutral? I don't know. Doing that prevents regen
     //when in neutral and I don't think people will like that.
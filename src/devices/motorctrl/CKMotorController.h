@@ -54,6 +54,7 @@ public:
 public:
     virtual void handleTick();
     virtual void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
     virtual void setup();
     void earlyInit();
     void setGear(Gears gear);
@@ -37,6 +37,38 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "CodaMotorController.h"
+#include "CanSignal.h"
+
+//0x209 Accurate Feedback. Little endian words with 32128 as zero
+static constexpr CanSignalDef CODA_TORQUE = {0, 16, CAN_INTEL, false, 0.1f, -3212.8f};
+static constexpr CanSignalDef CODA_DC_VOLTAGE = {16, 16, CAN_INTEL, false, 0.1f, -3212.8f};
+static constexpr CanSignalDef CODA_DC_CURRENT = {32, 16, CAN_INTEL, false, 0.1f, -3212.8f};
+static constexpr CanSignalDef CODA_SPEED = {48, 16, CAN_INTEL, false, 0.5f, -16064.0f};
+//0x20E Temperature Feedback, degrees C with a 40 degree offset
+static constexpr CanSignalDef CODA_INVERTER_TEMP = {16, 8, CAN_INTEL, false, 1.0f, -40.0f};
+static constexpr CanSignalDef CODA_ROTOR_TEMP = {24, 8, CAN_INTEL, false, 1.0f, -40.0f};
+static constexpr CanSignalDef CODA_STATOR_TEMP = {32, 8, CAN_INTEL, false, 1.0f, -40.0f};
+//0x204 Torque Command
+static constexpr CanSignalDef CODA_CMD_SEQUENCE = {8, 4, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef CODA_CMD_REVERSE = {12, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef CODA_CMD_FORWARD = {13, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef CODA_CMD_DISABLE = {14, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef CODA_CMD_ENABLE = {15, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef CODA_CMD_TORQUE = {16, 16, CAN_INTEL, false, 1.0f, 0.0f};
+
+struct CodaFeedback
+{
+    float torque;
+    float dcVoltage;
+    float dcCurrent;
+    float speed;
+};
+
+typedef CanFrameLayout<CodaFeedback,
+        CAN_FIELD(CODA_TORQUE, CodaFeedback, torque),
+        CAN_FIELD(CODA_DC_VOLTAGE, CodaFeedback, dcVoltage),
+        CAN_FIELD(CODA_DC_CURRENT, CodaFeedback, dcCurrent),
+        CAN_FIELD(CODA_SPEED, CodaFeedback, speed)> CodaFeedbackFrame;
 
 template<class T> inline Print &operator <<(Print &obj, T arg) {
     obj.print(arg);
@@ -76,22 +108,23 @@ void CodaMotorController::setup()
     // register ourselves as observer of all 0x20x can frames for UQM
     canHandlerIsolated.attach(this, 0x200, 0x7f0, false);
 
-    operationState=ENABLE;
-    selectedGear=DRIVE;
+    setStatus(operationState, ENABLE);
+    setStatus(selectedGear, DRIVE);
     tickHandler.attach(this, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_CODAUQM);
 }
 
 
 void CodaMotorController::handleCanFrame(const CAN_message_t &frame)
 {
-    int RotorTemp, invTemp, StatorTemp;
-    int temp;
+    CanPayload payload(frame);
+    CodaFeedback feedback;
+    float RotorTemp, StatorTemp;
     online = 1; //if a frame got to here then it passed the filter and must come from UQM
     if (!running) //if we're newly running then cancel faults if necessary.
     {
         faultHandler.cancelOngoingFault(CODAUQM, FAULT_MOTORCTRL_COMM);
     }
-    running=true;
+    setStatus(running, true);
     Logger::debug("UQM inverter msg: %X   %X   %X   %X   %X   %X   %X   %X  %X", frame.id, frame.buf[0],
                   frame.buf[1],frame.buf[2],frame.buf[3],frame.buf[4],
                   frame.buf[5],frame.buf[6],frame.buf[7]);
@@ -101,16 +134,17 @@ void CodaMotorController::handleCanFrame(const CAN_message_t &frame)
 
     case 0x209:  //Accurate Feedback Message
 
-        torqueActual =  ((((frame.buf[1] * 256) + frame.buf[0])-32128)) / 10.0f;
-        dcVoltage = (((frame.buf[3] * 256) + frame.buf[2])-32128) / 10.0f;
+        CodaFeedbackFrame::decode(payload, feedback);
+        setStatus(torqueActual, feedback.torque);
+        setStatus(dcVoltage, feedback.dcVoltage);
         
         if(dcVoltage< 100.0f)
         {
-            dcVoltage=100.0f;   //Lowest value we can display on dashboard
+            setStatus(dcVoltage, 100.0f);   //Lowest value we can display on dashboard
         }
 
-        dcCurrent = (((frame.buf[5] * 256) + frame.buf[4])-32128) / 10.0f;
-        speedActual = abs((((frame.buf[7] * 256) + frame.buf[6])-32128) / 2.0f);
+        setStatus(dcCurrent, feedback.dcCurrent);
+        setStatus(speedActual, abs(feedback.speed));
 
         Logger::debug("UQM Actual Torque: %f DC Voltage: %f Amps: %f RPM: %u", torqueActual, dcVoltage, dcCurrent, speedActual);
         break;
@@ -133,23 +167,22 @@ void CodaMotorController::handleCanFrame(const CAN_message_t &frame)
 
     case 0x20E:     //Temperature Feedback Message
 
-        invTemp = frame.buf[2];
-        RotorTemp = frame.buf[3];
-        StatorTemp = frame.buf[4];
-        temperatureInverter = (invTemp-40);
+        RotorTemp = payload.value<CODA_ROTOR_TEMP>();
+        StatorTemp = payload.value<CODA_STATOR_TEMP>();
+        setStatus(temperatureInverter, payload.value<CODA_INVERTER_TEMP>());
         if (RotorTemp > StatorTemp) {
-            temperatureMotor = (RotorTemp-40);
+            setStatus(temperatureMotor, RotorTemp);
         }
         else {
-            temperatureMotor = (StatorTemp-40);
+            setStatus(temperatureMotor, StatorTemp);
         }
         Logger::debug("UQM 20E Inverter temp: %i Motor temp: %i", temperatureInverter,temperatureMotor);
         break;
 
     case 0x20F:    //CAN Watchdog Status Message
         Logger::debug("UQM 20F CAN Watchdog status error");
-        warning=true;
-        running=false;
+        setStatus(warning, true);
+        setStatus(running, false);
         sendCmd2(); //If we get a Watchdog status, we need to respond with Watchdog reset
         break;
     }
@@ -166,11 +199,11 @@ void CodaMotorController::handleTick() {
     {   //we set the RUNNING light on.  If no frames are received for 2 seconds, we set running OFF.
         if (millis()-mss>2000)
         {
-            running=false; // We haven't received any frames for over 2 seconds.  Otherwise online would be true.
+            setStatus(running, false); // We haven't received any frames for over 2 seconds.  Otherwise online would be true.
             mss=millis();   //Reset our 2 second timer
         }
     }
-    else running=true;
+    else setStatus(running, true);
     online=false;//This flag will be set to true by received frames
 
 }
@@ -206,58 +239,57 @@ void CodaMotorController::sendCmd1()
     CodaMotorControllerConfiguration *config = (CodaMotorControllerConfiguration *)getConfiguration();
 
     CAN_message_t output;
+    CanPayloadBuilder payload; //First byte is always zero.
     output.len = 5;
     output.id = 0x204;
     output.flags.extended = 0; //standard frame
-    output.buf[0] = 0x00; //First byte is always zero.
 
 
     if(operationState==ENABLE)
     {
-        output.buf[1] = 0x80; //1000 0000
+        payload.set<CODA_CMD_ENABLE>(1); //1000 0000
     }
     else
     {
-        output.buf[1] = 0x40; //0100 0000
+        payload.set<CODA_CMD_DISABLE>(1); //0100 0000
     }
 
     if(selectedGear==DRIVE)
     {
-        output.buf[1] |= 0x20; //xx10 0000
+        payload.set<CODA_CMD_FORWARD>(1); //xx10 0000
     }
     else
     {
-        output.buf[1] |= 0x10;//xx01 0000
+        payload.set<CODA_CMD_REVERSE>(1); //xx01 0000
     }
 
     sequence+=1; //Increment sequence
     if (sequence==8) {
         sequence=0;   //If we reach 8, go to zero
     }
-    output.buf[1] |= sequence; //This should retain left four and add sequence count
-    //to right four bits.
+    payload.set<CODA_CMD_SEQUENCE>(sequence); //sequence count in the right four bits
     //Requested throttle is [-1000, 1000]
     //Two byte torque request in 0.1NM Can be positive or negative
 
-    torqueRequested = ((throttleRequested * config->torqueMax) / 100.0f); //Calculate torque request from throttle position x maximum torque
+    setStatus(torqueRequested, ((throttleRequested * config->torqueMax) / 100.0f)); //Calculate torque request from throttle position x maximum torque
  
     //If our requested torque is a negative number, we are in regen.  Let's use taper values to taper it below threshold rpm
     if(torqueRequested < 0 && speedActual < config->regenTaperUpper)  //We are in regen and below regenTaperUpper value
       {    
         
-        if (speedActual < config->regenTaperLower) torqueRequested = 0; //If less than lower taper, NO regen
+        if (speedActual < config->regenTaperLower) setStatus(torqueRequested, 0); //If less than lower taper, NO regen
         
         else {        
               int32_t range = config->regenTaperUpper - config->regenTaperLower; 
               int32_t taper = speedActual - config->regenTaperLower;
               int32_t calc = (torqueRequested * taper) / range;
-              torqueRequested = (int16_t)calc;  //A tapered REGEN value function of RPM within range upper/lower.
+              setStatus(torqueRequested, (int16_t)calc);  //A tapered REGEN value function of RPM within range upper/lower.
             }
       }
 
     //If overspeed, let's cut torque in half.  If not, add requested torque to torqueCommand
       
-    if(speedActual>config->speedMax) {torqueRequested /= 2.0f;}   //If actual rpm greater than max rpm, add torque command to offset
+    if(speedActual>config->speedMax) {setStatus(torqueRequested, torqueRequested / 2.0f);}   //If actual rpm greater than max rpm, add torque command to offset
     
      torqueCommand = 32128 + torqueRequested; //Torque command 32128 is zero torque.  Values below are regen.  Above are torque.
   
@@ -272,11 +304,11 @@ void CodaMotorController::sendCmd1()
         torqueCommand = 32128 + working; //limited regen request
     }*/
     
-    output.buf[3] = (torqueCommand & 0xFF00) >> 8;  //Stow torque command in bytes 2 and 3.
-    output.buf[2] = (torqueCommand & 0x00FF);
+    payload.set<CODA_CMD_TORQUE>(torqueCommand);  //Stow torque command in bytes 2 and 3.
+    payload.store(output);
     output.buf[4] = genCodaCRC(output.buf[1], output.buf[2], output.buf[3]); //Calculate security byte
 
-    canHandlerIsolated.sendFrame(output);  //Mail it.
+    canHandlerIsolated.sendFrame(output, CAN_TX_CRITICAL, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_CODAUQM);  //Mail it.
     timestamp();
 
     Logger::debug("Torque command: %X   %X  ControlByte: %X  LSB %X  MSB: %X  CRC: %X  %d:%d:%d.%d",output.id, output.buf[0],
@@ -308,12 +340,12 @@ void CodaMotorController::sendCmd2() {
     output.buf[6] = 0x00;
     output.buf[7] = 0x00;
 
-    canHandlerIsolated.sendFrame(output);
+    canHandlerIsolated.sendFrame(output, CAN_TX_CRITICAL, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_CODAUQM);
     timestamp();
     Logger::debug("Watchdog reset: %X  %X  %X  %d:%d:%d.%d",output.buf[0], output.buf[1],
                   output.buf[2], hours, minutes, seconds, milliseconds);
 
-    warning=false;
+    setStatus(warning, false);
 }
 
 
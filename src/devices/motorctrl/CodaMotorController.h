@@ -53,6 +53,7 @@ class CodaMotorController: public MotorController, CanObserver {
 public:
     virtual void handleTick();
     virtual void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
     virtual void setup();
     void earlyInit();
 
@@ -42,6 +42,15 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "DmocMotorController.h"
+#include "CanSignal.h"
+
+//the DMOC is big endian throughout. Temperatures have a 40 degree offset
+static constexpr CanSignalDef DMOC_ROTOR_TEMP = {7, 8, CAN_MOTOROLA, false, 1.0f, -40.0f};
+static constexpr CanSignalDef DMOC_INVERTER_TEMP = {15, 8, CAN_MOTOROLA, false, 1.0f, -40.0f};
+static constexpr CanSignalDef DMOC_STATOR_TEMP = {23, 8, CAN_MOTOROLA, false, 1.0f, -40.0f};
+static constexpr CanSignalDef DMOC_TORQUE = {7, 16, CAN_MOTOROLA, false, 0.1f, -3000.0f};
+static constexpr CanSignalDef DMOC_SPEED = {7, 16, CAN_MOTOROLA, false, 1.0f, -20000.0f};
+static constexpr CanSignalDef DMOC_OP_STATE = {55, 4, CAN_MOTOROLA, false, 1.0f, 0.0f};
 
 extern bool runThrottle; //TODO: remove use of global variables !
 long ms;
@@ -54,6 +63,7 @@ DmocMotorController::DmocMotorController() : MotorController() {
     actualState = DISABLED;
     online = 0;
     activityCount = 0;
+    cmdSlot[0] = cmdSlot[1] = cmdSlot[2] = -1;
 //	maxTorque = 2000;
     commonName = "DMOC645 Inverter";
     shortName = "DMOC645";
@@ -88,18 +98,30 @@ void DmocMotorController::setup() {
     stat = {"MC_torqueCmd", &torqueCommand, CFG_ENTRY_VAR_TYPE::UINT16, 0, this};
     deviceManager.addStatusEntry(stat);
 
+    //setup() runs again after config changes. Start from scratch so nothing is attached or scheduled twice
+    attachedCANBus->detachAll(this);
     setAttachedCANBus(config->canbusNum);
+    dependsOnCanBus(config->canbusNum);
 
     // register ourselves as observer of 0x23x and 0x65x can frames
     attachedCANBus->attach(this, 0x230, 0x7f0, false);
     attachedCANBus->attach(this, 0x650, 0x7f0, false);
 
-    running = false;
+    setStatus(running, false);
     setPowerMode(modeTorque);
     setSelectedGear(NEUTRAL);
     setOpState(DISABLED );
     ms=millis();
 
+    //the DMOC wants its command frames steady so they're sent from the CAN handler's hardware timer, not from handleTick()
+    CAN_message_t output;
+    buildCmd1(output);
+    cmdSlot[0] = attachedCANBus->addPeriodic(this, output, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_DMOC, 0);
+    buildCmd2(output);
+    cmdSlot[1] = attachedCANBus->addPeriodic(this, output, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_DMOC, 1000);
+    buildCmd3(output);
+    cmdSlot[2] = attachedCANBus->addPeriodic(this, output, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_DMOC, 2000);
+
     tickHandler.attach(this, CFG_TICK_INTERVAL_MOTOR_CONTROLLER_DMOC);
 }
 
@@ -112,6 +134,7 @@ void DmocMotorController::setup() {
  */
 
 void DmocMotorController::handleCanFrame(const CAN_message_t &frame) {
+    CanPayload payload(frame);
     int RotorTemp, invTemp, StatorTemp;
     int temp;
     online = true; //if a frame got to here then it passed the filter and must have been from the DMOC
@@ -121,70 +144,70 @@ void DmocMotorController::handleCanFrame(const CAN_message_t &frame) {
 
     switch (frame.id) {
     case 0x651: //Temperature status
-        RotorTemp = frame.buf[0];
-        invTemp = frame.buf[1];
-        StatorTemp = frame.buf[2];
-        temperatureInverter = (invTemp-40);
+        RotorTemp = payload.value<DMOC_ROTOR_TEMP>();
+        invTemp = payload.value<DMOC_INVERTER_TEMP>();
+        StatorTemp = payload.value<DMOC_STATOR_TEMP>();
+        setStatus(temperatureInverter, invTemp);
         //now pick highest of motor temps and report it
         if (RotorTemp > StatorTemp) {
-            temperatureMotor = (RotorTemp - 40);
+            setStatus(temperatureMotor, RotorTemp);
         }
         else {
-            temperatureMotor = (StatorTemp - 40);
+            setStatus(temperatureMotor, StatorTemp);
         }
         activityCount++;
         break;
     case 0x23A: //torque report
-        torqueActual = (((frame.buf[0] * 256) + frame.buf[1]) - 30000) / 10.0f;
+        setStatus(torqueActual, payload.value<DMOC_TORQUE>());
         activityCount++;
         break;
 
     case 0x23B: //speed and current operation status
-        speedActual = abs(((frame.buf[0] * 256) + frame.buf[1]) - 20000);
-        temp = (OperationState) (frame.buf[6] >> 4);
+        setStatus(speedActual, abs((int)payload.value<DMOC_SPEED>()));
+        temp = (OperationState) payload.get<DMOC_OP_STATE>();
         //actually, the above is an operation status report which doesn't correspond
         //to the state enum so translate here.
         switch (temp) {
 
         case 0: //Initializing
             actualState = DISABLED;
-            faulted=false;
+            setStatus(faulted, false);
             break;
 
         case 1: //disabled
             actualState = DISABLED;
-            faulted=false;
+            setStatus(faulted, false);
             break;
 
         case 2: //ready (standby)
             actualState = STANDBY;
-            faulted=false;
-            ready = true;
+            setStatus(faulted, false);
+            setStatus(ready, true);
             break;
 
         case 3: //enabled
             actualState = ENABLE;
-            faulted=false;
+            setStatus(faulted, false);
             break;
 
         case 4: //Power Down
             actualState = POWERDOWN;
-            faulted=false;
+            setStatus(faulted, false);
             break;
 
         case 5: //Fault
             actualState = DISABLED;
-            faulted=true;
+            setStatus(faulted, true);
             break;
 
         case 6: //Critical Fault
             actualState = DISABLED;
-            faulted=true;
+            setStatus(faulted, true);
             break;
 
         case 7: //LOS
             actualState = DISABLED;
-            faulted=true;
+            setStatus(faulted, true);
             break;
         }
         Logger::debug(DMOC645, "Reported OpState: %d", temp);
@@ -196,8 +219,8 @@ void DmocMotorController::handleCanFrame(const CAN_message_t &frame) {
         //break;
 
     case 0x650: //HV bus status
-        dcVoltage = ((frame.buf[0] * 256) + frame.buf[1]) / 10.0f;
-        dcCurrent = (((frame.buf[2] * 256) + frame.buf[3]) - 5000) / 10.0f; //offset is 500A, unit = .1A
+        setStatus(dcVoltage, ((frame.buf[0] * 256) + frame.buf[1]) / 10.0f);
+        setStatus(dcCurrent, (((frame.buf[2] * 256) + frame.buf[3]) - 5000) / 10.0f); //offset is 500A, unit = .1A
         activityCount++;
         break;
     }
@@ -230,27 +253,30 @@ void DmocMotorController::handleTick() {
     {   //we set the RUNNING light on.  If no frames are received for 2 seconds, we set running OFF.
         if ((millis()-ms)>2000)
         {
-            running=false; // We haven't received any frames for over 2 seconds.  Otherwise online would be true.
+            setStatus(running, false); // We haven't received any frames for over 2 seconds.  Otherwise online would be true.
             ms=millis();   //Reset our 2 second timer
         }
     }
-    else running=true;
+    else setStatus(running, true);
     online=false;//This flag will be set to 1 by received frames.
 
+    //the command frames themselves go out on the CAN periodic schedule, see handlePeriodicFrame()
+}
 
-    sendCmd1();  //This actually sets our GEAR and our actualstate cycle
-    sendCmd2();  //This is our torque command
-    sendCmd3();
-    //sendCmd4();  //These appear to be not needed.
-    //sendCmd5();  //But we'll keep them for future reference
-
-
+/*
+ Called by the CAN handler shortly before one of our command frames is due to get it ready.
+ Cmd1 moves alive on so Cmd2 and Cmd3, which go out 1 and 2ms after it, carry the same value it did.
+ Cmd4 and Cmd5 appear to be not needed but we'll keep them for future reference.
+*/
+void DmocMotorController::handlePeriodicFrame(int slot, CAN_message_t &frame) {
+    if (slot == cmdSlot[0]) buildCmd1(frame);  //This actually sets our GEAR and our actualstate cycle
+    else if (slot == cmdSlot[1]) buildCmd2(frame);  //This is our torque command
+    else if (slot == cmdSlot[2]) buildCmd3(frame);
 }
 
 //Commanded RPM plus state of key and gear selector
-void DmocMotorController::sendCmd1() {
+void DmocMotorController::buildCmd1(CAN_message_t &output) {
     DmocMotorControllerConfiguration *config = (DmocMotorControllerConfiguration *)getConfiguration();
-    CAN_message_t output;
     OperationState newstate;
     alive = (alive + 2) & 0x0F;
     output.len = 8;
@@ -258,9 +284,9 @@ void DmocMotorController::sendCmd1() {
     output.flags.extended = 0; //standard frame
 
     if (throttleRequested > 0 && operationState == ENABLE && selectedGear != NEUTRAL && powerMode == modeSpeed)
-        speedRequested = 20000 + (((long) throttleRequested * (long) config->speedMax) / 1000);
+        setStatus(speedRequested, 20000 + (((long) throttleRequested * (long) config->speedMax) / 1000));
     else
-        speedRequested = 20000;
+        setStatus(speedRequested, 20000);
     output.buf[0] = (speedRequested & 0xFF00) >> 8;
     output.buf[1] = (speedRequested & 0x00FF);
     output.buf[2] = 0; //not used
@@ -288,26 +314,23 @@ void DmocMotorController::sendCmd1() {
  
     Logger::debug(DMOC645, "0x232 tx: %X %X %X %X %X %X %X %X", output.buf[0], output.buf[1], output.buf[2], output.buf[3],
                   output.buf[4], output.buf[5], output.buf[6], output.buf[7]);
-
-    attachedCANBus->sendFrame(output);
 }
 
 void DmocMotorController::taperRegen()
 {
     DmocMotorControllerConfiguration *config = (DmocMotorControllerConfiguration *)getConfiguration();
-    if (speedActual < config->regenTaperLower) torqueRequested = 0;
+    if (speedActual < config->regenTaperLower) setStatus(torqueRequested, 0);
     else {        
         int32_t range = config->regenTaperUpper - config->regenTaperLower; //next phase is to not hard code this
         int32_t taper = speedActual - config->regenTaperLower;
         int32_t calc = (torqueRequested * taper) / range;
-        torqueRequested = (int16_t)calc;
+        setStatus(torqueRequested, (int16_t)calc);
     }
 }
 
 //Torque limits
-void DmocMotorController::sendCmd2() {
+void DmocMotorController::buildCmd2(CAN_message_t &output) {
     DmocMotorControllerConfiguration *config = (DmocMotorControllerConfiguration *)getConfiguration();
-    CAN_message_t output;
     output.len = 8;
     output.id = 0x233;
     output.flags.extended = 0; //standard frame
@@ -321,14 +344,14 @@ void DmocMotorController::sendCmd2() {
 
     Logger::debug(DMOC645, "Throttle requested: %i", throttleRequested);
 
-    torqueRequested=0;
+    setStatus(torqueRequested, 0);
     if (actualState == ENABLE) { //don't even try sending torque commands until the DMOC reports it is ready
         if (selectedGear == DRIVE) {
-            torqueRequested = (((long) throttleRequested * (long) config->torqueMax) / 100.0f);
+            setStatus(torqueRequested, (((long) throttleRequested * (long) config->torqueMax) / 100.0f));
             //if (speedActual < config->regenTaperUpper && torqueRequested < 0) taperRegen();
         }
         if (selectedGear == REVERSE) {
-            torqueRequested = (((long) throttleRequested * -1 *(long) config->torqueMax) / 100.0f);//If reversed, regen becomes positive torque and positive pedal becomes regen.  Let's reverse this by reversing the sign.  In this way, we'll have gradually diminishing positive torque (in reverse, regen) followed by gradually increasing regen (positive torque in reverse.)
+            setStatus(torqueRequested, (((long) throttleRequested * -1 *(long) config->torqueMax) / 100.0f));//If reversed, regen becomes positive torque and positive pedal becomes regen.  Let's reverse this by reversing the sign.  In this way, we'll have gradually diminishing positive torque (in reverse, regen) followed by gradually increasing regen (positive torque in reverse.)
             //if (speedActual < config->regenTaperUpper && torqueRequested > 0) taperRegen();
         }
     }
@@ -366,8 +389,6 @@ void DmocMotorController::sendCmd2() {
 
     //Logger::debug("requested torque: %i",(((long) throttleRequested * (long) maxTorque) / 1000L));
 
-    attachedCANBus->sendFrame(output);
-
     timestamp();
     Logger::debug(DMOC645, "Torque command: %X  %X  %X  %X  %X  %X  %X  CRC: %X",output.buf[0],
                   output.buf[1],output.buf[2],output.buf[3],output.buf[4],output.buf[5],output.buf[6],output.buf[7]);
@@ -375,8 +396,7 @@ void DmocMotorController::sendCmd2() {
 }
 
 //Power limits plus setting ambient temp and whether to cool power train or go into limp mode
-void DmocMotorController::sendCmd3() {
-    CAN_message_t output;
+void DmocMotorController::buildCmd3(CAN_message_t &output) {
     output.len = 8;
     output.id = 0x234;
     output.flags.extended = 0; //standard frame
@@ -391,13 +411,10 @@ void DmocMotorController::sendCmd3() {
     output.buf[5] = 60; //20 degrees celsius
     output.buf[6] = alive;
     output.buf[7] = calcChecksum(output);
-
-    attachedCANBus->sendFrame(output);
 }
 
 //challenge/response frame 1 - Really doesn't contain anything we need I dont think
-void DmocMotorController::sendCmd4() {
-    CAN_message_t output;
+void DmocMotorController::buildCmd4(CAN_message_t &output) {
     output.len = 8;
     output.id = 0x235;
     output.flags.extended = 0; //standard frame
@@ -409,13 +426,10 @@ void DmocMotorController::sendCmd4() {
     output.buf[5] = 1;
     output.buf[6] = alive;
     output.buf[7] = calcChecksum(output);
-
-    attachedCANBus->sendFrame(output);
 }
 
 //Another C/R frame but this one also specifies which shifter position we're in
-void DmocMotorController::sendCmd5() {
-    CAN_message_t output;
+void DmocMotorController::buildCmd5(CAN_message_t &output) {
     output.len = 8;
     output.id = 0x236;
     output.flags.extended = 0; //standard frame
@@ -435,17 +449,15 @@ void DmocMotorController::sendCmd5() {
     //--PRND12
     output.buf[6] = alive;
     output.buf[7] = calcChecksum(output);
-
-    attachedCANBus->sendFrame(output);
 }
 
 
 void DmocMotorController::setGear(Gears gear) {
-    selectedGear = gear;
+    setStatus(selectedGear, gear);
     //if the gear was just set to drive or reverse and the DMOC is not currently in enabled
     //op state then ask for it by name
     if (selectedGear != NEUTRAL) {
-        operationState = ENABLE;
+        setStatus(operationState, ENABLE);
     }
     //should it be set to standby when selecting neutral? I don't know. Doing that prevents regen
     //when in neutral and I don't think people will like that.
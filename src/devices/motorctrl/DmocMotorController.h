@@ -67,6 +67,8 @@ public:
 public:
     virtual void handleTick();
     virtual void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
+    virtual void handlePeriodicFrame(int slot, CAN_message_t &frame);
     virtual void setup();
     void earlyInit();
     void setGear(Gears gear);
@@ -87,13 +89,14 @@ private:
     byte alive;
     int activityCount;
     uint16_t torqueCommand;
+    int cmdSlot[3]; //CAN periodic slots of command frames 1 to 3
     void timestamp();
 
-    void sendCmd1();
-    void sendCmd2();
-    void sendCmd3();
-    void sendCmd4();
-    void sendCmd5();
+    void buildCmd1(CAN_message_t &output);
+    void buildCmd2(CAN_message_t &output);
+    void buildCmd3(CAN_message_t &output);
+    void buildCmd4(CAN_message_t &output);
+    void buildCmd5(CAN_message_t &output);
     byte calcChecksum(const CAN_message_t &thisFrame);
 
 };
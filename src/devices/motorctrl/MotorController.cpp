@@ -27,6 +27,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "MotorController.h"
+#include "../misc/Precharger.h"
 
 MotorController::MotorController() : Device() {
     ready = false;
@@ -59,6 +60,10 @@ MotorController::MotorController() : Device() {
     skipcounter = 0;
     testenableinput = 0;
     testreverseinput = 0;
+
+    //no driving until the HV side and the pedal are there
+    dependsOn(PRECHARGER);
+    dependsOnType(DEVICE_THROTTLE);
 }
 
 void MotorController::setup() {
@@ -125,17 +130,23 @@ void MotorController::setup() {
     deviceManager.addStatusEntry(stat);
     stat = {"MC_MechPower", &mechanicalPower, CFG_ENTRY_VAR_TYPE::FLOAT, 0, this};
     deviceManager.addStatusEntry(stat);
-    stat = {"MC_MotorTemp", &temperatureMotor, CFG_ENTRY_VAR_TYPE::FLOAT, 0, this};
+    //temperatures move slowly and jitter a bit. Only send real changes, at most once a second (deadband, minInterval)
+    stat = {"MC_MotorTemp", &temperatureMotor, CFG_ENTRY_VAR_TYPE::FLOAT, 0, this, 0.5f, 1000};
     deviceManager.addStatusEntry(stat);
-    stat = {"MC_InverterTemp", &temperatureInverter, CFG_ENTRY_VAR_TYPE::FLOAT, 0, this};
+    stat = {"MC_InverterTemp", &temperatureInverter, CFG_ENTRY_VAR_TYPE::FLOAT, 0, this, 0.5f, 1000};
     deviceManager.addStatusEntry(stat);
-    stat = {"MC_SysTemp", &temperatureSystem, CFG_ENTRY_VAR_TYPE::FLOAT, 0, this};
+    stat = {"MC_SysTemp", &temperatureSystem, CFG_ENTRY_VAR_TYPE::FLOAT, 0, this, 0.5f, 1000};
     deviceManager.addStatusEntry(stat);
 
     Device::setup();
 }
 
 
+//the motor controller is what actually makes the car go (or stop). Always goes first
+TickPriority MotorController::getTickPriority() {
+    return TICK_PRIORITY_CRITICAL;
+}
+
 void MotorController::handleTick() {
 
     MotorControllerConfiguration *config = (MotorControllerConfiguration *)getConfiguration();
@@ -145,15 +156,15 @@ void MotorController::handleTick() {
     statusBitfield.faulted = faulted;
 
     //Calculate killowatts and kilowatt hours
-    mechanicalPower = dcVoltage * dcCurrent / 1000.0f; //In kilowatts.
+    setStatus(mechanicalPower, dcVoltage * dcCurrent / 1000.0f); //In kilowatts.
 
     //Throttle check
     Throttle *accelerator = deviceManager.getAccelerator();
     Throttle *brake = deviceManager.getBrake();
     if (accelerator)
-        throttleRequested = accelerator->getLevel();
+        setStatus(throttleRequested, accelerator->getLevel());
     if (brake && brake->getLevel() < -10 && brake->getLevel() < accelerator->getLevel()) //if the brake has been pressed it overrides the accelerator.
-        throttleRequested = brake->getLevel();
+        setStatus(throttleRequested, brake->getLevel());
     //Logger::debug("Throttle: %d", throttleRequested);
 
     if(skipcounter++ > 30)    //A very low priority loop for checks that only need to be done once per second.
@@ -268,7 +279,7 @@ DeviceType MotorController::getType() {
 }
 
 void MotorController::setOpState(OperationState op) {
-    operationState = op;
+    setStatus(operationState, op);
 }
 
 MotorController::OperationState MotorController::getOpState() {
@@ -279,7 +290,7 @@ MotorController::PowerMode MotorController::getPowerMode() {
 }
 
 void MotorController::setPowerMode(PowerMode mode) {
-    powerMode = mode;
+    setStatus(powerMode, mode);
 }
 
 uint32_t MotorController::getStatusBitfield() {
@@ -319,7 +330,7 @@ MotorController::Gears MotorController::getSelectedGear() {
     return selectedGear;
 }
 void MotorController::setSelectedGear(Gears gear) {
-    selectedGear=gear;
+    setStatus(selectedGear, gear);
 }
 
 float MotorController::getTorqueAvailable() {
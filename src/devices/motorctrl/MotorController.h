@@ -117,6 +117,7 @@ public:
     DeviceType getType();
     void setup();
     void handleTick();
+    TickPriority getTickPriority();
     uint32_t getTickInterval();
 
     void loadConfiguration();
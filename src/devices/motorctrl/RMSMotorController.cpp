@@ -29,6 +29,44 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "RMSMotorController.h"
+#include "CanSignal.h"
+
+//nearly every frame the inverter broadcasts is four signed little endian 16 bit words. Temperatures,
+//currents, voltages and torques are in tenths, internal voltages in hundredths and flux in thousandths
+static constexpr CanSignalDef RMS_WORD0 = {0, 16, CAN_INTEL, true, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_WORD1 = {16, 16, CAN_INTEL, true, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_WORD2 = {32, 16, CAN_INTEL, true, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_WORD3 = {48, 16, CAN_INTEL, true, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_TENTHS0 = {0, 16, CAN_INTEL, true, 0.1f, 0.0f};
+static constexpr CanSignalDef RMS_TENTHS1 = {16, 16, CAN_INTEL, true, 0.1f, 0.0f};
+static constexpr CanSignalDef RMS_TENTHS2 = {32, 16, CAN_INTEL, true, 0.1f, 0.0f};
+static constexpr CanSignalDef RMS_TENTHS3 = {48, 16, CAN_INTEL, true, 0.1f, 0.0f};
+static constexpr CanSignalDef RMS_HUNDREDTHS0 = {0, 16, CAN_INTEL, true, 0.01f, 0.0f};
+static constexpr CanSignalDef RMS_HUNDREDTHS1 = {16, 16, CAN_INTEL, true, 0.01f, 0.0f};
+static constexpr CanSignalDef RMS_HUNDREDTHS2 = {32, 16, CAN_INTEL, true, 0.01f, 0.0f};
+static constexpr CanSignalDef RMS_HUNDREDTHS3 = {48, 16, CAN_INTEL, true, 0.01f, 0.0f};
+static constexpr CanSignalDef RMS_THOUSANDTHS0 = {0, 16, CAN_INTEL, true, 0.001f, 0.0f};
+static constexpr CanSignalDef RMS_THOUSANDTHS1 = {16, 16, CAN_INTEL, true, 0.001f, 0.0f};
+//fault bits and the uptime counter are 32 bits
+static constexpr CanSignalDef RMS_LONG0 = {0, 32, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_LONG1 = {32, 32, CAN_INTEL, false, 1.0f, 0.0f};
+//internal states 0xAA
+static constexpr CanSignalDef RMS_VSM_STATE = {0, 16, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_INV_STATE = {16, 8, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_RELAY_STATE = {24, 8, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_RUN_MODE = {32, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_ACTIVE_DISCHARGE = {37, 3, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_CMD_MODE = {40, 8, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_ENABLED = {48, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_LOCKOUT = {55, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_DIRECTION = {56, 8, CAN_INTEL, false, 1.0f, 0.0f};
+//command frame 0xC0
+static constexpr CanSignalDef RMS_CMD_TORQUE = {0, 16, CAN_INTEL, true, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_CMD_SPEED = {16, 16, CAN_INTEL, true, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_CMD_DIRECTION = {32, 8, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_CMD_ENABLE = {40, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_CMD_DISCHARGE = {41, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef RMS_CMD_TORQUE_LIMIT = {48, 16, CAN_INTEL, true, 1.0f, 0.0f};
 
 template<class T> inline Print &operator <<(Print &obj, T arg) {
     obj.print(arg);
@@ -41,6 +79,7 @@ RMSMotorController::RMSMotorController() : MotorController()
     online = 0;
     activityCount = 0;
     sequence = 0;
+    cmdSlot = -1;
     isLockedOut = true;
     commonName = "Rinehart Motion Systems Inverter";
     shortName = "RMSInverter";
@@ -68,13 +107,17 @@ void RMSMotorController::setup()
     entry = {"RMS-CANBUS", "Set which CAN bus to connect to (0-2)", &config->canbusNum, CFG_ENTRY_VAR_TYPE::BYTE, 0, 2, 0, nullptr};
     cfgEntries.push_back(entry);
 
+    //setup() runs again after config changes. Start from scratch so nothing is attached or scheduled twice
+    attachedCANBus->detachAll(this);
+    cmdSlot = -1;
     setAttachedCANBus(config->canbusNum);
+    dependsOnCanBus(config->canbusNum);
 
     //allow through 0xA0 through 0xAF	
     attachedCANBus->attach(this, 0x0A0, 0x7f0, false);
 
-    operationState = ENABLE;
-    selectedGear = NEUTRAL;
+    setStatus(operationState, ENABLE);
+    setStatus(selectedGear, NEUTRAL);
     tickHandler.attach(this, CFG_TICK_INTERVAL_MOTOR_CONTROLLER);
 }
 
@@ -90,7 +133,7 @@ void RMSMotorController::handleCanFrame(const CAN_message_t &frame)
         faultHandler.cancelOngoingFault(RINEHARTINV, FAULT_MOTORCTRL_COMM);
     }
     
-    running = true;
+    setStatus(running, true);
     
     Logger::debug("inverter msg: %X   %X   %X   %X   %X   %X   %X   %X  %X", frame.id, frame.buf[0],
                   frame.buf[1],frame.buf[2],frame.buf[3],frame.buf[4],
@@ -152,47 +195,51 @@ void RMSMotorController::handleCanFrame(const CAN_message_t &frame)
 
 void RMSMotorController::handleCANMsgTemperature1(uint8_t *data)
 {
+	CanPayload payload(data);
 	float igbtTemp1, igbtTemp2, igbtTemp3, gateTemp;
-    igbtTemp1 = data[0] + (data[1] * 256) / 10.0f;
-	igbtTemp2 = data[2] + (data[3] * 256) / 10.0f;
-    igbtTemp3 = data[4] + (data[5] * 256) / 10.0f;
-    gateTemp = data[6] + (data[7] * 256) / 10.0f;
+    igbtTemp1 = payload.value<RMS_TENTHS0>();
+	igbtTemp2 = payload.value<RMS_TENTHS1>();
+    igbtTemp3 = payload.value<RMS_TENTHS2>();
+    gateTemp = payload.value<RMS_TENTHS3>();
     Logger::debug("IGBT Temps - 1: %f  2: %f  3: %f     Gate Driver: %f    (C)", igbtTemp1, igbtTemp2, igbtTemp3, gateTemp);
-    temperatureInverter = igbtTemp1;
-    if (igbtTemp2 > temperatureInverter) temperatureInverter = igbtTemp2;
-    if (igbtTemp3 > temperatureInverter) temperatureInverter = igbtTemp3;
-    if (gateTemp > temperatureInverter) temperatureInverter = gateTemp;
+    setStatus(temperatureInverter, igbtTemp1);
+    if (igbtTemp2 > temperatureInverter) setStatus(temperatureInverter, igbtTemp2);
+    if (igbtTemp3 > temperatureInverter) setStatus(temperatureInverter, igbtTemp3);
+    if (gateTemp > temperatureInverter) setStatus(temperatureInverter, gateTemp);
 }
 
 void RMSMotorController::handleCANMsgTemperature2(uint8_t *data)
 {
+    CanPayload payload(data);
     float ctrlTemp, rtdTemp1, rtdTemp2, rtdTemp3;
-    ctrlTemp = data[0] + (data[1] * 256) / 10.0f;
-	rtdTemp1 = data[2] + (data[3] * 256) / 10.0f;
-    rtdTemp2 = data[4] + (data[5] * 256) / 10.0f;
-    rtdTemp3 = data[6] + (data[7] * 256) / 10.0f;
+    ctrlTemp = payload.value<RMS_TENTHS0>();
+	rtdTemp1 = payload.value<RMS_TENTHS1>();
+    rtdTemp2 = payload.value<RMS_TENTHS2>();
+    rtdTemp3 = payload.value<RMS_TENTHS3>();
     Logger::debug("Ctrl Temp: %f  RTD1: %f   RTD2: %f   RTD3: %f    (C)", ctrlTemp, rtdTemp1, rtdTemp2, rtdTemp3);
-	temperatureSystem = ctrlTemp;
+	setStatus(temperatureSystem, ctrlTemp);
 }
 
 void RMSMotorController::handleCANMsgTemperature3(uint8_t *data)
 {
+    CanPayload payload(data);
     float rtdTemp4, rtdTemp5, motorTemp, torqueShudder;
-    rtdTemp4 = data[0] + (data[1] * 256) / 10.0f;
-	rtdTemp5 = data[2] + (data[3] * 256) / 10.0f;
-    motorTemp = data[4] + (data[5] * 256) / 10.0f;
-    torqueShudder = data[6] + (data[7] * 256);
+    rtdTemp4 = payload.value<RMS_TENTHS0>();
+	rtdTemp5 = payload.value<RMS_TENTHS1>();
+    motorTemp = payload.value<RMS_TENTHS2>();
+    torqueShudder = payload.value<RMS_TENTHS3>();
     Logger::debug("RTD4: %f   RTD5: %f   Motor Temp: %f    Torque Shudder: %f", rtdTemp4, rtdTemp5, motorTemp, torqueShudder);
-	temperatureMotor = motorTemp;
+	setStatus(temperatureMotor, motorTemp);
 }
 
 void RMSMotorController::handleCANMsgAnalogInputs(uint8_t *data)
 {
+	CanPayload payload(data);
 	int analog1, analog2, analog3, analog4;
-    analog1 = data[0] + (data[1] * 256);
-	analog2 = data[2] + (data[3] * 256);
-    analog3 = data[4] + (data[5] * 256);
-    analog4 = data[6] + (data[7] * 256);
+    analog1 = payload.get<RMS_WORD0>();
+	analog2 = payload.get<RMS_WORD1>();
+    analog3 = payload.get<RMS_WORD2>();
+    analog4 = payload.get<RMS_WORD3>();
 	Logger::debug("RMS  A1: %i   A2: %i   A3: %i   A4: %i", analog1, analog2, analog3, analog4);
 }
 
@@ -210,56 +257,61 @@ void RMSMotorController::handleCANMsgDigitalInputs(uint8_t *data)
 
 void RMSMotorController::handleCANMsgMotorPos(uint8_t *data)
 {
+	CanPayload payload(data);
 	int motorAngle, motorSpeed, elecFreq, deltaResolver;
-    motorAngle = data[0] + (data[1] * 256);
-	motorSpeed = data[2] + (data[3] * 256);
-    elecFreq = data[4] + (data[5] * 256);
-    deltaResolver = data[6] + (data[7] * 256);
-	speedActual = motorSpeed;
+    motorAngle = payload.get<RMS_WORD0>();
+	motorSpeed = payload.get<RMS_WORD1>();
+    elecFreq = payload.get<RMS_WORD2>();
+    deltaResolver = payload.get<RMS_WORD3>();
+	setStatus(speedActual, motorSpeed);
 	Logger::debug("Angle: %i   Speed: %i   Freq: %i    Delta: %i", motorAngle, motorSpeed, elecFreq, deltaResolver);
 }
 
 void RMSMotorController::handleCANMsgCurrent(uint8_t *data)
 {
+	CanPayload payload(data);
 	float phaseCurrentA, phaseCurrentB, phaseCurrentC, busCurrent;
-    phaseCurrentA = data[0] + (data[1] * 256)  / 10.0f;
-	phaseCurrentB = data[2] + (data[3] * 256) / 10.0f;
-    phaseCurrentC = data[4] + (data[5] * 256) / 10.0f;
-    busCurrent = data[6] + (data[7] * 256) / 10.0f;
-	dcCurrent = busCurrent;
-	acCurrent = phaseCurrentA;
-	if (phaseCurrentB > acCurrent) acCurrent = phaseCurrentB;
-	if (phaseCurrentC > acCurrent) acCurrent = phaseCurrentC;
+    phaseCurrentA = payload.value<RMS_TENTHS0>();
+	phaseCurrentB = payload.value<RMS_TENTHS1>();
+    phaseCurrentC = payload.value<RMS_TENTHS2>();
+    busCurrent = payload.value<RMS_TENTHS3>();
+	setStatus(dcCurrent, busCurrent);
+	setStatus(acCurrent, phaseCurrentA);
+	if (phaseCurrentB > acCurrent) setStatus(acCurrent, phaseCurrentB);
+	if (phaseCurrentC > acCurrent) setStatus(acCurrent, phaseCurrentC);
 	Logger::debug("Phase A: %f    B: %f   C: %f    Bus Current: %f", phaseCurrentA, phaseCurrentB, phaseCurrentC, busCurrent);
 }
 
 void RMSMotorController::handleCANMsgVoltage(uint8_t *data)
 {
-	float dcVoltage, outVoltage, Vd, Vq;
-    dcVoltage = data[0] + (data[1] * 256) / 10.0f;
-	outVoltage = data[2] + (data[3] * 256) / 10.0f;
-    Vd = data[4] + (data[5] * 256) / 10.0f;
-    Vq = data[6] + (data[7] * 256) / 10.0f;
+	CanPayload payload(data);
+	float outVoltage, Vd, Vq;
+    setStatus(dcVoltage, payload.value<RMS_TENTHS0>());
+	outVoltage = payload.value<RMS_TENTHS1>();
+    Vd = payload.value<RMS_TENTHS2>();
+    Vq = payload.value<RMS_TENTHS3>();
 	Logger::debug("Bus Voltage: %f    OutVoltage: %f   Vd: %f    Vq: %f", dcVoltage, outVoltage, Vd, Vq);
 }
 
 void RMSMotorController::handleCANMsgFlux(uint8_t *data)
 {
+	CanPayload payload(data);
 	float fluxCmd, fluxEst, Id, Iq;
-    fluxCmd = data[0] + (data[1] * 256) / 10.0f;
-	fluxEst = data[2] + (data[3] * 256) / 10.0f;
-    Id = data[4] + (data[5] * 256) / 10.0f;
-    Iq = data[6] + (data[7] * 256) / 10.0f;
+    fluxCmd = payload.value<RMS_THOUSANDTHS0>();
+	fluxEst = payload.value<RMS_THOUSANDTHS1>();
+    Id = payload.value<RMS_TENTHS2>();
+    Iq = payload.value<RMS_TENTHS3>();
 	Logger::debug("Flux Cmd: %f  Flux Est: %f   Id: %f    Iq: %f", fluxCmd, fluxEst, Id, Iq);
 }
 
 void RMSMotorController::handleCANMsgIntVolt(uint8_t *data)
 {
-	int volts15, volts25, volts50, volts120;
-    volts15 = data[0] + (data[1] * 256) / 10.0f;
-	volts25 = data[2] + (data[3] * 256) / 10.0f;
-    volts50 = data[4] + (data[5] * 256) / 10.0f;
-    volts120 = data[6] + (data[7] * 256) / 10.0f;
+	CanPayload payload(data);
+	float volts15, volts25, volts50, volts120;
+    volts15 = payload.value<RMS_HUNDREDTHS0>();
+	volts25 = payload.value<RMS_HUNDREDTHS1>();
+    volts50 = payload.value<RMS_HUNDREDTHS2>();
+    volts120 = payload.value<RMS_HUNDREDTHS3>();
 	Logger::debug("1.5V: %f   2.5V: %f   5.0V: %f    12V: %f", volts15, volts25, volts50, volts120);
 }
 
@@ -267,15 +319,16 @@ void RMSMotorController::handleCANMsgIntState(uint8_t *data)
 {
 	int vsmState, invState, relayState, invRunMode, invActiveDischarge, invCmdMode, invEnable, invLockout, invDirection;
 	
-	vsmState = data[0] + (data[1] * 256);
-	invState = data[2];
-	relayState = data[3];
-	invRunMode = data[4] & 1;
-	invActiveDischarge = data[4] >> 5;
-	invCmdMode = data[5];
-	isEnabled = data[6] & 1;
-	isLockedOut = data[6] >> 7;
-	invDirection = data[7];
+	CanPayload payload(data);
+	vsmState = payload.get<RMS_VSM_STATE>();
+	invState = payload.get<RMS_INV_STATE>();
+	relayState = payload.get<RMS_RELAY_STATE>();
+	invRunMode = payload.get<RMS_RUN_MODE>();
+	invActiveDischarge = payload.get<RMS_ACTIVE_DISCHARGE>();
+	invCmdMode = payload.get<RMS_CMD_MODE>();
+	isEnabled = payload.get<RMS_ENABLED>();
+	isLockedOut = payload.get<RMS_LOCKOUT>();
+	invDirection = payload.get<RMS_DIRECTION>();
 
     switch (vsmState)
 	{
@@ -344,8 +397,8 @@ void RMSMotorController::handleCANMsgIntState(uint8_t *data)
 	
 	Logger::debug ("Relay States: %x", relayState);
 	
-	if (invRunMode) powerMode = modeSpeed;
-	else powerMode = modeTorque;
+	if (invRunMode) setStatus(powerMode, modeSpeed);
+	else setStatus(powerMode, modeTorque);
 	
 	switch (invActiveDischarge)
 	{
@@ -382,14 +435,15 @@ void RMSMotorController::handleCANMsgIntState(uint8_t *data)
 
 void RMSMotorController::handleCANMsgFaults(uint8_t *data)
 {
+	CanPayload payload(data);
 	uint32_t postFaults, runFaults;
 	
-	postFaults = data[0] + (data[1] * 256) + (data[2] * 65536ul) + (data[3] * 16777216ul);
-	runFaults = data[4] + (data[5] * 256) + (data[6] * 65536ul) + (data[7] * 16777216ul);
+	postFaults = payload.get<RMS_LONG0>();
+	runFaults = payload.get<RMS_LONG1>();
 	
 	//for non-debugging purposes if either of the above is not zero then crap has hit the fan. Register as faulted and quit trying to move
-	if (postFaults != 0 || runFaults != 0) faulted = true;
-	else faulted = false;
+	if (postFaults != 0 || runFaults != 0) setStatus(faulted, true);
+	else setStatus(faulted, false);
 	
 	if (postFaults & 1) Logger::error("Desat Fault!");
 	if (postFaults & 2) Logger::error("HW Over Current Limit!");
@@ -451,34 +505,37 @@ void RMSMotorController::handleCANMsgFaults(uint8_t *data)
 
 void RMSMotorController::handleCANMsgTorqueTimer(uint8_t *data)
 {
+	CanPayload payload(data);
 	float cmdTorque, actTorque;
 	uint32_t uptime;
 	
-	cmdTorque = data[0] + (data[1] * 256) / 10.0f;
-	actTorque = data[2] + (data[3] * 256) / 10.0f;
-	uptime = data[4] + (data[5] * 256) + (data[6] * 65536ul) + (data[7] * 16777216ul);
+	cmdTorque = payload.value<RMS_TENTHS0>();
+	actTorque = payload.value<RMS_TENTHS1>();
+	uptime = payload.get<RMS_LONG1>();
 	Logger::debug("Torque Cmd: %f   Actual: %f     Uptime: %lu", cmdTorque, actTorque, uptime);
-	torqueActual = actTorque;
+	setStatus(torqueActual, actTorque);
 	//torqueCommand = cmdTorque; //should this be here? We set commanded torque and probably shouldn't overwrite here.
 }
 
 void RMSMotorController::handleCANMsgModFluxWeaken(uint8_t *data)
 {
+	CanPayload payload(data);
 	int modIdx, fieldWeak, IdCmd, IqCmd;
-    modIdx = data[0] + (data[1] * 256);
-	fieldWeak = data[2] + (data[3] * 256);
-    IdCmd = data[4] + (data[5] * 256);
-    IqCmd = data[6] + (data[7] * 256);
+    modIdx = payload.get<RMS_WORD0>();
+	fieldWeak = payload.get<RMS_WORD1>();
+    IdCmd = payload.get<RMS_WORD2>();
+    IqCmd = payload.get<RMS_WORD3>();
 	Logger::debug("Mod: %i  Weaken: %i   Id: %i   Iq: %i", modIdx, fieldWeak, IdCmd, IqCmd);
 }
 
 void RMSMotorController::handleCANMsgFirmwareInfo(uint8_t *data)
 {
 	int EEVersion, firmVersion, dateMMDD, dateYYYY;
-    EEVersion = data[0] + (data[1] * 256);
-	firmVersion = data[2] + (data[3] * 256);
-    dateMMDD = data[4] + (data[5] * 256);
-    dateYYYY = data[6] + (data[7] * 256);
+	CanPayload payload(data);
+    EEVersion = payload.get<RMS_WORD0>();
+	firmVersion = payload.get<RMS_WORD1>();
+    dateMMDD = payload.get<RMS_WORD2>();
+    dateYYYY = payload.get<RMS_WORD3>();
 	Logger::debug("EEVer: %u  Firmware: %u   Date: %u %u", EEVersion, firmVersion, dateMMDD, dateYYYY);
 }
 
@@ -490,26 +547,44 @@ void RMSMotorController::handleTick() {
 
     MotorController::handleTick(); //kick the ball up to papa
 	
-    if (isCANControlled) sendCmdFrame();   //Send out control message if inverter tells us it's set to CAN control. Otherwise just listen
+    //Send out control message if inverter tells us it's set to CAN control. Otherwise just listen.
+    //The inverter faults if the command frame is late so it goes out on the CAN handler's hardware timer
+    if (isCANControlled && cmdSlot < 0)
+    {
+        CAN_message_t output;
+        buildCmdFrame(output);
+        cmdSlot = attachedCANBus->addPeriodic(this, output, CFG_TICK_INTERVAL_MOTOR_CONTROLLER);
+    }
+    else if (!isCANControlled && cmdSlot >= 0)
+    {
+        attachedCANBus->removePeriodic(cmdSlot);
+        cmdSlot = -1;
+    }
 
     if(!online)  //This routine checks to see if we have received any frames from the inverter.  If so, ONLINE would be true and
     {   //we set the RUNNING light on.  If no frames are received for 2 seconds, we set running OFF.
         if (millis()-mss>2000)
         {
-            running = false; // We haven't received any frames for over 2 seconds.  Otherwise online would be true.
+            setStatus(running, false); // We haven't received any frames for over 2 seconds.  Otherwise online would be true.
             mss=millis();   //Reset our 2 second timer
         }
     }
-    else running = true;
+    else setStatus(running, true);
     online = false;//This flag will be set to true by received frames
 }
 
 
-void RMSMotorController::sendCmdFrame()
+//our command frame is due shortly. Get it ready
+void RMSMotorController::handlePeriodicFrame(int slot, CAN_message_t &frame)
+{
+    buildCmdFrame(frame);
+}
+
+void RMSMotorController::buildCmdFrame(CAN_message_t &output)
 {
     RMSMotorControllerConfiguration *config = (RMSMotorControllerConfiguration *)getConfiguration();
+    CanPayloadBuilder payload;
 
-    CAN_message_t output;
     output.len = 8;
     output.id = 0xC0;
     output.flags.extended = 0; //standard frame
@@ -520,34 +595,34 @@ void RMSMotorController::sendCmdFrame()
 	//Byte 6-7 = Commanded Torque Limit (Send as 0 to accept EEPROM parameter unless we're setting the limit really low for some reason such as faulting or a warning)
 	
 	//Speed set as 0
-	output.buf[2] = 0;
-	output.buf[3] = 0;
+	payload.set<RMS_CMD_SPEED>(0);
 	
 	//Torque limit set as 0
-	output.buf[6] = 0;
-	output.buf[7] = 0;
+	payload.set<RMS_CMD_TORQUE_LIMIT>(0);
 	
+	//Never ask for discharge
+	payload.set<RMS_CMD_DISCHARGE>(0);
 	
     //if(operationState == ENABLE && !isLockedOut && selectedGear != NEUTRAL && donePrecharge)
     if(operationState == ENABLE && !isLockedOut && selectedGear != NEUTRAL)
     {
-        output.buf[5] = 1;
+        payload.set<RMS_CMD_ENABLE>(1);
     }
     else
     {
-        output.buf[5] = 0;
+        payload.set<RMS_CMD_ENABLE>(0);
     }
 
     if(selectedGear == DRIVE)
     {
-        output.buf[4] = 0;
+        payload.set<RMS_CMD_DIRECTION>(0);
     }
     else
     {
-        output.buf[4] = 1;
+        payload.set<RMS_CMD_DIRECTION>(1);
     }
     
-    torqueRequested = ((throttleRequested * config->torqueMax) / 100.0f); //Calculate torque request from throttle position x maximum torque
+    setStatus(torqueRequested, ((throttleRequested * config->torqueMax) / 100.0f)); //Calculate torque request from throttle position x maximum torque
     if(speedActual<config->speedMax) {
         torqueCommand = torqueRequested;   //If actual rpm less than max rpm, add torque command to offset
     }
@@ -555,14 +630,13 @@ void RMSMotorController::sendCmdFrame()
         torqueCommand = torqueRequested / 2.0f;   //If at RPM limit, cut torque command in half.
     }
     
-    if (torqueRequested < 0) torqueRequested = 0;
+    if (torqueRequested < 0) setStatus(torqueRequested, 0);
     
     Logger::debug("ThrottleRequested: %i     TorqueRequested: %i", throttleRequested, torqueRequested);
 	
-    output.buf[1] = (torqueCommand & 0xFF00) >> 8;  //Stow torque command in bytes 0 and 1.
-    output.buf[0] = (torqueCommand & 0x00FF);
-    
-    attachedCANBus->sendFrame(output);  //Mail it.
+    payload.set<RMS_CMD_TORQUE>((int16_t)torqueCommand);  //Stow torque command in bytes 0 and 1.
+    payload.store(output);
+
 
     Logger::debug("CAN Command Frame: %X  %X  %X  %X  %X  %X  %X  %X",output.id, output.buf[0],
                   output.buf[1],output.buf[2],output.buf[3],output.buf[4],
@@ -50,6 +50,8 @@ class RMSMotorController: public MotorController, CanObserver {
 public:
     virtual void handleTick();
     virtual void handleCanFrame(const CAN_message_t &frame);
+    CanObserver *asCanObserver() { return this; }
+    virtual void handlePeriodicFrame(int slot, CAN_message_t &frame);
     virtual void setup();
     void earlyInit();
 
@@ -70,8 +72,9 @@ private:
 	bool isLockedOut;
 	bool isEnabled;
 	bool isCANControlled;
+	int cmdSlot; //CAN periodic slot of the command frame, -1 while not under CAN control
 
-   void sendCmdFrame();
+   void buildCmdFrame(CAN_message_t &output);
    void handleCANMsgTemperature1(uint8_t *data);
    void handleCANMsgTemperature2(uint8_t *data);
    void handleCANMsgTemperature3(uint8_t *data);
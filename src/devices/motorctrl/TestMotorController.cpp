@@ -48,7 +48,7 @@ void TestMotorController::setup() {
     loadConfiguration();
     MotorController::setup(); // run the parent class version of this function
 
-    running = true;
+    setStatus(running, true);
     setPowerMode(modeTorque);
     setSelectedGear(DRIVE);
     setOpState(ENABLE);
@@ -61,62 +61,62 @@ void TestMotorController::handleTick() {
     
     MotorController::handleTick(); //kick the ball up to papa
     
-    dcVoltage = 360.0f; //360v nominal voltage
+    setStatus(dcVoltage, 360.0f); //360v nominal voltage
 
     //use throttleRequested to produce some motor like output.
     //throttleRequested ranges +/- 1000 so regen is possible here if the throttle has it set up.
     
     if (powerMode == modeSpeed)
     {
-        torqueRequested = 0;
+        setStatus(torqueRequested, 0);
         if (throttleRequested > 0 && operationState == ENABLE && selectedGear != NEUTRAL)
-            speedRequested = (((long) throttleRequested * (long) config->speedMax) / 1000);
+            setStatus(speedRequested, (((long) throttleRequested * (long) config->speedMax) / 1000));
         else
-            speedRequested = 0;
+            setStatus(speedRequested, 0);
         
-        speedActual = ((speedActual * 8) + (speedRequested * 2)) / 10;
-        torqueActual = speedActual / 20;
+        setStatus(speedActual, ((speedActual * 8) + (speedRequested * 2)) / 10);
+        setStatus(torqueActual, speedActual / 20);
         
         //generate some baseline holding current to maintain the speed.
-        dcCurrent = speedRequested / 66;
+        setStatus(dcCurrent, speedRequested / 66);
         //Then add some accelerating current for the difference between target and actual
-        dcCurrent += (speedRequested - speedActual) / 10;
+        setStatus(dcCurrent, dcCurrent + (speedRequested - speedActual) / 10);
     }
     else
     {
         if (selectedGear == DRIVE)
-            torqueRequested = (((long) throttleRequested * (long) config->torqueMax) / 1000.0f);
+            setStatus(torqueRequested, (((long) throttleRequested * (long) config->torqueMax) / 1000.0f));
         if (selectedGear == REVERSE)
-            torqueRequested = (((long) throttleRequested * -1 *(long) config->torqueMax) / 1000.0f);
+            setStatus(torqueRequested, (((long) throttleRequested * -1 *(long) config->torqueMax) / 1000.0f));
         
-        torqueActual = ((torqueActual * 7) + (torqueRequested * 3)) / 10.0;
-        speedActual = torqueActual * 2;
-        if (speedActual < 0) speedActual = 0;
+        setStatus(torqueActual, ((torqueActual * 7) + (torqueRequested * 3)) / 10.0);
+        setStatus(speedActual, torqueActual * 2);
+        if (speedActual < 0) setStatus(speedActual, 0);
         
-        speedRequested = 0;
+        setStatus(speedRequested, 0);
         
         //generate some baseline holding current to maintain the speed.
-        dcCurrent = torqueRequested / 3;
+        setStatus(dcCurrent, torqueRequested / 3);
         //Then add some accelerating current for the difference between target and actual
-        dcCurrent += (torqueRequested - torqueActual) * 2;        
+        setStatus(dcCurrent, dcCurrent + (torqueRequested - torqueActual) * 2);        
                 
     }
     
-    acCurrent = (dcCurrent * 40) / 30; //A bit more current than DC bus    
+    setStatus(acCurrent, (dcCurrent * 40) / 30); //A bit more current than DC bus    
     
     //Both dc current and dc voltage are scaled up 10, mech power should be in 0.1kw increments
     //current*voltage = watts but there is inefficiency to deal with. and it's watts but we're scaled up 100x
     //because of multipliers so need to scale down 100x to get to watts then by 100x again to get to 0.1kw
     //100x100 = 10000 but inefficiency should make it even worse
-    mechanicalPower = (dcCurrent * dcVoltage) / 1200.0f;
+    setStatus(mechanicalPower, (dcCurrent * dcVoltage) / 1200.0f);
     
     //Heat up or cool motor and inverter based on mechanical power being used.
     //Assume ambient temperature is 18C
     //These numbers are horrifically off from realistic physics at this point
     //but we're trying to aid debugging, not making a perfect physics model.
-    temperatureMotor = 180 + abs(mechanicalPower * 2);
-    temperatureInverter = 190 + abs(mechanicalPower * 3) / 2;
-    temperatureSystem = (temperatureInverter + temperatureMotor) / 2;
+    setStatus(temperatureMotor, 180 + abs(mechanicalPower * 2));
+    setStatus(temperatureInverter, 190 + abs(mechanicalPower * 3) / 2);
+    setStatus(temperatureSystem, (temperatureInverter + temperatureMotor) / 2);
     
     Logger::debug(TESTINVERTER, "PowerMode: %i, Gear: %i", powerMode, selectedGear);
     Logger::debug(TESTINVERTER, "TorqueReq: %f, SpeedReq: %i", torqueRequested, speedRequested);
@@ -125,11 +125,11 @@ void TestMotorController::handleTick() {
 }
 
 void TestMotorController::setGear(Gears gear) {
-    selectedGear = gear;
+    setStatus(selectedGear, gear);
     //if the gear was just set to drive or reverse and the DMOC is not currently in enabled
     //op state then ask for it by name
     if (selectedGear != NEUTRAL) {
-        operationState = ENABLE;
+        setStatus(operationState, ENABLE);
     }
     //should it be set to standby when selecting neutral? I don't know. Doing that prevents regen
     //when in neutral and I don't think people will like that.
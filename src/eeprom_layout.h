@@ -79,9 +79,20 @@ First device entry is 0xDEAD if valid - otherwise table is initialized
 //start EEPROM addr where the system log starts. <SYS LOG YET TO BE DEFINED>
 #define EE_SYS_LOG              69632
 
-//start EEPROM addr for fault log (Used by fault_handler)
+//start EEPROM addr of the old fault log. The fault log is kept in the record store now
 #define EE_FAULT_LOG            102400
 
+/*
+Device settings and the fault log are kept in the record store (see RecordStore.h), which takes
+the whole upper half of the EEPROM. It's a log: every change is appended as a new record and the
+store moves through its sectors in turn so the writes get spread over 512 pages instead of hitting
+the same few over and over. The per device blocks above are only read any more to move old settings
+over the first time the store is set up.
+*/
+#define EE_RECORD_STORE         131072 //start EEPROM addr of the record store
+#define EE_RECORD_STORE_SIZE    131072 //runs to the end of the EEPROM
+#define EE_RECORD_SECTOR_SIZE   4096   //the store fills and recycles sectors of this size one at a time
+
 /*Now, all devices also have a default list of things that WILL be stored in EEPROM. Each actual
 implementation for a given device can store it's own custom info as well. This data must come after
 the end of the stardard data. The below numbers are offsets from the device's eeprom section
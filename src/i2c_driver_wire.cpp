@@ -57,6 +57,7 @@ void I2CDriverWire::beginTransmission(int address) {
 }
 
 uint8_t I2CDriverWire::endTransmission(int stop) {
+    finish(); // the bus may be shared with someone using the async calls directly. Let them finish first
     master.write_async(write_address, tx_buffer, tx_next_byte_to_write, stop);
     finish();
     return toWireResult(master.error());
@@ -84,6 +85,7 @@ size_t I2CDriverWire::write(const uint8_t* data, size_t length) {
 uint8_t I2CDriverWire::requestFrom(int address, int quantity, int stop) {
     rx_bytes_available = 0;
     rx_next_byte_to_read = 0;
+    finish();
     master.read_async((uint8_t)address, rxBuffer, min((size_t)quantity, rx_buffer_length), stop);
     finish();
     rx_bytes_available = master.get_bytes_transferred();
@@ -323,6 +323,7 @@ bool IMX_RT1060_I2CMaster::start(uint8_t address, uint32_t direction) {
     }
 
     // Start a new transaction
+    transaction_count++;
     ignore_tdf = direction;
     _error = I2CError::ok;
     state = State::starting;
@@ -124,6 +124,12 @@ public:
 
     void read_async(uint8_t address, uint8_t* buffer, size_t num_bytes, bool send_stop) override;
 
+    // Counts transactions started on this port. Code that shares the bus with Wire
+    // can use it to tell whether error() still belongs to its own last transaction.
+    inline uint32_t get_transaction_count() {
+        return transaction_count;
+    }
+
     // DO NOT call this method directly.
     void _interrupt_service_routine();
 private:
@@ -146,6 +152,7 @@ private:
     volatile State state = State::idle;
     volatile uint32_t ignore_tdf = false;          // True for a receivve transfer
     volatile bool stop_on_completion = false;   // True if the transmit transfer requires a stop.
+    volatile uint32_t transaction_count = 0;
 
     void (* isr)();
     void set_clock(uint32_t frequency);
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""
+Convert GEVCU7 CAN recordings (CANxxxxx.BIN from the sdCard) into something other tools can read.
+
+By default the output is candump log format (candump -l) which can be replayed with canplayer
+or loaded by SavvyCAN. Use --csv to get SavvyCAN's native CSV format instead.
+
+    canrec2csv.py CAN00001.BIN CAN00002.BIN > capture.log
+    canrec2csv.py --csv -o capture.csv CAN0000*.BIN
+
+See src/CanRecorder.h for the file layout.
+"""
+
+import argparse
+import struct
+import sys
+
+SECTOR_SIZE = 512
+MAGIC = b"GVCANREC"
+HEADER = struct.Struct("<8sHHIIII3I")
+RECORD = struct.Struct("<BBII")
+
+CANREC_VALID = 0x80
+CANREC_TIME = 0x40
+CANREC_TX = 0x20
+CANREC_EXTENDED = 0x10
+CANREC_BRS = 0x08
+CANREC_FD = 0x04
+CANREC_BUS_MASK = 0x03
+
+
+def read_frames(filename):
+    """Yields (timestamp in microseconds, flags, id, data) for every frame in one recording."""
+    with open(filename, "rb") as f:
+        header = f.read(SECTOR_SIZE)
+        if len(header) < HEADER.size:
+            raise ValueError("%s: file too short" % filename)
+        magic, version, sector_size, _, _, time_high, _, _, _, _ = HEADER.unpack_from(header)
+        if magic != MAGIC:
+            raise ValueError("%s: not a GEVCU CAN recording" % filename)
+        if version != 1 or sector_size != SECTOR_SIZE:
+            raise ValueError("%s: unsupported version %d / sector size %d" % (filename, version, sector_size))
+
+        while True:
+            sector = f.read(SECTOR_SIZE)
+            if len(sector) < SECTOR_SIZE:
+                break
+            offset = 0
+            while offset + 2 <= SECTOR_SIZE:
+                flags = sector[offset]
+                length = sector[offset + 1]
+                if not (flags & CANREC_VALID):
+                    break  # padding, rest of the sector is empty
+                if flags & CANREC_TIME:
+                    (time_high,) = struct.unpack_from("<I", sector, offset + 2)
+                    offset += 2 + length
+                    continue
+                if offset + RECORD.size + length > SECTOR_SIZE:
+                    break  # damaged sector, records never cross the boundary
+                _, _, time_low, can_id = RECORD.unpack_from(sector, offset)
+                data = sector[offset + RECORD.size:offset + RECORD.size + length]
+                yield (time_high << 32) | time_low, flags, can_id, data
+                offset += RECORD.size + length
+
+
+def format_candump(timestamp, flags, can_id, data):
+    bus = flags & CANREC_BUS_MASK
+    if flags & CANREC_EXTENDED:
+        ident = "%08X" % can_id
+    else:
+        ident = "%03X" % can_id
+    if flags & CANREC_FD:
+        sep = "##%X" % (1 if flags & CANREC_BRS else 0)
+    else:
+        sep = "#"
+    return "(%d.%06d) can%d %s%s%s" % (timestamp // 1000000, timestamp % 1000000, bus, ident, sep, data.hex().upper())
+
+
+def format_csv(timestamp, flags, can_id, data):
+    fields = [
+        str(timestamp),
+        "%08X" % can_id,
+        "true" if flags & CANREC_EXTENDED else "false",
+        "Tx" if flags & CANREC_TX else "Rx",
+        str(flags & CANREC_BUS_MASK),
+        str(len(data)),
+    ]
+    fields.extend("%02X" % b for b in data)
+    return ",".join(fields)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert GEVCU7 CAN recordings to candump or SavvyCAN CSV")
+    parser.add_argument("files", nargs="+", help="recording files. Processed in name order, which is the order they were written")
+    parser.add_argument("--csv", action="store_true", help="write SavvyCAN CSV instead of candump log format")
+    parser.add_argument("-o", "--output", help="output file (default stdout)")
+    args = parser.parse_args()
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    if args.csv:
+        max_len = 64
+        out.write("Time Stamp,ID,Extended,Dir,Bus,LEN," + ",".join("D%d" % (i + 1) for i in range(max_len)) + "\n")
+        formatter = format_csv
+    else:
+        formatter = format_candump
+
+    count = 0
+    for filename in sorted(args.files):
+        try:
+            for frame in read_frames(filename):
+                out.write(formatter(*frame) + "\n")
+                count += 1
+        except ValueError as e:
+            print(e, file=sys.stderr)
+    if out is not sys.stdout:
+        out.close()
+    print("%d frames converted" % count, file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,336 @@
+/*
+ * cansignal_test.cpp
+ *
+ * Host side check of src/CanSignal.h. Every signal below is decoded and encoded with CanPayload and
+ * CanPayloadBuilder and the results compared with a plain bit by bit implementation of the DBC bit
+ * numbering that shares no code with them. Build and run it on the PC, no test framework needed:
+ *
+ *     g++ -std=gnu++14 -O1 -Wall -I../src cansignal_test.cpp -o cansignal_test && ./cansignal_test
+ *
+ * It prints each failure and exits with 1 if there were any.
+ *
+Copyright (c) 2022 Collin Kidder
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "CanSignal.h"
+
+static int failures = 0;
+static uint32_t rngState = 0x12345678;
+
+static uint32_t rng()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+/*
+ * The reference. Walks the signal one bit at a time from its least significant bit. Intel signals
+ * simply go up through the frame. Going from the lsb towards the msb of a Motorola signal goes up
+ * within a byte and after bit 7 carries on at bit 0 of the byte before it.
+ */
+static int nextBit(const CanSignalDef &sig, int pos)
+{
+    if (sig.order == CAN_INTEL) return pos + 1;
+    if ((pos & 7) == 7) return pos - 15;
+    return pos + 1;
+}
+
+//position of the signal's least significant bit. A Motorola start bit is the msb, walk down from it
+static int lsbPosition(const CanSignalDef &sig)
+{
+    if (sig.order == CAN_INTEL) return sig.startBit;
+    int pos = sig.startBit;
+    for (int i = 1; i < sig.length; i++) pos = ((pos & 7) == 0) ? pos + 15 : pos - 1;
+    return pos;
+}
+
+static int64_t referenceGet(const CanSignalDef &sig, const uint8_t *buf)
+{
+    uint64_t raw = 0;
+    int pos = lsbPosition(sig);
+    for (int i = 0; i < sig.length; i++)
+    {
+        if (buf[pos / 8] & (1 << (pos % 8))) raw |= (uint64_t)1 << i;
+        pos = nextBit(sig, pos);
+    }
+    if (sig.isSigned && (raw & ((uint64_t)1 << (sig.length - 1)))) return (int64_t)raw - ((int64_t)1 << sig.length);
+    return (int64_t)raw;
+}
+
+static void referenceSet(const CanSignalDef &sig, uint8_t *buf, int64_t value)
+{
+    uint64_t raw = (uint64_t)value;
+    int pos = lsbPosition(sig);
+    for (int i = 0; i < sig.length; i++)
+    {
+        if (raw & ((uint64_t)1 << i)) buf[pos / 8] |= (1 << (pos % 8));
+        else buf[pos / 8] &= ~(1 << (pos % 8));
+        pos = nextBit(sig, pos);
+    }
+}
+
+static void fail(const char *name, const char *what, const uint8_t *buf, int64_t expected, int64_t got)
+{
+    failures++;
+    printf("FAIL %s %s: expected %lld got %lld, payload", name, what, (long long)expected, (long long)got);
+    for (int i = 0; i < 8; i++) printf(" %02X", buf[i]);
+    printf("\n");
+}
+
+//get() for signed signals, getUnsigned() for unsigned ones so 32 bit values past 0x7FFFFFFF come out right
+template<const CanSignalDef &S> int64_t getRaw(const CanPayload &payload)
+{
+    return S.isSigned ? (int64_t)payload.get<S>() : (int64_t)payload.getUnsigned<S>();
+}
+
+template<const CanSignalDef &S> void setRaw(CanPayloadBuilder &builder, int64_t value)
+{
+    if (S.isSigned) builder.set<S>((int32_t)value);
+    else builder.setUnsigned<S>((uint32_t)value);
+}
+
+template<const CanSignalDef &S> void checkSignal(const char *name)
+{
+    int64_t lo = canSignalMin(S), hi = canSignalMax(S);
+    for (int round = 0; round < 2000; round++)
+    {
+        uint8_t buf[8];
+        for (int i = 0; i < 8; i++) buf[i] = rng();
+        if (round == 0) memset(buf, 0xFF, 8);
+        if (round == 1) memset(buf, 0, 8);
+
+        //decoding
+        int64_t expected = referenceGet(S, buf);
+        CanPayload payload(buf);
+        int64_t got = getRaw<S>(payload);
+        if (got != expected) fail(name, "get", buf, expected, got);
+
+        //a short frame reads as if the missing bytes were 0
+        uint8_t len = rng() % 9;
+        uint8_t padded[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        memcpy(padded, buf, len);
+        expected = referenceGet(S, padded);
+        got = getRaw<S>(CanPayload(buf, len));
+        if (got != expected) fail(name, "get short frame", padded, expected, got);
+
+        //encoding. Everything outside the signal stays 0
+        int64_t value = lo + (int64_t)(((uint64_t)rng() << 32 | rng()) % (uint64_t)(hi - lo + 1));
+        if (round == 0) value = hi;
+        if (round == 1) value = lo;
+        uint8_t want[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        referenceSet(S, want, value);
+        CanPayloadBuilder builder;
+        setRaw<S>(builder, value);
+        uint8_t have[8];
+        builder.store(have);
+        for (int i = 0; i < 8; i++)
+        {
+            if (have[i] != want[i])
+            {
+                fail(name, "set", have, value, referenceGet(S, have));
+                break;
+            }
+        }
+    }
+
+    //out of range raw values are clamped, not wrapped into other bits
+    uint8_t have[8];
+    CanPayloadBuilder over;
+    if (S.isSigned) over.set<S>((hi < INT32_MAX) ? (int32_t)(hi + 1) : (int32_t)hi);
+    else over.setUnsigned<S>((hi < UINT32_MAX) ? (uint32_t)(hi + 1) : (uint32_t)hi);
+    over.store(have);
+    if (referenceGet(S, have) != hi) fail(name, "clamp high", have, hi, referenceGet(S, have));
+    CanPayloadBuilder under;
+    if (S.isSigned) under.set<S>((lo > INT32_MIN) ? (int32_t)(lo - 1) : (int32_t)lo);
+    else under.set<S>(-1);
+    under.store(have);
+    if (referenceGet(S, have) != lo) fail(name, "clamp low", have, lo, referenceGet(S, have));
+}
+
+//signals chosen to hit byte boundaries, both ends of the frame and the 1 and 32 bit extremes
+static constexpr CanSignalDef INTEL_BYTE = {0, 8, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef INTEL_BIT = {13, 1, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef INTEL_NIBBLE = {60, 4, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef INTEL_WORD = {16, 16, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef INTEL_ODD = {5, 13, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef INTEL_SIGNED = {20, 12, CAN_INTEL, true, 1.0f, 0.0f};
+static constexpr CanSignalDef INTEL_SIGNED_WORD = {48, 16, CAN_INTEL, true, 1.0f, 0.0f};
+static constexpr CanSignalDef INTEL_LONG = {32, 32, CAN_INTEL, false, 1.0f, 0.0f};
+static constexpr CanSignalDef INTEL_SIGNED_LONG = {3, 32, CAN_INTEL, true, 1.0f, 0.0f};
+static constexpr CanSignalDef MOTO_BYTE = {7, 8, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef MOTO_BIT = {34, 1, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef MOTO_WORD = {7, 16, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef MOTO_ODD = {3, 12, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef MOTO_THREE_BYTES = {12, 14, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef MOTO_SIGNED = {39, 16, CAN_MOTOROLA, true, 1.0f, 0.0f};
+static constexpr CanSignalDef MOTO_SIGNED_ODD = {50, 11, CAN_MOTOROLA, true, 1.0f, 0.0f};
+static constexpr CanSignalDef MOTO_LAST = {63, 8, CAN_MOTOROLA, true, 1.0f, 0.0f};
+static constexpr CanSignalDef MOTO_LONG = {7, 32, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef MOTO_SIGNED_LONG = {29, 32, CAN_MOTOROLA, true, 1.0f, 0.0f};
+
+//physical values and whole frames
+static constexpr CanSignalDef SCALED_SPEED = {7, 16, CAN_MOTOROLA, false, 1.0f, -20000.0f};
+static constexpr CanSignalDef SCALED_TORQUE = {16, 16, CAN_INTEL, true, 0.1f, 0.0f};
+static constexpr CanSignalDef SCALED_TEMP = {32, 8, CAN_INTEL, false, 1.0f, -40.0f};
+static constexpr CanSignalDef STATE_BITS = {43, 4, CAN_MOTOROLA, false, 1.0f, 0.0f};
+static constexpr CanSignalDef FLAG = {47, 1, CAN_INTEL, false, 1.0f, 0.0f};
+
+struct TestFrame
+{
+    float speed;
+    float torque;
+    float temperature;
+    uint8_t state;
+    bool flag;
+};
+
+typedef CanFrameLayout<TestFrame,
+        CAN_FIELD(SCALED_SPEED, TestFrame, speed),
+        CAN_FIELD(SCALED_TORQUE, TestFrame, torque),
+        CAN_FIELD(SCALED_TEMP, TestFrame, temperature),
+        CAN_FIELD(STATE_BITS, TestFrame, state),
+        CAN_FIELD(FLAG, TestFrame, flag)> TestFrameLayout;
+
+struct LongFrame
+{
+    uint32_t counter;
+};
+
+typedef CanFrameLayout<LongFrame, CAN_FIELD(INTEL_LONG, LongFrame, counter)> LongFrameLayout;
+
+static void checkValue(const char *what, float expected, float got)
+{
+    float diff = expected - got;
+    if (diff < -0.001f || diff > 0.001f)
+    {
+        failures++;
+        printf("FAIL %s: expected %f got %f\n", what, expected, got);
+    }
+}
+
+static void checkLayout()
+{
+    for (int round = 0; round < 2000; round++)
+    {
+        uint8_t buf[8];
+        for (int i = 0; i < 8; i++) buf[i] = rng();
+        TestFrame frame;
+        TestFrameLayout::decode(buf, 8, frame);
+        checkValue("layout speed", referenceGet(SCALED_SPEED, buf) - 20000.0f, frame.speed);
+        checkValue("layout torque", referenceGet(SCALED_TORQUE, buf) * 0.1f, frame.torque);
+        checkValue("layout temperature", referenceGet(SCALED_TEMP, buf) - 40.0f, frame.temperature);
+        if (frame.state != referenceGet(STATE_BITS, buf)) fail("layout", "state", buf, referenceGet(STATE_BITS, buf), frame.state);
+        if (frame.flag != (referenceGet(FLAG, buf) != 0)) fail("layout", "flag", buf, referenceGet(FLAG, buf), frame.flag);
+
+        //and back. Only the bits the layout covers survive
+        uint8_t want[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        referenceSet(SCALED_SPEED, want, referenceGet(SCALED_SPEED, buf));
+        referenceSet(SCALED_TORQUE, want, referenceGet(SCALED_TORQUE, buf));
+        referenceSet(SCALED_TEMP, want, referenceGet(SCALED_TEMP, buf));
+        referenceSet(STATE_BITS, want, referenceGet(STATE_BITS, buf));
+        referenceSet(FLAG, want, referenceGet(FLAG, buf));
+        uint8_t have[8];
+        TestFrameLayout::encode(frame, have);
+        if (memcmp(have, want, 8) != 0) fail("layout", "encode", have, 0, 1);
+    }
+
+    //physical values round to the nearest raw value and clamp at the ends of the range
+    uint8_t have[8];
+    CanPayloadBuilder builder;
+    builder.setValue<SCALED_TORQUE>(-12.34f);
+    builder.setValue<SCALED_TEMP>(500.0f);
+    builder.setValue<SCALED_SPEED>(-30000.0f);
+    builder.store(have);
+    if (referenceGet(SCALED_TORQUE, have) != -123) fail("setValue", "rounding", have, -123, referenceGet(SCALED_TORQUE, have));
+    if (referenceGet(SCALED_TEMP, have) != 255) fail("setValue", "clamp high", have, 255, referenceGet(SCALED_TEMP, have));
+    if (referenceGet(SCALED_SPEED, have) != 0) fail("setValue", "clamp low", have, 0, referenceGet(SCALED_SPEED, have));
+
+    //unsigned 32 bit signals keep their top half, both raw and as physical values
+    const uint8_t big[8] = {0, 0, 0, 0, 0x00, 0x00, 0x00, 0xF0};
+    CanPayload payload(big);
+    checkValue("value unsigned long", 4026531840.0f, payload.value<INTEL_LONG>());
+    CanPayloadBuilder longBuilder;
+    longBuilder.setValue<INTEL_LONG>(4026531840.0f);
+    longBuilder.setValue<MOTO_LONG>(5e9f);
+    longBuilder.store(have);
+    if (referenceGet(INTEL_LONG, have) != 0xF0000000ll) fail("setValue", "unsigned long", have, 0xF0000000ll, referenceGet(INTEL_LONG, have));
+    if (referenceGet(MOTO_LONG, have) != 0xFFFFFFFFll) fail("setValue", "unsigned long clamp", have, 0xFFFFFFFFll, referenceGet(MOTO_LONG, have));
+    LongFrame longFrame;
+    LongFrameLayout::decode(big, 8, longFrame);
+    if (longFrame.counter != 0xF0000000ul) fail("layout", "unsigned long", big, 0xF0000000ll, longFrame.counter);
+    LongFrameLayout::encode(longFrame, have);
+    if (memcmp(have, big, 8) != 0) fail("layout", "unsigned long encode", have, 0xF0000000ll, referenceGet(INTEL_LONG, have));
+}
+
+//the reference itself, against frames worked out by hand from the DBC bit numbering
+static void checkReference()
+{
+    const uint8_t frame[8] = {0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC, 0xDE, 0xF0};
+    if (referenceGet(MOTO_WORD, frame) != 0x1234) fail("reference", "motorola word", frame, 0x1234, referenceGet(MOTO_WORD, frame));
+    if (referenceGet(INTEL_WORD, frame) != 0x7856) fail("reference", "intel word", frame, 0x7856, referenceGet(INTEL_WORD, frame));
+    //Motorola start bit 3, 12 bits: low nibble of byte 0 then all of byte 1
+    if (referenceGet(MOTO_ODD, frame) != 0x234) fail("reference", "motorola odd", frame, 0x234, referenceGet(MOTO_ODD, frame));
+    //Motorola start bit 39 is the top of byte 4, 16 bits signed: 0x9ABC
+    if (referenceGet(MOTO_SIGNED, frame) != (int16_t)0x9ABC) fail("reference", "motorola signed", frame, (int16_t)0x9ABC, referenceGet(MOTO_SIGNED, frame));
+    //Intel start bit 48, 16 bits signed: bytes 6 and 7 little endian
+    if (referenceGet(INTEL_SIGNED_WORD, frame) != (int16_t)0xF0DE) fail("reference", "intel signed", frame, (int16_t)0xF0DE, referenceGet(INTEL_SIGNED_WORD, frame));
+}
+
+#define CHECK(signal) checkSignal<signal>(#signal)
+
+int main()
+{
+    checkReference();
+    CHECK(INTEL_BYTE);
+    CHECK(INTEL_BIT);
+    CHECK(INTEL_NIBBLE);
+    CHECK(INTEL_WORD);
+    CHECK(INTEL_ODD);
+    CHECK(INTEL_SIGNED);
+    CHECK(INTEL_SIGNED_WORD);
+    CHECK(INTEL_LONG);
+    CHECK(INTEL_SIGNED_LONG);
+    CHECK(MOTO_BYTE);
+    CHECK(MOTO_BIT);
+    CHECK(MOTO_WORD);
+    CHECK(MOTO_ODD);
+    CHECK(MOTO_THREE_BYTES);
+    CHECK(MOTO_SIGNED);
+    CHECK(MOTO_SIGNED_ODD);
+    CHECK(MOTO_LAST);
+    CHECK(MOTO_LONG);
+    CHECK(MOTO_SIGNED_LONG);
+    checkLayout();
+    if (failures)
+    {
+        printf("%i failures\n", failures);
+        return 1;
+    }
+    printf("all CAN signal checks passed\n");
+    return 0;
+}
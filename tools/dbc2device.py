@@ -0,0 +1,736 @@
+#!/usr/bin/env python3
+"""
+Turn a DBC file for an inverter, BMS, charger or the like into the skeleton of a GEVCU7 device
+driver, laid out like docs/ExampleDevice.cpp.
+
+    dbc2device.py --name OrionBMS --id 0x2200 --type bms --node BMS -o src/devices/bms orion.dbc
+
+This writes OrionBMS.h, OrionBMS.cpp and OrionBMSSignals.h. The signals header holds a CanSignalDef
+(see src/CanSignal.h) for every signal, the driver attaches to every message it receives, decodes
+them into status variables registered as StatusEntry records and builds the frames it sends. Messages
+with a GenMsgCycleTime attribute are sent from the CAN handler's periodic table, the rest once per
+tick. --node is the name the DBC gives the device. Messages it transmits are received by GEVCU and
+messages it receives are sent by GEVCU. Without --node every message is treated as received.
+--type motorctrl, bms, charger and dcdc drivers derive from MotorController, BatteryManager,
+ChargeController and DCDCController so the rest of GEVCU can use them as one. Decoded signals that
+would hide a variable of the base class get the message name in front.
+
+--bench FILE also writes a host side program that checks the signal tables and times the decoders:
+
+    dbc2device.py ... --bench orion_bench.cpp orion.dbc
+    g++ -O2 -std=gnu++14 -I src/devices/bms orion_bench.cpp -o orion_bench && ./orion_bench
+
+Keep the benchmark out of src/, the Arduino build compiles every .cpp in there.
+
+Only the first 8 bytes of a frame are decoded and signals longer than 32 bits are skipped. Anything
+that can't be turned into code is reported on stderr and left as a comment in the output. The
+output is a starting point, look it over before enabling the device.
+"""
+
+import argparse
+import datetime
+import os
+import re
+import sys
+
+DEVICE_TYPES = {
+    "motorctrl": "DEVICE_MOTORCTRL",
+    "bms": "DEVICE_BMS",
+    "charger": "DEVICE_CHARGER",
+    "display": "DEVICE_DISPLAY",
+    "misc": "DEVICE_MISC",
+    "io": "DEVICE_IO",
+    "dcdc": "DEVICE_DCDC",
+}
+
+#DeviceManager hands out devices of these types as the class they belong to, so the driver has to
+#derive from it. (class, its configuration class, header under src/devices)
+BASE_CLASSES = {
+    "motorctrl": ("MotorController", "MotorControllerConfiguration", "motorctrl/MotorController.h"),
+    "bms": ("BatteryManager", "BatteryManagerConfiguration", "bms/BatteryManager.h"),
+    "charger": ("ChargeController", "ChargeConfiguration", "charger/ChargeController.h"),
+    "dcdc": ("DCDCController", "DCDCConfiguration", "dcdc/DCDCController.h"),
+}
+PLAIN_DEVICE = ("Device", "DeviceConfiguration", "Device.h")
+
+#BatteryManager leaves these to the driver
+BMS_QUERIES = ["hasPackVoltage", "hasPackCurrent", "hasTemperatures", "isChargeOK", "isDischargeOK"]
+
+DEVICES_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src", "devices")
+RE_MEMBER = re.compile(r"^\s+[\w:<>,]+[\w:<>,\s\*&]*?[\s\*&](\w+)\s*(?:\[[^\]]*\])?\s*(?:=[^;]*)?;")
+
+RE_MESSAGE = re.compile(r"^BO_\s+(\d+)\s+(\w+)\s*:\s*(\d+)\s+(\w+)")
+RE_SIGNAL = re.compile(r"^\s*SG_\s+(\w+)\s*(M|m\d+)?\s*:\s*(\d+)\|(\d+)@([01])([+-])\s*"
+                       r"\(\s*([^,]+?)\s*,\s*([^)]+?)\s*\)\s*\[\s*([^|]*?)\s*\|\s*([^\]]*?)\s*\]\s*"
+                       r"\"([^\"]*)\"\s*(.*)$")
+RE_CYCLE = re.compile(r"^BA_\s+\"GenMsgCycleTime\"\s+BO_\s+(\d+)\s+(\d+)\s*;")
+RE_VALUES = re.compile(r"^VAL_\s+(\d+)\s+(\w+)\s+(.*);")
+RE_VALUE_PAIR = re.compile(r"(-?\d+)\s+\"([^\"]*)\"")
+RE_COMMENT = re.compile(r"CM_\s+SG_\s+(\d+)\s+(\w+)\s+\"((?:[^\"\\]|\\.)*)\"\s*;", re.S)
+
+#DBC ids have bit 31 set for extended frames
+DBC_EXTENDED = 0x80000000
+
+MIT_LICENSE = """\
+Copyright (c) {year} {author}
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be included
+in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+"""
+
+
+def base_members(header):
+    """Names of the variables declared in a header under src/devices and in Device.h, which a
+    generated driver inherits. Empty if the tree isn't where this script expects it"""
+    names = set()
+    for path in (header, "Device.h"):
+        try:
+            with open(os.path.join(DEVICES_DIR, path), encoding="latin-1") as f:
+                for line in f:
+                    match = RE_MEMBER.match(line)
+                    if match and "(" not in line and not line.lstrip().startswith(("return", "//", "#")):
+                        names.add(match.group(1))
+        except OSError:
+            pass
+    return names
+
+
+def warn(text):
+    print("warning: " + text, file=sys.stderr)
+
+
+def words(name):
+    """Splits Foo_BarBaz or FOO_BAR into its words"""
+    return [w for w in re.findall(r"[A-Z]+(?![a-z])|[A-Z]?[a-z]+|\d+", name)]
+
+
+def upper_name(name):
+    return "_".join(w.upper() for w in words(name)) or name.upper()
+
+
+def camel_name(name):
+    parts = words(name)
+    if not parts:
+        return name
+    return parts[0].lower() + "".join(w.capitalize() for w in parts[1:])
+
+
+def number(text):
+    value = float(text)
+    return int(value) if value == int(value) else value
+
+
+def c_float(value):
+    text = repr(float(value))
+    if "e" not in text and "." not in text:
+        text += ".0"
+    return text + "f"
+
+
+class Signal:
+    def __init__(self, match, message):
+        (self.name, mux, start, length, order, sign, scale, offset,
+         self.minimum, self.maximum, self.unit, receivers) = match.groups()
+        self.message = message
+        self.start = int(start)
+        self.length = int(length)
+        self.motorola = order == "0"
+        self.signed = sign == "-"
+        self.scale = number(scale)
+        self.offset = number(offset)
+        self.receivers = [r for r in re.split(r"[\s,]+", receivers.strip()) if r]
+        self.is_mux = mux == "M"
+        self.mux_value = int(mux[1:]) if mux and mux != "M" else None
+        self.values = []
+        self.comment = ""
+        self.const = ""
+        self.member = ""
+        self.skipped = self.check()
+
+    def check(self):
+        """Reason the signal can't be used, or None"""
+        if self.length < 1 or self.length > 32:
+            return "%d bits long, CanSignal only handles 1 to 32" % self.length
+        if self.motorola:
+            shift = 56 - (self.start & 0xF8) + (self.start & 7) - (self.length - 1)
+        else:
+            shift = self.start
+        if shift < 0 or shift + self.length > 64:
+            return "not within the first 8 bytes"
+        if self.scale == 0:
+            return "scale of 0"
+        return None
+
+    def raw_range(self):
+        if self.signed:
+            return -(1 << (self.length - 1)), (1 << (self.length - 1)) - 1
+        return 0, (1 << self.length) - 1
+
+    def c_type(self):
+        """(C type, CFG_ENTRY_VAR_TYPE) of the variable holding the physical value"""
+        if isinstance(self.scale, float) or isinstance(self.offset, float):
+            return "float", "FLOAT"
+        low, high = [r * self.scale + self.offset for r in self.raw_range()]
+        low, high = min(low, high), max(low, high)
+        if low >= 0 and high <= 0xFF:
+            return "uint8_t", "BYTE"
+        if low >= -0x8000 and high <= 0x7FFF:
+            return "int16_t", "INT16"
+        if low >= 0 and high <= 0xFFFF:
+            return "uint16_t", "UINT16"
+        if low >= -0x80000000 and high <= 0x7FFFFFFF:
+            return "int32_t", "INT32"
+        if low >= 0 and high <= 0xFFFFFFFF:
+            return "uint32_t", "UINT32"
+        return "float", "FLOAT"
+
+    def bench_values(self):
+        """Raw values the benchmark packs: both ends of the range CanSignal.h allows and two bit
+        patterns that look different in every byte, so bits landing in the wrong place show up"""
+        low, high = self.raw_range()
+        values = [low, high]
+        for pattern in (0x9E3779B9, 0x61C88646):
+            raw = pattern & ((1 << self.length) - 1)
+            if self.signed and raw >= 1 << (self.length - 1):
+                raw -= 1 << self.length
+            raw = max(low, min(high, raw))
+            if raw not in values:
+                values.append(raw)
+        return values
+
+    def pack(self, raw):
+        """The 8 payload bytes with only this signal set, worked out one bit at a time from the DBC
+        bit numbering. Deliberately nothing like the shifts CanSignal.h uses so the benchmark checks
+        that against something independent"""
+        data = [0] * 8
+        pos = self.start
+        if self.motorola: #the start bit is the msb, walk down to the lsb
+            for _ in range(self.length - 1):
+                pos = pos + 15 if pos % 8 == 0 else pos - 1
+        for bit in range(self.length):
+            if (raw >> bit) & 1:
+                data[pos // 8] |= 1 << (pos % 8)
+            pos = pos - 15 if self.motorola and pos % 8 == 7 else pos + 1
+        return data
+
+    def is_raw(self):
+        return self.scale == 1 and self.offset == 0
+
+    def raw_get(self):
+        """CanPayload call for the raw value. get() hands back an int32_t, which can't hold an
+        unsigned 32 bit signal past 0x7FFFFFFF"""
+        return "get" if self.signed or self.length < 32 else "getUnsigned"
+
+    def raw_set(self):
+        return "set" if self.signed or self.length < 32 else "setUnsigned"
+
+    def definition(self):
+        return "{%d, %d, %s, %s, %s, %s}" % (self.start, self.length, "CAN_MOTOROLA" if self.motorola else "CAN_INTEL",
+                                            "true" if self.signed else "false", c_float(self.scale), c_float(self.offset))
+
+
+class Message:
+    def __init__(self, match):
+        dbc_id, self.name, dlc, self.sender = match.groups()
+        dbc_id = int(dbc_id)
+        self.extended = bool(dbc_id & DBC_EXTENDED)
+        self.id = dbc_id & 0x1FFFFFFF
+        self.dlc = int(dlc)
+        self.signals = []
+        self.cycle = 0
+        self.const = ""
+        self.func = ""
+        self.slot = ""
+
+    def dbc_id(self):
+        return self.id | (DBC_EXTENDED if self.extended else 0)
+
+    def receivers(self):
+        names = set()
+        for sig in self.signals:
+            names.update(sig.receivers)
+        return names
+
+    def usable(self):
+        return [s for s in self.signals if not s.skipped]
+
+    def mux(self):
+        for sig in self.usable():
+            if sig.is_mux:
+                return sig
+        return None
+
+
+def parse_dbc(text):
+    messages = []
+    by_id = {}
+    current = None
+    for line in text.splitlines():
+        match = RE_MESSAGE.match(line)
+        if match:
+            current = Message(match)
+            messages.append(current)
+            by_id[current.dbc_id()] = current
+            continue
+        match = RE_SIGNAL.match(line)
+        if match:
+            if current is None:
+                warn("signal outside of a message: " + line.strip())
+                continue
+            current.signals.append(Signal(match, current))
+            continue
+        if not line.startswith(" "):
+            current = None
+        match = RE_CYCLE.match(line)
+        if match and int(match.group(1)) in by_id:
+            by_id[int(match.group(1))].cycle = int(match.group(2))
+            continue
+        match = RE_VALUES.match(line)
+        if match and int(match.group(1)) in by_id:
+            for sig in by_id[int(match.group(1))].signals:
+                if sig.name == match.group(2):
+                    sig.values = [(int(v), d) for v, d in RE_VALUE_PAIR.findall(match.group(3))]
+    for match in RE_COMMENT.finditer(text):
+        msg = by_id.get(int(match.group(1)))
+        for sig in msg.signals if msg else []:
+            if sig.name == match.group(2):
+                sig.comment = " ".join(match.group(3).replace('\\"', '"').split())
+    return messages
+
+
+class Device:
+    def __init__(self, args, messages):
+        self.name = args.name
+        self.prefix = (args.prefix or upper_name(args.name)).upper()
+        self.short = self.prefix.replace("_", "")[:10]
+        self.id = args.id
+        self.type = DEVICE_TYPES[args.type]
+        self.kind = args.type
+        self.base, self.base_config, self.base_header = BASE_CLASSES.get(args.type, PLAIN_DEVICE)
+        self.bus = args.bus
+        self.tick = args.tick
+        self.source = os.path.basename(args.dbc)
+        self.author = args.author
+        self.year = datetime.date.today().year
+        self.guard = upper_name(args.name) + "_H_"
+
+        if args.node:
+            self.rx = [m for m in messages if m.sender == args.node]
+            self.tx = [m for m in messages if m.sender != args.node and args.node in m.receivers()]
+        else:
+            self.rx = messages
+            self.tx = []
+        self.name_things()
+
+    def name_things(self):
+        """Picks C names for everything, making sure nothing collides"""
+        members = {}
+        for msg in self.rx + self.tx:
+            msg.const = "%s_%s" % (self.prefix, upper_name(msg.name))
+            msg.func = "build" + camel_name(msg.name)[:1].upper() + camel_name(msg.name)[1:]
+            msg.slot = camel_name(msg.name) + "Slot"
+            for sig in msg.signals:
+                sig.const = "%s_%s" % (msg.const, upper_name(sig.name))
+                if sig.skipped:
+                    warn("%s.%s skipped: %s" % (msg.name, sig.name, sig.skipped))
+                    continue
+                if not sig.is_mux:
+                    members.setdefault(camel_name(sig.name), []).append(sig)
+        inherited = base_members(self.base_header)
+        for name, sigs in members.items():
+            for sig in sigs:
+                sig.member = name if len(sigs) == 1 and name not in inherited else camel_name(sig.message.name + "_" + sig.name)
+                if sig.member in inherited:
+                    sig.member += "Signal"
+
+    def variables(self, messages):
+        return [s for m in messages for s in m.usable() if not s.is_mux]
+
+    #####################################################################################
+    # SIGNALS HEADER
+    #####################################################################################
+    def signals_header(self):
+        out = []
+        out.append("/*\n * %sSignals.h\n *\n" % self.name)
+        out.append(" * Signals of %s, generated by tools/dbc2device.py. Change the DBC file and generate this again\n"
+                   " * rather than editing it by hand.\n *\n" % self.source)
+        out.append(MIT_LICENSE.format(year=self.year, author=self.author))
+        out.append("\n */\n\n")
+        guard = upper_name(self.name) + "_SIGNALS_H_"
+        out.append("#ifndef %s\n#define %s\n\n" % (guard, guard))
+        out.append("#include \"../../CanSignal.h\"\n")
+
+        for msg in self.rx + self.tx:
+            every = ", every %ums" % msg.cycle if msg.cycle else ""
+            out.append("\n//%s - sent by %s, %d bytes%s\n" % (msg.name, msg.sender if msg in self.rx else "GEVCU",
+                                                             msg.dlc, every))
+            out.append("#define %-40s 0x%X\n" % (msg.const, msg.id))
+            out.append("#define %-40s %s\n" % (msg.const + "_EXT", "true" if msg.extended else "false"))
+            for sig in msg.signals:
+                if sig.skipped:
+                    out.append("//%s skipped, %s\n" % (sig.name, sig.skipped))
+                    continue
+                note = []
+                if sig.unit:
+                    note.append(sig.unit)
+                if sig.is_mux:
+                    note.append("multiplexer")
+                if sig.mux_value is not None:
+                    note.append("only when the multiplexer is %d" % sig.mux_value)
+                if sig.comment:
+                    note.append(sig.comment)
+                out.append("static constexpr CanSignalDef %s = %s;%s\n" % (sig.const, sig.definition(),
+                                                                         (" //" + ", ".join(note)) if note else ""))
+                for value, desc in sig.values:
+                    out.append("//    %d = %s\n" % (value, desc))
+        out.append("\n#endif /* %s */\n" % guard)
+        return "".join(out)
+
+    #####################################################################################
+    # DEVICE HEADER
+    #####################################################################################
+    def header(self):
+        out = []
+        out.append("/*\n * %s.h\n *\n" % self.name)
+        out.append(" * Driver for the device described by %s. The skeleton was generated by tools/dbc2device.py\n *\n"
+                   % self.source)
+        out.append(MIT_LICENSE.format(year=self.year, author=self.author))
+        out.append("\n */\n\n")
+        out.append("#ifndef %s\n#define %s\n\n" % (self.guard, self.guard))
+        out.append("#include <Arduino.h>\n")
+        for inc in ("config.h", "sys_io.h", "TickHandler.h", "Logger.h", "DeviceManager.h", "CanHandler.h"):
+            out.append("#include \"../../%s\"\n" % inc)
+        out.append("#include \"../%s\"\n\n" % self.base_header)
+        out.append("#define %-31s 0x%04X\n" % (self.prefix, self.id))
+        out.append("#define %-31s %d\n\n" % ("CFG_TICK_INTERVAL_" + self.prefix, self.tick))
+
+        out.append("class %sConfiguration: public %s {\npublic:\n    uint8_t canbusNum;\n};\n\n" % (self.name, self.base_config))
+        out.append("class %s: public %s, CanObserver {\npublic:\n" % (self.name, self.base))
+        out.append("    %s();\n" % self.name)
+        out.append("    void setup();\n    void earlyInit();\n    void handleTick();\n")
+        out.append("    void handleCanFrame(const CAN_message_t &frame);\n")
+        out.append("    CanObserver *asCanObserver() { return this; }\n")
+        if any(m.cycle for m in self.tx):
+            out.append("    void handlePeriodicFrame(int slot, CAN_message_t &frame);\n")
+        out.append("    DeviceId getId();\n    DeviceType getType();\n    uint32_t getTickInterval();\n\n")
+        if self.kind == "bms":
+            for query in BMS_QUERIES:
+                out.append("    bool %s();\n" % query)
+            out.append("\n")
+        out.append("    void loadConfiguration();\n    void saveConfiguration();\n\nprivate:\n")
+
+        rx_vars = self.variables(self.rx)
+        if rx_vars:
+            out.append("    //decoded from received frames, all of these are StatusEntry records\n")
+            for sig in rx_vars:
+                out.append("    %s %s;%s\n" % (sig.c_type()[0], sig.member, (" //" + sig.unit) if sig.unit else ""))
+        tx_vars = self.variables(self.tx)
+        if tx_vars:
+            out.append("\n    //values put into the frames we send\n")
+            for sig in tx_vars:
+                out.append("    %s %s;%s\n" % (sig.c_type()[0], sig.member, (" //" + sig.unit) if sig.unit else ""))
+        periodic = [m for m in self.tx if m.cycle]
+        if periodic:
+            out.append("\n")
+            for msg in periodic:
+                out.append("    int %s; //periodic table slot for %s, -1 when not scheduled\n" % (msg.slot, msg.name))
+        if self.tx:
+            out.append("\n")
+            for msg in self.tx:
+                out.append("    void %s(CAN_message_t &output);\n" % msg.func)
+        out.append("};\n\n#endif /* %s */\n" % self.guard)
+        return "".join(out)
+
+    #####################################################################################
+    # DEVICE SOURCE
+    #####################################################################################
+    def source_file(self):
+        n = self.name
+        out = []
+        out.append("/*\n * %s.cpp\n *\n" % n)
+        out.append(" * Generated from %s by tools/dbc2device.py. Decoding and building frames is done, the rest\n"
+                   " * (what the values mean to the car, faults, configuration) is up to you.\n *\n" % self.source)
+        out.append(MIT_LICENSE.format(year=self.year, author=self.author))
+        out.append(" */\n\n")
+        out.append("#include \"%s.h\"\n#include \"%sSignals.h\"\n\n" % (n, n))
+
+        #constructor
+        out.append("%s::%s() : %s()\n{\n" % (n, n, self.base))
+        out.append("    commonName = \"%s\";\n    shortName = \"%s\";\n" % (n, self.short))
+        for sig in self.variables(self.rx) + self.variables(self.tx):
+            out.append("    %s = 0;\n" % sig.member)
+        for msg in self.tx:
+            if msg.cycle:
+                out.append("    %s = -1;\n" % msg.slot)
+        out.append("}\n\n")
+
+        out.append("void %s::earlyInit()\n{\n    prefsHandler = new PrefHandler(%s);\n}\n\n" % (n, self.prefix))
+
+        #setup
+        out.append("void %s::setup()\n{\n" % n)
+        out.append("    tickHandler.detach(this);\n\n")
+        out.append("    Logger::info(\"add device: %s (id: %%X, %%X)\", %s, this);\n\n" % (n, self.prefix))
+        out.append("    loadConfiguration();\n\n    %s::setup();\n\n" % self.base)
+        out.append("    %sConfiguration *config = (%sConfiguration *)getConfiguration();\n\n" % (n, n))
+        if self.base == "Device":
+            out.append("    cfgEntries.reserve(1);\n\n")
+        out.append("    ConfigEntry entry;\n")
+        out.append("    entry = {\"%s-CANBUS\", \"Set which CAN bus to connect to (0-2)\", &config->canbusNum, "
+                   "CFG_ENTRY_VAR_TYPE::BYTE, 0, 2, 0, nullptr};\n" % self.prefix)
+        out.append("    cfgEntries.push_back(entry);\n")
+        out.append("    //add a ConfigEntry here for every setting in %sConfiguration\n\n" % n)
+
+        rx_vars = self.variables(self.rx)
+        if rx_vars:
+            out.append("    StatusEntry stat;\n")
+            out.append("    //        name              var         type                  prevVal  obj\n")
+            for sig in rx_vars:
+                out.append("    stat = {\"%s_%s\", &%s, CFG_ENTRY_VAR_TYPE::%s, 0, this};\n"
+                           % (self.short, sig.name, sig.member, sig.c_type()[1]))
+                out.append("    deviceManager.addStatusEntry(stat);\n")
+            out.append("\n")
+
+        out.append("    //setup() runs again after config changes. Start from scratch so nothing is attached or scheduled twice\n")
+        out.append("    attachedCANBus->detachAll(this);\n")
+        for msg in self.tx:
+            if msg.cycle:
+                out.append("    %s = -1;\n" % msg.slot)
+        out.append("    setAttachedCANBus(config->canbusNum);\n    dependsOnCanBus(config->canbusNum);\n\n")
+        for msg in self.rx:
+            if not msg.usable():
+                continue
+            out.append("    attachedCANBus->attach(this, %s, %s, %s_EXT);\n"
+                       % (msg.const, "0x1FFFFFFF" if msg.extended else "0x7FF", msg.const))
+
+        periodic = [m for m in self.tx if m.cycle]
+        if periodic:
+            out.append("\n    CAN_message_t output;\n")
+            for i, msg in enumerate(periodic):
+                phase = (i * 1000) % (msg.cycle * 1000)
+                out.append("    %s(output);\n" % msg.func)
+                out.append("    %s = attachedCANBus->addPeriodic(this, output, %d%s);\n"
+                           % (msg.slot, msg.cycle * 1000, (", %d" % phase) if phase else ""))
+
+        out.append("\n    tickHandler.attach(this, CFG_TICK_INTERVAL_%s);\n}\n\n" % self.prefix)
+
+        #tick
+        out.append("void %s::handleTick()\n{\n    %s::handleTick();\n" % (n, self.base))
+        ticked = [m for m in self.tx if not m.cycle]
+        if ticked:
+            out.append("\n    CAN_message_t output;\n")
+            for msg in ticked:
+                out.append("    %s(output);\n    attachedCANBus->sendFrame(output);\n" % msg.func)
+        out.append("}\n\n")
+
+        #receive
+        out.append("void %s::handleCanFrame(const CAN_message_t &frame)\n{\n" % n)
+        rx = [m for m in self.rx if m.usable()]
+        if rx:
+            out.append("    CanPayload payload(frame);\n\n    switch (frame.id)\n    {\n")
+            for msg in rx:
+                out.append("    case %s:\n" % msg.const)
+                out.extend(self.decode(msg))
+                out.append("        break;\n")
+            out.append("    }\n")
+        out.append("}\n\n")
+
+        #send
+        if periodic:
+            out.append("//one of our periodic frames is due shortly. Get it ready\n")
+            out.append("void %s::handlePeriodicFrame(int slot, CAN_message_t &frame)\n{\n" % n)
+            for i, msg in enumerate(periodic):
+                out.append("    %sif (slot == %s) %s(frame);\n" % ("else " if i else "", msg.slot, msg.func))
+            out.append("}\n\n")
+        for msg in self.tx:
+            out.extend(self.build(msg))
+
+        out.append("DeviceId %s::getId()\n{\n    return (%s);\n}\n\n" % (n, self.prefix))
+        out.append("DeviceType %s::getType()\n{\n    return (DeviceType::%s);\n}\n\n" % (n, self.type))
+        out.append("uint32_t %s::getTickInterval()\n{\n    return CFG_TICK_INTERVAL_%s;\n}\n\n" % (n, self.prefix))
+        if self.kind == "bms":
+            out.append("//what this BMS can tell the rest of GEVCU. Fill these in from the decoded signals\n")
+            for query in BMS_QUERIES:
+                out.append("bool %s::%s()\n{\n    return false;\n}\n\n" % (n, query))
+
+        out.append("void %s::loadConfiguration()\n{\n" % n)
+        out.append("    %sConfiguration *config = (%sConfiguration *)getConfiguration();\n\n" % (n, n))
+        out.append("    if (!config) {\n        config = new %sConfiguration();\n        setConfiguration(config);\n    }\n\n" % n)
+        out.append("    %s::loadConfiguration();\n\n" % self.base)
+        out.append("    prefsHandler->read(\"CanbusNum\", &config->canbusNum, %d);\n}\n\n" % self.bus)
+
+        out.append("void %s::saveConfiguration()\n{\n" % n)
+        out.append("    %sConfiguration *config = (%sConfiguration *)getConfiguration();\n\n" % (n, n))
+        out.append("    %s::saveConfiguration();\n\n" % self.base)
+        out.append("    prefsHandler->write(\"CanbusNum\", config->canbusNum);\n")
+        out.append("    prefsHandler->saveChecksum();\n    prefsHandler->forceCacheWrite();\n}\n\n")
+
+        out.append("%s %s;\n" % (n, camel_name(n)))
+        return "".join(out)
+
+    def decode(self, msg):
+        out = []
+        mux = msg.mux()
+        plain = [s for s in msg.usable() if not s.is_mux and s.mux_value is None]
+        for sig in plain:
+            out.append("        setStatus(%s, payload.%s<%s>());\n" % (sig.member, sig.raw_get() if sig.is_raw() else "value", sig.const))
+        if mux:
+            muxed = {}
+            for sig in msg.usable():
+                if sig.mux_value is not None:
+                    muxed.setdefault(sig.mux_value, []).append(sig)
+            out.append("        switch (payload.get<%s>())\n        {\n" % mux.const)
+            for value in sorted(muxed):
+                out.append("        case %d:\n" % value)
+                for sig in muxed[value]:
+                    out.append("            setStatus(%s, payload.%s<%s>());\n"
+                               % (sig.member, sig.raw_get() if sig.is_raw() else "value", sig.const))
+                out.append("            break;\n")
+            out.append("        }\n")
+        return out
+
+    def build(self, msg):
+        out = []
+        out.append("void %s::%s(CAN_message_t &output)\n{\n" % (self.name, msg.func))
+        out.append("    CanPayloadBuilder payload;\n\n")
+        out.append("    output.id = %s;\n    output.len = %d;\n    output.flags.extended = %s_EXT;\n"
+                   % (msg.const, min(msg.dlc, 8), msg.const))
+        if msg.mux():
+            out.append("    //multiplexed, set %s and only the signals that go with its value\n" % msg.mux().const)
+        for sig in msg.usable():
+            if sig.is_mux:
+                out.append("    payload.set<%s>(0);\n" % sig.const)
+                continue
+            out.append("    %spayload.%s<%s>(%s);\n" % ("//" if sig.mux_value is not None else "",
+                                                        sig.raw_set() if sig.is_raw() else "setValue", sig.const, sig.member))
+        out.append("    payload.store(output);\n}\n\n")
+        return out
+
+    #####################################################################################
+    # BENCHMARK
+    #####################################################################################
+    def benchmark(self):
+        n = self.name
+        msgs = [m for m in self.rx + self.tx if m.usable()]
+        out = []
+        out.append("/*\n * Host side check and benchmark of the %s signal tables, generated by tools/dbc2device.py.\n" % n)
+        out.append(" * Every signal is packed at a few raw values and the bytes compared with the ones the generator\n")
+        out.append(" * worked out from the DBC bit numbering, then read back from those bytes. After that each\n")
+        out.append(" * message's decoder is run over a batch of random payloads and timed.\n *\n")
+        out.append(" *     g++ -O2 -std=gnu++14 -I <directory with %sSignals.h> <this file> -o bench\n */\n\n" % n)
+        out.append("#include <chrono>\n#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n#include \"%sSignals.h\"\n\n" % n)
+        out.append("#define FRAMES 4096\n#define ROUNDS 200\n\nstatic int failures = 0;\n\n")
+
+        out.append("struct Expected\n{\n    int64_t raw;\n    uint8_t bytes[8];\n};\n\n")
+        out.append("//get() and set() for signed signals, getUnsigned() and setUnsigned() for unsigned ones\n")
+        out.append("template<const CanSignalDef &S> int64_t getRaw(const CanPayload &payload)\n{\n")
+        out.append("    return S.isSigned ? (int64_t)payload.get<S>() : (int64_t)payload.getUnsigned<S>();\n}\n\n")
+        out.append("template<const CanSignalDef &S> void setRaw(CanPayloadBuilder &builder, int64_t raw)\n{\n")
+        out.append("    if (S.isSigned) builder.set<S>((int32_t)raw);\n    else builder.setUnsigned<S>((uint32_t)raw);\n}\n\n")
+        out.append("template<const CanSignalDef &S, int N> void checkSignal(const char *name, const Expected (&expected)[N])\n{\n")
+        out.append("    for (int i = 0; i < N; i++)\n    {\n")
+        out.append("        uint8_t buf[8];\n        CanPayloadBuilder builder;\n")
+        out.append("        setRaw<S>(builder, expected[i].raw);\n        builder.store(buf);\n")
+        out.append("        if (memcmp(buf, expected[i].bytes, 8) != 0)\n        {\n")
+        out.append("            printf(\"%s: %lld packed as %02X %02X %02X %02X %02X %02X %02X %02X\\n\", name, (long long)expected[i].raw,\n")
+        out.append("                   buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);\n")
+        out.append("            failures++;\n        }\n")
+        out.append("        if (getRaw<S>(CanPayload(expected[i].bytes)) != expected[i].raw)\n        {\n")
+        out.append("            printf(\"%s: expected %lld, read %lld\\n\", name, (long long)expected[i].raw, (long long)getRaw<S>(CanPayload(expected[i].bytes)));\n")
+        out.append("            failures++;\n        }\n    }\n}\n\n")
+
+        for msg in msgs:
+            out.append("static float decode%s(const uint8_t *buf)\n{\n" % msg.func[5:])
+            out.append("    CanPayload payload(buf, %d);\n    float sum = 0;\n" % min(msg.dlc, 8))
+            for sig in msg.usable():
+                out.append("    sum += payload.value<%s>();\n" % sig.const)
+            out.append("    return sum;\n}\n\n")
+
+        out.append("static void timeDecoder(const char *name, float (*decoder)(const uint8_t *), int signals, uint8_t (*frames)[8])\n{\n")
+        out.append("    volatile float sink = 0;\n")
+        out.append("    auto start = std::chrono::steady_clock::now();\n")
+        out.append("    for (int round = 0; round < ROUNDS; round++)\n")
+        out.append("        for (int i = 0; i < FRAMES; i++) sink = sink + decoder(frames[i]);\n")
+        out.append("    auto end = std::chrono::steady_clock::now();\n")
+        out.append("    double ns = std::chrono::duration<double, std::nano>(end - start).count() / ((double)FRAMES * ROUNDS);\n")
+        out.append("    printf(\"%-32s %2d signals %8.1f ns/frame %8.2f Mframes/s\\n\", name, signals, ns, 1000.0 / ns);\n}\n\n")
+
+        out.append("int main()\n{\n")
+        for msg in msgs:
+            for sig in msg.usable():
+                rows = ["{%s, {%s}}" % ("INT32_MIN" if raw == -(1 << 31) else raw, ", ".join("0x%02X" % b for b in sig.pack(raw))) for raw in sig.bench_values()]
+                out.append("    {\n        static const Expected expected[] = {%s};\n" % ",\n                                            ".join(rows))
+                out.append("        checkSignal<%s>(\"%s\", expected);\n    }\n" % (sig.const, sig.const))
+        out.append("\n    static uint8_t frames[FRAMES][8];\n    srand(1);\n")
+        out.append("    for (int i = 0; i < FRAMES; i++)\n        for (int j = 0; j < 8; j++) frames[i][j] = rand() & 0xFF;\n\n")
+        for msg in msgs:
+            out.append("    timeDecoder(\"%s\", decode%s, %d, frames);\n" % (msg.name, msg.func[5:], len(msg.usable())))
+        out.append("\n    printf(\"%s\\n\", failures ? \"FAILED\" : \"ok\");\n    return failures ? 1 : 0;\n}\n")
+        return "".join(out)
+
+
+def write(path, text):
+    with open(path, "w") as f:
+        f.write(text)
+    print("wrote " + path, file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate a GEVCU7 device driver skeleton from a DBC file")
+    parser.add_argument("dbc", help="DBC file describing the device")
+    parser.add_argument("--name", required=True, help="C++ class name of the device, also used for the file names")
+    parser.add_argument("--id", required=True, type=lambda x: int(x, 0), help="device id, like 0x2200. Must be unique")
+    parser.add_argument("--type", default="misc", choices=sorted(DEVICE_TYPES), help="kind of device (default misc)")
+    parser.add_argument("--node", help="name the DBC gives the device. Without it every message is received")
+    parser.add_argument("--prefix", help="prefix for defines, config and status names (default from --name)")
+    parser.add_argument("--bus", type=int, default=0, choices=[0, 1, 2], help="default CAN bus (default 0)")
+    parser.add_argument("--tick", type=int, default=100000, help="tick interval in microseconds (default 100000)")
+    parser.add_argument("--author", default="YOUR NAME", help="name for the copyright line")
+    parser.add_argument("-o", "--out-dir", default=".", help="where to write the driver (default .)")
+    parser.add_argument("--bench", help="also write a host side benchmark of the decoders to this file")
+    args = parser.parse_args()
+
+    if not re.match(r"^[A-Za-z_]\w*$", args.name):
+        parser.error("--name must be a valid C++ identifier")
+    try:
+        with open(args.dbc, encoding="latin-1") as f:
+            messages = parse_dbc(f.read())
+    except OSError as e:
+        print(e, file=sys.stderr)
+        return 1
+    if not messages:
+        print("%s: no messages found" % args.dbc, file=sys.stderr)
+        return 1
+    if args.node and not any(m.sender == args.node or args.node in m.receivers() for m in messages):
+        print("%s: node %s doesn't send or receive anything" % (args.dbc, args.node), file=sys.stderr)
+        return 1
+
+    device = Device(args, messages)
+    if len(device.variables(device.rx)) > 64:
+        warn("%d status entries, think about which ones are really needed" % len(device.variables(device.rx)))
+    base = os.path.join(args.out_dir, args.name)
+    write(base + "Signals.h", device.signals_header())
+    write(base + ".h", device.header())
+    write(base + ".cpp", device.source_file())
+    if args.bench:
+        write(args.bench, device.benchmark())
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
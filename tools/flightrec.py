@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+"""
+Decode the crash flight recorder dumps GEVCU7 leaves on the sdCard (CRASHxxx.BIN) after a crash or
+watchdog reset.
+
+    flightrec.py CRASH001.BIN
+
+Times are shown relative to the last thing the recorder saw before the reset. They come from the
+CPU cycle counter, which wraps about every 7 seconds at 600MHz, so anything older than that shows
+the wrong age.
+See src/CrashHandler.h for the file layout.
+"""
+
+import argparse
+import struct
+import sys
+
+FILE_MAGIC = b"GVFLIGHT"
+FLIGHTREC_MAGIC = 0x52464756
+VERSION = 1
+NUM_BUSES = 3
+
+FILE_HEADER = struct.Struct("<8sHHII6I")
+NAME = struct.Struct("<I16s")
+RECORDER = struct.Struct("<IHHIIHHHHIIIIII3I")
+CRUMB = struct.Struct("<II")
+TICK = struct.Struct("<III")
+FRAME = struct.Struct("<IIBB8sH")
+
+CANREC_TX = 0x20
+CANREC_EXTENDED = 0x10
+CANREC_BRS = 0x08
+CANREC_FD = 0x04
+
+SRSR_BITS = [
+    (1 << 0, "power on / IPP reset"),
+    (1 << 1, "lockup"),
+    (1 << 2, "CSU"),
+    (1 << 3, "IPP user reset"),
+    (1 << 4, "watchdog 1/2"),
+    (1 << 5, "JTAG"),
+    (1 << 6, "JTAG software"),
+    (1 << 7, "watchdog 3"),
+    (1 << 8, "temperature sensor"),
+]
+
+
+def decode_crumb(val):
+    """Same as CrashHandler::decodeBreadcrumbToString"""
+    chars = [(val >> 27) & 0x1F, (val >> 22) & 0x1F, (val >> 17) & 0x1F, (val >> 12) & 0x1F, (val >> 7) & 0x1F]
+    return "".join(chr(c + 0x40) for c in chars) + "%02x" % (val & 0x7F)
+
+
+def ring(entries, head):
+    """Entries of a ring buffer oldest first. head counts every entry ever written"""
+    size = len(entries)
+    for i in range(max(0, head - size), head):
+        yield entries[i % size]
+
+
+class Recording:
+    def __init__(self, data, names):
+        fields = RECORDER.unpack_from(data)
+        (self.magic, self.version, self.size, self.build_num, self.cpu_hz, self.num_crumbs, self.num_ticks,
+         self.num_frames, _, self.last_cycles, self.last_millis, self.current_observer, self.current_start,
+         self.crumb_head, self.tick_head) = fields[:15]
+        self.frame_head = fields[15:18]
+        if self.magic != FLIGHTREC_MAGIC or self.version != VERSION:
+            raise ValueError("not a version %d flight recording" % VERSION)
+        if len(data) < self.size:
+            raise ValueError("flight recording is cut short")
+        self.names = names
+
+        offset = RECORDER.size
+        self.crumbs = [CRUMB.unpack_from(data, offset + i * CRUMB.size) for i in range(self.num_crumbs)]
+        offset += self.num_crumbs * CRUMB.size
+        self.ticks = [TICK.unpack_from(data, offset + i * TICK.size) for i in range(self.num_ticks)]
+        offset += self.num_ticks * TICK.size
+        self.frames = []
+        for bus in range(NUM_BUSES):
+            self.frames.append([FRAME.unpack_from(data, offset + i * FRAME.size) for i in range(self.num_frames)])
+            offset += self.num_frames * FRAME.size
+
+    def age(self, cycles):
+        """Time before the last recorded event, as text"""
+        diff = (self.last_cycles - cycles) & 0xFFFFFFFF
+        return "-%10.3fms" % (diff * 1000.0 / self.cpu_hz)
+
+    def duration(self, cycles):
+        return "%.1fus" % (cycles * 1000000.0 / self.cpu_hz)
+
+    def observer(self, address):
+        return self.names.get(address, "%08X" % address)
+
+
+def print_recording(out, header, rec):
+    magic, version, num_names, build_num, reset_status = header[:5]
+    crash_crumbs = header[5:]
+
+    reasons = [text for bit, text in SRSR_BITS if reset_status & bit]
+    out.write("Build %d, saved by build %d\n" % (rec.build_num, build_num))
+    out.write("Reset status %08X (%s)\n" % (reset_status, ", ".join(reasons) if reasons else "no reason given"))
+    out.write("Last event at %u ms uptime. CPU at %u MHz\n" % (rec.last_millis, rec.cpu_hz // 1000000))
+    if rec.current_observer:
+        out.write("Running at reset: %s, in handleTick() for %s\n" % (rec.observer(rec.current_observer),
+                                                                      rec.duration((rec.last_cycles - rec.current_start) & 0xFFFFFFFF)))
+    else:
+        out.write("Not in a tick at reset\n")
+    crumbs = [decode_crumb(c) for c in crash_crumbs if c]
+    if crumbs:
+        out.write("Crash report breadcrumbs: %s\n" % " ".join(crumbs))
+
+    out.write("\nBreadcrumbs (oldest first):\n")
+    for cycles, crumb in ring(rec.crumbs, rec.crumb_head):
+        out.write("  %s  %s\n" % (rec.age(cycles), decode_crumb(crumb)))
+
+    out.write("\nTicks (oldest first):\n")
+    for cycles, duration, address in ring(rec.ticks, rec.tick_head):
+        out.write("  %s  %-14s %s\n" % (rec.age(cycles), rec.observer(address), rec.duration(duration)))
+
+    for bus in range(NUM_BUSES):
+        out.write("\nCAN bus %d (oldest first):\n" % bus)
+        for cycles, can_id, flags, length, data, _ in ring(rec.frames[bus], rec.frame_head[bus]):
+            ident = ("%08X" if flags & CANREC_EXTENDED else "%03X") % can_id
+            kind = ("FD+BRS" if flags & CANREC_BRS else "FD") if flags & CANREC_FD else ""
+            shown = data[:min(length, 8)].hex(" ").upper()
+            if length > 8:
+                shown += " ..."
+            out.write("  %s  %s %-8s [%2d] %-6s %s\n" % (rec.age(cycles), "Tx" if flags & CANREC_TX else "Rx",
+                                                         ident, length, kind, shown))
+
+
+def read_file(filename):
+    with open(filename, "rb") as f:
+        data = f.read()
+    if len(data) < FILE_HEADER.size:
+        raise ValueError("%s: file too short" % filename)
+    header = FILE_HEADER.unpack_from(data)
+    if header[0] != FILE_MAGIC:
+        raise ValueError("%s: not a GEVCU flight recorder dump" % filename)
+    if header[1] != VERSION:
+        raise ValueError("%s: unsupported version %d" % (filename, header[1]))
+
+    offset = FILE_HEADER.size
+    names = {}
+    for _ in range(header[2]):
+        address, name = NAME.unpack_from(data, offset)
+        names[address] = name.split(b"\0", 1)[0].decode("ascii", "replace")
+        offset += NAME.size
+    try:
+        return header, Recording(data[offset:], names)
+    except (ValueError, struct.error) as e:
+        raise ValueError("%s: %s" % (filename, e))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode GEVCU7 crash flight recorder dumps")
+    parser.add_argument("files", nargs="+", help="CRASHxxx.BIN files from the sdCard")
+    args = parser.parse_args()
+
+    failed = False
+    for filename in args.files:
+        try:
+            header, rec = read_file(filename)
+        except ValueError as e:
+            print(e, file=sys.stderr)
+            failed = True
+            continue
+        if len(args.files) > 1:
+            sys.stdout.write("==== %s ====\n" % filename)
+        print_recording(sys.stdout, header, rec)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())